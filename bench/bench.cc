@@ -0,0 +1,749 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#include <unistd.h>
+#include <core/arg_parse.h>
+#include <core/thread_pool.h>
+#include <core/log.h>
+#include <core/rand.h>
+#include <core/layer_pool_avg.h>
+#include <core/layer_mult.h>
+#include <core/layer_sigmoid.h>
+#include <core/layer_tanh.h>
+#include <core/solver_rmsprop.h>
+#include <core/static_graph.h>
+#include <sandbox/mnist/mnist.h>
+#include <sandbox/cifar10/cifar10.h>
+#include <sandbox/textgen/textgen.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Bench
+ *  \brief  Benchmark suite
+ *
+ * Times the forward and backward passes of each layer over a sweep of shapes
+ * and batch sizes, and the training steps of the sandbox models (fed with
+ * synthetic datasets unless real ones are given).
+ *
+ * Each result is written as a CSV row, to be compared between commits:
+ *   suite,name,config,pass,iterations,ns_per_iter,gflops,ns_per_element,
+ *   steps_per_sec
+ * The operations are the estimates of the profiler (see Layer::Flop), the
+ * elements are the output values of the layer (the samples for the models).
+ */
+template <typename Dtype>
+class Bench {
+  // Public types
+ public:
+  typedef Dtype Type;
+  typedef std::chrono::steady_clock Clock;
+  typedef std::function<std::shared_ptr<Layer<Dtype>>(uint32_t)> LayerMaker;
+
+
+  // Protected attributes
+ protected:
+  std::FILE*  out_;       // Results file
+  const char* filter_;    // Only run the benchmarks containing this string
+  double      min_time_;  // Minimum time per benchmark (s)
+  std::mt19937 gen_;      // Random generator (synthetic data)
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Check if a benchmark is selected.
+   *
+   *  \param[in]  suite: suite name
+   *  \param[in]  name : benchmark name
+   *
+   *  \return     Selected?
+   */
+  bool Selected(const char* suite, const std::string& name) const {
+    return !filter_ ||
+           (std::string(suite) + "/" + name).find(filter_) !=
+           std::string::npos;
+  }
+
+  /*!
+   * Time a function, running it until the minimum time is reached.
+   *
+   *  \param[in]  func    : function to time
+   *
+   *  \param[out] num_iter: number of iterations
+   *  \return     Time per iteration (s)
+   */
+  double Time(const std::function<void()>& func, uint64_t* num_iter) const {
+    // Warm up (caches, allocations and thread pool)
+    func();
+
+    uint64_t iter = 0;
+    double   time = 0;
+    Clock::time_point start = Clock::now();
+    do {
+      func();
+      ++iter;
+      time = std::chrono::duration<double>(Clock::now() - start).count();
+    } while (time < min_time_ || iter < 3);
+
+    *num_iter = iter;
+    return time / iter;
+  }
+
+  /*!
+   * Write a result.
+   *
+   *  \param[in]  suite        : suite name
+   *  \param[in]  name         : benchmark name
+   *  \param[in]  config       : benchmark configuration
+   *  \param[in]  pass         : pass
+   *  \param[in]  num_iter     : number of iterations
+   *  \param[in]  time         : time per iteration (s)
+   *  \param[in]  flop         : number of operations per iteration
+   *  \param[in]  num_element  : number of elements per iteration
+   *  \param[in]  steps_per_sec: speed (models only, 0 otherwise)
+   */
+  void Write(const char* suite, const std::string& name,
+             const std::string& config, const char* pass, uint64_t num_iter,
+             double time, uint64_t flop, uint64_t num_element,
+             double steps_per_sec) const {
+    double gflops         = time > 0 ? flop * 1e-9 / time : 0.;
+    double ns_per_element = num_element ? time * 1e9 / num_element : 0.;
+    std::fprintf(out_, "%s,%s,%s,%s,%llu,%.1f,%.3f,%.3f,%.3f\n", suite,
+                 name.c_str(), config.c_str(), pass,
+                 static_cast<unsigned long long>(num_iter),  // NOLINT
+                 time * 1e9, gflops, ns_per_element, steps_per_sec);
+    std::fflush(out_);
+    Report(kInfo, "%-8s %-12s %-28s %-8s %12.1f ns %9.3f GFLOP/s", suite,
+           name.c_str(), config.c_str(), pass, time * 1e9, gflops);
+  }
+
+  /*!
+   * Generate a random input.
+   *
+   *  \param[in]  n: matrix size
+   *  \param[in]  d: matrix size
+   *  \param[in]  m: matrix size
+   *  \param[in]  f: matrix size (batch size)
+   *
+   *  \return     Random matrix
+   */
+  static std::shared_ptr<Mat<Dtype>> Input(uint32_t n, uint32_t d,
+                                           uint32_t m, uint32_t f) {
+    return Rand<Dtype>::GenMat(n, d, m, f, Dtype(-1), Dtype(1));
+  }
+
+  /*!
+   * Benchmark a layer forward and backward passes (training phase).
+   *
+   *  \param[in]  name      : layer name
+   *  \param[in]  config    : layer configuration
+   *  \param[in]  batch_size: batch size
+   *  \param[in]  make      : function creating the layer
+   */
+  void RunLayer(const std::string& name, const std::string& config,
+                uint32_t batch_size, const LayerMaker& make) const {
+    if (!Selected("layer", name)) {
+      return;
+    }
+
+    std::shared_ptr<Layer<Dtype>> layer = make(batch_size);
+    State state(State::PHASE_TRAIN);
+    std::string batch_config = config + " b" + std::to_string(batch_size);
+
+    // Random output derivatives for the backward pass
+    layer->Forward(state);
+    for (const std::shared_ptr<Mat<Dtype>>& out : layer->Output()) {
+      if (out->deriv) {
+        std::uniform_real_distribution<Dtype> dist(Dtype(-1), Dtype(1));
+        std::mt19937 gen(batch_size);
+        Dtype* deriv = out->DerivData();
+        for (uint32_t i = 0; i < out->deriv->Size(); ++i) {
+          deriv[i] = dist(gen);
+        }
+      }
+    }
+
+    uint64_t num_element = Layer<Dtype>::NumValue({layer->Output()[0]});
+    uint64_t num_iter;
+    double time = Time([&layer, &state] { layer->Forward(state); },
+                       &num_iter);
+    Write("layer", name, batch_config, "forward", num_iter, time,
+          layer->Flop(), num_element, 0);
+    time = Time([&layer, &state] { layer->Backward(state); }, &num_iter);
+    Write("layer", name, batch_config, "backward", num_iter, time,
+          2 * layer->Flop(), num_element, 0);
+  }
+
+  /*!
+   * Benchmark the training steps of a model (forward, backward and update).
+   *
+   *  \param[in]  name      : model name
+   *  \param[in]  config    : model configuration
+   *  \param[in]  model     : model
+   */
+  void RunModel(const std::string& name, const std::string& config,
+                Model<Dtype>* model) const {
+    SolverRMSprop<Dtype> solver(0, 0, 0, 0, Dtype(1), Dtype(0.999),
+                                Dtype(0.001), Dtype(5));
+
+    // Warm up, then double the number of steps until the minimum time
+    solver.Train(model, 2, Dtype(0.001));
+    uint64_t num_step = 0;
+    double   time     = 0;
+    for (uint32_t step = 1; time < min_time_ || num_step < 4; step *= 2) {
+      Clock::time_point start = Clock::now();
+      solver.Train(model, step, Dtype(0.001));
+      time     += std::chrono::duration<double>(Clock::now() - start).count();
+      num_step += step;
+    }
+    time /= num_step;
+
+    // A step runs a forward and a backward pass (counted twice)
+    Write("model", name, config, "step", num_step, time, 3 * model->Flop(),
+          model->BatchSize(), 1 / time);
+  }
+
+  /*!
+   * Benchmark the inference of a pruned inner product (see SparseFilter)
+   * against its dense filter, checking each output keeps some weights.
+   *
+   *  \param[in]  num_in    : number of inputs
+   *  \param[in]  num_out   : number of outputs
+   *  \param[in]  batch_size: batch size
+   *  \param[in]  sparsity  : fraction of the blocks to prune
+   */
+  void RunSparse(uint32_t num_in, uint32_t num_out, uint32_t batch_size,
+                 Dtype sparsity) const {
+    if (!Selected("sparse", "ip")) {
+      return;
+    }
+    std::string config = std::to_string(num_in) + "->" +
+                         std::to_string(num_out) + " s" +
+                         std::to_string(int(sparsity * 100)) + " b" +
+                         std::to_string(batch_size);
+
+    Param param;
+    param.Add("num_output", num_out);
+    LayerInnerProduct<Dtype> layer("ip",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+      Input(1, 1, num_in, batch_size)}, param);
+    State state(State::PHASE_TEST);
+
+    uint64_t num_element = Layer<Dtype>::NumValue({layer.Output()[0]});
+    uint64_t flop        = layer.Flop();
+    uint64_t num_iter;
+    double time = Time([&layer, &state] { layer.Forward(state); },
+                       &num_iter);
+    Write("sparse", "ip", config, "dense", num_iter, time, flop,
+          num_element, 0);
+
+    // The last group of outputs can be smaller than a block: its outputs
+    // must be pruned as much as the others
+    layer.GetSparse()->Prune(sparsity);
+    std::vector<std::shared_ptr<Mat<Dtype>>> weight;
+    layer.GetWeight(&weight);
+    for (uint32_t out = 0; out < num_out; ++out) {
+      const Dtype* row = weight[0]->Data() + size_t(out) * num_in;
+      Check(std::any_of(row, row + num_in, [](Dtype w) { return w != 0; }),
+            "Output %d of '%s' lost all its weights when pruned", out,
+            config.c_str());
+    }
+
+    time = Time([&layer, &state] { layer.Forward(state); }, &num_iter);
+    Write("sparse", "ip", config, "sparse", num_iter, time, layer.Flop(),
+          num_element, 0);
+  }
+
+  /*!
+   * Benchmark the inference of a small fully connected model, one sample at
+   * a time, as a Model and as a StaticGraph of the same weights.
+   */
+  template <uint32_t NUM_IN, uint32_t NUM_HIDDEN, uint32_t NUM_OUT>
+  void RunStatic() const {
+    if (!Selected("static", "mlp")) {
+      return;
+    }
+    std::string config = std::to_string(NUM_IN) + "-" +
+                         std::to_string(NUM_HIDDEN) + "-" +
+                         std::to_string(NUM_HIDDEN) + "-" +
+                         std::to_string(NUM_OUT) + " b1";
+
+    // Model: IP1, RELU1, IP2, RELU2, IP3
+    Model<Dtype> model("bench");
+    std::shared_ptr<Mat<Dtype>> in = Input(NUM_IN, 1, 1, 1);
+    Param hidden_param, out_param;
+    hidden_param.Add("num_output", NUM_HIDDEN);
+    out_param.Add("num_output", NUM_OUT);
+    std::shared_ptr<Mat<Dtype>> out = in;
+    const char* kName[] = {"ip1", "relu1", "ip2", "relu2", "ip3"};
+    for (uint32_t i = 0; i < 5; ++i) {
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>> layer_in{out};
+      if (i & 1) {
+        out = model.Add(std::make_shared<LayerRelu<Dtype>>(kName[i],
+                                                           layer_in))[0];
+      } else {
+        out = model.Add(std::make_shared<LayerInnerProduct<Dtype>>(kName[i],
+                        layer_in, i < 4 ? hidden_param : out_param))[0];
+      }
+    }
+
+    // Static graph, copying the weights of the model
+    typedef StaticGraph<Dtype,
+                        StaticInnerProduct<Dtype, NUM_IN, NUM_HIDDEN>,
+                        StaticRelu<Dtype, NUM_HIDDEN>,
+                        StaticInnerProduct<Dtype, NUM_HIDDEN, NUM_HIDDEN>,
+                        StaticRelu<Dtype, NUM_HIDDEN>,
+                        StaticInnerProduct<Dtype, NUM_HIDDEN, NUM_OUT>> Graph;
+    std::unique_ptr<Graph> graph(new Graph("bench", {kName[0], kName[1],
+                                                     kName[2], kName[3],
+                                                     kName[4]}));
+    std::vector<typename ModelFile<Dtype>::Tensor> src, dst;
+    model.GetTensor(&src);
+    graph->GetTensor(&dst);
+    for (size_t i = 0; i < dst.size(); ++i) {
+      Check(dst[i].name == src[i].name && dst[i].bytes == src[i].bytes,
+            "Tensor '%s' is not matching", dst[i].name.c_str());
+      std::memcpy(dst[i].data, src[i].data, dst[i].bytes);
+    }
+
+    State state(State::PHASE_TEST);
+    const Dtype* in_data = in->Data();
+    Dtype static_out[NUM_OUT];
+    uint64_t num_iter;
+    double time = Time([&model, &state] { model.Forward(state); },
+                       &num_iter);
+    Write("static", "mlp", config, "model", num_iter, time, model.Flop(),
+          NUM_OUT, 0);
+    time = Time([&graph, in_data, &static_out] {
+      graph->Forward(in_data, static_out);
+    }, &num_iter);
+    Write("static", "mlp", config, "static", num_iter, time, model.Flop(),
+          NUM_OUT, 0);
+
+    // Both must give the same outputs
+    Dtype max_diff = Dtype(0);
+    for (uint32_t i = 0; i < NUM_OUT; ++i) {
+      max_diff = std::max(max_diff, std::abs(static_out[i] - out->Data()[i]));
+    }
+    Report(kInfo, "%-8s %-12s %-28s max difference %g", "static", "mlp",
+           config.c_str(), max_diff);
+  }
+
+  /*!
+   * Write a synthetic file.
+   *
+   *  \param[in]  file_path: file path
+   *  \param[in]  header   : big endian header values
+   *  \param[in]  size     : number of random bytes after the header
+   *  \param[in]  max_byte : maximum value of a byte
+   */
+  void WriteFile(const std::string& file_path,
+                 const std::vector<uint32_t>& header, size_t size,
+                 uint32_t max_byte) {
+    std::FILE* file = std::fopen(file_path.c_str(), "wb");
+    if (!file) {
+      Report(kError, "Can't create file '%s'", file_path.c_str());
+      return;
+    }
+    for (uint32_t val : header) {
+      uint8_t bytes[4] = {uint8_t(val >> 24), uint8_t(val >> 16),
+                          uint8_t(val >> 8) , uint8_t(val)};
+      std::fwrite(bytes, 1, sizeof(bytes), file);
+    }
+    std::uniform_int_distribution<uint32_t> dist(0, max_byte);
+    std::vector<uint8_t> data(size);
+    for (size_t i = 0; i < size; ++i) {
+      data[i] = uint8_t(dist(gen_));
+    }
+    std::fwrite(data.data(), 1, size, file);
+    std::fclose(file);
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  out     : results file
+   *  \param[in]  filter  : only run the benchmarks containing this string
+   *                        (nullptr: all)
+   *  \param[in]  min_time: minimum time per benchmark (s)
+   */
+  Bench(std::FILE* out, const char* filter, double min_time):
+    out_(out), filter_(filter), min_time_(min_time), gen_(0) {
+    std::fprintf(out_, "suite,name,config,pass,iterations,ns_per_iter,"
+                 "gflops,ns_per_element,steps_per_sec\n");
+  }
+
+  /*!
+   * Destructor.
+   */
+  ~Bench() {}
+
+  /*!
+   * Benchmark the layers.
+   *
+   *  \param[in]  batch_size: batch sizes
+   */
+  void RunLayers(const std::vector<uint32_t>& batch_size) const {
+    for (uint32_t batch : batch_size) {
+      // Convolutions: width, height, inputs, outputs (3x3, padding 1)
+      const uint32_t kConv[][4] = {
+        {28, 28, 1, 8}, {14, 14, 8, 16}, {32, 32, 3, 32}, {16, 16, 32, 64}
+      };
+      for (const uint32_t* conv : kConv) {
+        RunLayer("conv", std::to_string(conv[0]) + "x" +
+                 std::to_string(conv[1]) + "x" + std::to_string(conv[2]) +
+                 "->" + std::to_string(conv[3]) + " k3", batch,
+                 [conv](uint32_t b) {
+          Param param;
+          param.Add("num_output"   , conv[3]);
+          param.Add("filter_width" , 3);
+          param.Add("filter_height", 3);
+          param.Add("padding_x"    , 1);
+          param.Add("padding_y"    , 1);
+          param.Add("stride_x"     , 1);
+          param.Add("stride_y"     , 1);
+          return std::make_shared<LayerConv<Dtype>>("conv",
+            std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+            Input(conv[0], conv[1], conv[2], b)}, param);
+        });
+      }
+
+      // Inner products: inputs, outputs
+      const uint32_t kIp[][2] = {{784, 64}, {64, 10}, {1024, 1024}};
+      for (const uint32_t* ip : kIp) {
+        RunLayer("ip", std::to_string(ip[0]) + "->" + std::to_string(ip[1]),
+                 batch, [ip](uint32_t b) {
+          Param param;
+          param.Add("num_output", ip[1]);
+          return std::make_shared<LayerInnerProduct<Dtype>>("ip",
+            std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+            Input(1, 1, ip[0], b)}, param);
+        });
+      }
+
+      // Matrix multiplications (shared first input): rows, columns
+      const uint32_t kMult[][2] = {{20, 25}, {256, 256}};
+      for (const uint32_t* mult : kMult) {
+        RunLayer("mult", std::to_string(mult[0]) + "x" +
+                 std::to_string(mult[1]), batch, [mult](uint32_t b) {
+          return std::make_shared<LayerMult<Dtype>>("mult",
+            std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+            Input(mult[0], mult[1], 1, 1), Input(mult[1], 1, 1, b)});
+        });
+      }
+
+      // Pooling: width, height, channels (3x3, padding 1, stride 2)
+      const uint32_t kPool[][3] = {{28, 28, 8}, {32, 32, 32}};
+      for (const uint32_t* pool : kPool) {
+        std::string config = std::to_string(pool[0]) + "x" +
+                             std::to_string(pool[1]) + "x" +
+                             std::to_string(pool[2]) + " k3s2";
+        Param param;
+        param.Add("filter_width" , 3);
+        param.Add("filter_height", 3);
+        param.Add("padding_x"    , 1);
+        param.Add("padding_y"    , 1);
+        param.Add("stride_x"     , 2);
+        param.Add("stride_y"     , 2);
+        RunLayer("pool_max", config, batch, [pool, param](uint32_t b) {
+          return std::make_shared<LayerPoolMax<Dtype>>("pool_max",
+            std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+            Input(pool[0], pool[1], pool[2], b)}, param);
+        });
+        RunLayer("pool_avg", config, batch, [pool, param](uint32_t b) {
+          return std::make_shared<LayerPoolAvg<Dtype>>("pool_avg",
+            std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+            Input(pool[0], pool[1], pool[2], b)}, param);
+        });
+      }
+
+      // Batch normalization: width, height, channels
+      const uint32_t kBn[][3] = {{14, 14, 8}, {16, 16, 32}};
+      for (const uint32_t* bn : kBn) {
+        RunLayer("batch_norm", std::to_string(bn[0]) + "x" +
+                 std::to_string(bn[1]) + "x" + std::to_string(bn[2]), batch,
+                 [bn](uint32_t b) {
+          Param param;
+          param.Add("moving_avg_frac", 0.99f);
+          return std::make_shared<LayerBatchNorm<Dtype>>("batch_norm",
+            std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+            Input(bn[0], bn[1], bn[2], b)}, param);
+        });
+      }
+
+      // Softmax loss: number of classes
+      const uint32_t kSoftmax[] = {10, 1000};
+      for (uint32_t num_class : kSoftmax) {
+        RunLayer("softmax", std::to_string(num_class), batch,
+                 [num_class](uint32_t b) {
+          std::shared_ptr<Mat<Dtype>> label =
+            std::make_shared<Mat<Dtype>>(1, 1, 1, b);
+          for (uint32_t i = 0; i < b; ++i) {
+            label->Data()[i] = Dtype(i % num_class);
+          }
+          return std::make_shared<LayerSoftMaxLoss<Dtype>>("softmax",
+            std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+            Input(1, 1, num_class, b), label});
+        });
+      }
+
+      // Activations (32x32x64 values per batch)
+      RunLayer("relu", "32x32x64", batch, [](uint32_t b) {
+        return std::make_shared<LayerRelu<Dtype>>("relu",
+          std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+          Input(32, 32, 64, b)});
+      });
+      RunLayer("sigmoid", "32x32x64", batch, [](uint32_t b) {
+        return std::make_shared<LayerSigmoid<Dtype>>("sigmoid",
+          std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+          Input(32, 32, 64, b)});
+      });
+      RunLayer("tanh", "32x32x64", batch, [](uint32_t b) {
+        return std::make_shared<LayerTanh<Dtype>>("tanh",
+          std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+          Input(32, 32, 64, b)});
+      });
+    }
+  }
+
+  /*!
+   * Benchmark the pruned inner products (see RunSparse).
+   */
+  void RunSparses() const {
+    // Inputs, outputs (not always a multiple of the block size)
+    const uint32_t kIp[][2] = {{784, 10}, {784, 64}, {1024, 1000}};
+    for (const uint32_t* ip : kIp) {
+      for (uint32_t batch : {1, 32}) {
+        RunSparse(ip[0], ip[1], batch, Dtype(0.8));
+      }
+    }
+  }
+
+  /*!
+   * Benchmark the static graphs against the models (see RunStatic).
+   */
+  void RunStatics() const {
+    RunStatic<4, 16, 1>();
+    RunStatic<784, 64, 10>();
+  }
+
+  /*!
+   * Benchmark the sandbox models training steps.
+   *
+   *  \param[in]  batch_size  : batch size
+   *  \param[in]  mnist_path  : path to the MNIST dataset (nullptr: synthetic)
+   *  \param[in]  cifar10_path: path to the CIFAR-10 dataset
+   *                            (nullptr: synthetic)
+   *  \param[in]  text_path   : path to the text file (nullptr: synthetic)
+   */
+  void RunModels(uint32_t batch_size, const char* mnist_path,
+                 const char* cifar10_path, const char* text_path) {
+    const uint32_t kNumTrain = 1024;
+    const uint32_t kNumTest  = 256;
+    std::string config = "b" + std::to_string(batch_size);
+
+    // Synthetic datasets, in the formats of the sandbox examples
+    char tmp_path[] = "/tmp/jik_bench_XXXXXX";
+    std::vector<std::string> tmp_file;
+    if ((!mnist_path || !cifar10_path || !text_path) && !mkdtemp(tmp_path)) {
+      Report(kError, "Can't create a temporary directory");
+      return;
+    }
+    std::string tmp = tmp_path;
+    std::string mnist, cifar10, text;
+
+    if (Selected("model", "mnist")) {
+      if (mnist_path) {
+        mnist = mnist_path;
+      } else {
+        mnist = tmp;
+        const char* kPrefix[2] = {"train", "t10k"};
+        for (uint32_t i = 0; i < 2; ++i) {
+          uint32_t count = i ? kNumTest : kNumTrain;
+          tmp_file.push_back(tmp + "/" + kPrefix[i] + "-images-idx3-ubyte");
+          WriteFile(tmp_file.back(), {0x803, count, 28, 28},
+                    size_t(count) * 28 * 28, 0xFF);
+          tmp_file.push_back(tmp + "/" + kPrefix[i] + "-labels-idx1-ubyte");
+          WriteFile(tmp_file.back(), {0x801, count}, count, 9);
+        }
+      }
+      for (uint32_t i = 0; i < 3; ++i) {
+        bool use_fc = i == 0;
+        bool use_bn = i == 2;
+        std::string path = mnist;
+        MnistModel<Dtype> model("bench", &path[0],
+                                MnistDataset<Dtype>::NumClass(), batch_size,
+                                use_fc, use_bn, 2);
+        RunModel("mnist", std::string(use_fc ? "fc" : use_bn ? "conv_bn" :
+                 "conv") + " " + config, &model);
+      }
+    }
+
+    if (Selected("model", "cifar10")) {
+      if (cifar10_path) {
+        cifar10 = cifar10_path;
+      } else {
+        cifar10 = tmp;
+        const char* kPrefix[2] = {"data", "test"};
+        for (uint32_t i = 0; i < 2; ++i) {
+          uint32_t count = i ? kNumTest : kNumTrain;
+          tmp_file.push_back(tmp + "/" + kPrefix[i] + "_batch.bin");
+          WriteFile(tmp_file.back(), {}, size_t(count) * (1 + 32 * 32 * 3),
+                    9);
+        }
+      }
+      for (uint32_t i = 0; i < 2; ++i) {
+        bool use_bn = i == 1;
+        std::string path = cifar10;
+        Cifar10Model<Dtype> model("bench", &path[0],
+                                  Cifar10Dataset<Dtype>::NumClass(),
+                                  batch_size, false, use_bn, 2);
+        RunModel("cifar10", std::string(use_bn ? "bn" : "default") + " " +
+                 config, &model);
+      }
+    }
+
+    if (Selected("model", "textgen")) {
+      if (text_path) {
+        text = text_path;
+      } else {
+        // Random sentences of lower case words
+        text = tmp + "/text.txt";
+        tmp_file.push_back(text);
+        std::FILE* file = std::fopen(text.c_str(), "wt");
+        if (!file) {
+          Report(kError, "Can't create file '%s'", text.c_str());
+          return;
+        }
+        std::uniform_int_distribution<uint32_t> letter(0, 26);
+        std::uniform_int_distribution<uint32_t> length(10, 60);
+        for (uint32_t i = 0; i < kNumTrain; ++i) {
+          for (uint32_t j = length(gen_); j; --j) {
+            uint32_t c = letter(gen_);
+            std::fputc(c == 26 ? ' ' : char('a' + c), file);
+          }
+          std::fputc('\n', file);
+        }
+        std::fclose(file);
+      }
+      for (uint32_t i = 0; i < 2; ++i) {
+        const uint32_t kHs = 20;
+        if (!i) {
+          TextgenModel<Rnn<Dtype>> model("bench",
+            TextgenModel<Rnn<Dtype>>::CreateDataLayer(text.c_str(), 0,
+            batch_size), Dtype(1), 5, {kHs, kHs}, Dtype(0.2), batch_size);
+          RunModel("textgen", "rnn " + config, &model);
+        } else {
+          TextgenModel<Lstm<Dtype>> model("bench",
+            TextgenModel<Lstm<Dtype>>::CreateDataLayer(text.c_str(), 0,
+            batch_size), Dtype(1), 5, {kHs, kHs}, Dtype(0.2), batch_size,
+            true);
+          RunModel("textgen", "lstm " + config, &model);
+        }
+      }
+    }
+
+    // Remove the synthetic datasets
+    for (const std::string& file_path : tmp_file) {
+      std::remove(file_path.c_str());
+    }
+    if (!mnist_path || !cifar10_path || !text_path) {
+      rmdir(tmp_path);
+    }
+  }
+};
+
+
+}  // namespace jik
+
+
+int main(int argc, char* argv[]) {
+  using namespace jik;  // NOLINT(build/namespaces)
+
+  // 32-bit float quantization
+  typedef float Dtype;
+
+  // Options
+  ArgParse arg(argc, argv);
+  const char* output_path  = arg.Arg("-output");
+  const char* filter       = arg.Arg("-filter");
+  const char* mnist_path   = arg.Arg("-mnist");
+  const char* cifar10_path = arg.Arg("-cifar10");
+  const char* text_path    = arg.Arg("-text");
+  double   min_time;
+  uint32_t batch_size, num_thread;
+  arg.Arg<double>  ("-mintime"  , 0.2, &min_time);
+  arg.Arg<uint32_t>("-batchsize", 32 , &batch_size);
+  arg.Arg<uint32_t>("-threads"  , 1  , &num_thread);
+
+  if (arg.ArgExists("-h")) {
+    Report(kInfo, "Usage: %s [-output <path/to/results.csv>] "
+           "[-filter <layer/conv, model/mnist, sparse/ip, static/mlp, ...>] "
+           "[-mintime <seconds>] [-batchsize <model batch size>] "
+           "[-threads <N>] [-mnist <path>] [-cifar10 <path>] "
+           "[-text <path>]", argv[0]);
+    return -1;
+  }
+
+  // Split the work across the threads
+  ThreadPool::Get().SetNumThread(num_thread);
+
+  std::FILE* out = stdout;
+  if (output_path) {
+    out = std::fopen(output_path, "wt");
+    if (!out) {
+      Report(kError, "Can't create file '%s'", output_path);
+      return -1;
+    }
+  }
+
+  Bench<Dtype> bench(out, filter, min_time);
+  bench.RunLayers({1, 16, 64});
+  bench.RunSparses();
+  bench.RunStatics();
+  bench.RunModels(batch_size, mnist_path, cifar10_path, text_path);
+
+  if (out != stdout) {
+    std::fclose(out);
+  }
+
+  return 0;
+}
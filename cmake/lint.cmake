@@ -7,7 +7,7 @@ set(LINT_COMMAND python ${CMAKE_BUILD_DIR}/cpplint.py)
 
 # Directories and files to run cpplint on
 set(SRC_FILE_EXTENSIONS h cc)
-set(SRC_DIRS core recurrent sandbox)
+set(SRC_DIRS core recurrent sandbox bench)
 
 # Find all files of interest
 foreach(ext ${SRC_FILE_EXTENSIONS})
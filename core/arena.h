@@ -0,0 +1,295 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#ifndef CORE_ARENA_H_
+#define CORE_ARENA_H_
+
+
+#include <core/memory_stats.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Arena
+ *  \brief  Memory arena (slab allocator)
+ *
+ * The arena hands out 64-byte aligned blocks carved out of large slabs.
+ * Every block keeps a reference on its slab, so a slab is only freed (or
+ * reused) once all the matrices using it are gone: resetting the arena never
+ * invalidates any live matrix.
+ *
+ * The arena is made current with a Scope: all the matrices created on this
+ * thread while the scope is alive draw their storage from the arena instead
+ * of the heap.
+ *
+ * Resetting the arena (e.g. between two graph rebuilds) remembers how much
+ * memory was used since the previous reset, so the next rebuild gets a single
+ * contiguous slab large enough to hold everything.
+ */
+class Arena {
+  // Public types
+ public:
+  static const size_t kAlignment   = 64;        // Alignment (bytes)
+  static const size_t kMinSlabSize = 1 << 20;   // Minimum slab size (bytes)
+
+  /*!
+   *  \class  Scope
+   *  \brief  Make an arena current for the lifetime of the scope
+   */
+  class Scope {
+    // Protected attributes
+   protected:
+    Arena* prev_;   // Previously current arena
+
+
+    // Public methods
+   public:
+    /*!
+     * Constructor.
+     *
+     *  \param[in]  arena: arena to make current (nullptr: heap)
+     */
+    explicit Scope(Arena* arena) {
+      prev_         = Arena::Curr();
+      Arena::Curr() = arena;
+    }
+
+    /*!
+     * Destructor.
+     */
+    ~Scope() {
+      Arena::Curr() = prev_;
+    }
+
+    Scope(const Scope&)            = delete;
+    Scope& operator=(const Scope&) = delete;
+  };
+
+
+  // Protected types
+ protected:
+  /*!
+   *  \struct Slab
+   *  \brief  Contiguous block of memory
+   */
+  struct Slab {
+    std::shared_ptr<uint8_t> mem;   // Memory
+    size_t                   size;  // Size (bytes)
+  };
+
+
+  // Protected attributes
+ protected:
+  std::vector<Slab> slab_;     // Slabs
+  size_t            curr_;     // Current slab (slab_.size() if none)
+  size_t            offset_;   // Offset in the current slab
+  size_t            used_;     // Memory handed out since the last reset
+  size_t            peak_;     // Maximum memory used between two resets
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Get the current arena of this thread.
+   *
+   *  \return Reference to the current arena
+   */
+  static Arena*& Curr() {
+    static thread_local Arena* arena = nullptr;
+    return arena;
+  }
+
+  /*!
+   * Round a size up to the alignment.
+   *
+   *  \param[in]  size: size (bytes)
+   *
+   *  \return     Aligned size (bytes)
+   */
+  static size_t Align(size_t size) {
+    return (size + kAlignment - 1) & ~(kAlignment - 1);
+  }
+
+  /*!
+   * Check if a slab is not used by any matrix anymore.
+   *
+   *  \param[in]  slab: slab
+   *
+   *  \return     Free?
+   */
+  static bool Free(const Slab& slab) {
+    return slab.mem.use_count() == 1;
+  }
+
+  /*!
+   * Switch to a slab having at least some free memory.
+   *
+   *  \param[in]  size: size needed (bytes)
+   */
+  void NextSlab(size_t size) {
+    // Try to get enough memory for what is left to allocate (based on what
+    // was used between the two previous resets), or grow geometrically
+    size_t want = std::max(size, size_t(kMinSlabSize));
+    if (peak_ > used_) {
+      want = std::max(want, peak_ - used_);
+    } else if (!slab_.empty()) {
+      want = std::max(want, 2 * slab_.back().size);
+    }
+
+    // Reuse a free slab if one is large enough
+    for (size_t i = 0; i < slab_.size(); ++i) {
+      if (i != curr_ && slab_[i].size >= want && Free(slab_[i])) {
+        curr_   = i;
+        offset_ = 0;
+        return;
+      }
+    }
+
+    Slab slab;
+    slab.mem  = AlignedAlloc(want);
+    slab.size = want;
+    slab_.push_back(slab);
+    curr_   = slab_.size() - 1;
+    offset_ = 0;
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   */
+  Arena() {
+    curr_ = offset_ = used_ = peak_ = 0;
+  }
+
+  /*!
+   * Destructor.
+   * The slabs used by live matrices are freed along with the last of them.
+   */
+  ~Arena() {}
+
+  Arena(const Arena&)            = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  /*!
+   * Get the current arena of this thread.
+   *
+   *  \return Current arena (nullptr: heap)
+   */
+  static Arena* Current() {
+    return Curr();
+  }
+
+  /*!
+   * Allocate aligned memory on the heap (tracked by MemoryStats).
+   *
+   *  \param[in]  size: size (bytes)
+   *
+   *  \return     Memory
+   */
+  static std::shared_ptr<uint8_t> AlignedAlloc(size_t size) {
+    uint8_t* mem     = new uint8_t[size + kAlignment - 1];
+    uint8_t* aligned = mem + ((kAlignment -
+                       (reinterpret_cast<uintptr_t>(mem) & (kAlignment - 1))) &
+                       (kAlignment - 1));
+    MemoryStats::Get().Reserve(size);
+    return std::shared_ptr<uint8_t>(aligned, [mem, size](uint8_t*) {
+      MemoryStats::Get().Release(size);
+      delete[] mem;
+    });
+  }
+
+  /*!
+   * Allocate some memory from the arena.
+   *
+   *  \param[in]  size: size (bytes)
+   *
+   *  \return     Memory (aligned, keeping its slab alive)
+   */
+  std::shared_ptr<uint8_t> Alloc(size_t size) {
+    size = Align(size);
+    if (curr_ >= slab_.size() || offset_ + size > slab_[curr_].size) {
+      NextSlab(size);
+    }
+    const Slab& slab = slab_[curr_];
+    std::shared_ptr<uint8_t> mem(slab.mem, slab.mem.get() + offset_);
+    offset_ += size;
+    used_   += size;
+    return mem;
+  }
+
+  /*!
+   * Reset the arena: the next allocations go to a new contiguous slab,
+   * reusing the memory of the slabs not used anymore.
+   */
+  void Reset() {
+    peak_   = std::max(peak_, used_);
+    used_   = 0;
+    offset_ = 0;
+
+    // Release the free slabs too small to be reused
+    slab_.erase(std::remove_if(slab_.begin(), slab_.end(),
+                               [this](const Slab& slab) {
+                                 return Free(slab) && slab.size < peak_;
+                               }), slab_.end());
+    curr_ = slab_.size();
+  }
+
+  /*!
+   * Get the memory handed out since the last reset.
+   *
+   *  \return Size (bytes)
+   */
+  size_t Used() const {
+    return used_;
+  }
+
+  /*!
+   * Get the memory reserved by the arena.
+   *
+   *  \return Size (bytes)
+   */
+  size_t Capacity() const {
+    size_t capacity = 0;
+    for (const Slab& slab : slab_) {
+      capacity += slab.size;
+    }
+    return capacity;
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_ARENA_H_
@@ -0,0 +1,291 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#ifndef CORE_BUFFER_H_
+#define CORE_BUFFER_H_
+
+
+#include <core/arena.h>
+#include <core/memory_stats.h>
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Buffer
+ *  \brief  Aligned array of values
+ *
+ * Fixed-size array with the subset of the std::vector interface used by the
+ * matrices. The storage is 64-byte aligned and comes from the current Arena
+ * (or from the heap if there is none). Each allocation is counted (see
+ * MemoryStats).
+ *
+ * Copying a buffer copies the values: if both buffers have the same size, the
+ * copy is done in place, without any allocation.
+ *
+ * Dtype must be a trivially copyable type (e.g. float or double).
+ */
+template <typename Dtype>
+class Buffer {
+  // Public types
+ public:
+  typedef Dtype         value_type;
+  typedef Dtype*        iterator;
+  typedef const Dtype*  const_iterator;
+
+
+  // Protected attributes
+ protected:
+  std::shared_ptr<uint8_t> mem_;    // Memory (keeping its slab alive)
+  Dtype*                   data_;   // Data
+  size_t                   size_;   // Number of values
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Allocate new storage (content undefined).
+   *
+   *  \param[in]  size: number of values
+   */
+  void Allocate(size_t size) {
+    if (!size) {
+      clear();
+      return;
+    }
+    Arena* arena = Arena::Current();
+    size_t bytes = size * sizeof(Dtype);
+    MemoryStats::Get().Count(bytes);
+    mem_  = arena ? arena->Alloc(bytes) : Arena::AlignedAlloc(bytes);
+    data_ = reinterpret_cast<Dtype*>(mem_.get());
+    size_ = size;
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Default constructor.
+   */
+  Buffer() {
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  size: number of values
+   *  \param[in]  val : initial value
+   */
+  explicit Buffer(size_t size, Dtype val = Dtype(0)): Buffer() {
+    resize(size, val);
+  }
+
+  /*!
+   * Copy constructor.
+   *
+   *  \param[in]  other: buffer to copy
+   */
+  Buffer(const Buffer& other): Buffer() {
+    *this = other;
+  }
+
+  /*!
+   * Move constructor.
+   *
+   *  \param[in]  other: buffer to move
+   */
+  Buffer(Buffer&& other): Buffer() {
+    *this = std::move(other);
+  }
+
+  /*!
+   * Destructor.
+   */
+  ~Buffer() {}
+
+  /*!
+   * Copy the values of another buffer.
+   *
+   *  \param[in]  other: buffer to copy
+   *
+   *  \return     Buffer
+   */
+  Buffer& operator=(const Buffer& other) {
+    if (this != &other) {
+      if (size_ != other.size_) {
+        Allocate(other.size_);
+      }
+      std::copy(other.begin(), other.end(), begin());
+    }
+    return *this;
+  }
+
+  /*!
+   * Move another buffer.
+   *
+   *  \param[in]  other: buffer to move
+   *
+   *  \return     Buffer
+   */
+  Buffer& operator=(Buffer&& other) {
+    if (this != &other) {
+      mem_        = std::move(other.mem_);
+      data_       = other.data_;
+      size_       = other.size_;
+      other.data_ = nullptr;
+      other.size_ = 0;
+    }
+    return *this;
+  }
+
+  /*!
+   * Resize the buffer, keeping the values already there.
+   *
+   *  \param[in]  size: number of values
+   *  \param[in]  val : value of the new elements
+   */
+  void resize(size_t size, Dtype val = Dtype(0)) {
+    if (size == size_) {
+      return;
+    }
+    Buffer prev(std::move(*this));
+    Allocate(size);
+    size_t count = std::min(size, prev.size_);
+    std::copy(prev.begin(), prev.begin() + count, begin());
+    std::fill(begin() + count, end(), val);
+  }
+
+  /*!
+   * Point the buffer to some existing memory (e.g. a mapped file), without
+   * any copy. The memory must be aligned for Dtype.
+   *
+   *  \param[in]  mem : memory (keeping what it comes from alive)
+   *  \param[in]  size: number of values
+   */
+  void Wrap(const std::shared_ptr<uint8_t>& mem, size_t size) {
+    mem_  = mem;
+    data_ = reinterpret_cast<Dtype*>(mem_.get());
+    size_ = size;
+  }
+
+  /*!
+   * Point the buffer to the memory of another one (its first values),
+   * without any copy: both buffers then share the same values.
+   *
+   *  \param[in]  other: buffer to share the memory of
+   *  \param[in]  size : number of values (at most the other buffer size)
+   */
+  void Share(const Buffer& other, size_t size) {
+    Wrap(other.mem_, size);
+  }
+
+  /*!
+   * Release the storage.
+   */
+  void clear() {
+    mem_.reset();
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  /*!
+   * Get the number of values.
+   *
+   *  \return Number of values
+   */
+  size_t size() const {
+    return size_;
+  }
+
+  /*!
+   * Check if the buffer is empty.
+   *
+   *  \return Empty?
+   */
+  bool empty() const {
+    return !size_;
+  }
+
+  /*!
+   * Get the data (const).
+   *
+   *  \return Data
+   */
+  const Dtype* data() const {
+    return data_;
+  }
+
+  /*!
+   * Get the data.
+   *
+   *  \return Data
+   */
+  Dtype* data() {
+    return data_;
+  }
+
+  /*!
+   * Get a value (const).
+   *
+   *  \param[in]  i: index
+   *
+   *  \return     Value
+   */
+  const Dtype& operator[](size_t i) const {
+    return data_[i];
+  }
+
+  /*!
+   * Get a value.
+   *
+   *  \param[in]  i: index
+   *
+   *  \return     Value
+   */
+  Dtype& operator[](size_t i) {
+    return data_[i];
+  }
+
+  /*!
+   * Iterators.
+   */
+  const_iterator begin() const { return data_; }
+  const_iterator end()   const { return data_ + size_; }
+  iterator       begin()       { return data_; }
+  iterator       end()         { return data_ + size_; }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_BUFFER_H_
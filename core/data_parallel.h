@@ -0,0 +1,325 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_DATA_PARALLEL_H_
+#define CORE_DATA_PARALLEL_H_
+
+
+#include <core/log.h>
+#include <core/model.h>
+#include <core/ring.h>
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  DataParallel
+ *  \brief  Data-parallel training over a ring of processes
+ *
+ * Each rank trains its own replica of the model on a shard of the training
+ * set (see LayerData::SetShard). After the backward pass, the weight
+ * derivatives are averaged over all the ranks (see Ring::AllReduce) so the
+ * replicas apply the same update and stay identical.
+ *
+ * The weights are grouped in buckets, in the order their derivatives are
+ * done during the backward pass (the last layers first, see
+ * Model::FirstUse). A communication thread reduces a bucket as soon as the
+ * backward pass gets past it (see Model::SetBackwardHook), overlapping the
+ * communications with the rest of the backward pass. Wait makes sure all the
+ * buckets are reduced before the solver updates the weights.
+ *
+ * The weights without derivative are not reduced: the moving averages of the
+ * batch normalization stay the ones of each rank's shard.
+ */
+template <typename Dtype>
+class DataParallel {
+  // Public types
+ public:
+  typedef Dtype Type;
+
+
+  // Protected types
+ protected:
+  struct Bucket {
+    std::vector<std::shared_ptr<Mat<Dtype>>> weight;  // Weights
+    size_t                                   ready;   // Layer after which
+                                                      // the bucket is done
+    std::vector<Dtype>                       data;    // Packed derivatives
+  };
+
+
+  // Protected attributes
+ protected:
+  Ring*                   ring_;         // Ring of ranks
+  size_t                  bucket_size_;  // Max number of values per bucket
+  Model<Dtype>*           model_;        // Model
+  std::vector<Bucket>     bucket_;       // Buckets (in reduction order)
+  std::vector<Dtype>      scratch_;      // All-reduce scratch buffer
+  size_t                  next_;         // Next bucket to queue
+  size_t                  num_done_;     // Number of buckets reduced
+  std::deque<size_t>      queue_;        // Buckets to reduce
+  bool                    stop_;         // Stop the thread?
+  std::thread             thread_;       // Communication thread
+  std::mutex              mutex_;        // Queue lock
+  std::condition_variable queue_cond_;   // Bucket queued
+  std::condition_variable done_cond_;    // Bucket reduced
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Reduce a bucket: average the derivatives over all the ranks.
+   *
+   *  \param[in]  bucket: bucket
+   */
+  void Reduce(Bucket* bucket) {
+    // Pack the derivatives
+    Dtype* data = bucket->data.data();
+    for (const std::shared_ptr<Mat<Dtype>>& weight : bucket->weight) {
+      const Dtype* deriv = weight->DerivData();
+      std::copy(deriv, deriv + weight->Size(), data);
+      data += weight->Size();
+    }
+
+    if (!ring_->AllReduce(bucket->data.size(), bucket->data.data(),
+                          scratch_.data())) {
+      return;
+    }
+
+    // Unpack the averages
+    Dtype scale = Dtype(1) / ring_->NumRank();
+    data = bucket->data.data();
+    for (const std::shared_ptr<Mat<Dtype>>& weight : bucket->weight) {
+      Dtype* deriv = weight->DerivData();
+      for (uint32_t i = 0; i < weight->Size(); ++i) {
+        deriv[i] = data[i] * scale;
+      }
+      data += weight->Size();
+
+      // The rows of a sparse derivative now include the other ranks' ones
+      if (weight->sparse) {
+        uint32_t row_size = weight->size[0];
+        uint32_t num_row  = weight->Size() / row_size;
+        weight->deriv_row.clear();
+        for (uint32_t row = 0; row < num_row; ++row) {
+          const Dtype* row_deriv = deriv + row * row_size;
+          if (std::any_of(row_deriv, row_deriv + row_size,
+                          [](Dtype val) { return val != Dtype(0); })) {
+            weight->AddDerivRow(row);
+          }
+        }
+      }
+    }
+  }
+
+  /*!
+   * Communication thread loop.
+   */
+  void Communicate() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      queue_cond_.wait(lock, [this] {
+        return stop_ || !queue_.empty();
+      });
+      if (stop_) {
+        return;
+      }
+      size_t index = queue_.front();
+      queue_.pop_front();
+      lock.unlock();
+      Reduce(&bucket_[index]);
+      lock.lock();
+      ++num_done_;
+      done_cond_.notify_one();
+    }
+  }
+
+  /*!
+   * Queue the buckets done once the backward pass of a layer is done.
+   *
+   *  \param[in]  layer: layer index
+   */
+  void OnBackward(size_t layer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t next = next_;
+    while (next_ < bucket_.size() && bucket_[next_].ready >= layer) {
+      queue_.push_back(next_++);
+    }
+    if (next_ != next) {
+      queue_cond_.notify_one();
+    }
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  ring       : ring of ranks (connected)
+   *  \param[in]  bucket_size: max size of a bucket (bytes)
+   */
+  explicit DataParallel(Ring* ring, size_t bucket_size = 1 << 20) {
+    ring_        = ring;
+    bucket_size_ = std::max(bucket_size / sizeof(Dtype), size_t(1));
+    model_       = nullptr;
+    next_        = num_done_ = 0;
+    stop_        = false;
+  }
+
+  /*!
+   * Destructor.
+   */
+  ~DataParallel() {
+    Detach();
+  }
+
+  DataParallel(const DataParallel&)            = delete;
+  DataParallel& operator=(const DataParallel&) = delete;
+
+  /*!
+   * Get the rank of this process.
+   *
+   *  \return Rank
+   */
+  uint32_t Rank() const {
+    return ring_->Rank();
+  }
+
+  /*!
+   * Get the number of ranks.
+   *
+   *  \return Number of ranks
+   */
+  uint32_t NumRank() const {
+    return ring_->NumRank();
+  }
+
+  /*!
+   * Start training a model: the weights of rank 0 are copied to all the
+   * ranks and the derivatives are reduced during each backward pass.
+   *
+   *  \param[in]  model: model
+   *
+   *  \return     Error?
+   */
+  bool Attach(Model<Dtype>* model) {
+    Detach();
+
+    std::vector<std::shared_ptr<Mat<Dtype>>> weight;
+    model->GetWeight(&weight);
+
+    // Same initial weights everywhere
+    for (const std::shared_ptr<Mat<Dtype>>& w : weight) {
+      if (!ring_->Broadcast(w->Size() * sizeof(Dtype), w->Data())) {
+        return false;
+      }
+    }
+
+    // Buckets, in the order the derivatives are done
+    std::vector<std::pair<size_t, size_t>> order(weight.size());
+    for (size_t i = 0; i < weight.size(); ++i) {
+      order[i] = std::make_pair(model->FirstUse(weight[i]), i);
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [](const std::pair<size_t, size_t>& a,
+                        const std::pair<size_t, size_t>& b) {
+      return a.first > b.first;
+    });
+    size_t max_size = 0;
+    for (const std::pair<size_t, size_t>& w : order) {
+      const std::shared_ptr<Mat<Dtype>>& mat = weight[w.second];
+      if (!mat->deriv) {
+        continue;
+      }
+      if (bucket_.empty() ||
+          bucket_.back().data.size() + mat->Size() > bucket_size_) {
+        bucket_.push_back(Bucket());
+      }
+      Bucket& bucket = bucket_.back();
+      bucket.weight.push_back(mat);
+      bucket.ready = w.first;
+      bucket.data.resize(bucket.data.size() + mat->Size());
+      max_size = std::max(max_size, bucket.data.size());
+    }
+    scratch_.resize(max_size / ring_->NumRank() + 1);
+
+    model_    = model;
+    next_     = num_done_ = 0;
+    stop_     = false;
+    thread_   = std::thread(&DataParallel::Communicate, this);
+    model_->SetBackwardHook([this](size_t layer) { OnBackward(layer); });
+    return true;
+  }
+
+  /*!
+   * Stop training the model.
+   */
+  void Detach() {
+    if (!model_) {
+      return;
+    }
+    model_->SetBackwardHook(std::function<void(size_t)>());
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    queue_cond_.notify_one();
+    thread_.join();
+    queue_.clear();
+    bucket_.clear();
+    model_ = nullptr;
+  }
+
+  /*!
+   * Wait for all the derivatives to be reduced (after the backward pass).
+   */
+  void Wait() {
+    // The buckets the hook did not queue (e.g. recurrent steps not run)
+    OnBackward(0);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_cond_.wait(lock, [this] {
+      return num_done_ == bucket_.size();
+    });
+    next_ = num_done_ = 0;
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_DATA_PARALLEL_H_
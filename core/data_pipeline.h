@@ -0,0 +1,285 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_DATA_PIPELINE_H_
+#define CORE_DATA_PIPELINE_H_
+
+
+#include <core/mat.h>
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  DataPipeline
+ *  \brief  Prefetching pipeline of batches
+ *
+ * A producer thread fills a ring of batches while the model is computing on
+ * the current one. Each batch holds one buffer per output of a data layer,
+ * a sample being copied (and eventually augmented) in the batch by a fill
+ * function. The samples are visited epoch by epoch, optionally shuffled at
+ * the beginning of each epoch.
+ *
+ * Getting the next batch swaps the buffers of the outputs with the ones of
+ * the batch, without any copy: the buffers previously in the outputs go back
+ * to the ring to be filled again. With 2 batches in the ring, the outputs are
+ * then triple-buffered.
+ *
+ * The fill function is called on the producer thread: it must not use the
+ * thread pool, nor anything the model may change while computing.
+ */
+template <typename Dtype>
+class DataPipeline {
+  // Public types
+ public:
+  typedef Dtype                       Type;
+  typedef std::vector<Buffer<Dtype>>  Batch;
+
+  /*!
+   * Fill function: copy a sample in a batch.
+   *
+   *  \param[in]  sample: sample index
+   *  \param[in]  batch : index in the batch
+   *
+   *  \param[out] data  : batch (one buffer per output)
+   */
+  typedef std::function<void(uint32_t sample, uint32_t batch,
+                             Batch* data)> Fill;
+
+
+  // Protected attributes
+ protected:
+  std::vector<Batch>       batch_;        // Ring of batches
+  std::vector<uint32_t>    order_;        // Order of the samples
+  Fill                     fill_;         // Fill function
+  uint32_t                 batch_size_;   // Batch size
+  uint32_t                 shard_;        // Shard of the samples
+  uint32_t                 num_shard_;    // Number of shards
+  uint32_t                 next_;         // Next sample (in order_)
+  uint32_t                 head_;         // Next batch to get
+  uint32_t                 num_ready_;    // Number of batches ready
+  bool                     shuffle_;      // Shuffle each epoch?
+  bool                     stop_;         // Stop the producer?
+  std::mt19937             gen_;          // Random generator (shuffling)
+  std::thread              producer_;     // Producer thread
+  std::mutex               mutex_;        // Ring lock
+  std::condition_variable  ready_cond_;   // Batch ready
+  std::condition_variable  free_cond_;    // Batch free
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Fill a batch with the next samples.
+   *
+   *  \param[out] data: batch
+   */
+  void FillBatch(Batch* data) {
+    for (uint32_t batch = 0; batch < batch_size_; ++batch) {
+      if (next_ >= uint32_t(order_.size())) {
+        // New epoch
+        next_ = 0;
+        if (shuffle_) {
+          std::shuffle(order_.begin(), order_.end(), gen_);
+        }
+      }
+      fill_(order_[next_++], batch, data);
+    }
+  }
+
+  /*!
+   * Producer thread loop.
+   */
+  void Producer() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      free_cond_.wait(lock, [this] {
+        return stop_ || num_ready_ < uint32_t(batch_.size());
+      });
+      if (stop_) {
+        return;
+      }
+
+      // The batch after the ready ones is not used by anyone else
+      uint32_t slot = (head_ + num_ready_) % uint32_t(batch_.size());
+      lock.unlock();
+      FillBatch(&batch_[slot]);
+      lock.lock();
+
+      ++num_ready_;
+      ready_cond_.notify_one();
+    }
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   */
+  DataPipeline(): gen_(std::random_device()()) {
+    batch_size_ = next_ = head_ = num_ready_ = 0;
+    shard_      = 0;
+    num_shard_  = 1;
+    shuffle_    = stop_ = false;
+  }
+
+  /*!
+   * Destructor.
+   */
+  ~DataPipeline() {
+    Stop();
+  }
+
+  DataPipeline(const DataPipeline&)            = delete;
+  DataPipeline& operator=(const DataPipeline&) = delete;
+
+  /*!
+   * Only visit a shard of the samples (e.g. one per rank in data-parallel
+   * training): the samples shard, shard + num_shard, shard + 2 * num_shard...
+   * Applies the next time the producer is started.
+   *
+   *  \param[in]  shard    : shard index
+   *  \param[in]  num_shard: number of shards
+   */
+  void SetShard(uint32_t shard, uint32_t num_shard) {
+    num_shard_ = std::max(num_shard, 1u);
+    shard_     = std::min(shard, num_shard_ - 1);
+  }
+
+  /*!
+   * Start the producer.
+   *
+   *  \param[in]  num_sample: number of samples
+   *  \param[in]  out       : outputs (giving the size of the batches)
+   *  \param[in]  fill      : fill function
+   *  \param[in]  num_batch : number of batches in the ring
+   *  \param[in]  shuffle   : shuffle the samples each epoch?
+   */
+  void Start(uint32_t num_sample,
+             const std::vector<std::shared_ptr<Mat<Dtype>>>& out,
+             const Fill& fill, uint32_t num_batch, bool shuffle = true) {
+    Stop();
+    if (!num_sample || out.empty() || !num_batch) {
+      return;
+    }
+
+    batch_.assign(num_batch, Batch());
+    for (Batch& data : batch_) {
+      for (const std::shared_ptr<Mat<Dtype>>& mat : out) {
+        data.emplace_back(mat->Capacity());
+      }
+    }
+
+    order_.clear();
+    for (uint32_t sample = shard_; sample < num_sample;
+         sample += num_shard_) {
+      order_.push_back(sample);
+    }
+    if (order_.empty()) {
+      return;
+    }
+    fill_       = fill;
+    batch_size_ = out[0]->size[3];
+    shuffle_    = shuffle;
+    next_       = shuffle_ ? uint32_t(order_.size()) : 0;
+    head_       = num_ready_ = 0;
+    producer_   = std::thread(&DataPipeline::Producer, this);
+  }
+
+  /*!
+   * Get the size of the batches being produced.
+   *
+   *  \return Batch size
+   */
+  uint32_t BatchSize() const {
+    return batch_size_;
+  }
+
+  /*!
+   * Stop the producer (the batches not fetched yet are lost).
+   */
+  void Stop() {
+    if (!producer_.joinable()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    free_cond_.notify_one();
+    producer_.join();
+    stop_ = false;
+    batch_.clear();
+  }
+
+  /*!
+   * Check if the producer is running.
+   *
+   *  \return Running?
+   */
+  bool Running() const {
+    return producer_.joinable();
+  }
+
+  /*!
+   * Get the next batch, waiting for it to be ready: the buffers of the
+   * outputs are swapped with the ones of the batch.
+   *
+   *  \param[in]  out: outputs
+   */
+  void Next(const std::vector<std::shared_ptr<Mat<Dtype>>>& out) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      ready_cond_.wait(lock, [this] {
+        return num_ready_ > 0;
+      });
+      Batch& data = batch_[head_];
+      for (size_t i = 0; i < out.size(); ++i) {
+        std::swap(out[i]->data, data[i]);
+      }
+      head_ = (head_ + 1) % uint32_t(batch_.size());
+      --num_ready_;
+    }
+    free_cond_.notify_one();
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_DATA_PIPELINE_H_
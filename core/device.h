@@ -0,0 +1,310 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_DEVICE_H_
+#define CORE_DEVICE_H_
+
+
+#include <core/log.h>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#ifdef JIK_USE_CUDA
+#include <cublas_v2.h>
+#include <cuda_runtime.h>
+#endif  // JIK_USE_CUDA
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Device
+ *  \brief  Device running the matrix multiplications
+ *
+ * By default, everything runs on the CPU. When built with CUDA (USE_CUDA),
+ * the large matrix multiplications (see Gemm, i.e. the inner product,
+ * matrix multiplication and im2col convolution layers) can run on the GPU
+ * with cuBLAS: the matrices are uploaded to device buffers, multiplied and
+ * the result is downloaded, the buffers being kept from a call to the next
+ * (the multiplications of the threads are serialized on the GPU).
+ *
+ * The matrices stay in host memory: only the multiplications large enough to
+ * pay for the transfers (see kMinSize) are run on the GPU.
+ *
+ * A single device is shared by the whole process (see Get).
+ */
+class Device {
+  // Public types
+ public:
+  /*!
+   *  \enum   E_DEVICE
+   *  \brief  Device type
+   */
+  enum E_DEVICE {
+    DEVICE_CPU = 0,   // CPU only
+    DEVICE_CUDA       // Large matrix multiplications on a CUDA GPU
+  };
+
+  static const uint64_t kMinSize = 1 << 22;  // Minimum m*n*k to offload
+
+
+  // Protected attributes
+ protected:
+  E_DEVICE       type_;    // Device type
+#ifdef JIK_USE_CUDA
+  std::mutex     mutex_;   // GPU lock
+  cublasHandle_t handle_;  // cuBLAS handle (nullptr: not created)
+  void*          buffer_;  // Device buffer (A, B, then C)
+  size_t         size_;    // Device buffer size (bytes)
+#endif  // JIK_USE_CUDA
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Constructor.
+   */
+  Device() {
+    type_   = DEVICE_CPU;
+#ifdef JIK_USE_CUDA
+    handle_ = nullptr;
+    buffer_ = nullptr;
+    size_   = 0;
+#endif  // JIK_USE_CUDA
+  }
+
+#ifdef JIK_USE_CUDA
+  /*!
+   * Get the size of a row-major matrix in memory.
+   *
+   *  \param[in]  rows: number of rows
+   *  \param[in]  cols: number of columns
+   *  \param[in]  ld  : leading dimension
+   *
+   *  \return     Number of values
+   */
+  static size_t Span(uint32_t rows, uint32_t cols, uint32_t ld) {
+    return size_t(rows - 1) * ld + cols;
+  }
+
+  /*!
+   * Get device buffers for the 3 matrices of a multiplication.
+   *
+   *  \param[in]  size_a: A size (bytes)
+   *  \param[in]  size_b: B size (bytes)
+   *  \param[in]  size_c: C size (bytes)
+   *
+   *  \return     Device buffer (nullptr on error)
+   */
+  uint8_t* Buffer(size_t size_a, size_t size_b, size_t size_c) {
+    size_t size = size_a + size_b + size_c;
+    if (size > size_) {
+      cudaFree(buffer_);
+      buffer_ = nullptr;
+      size_   = 0;
+      if (cudaMalloc(&buffer_, size) != cudaSuccess) {
+        Report(kWarning, "Can't allocate %ld byte(s) on the GPU", size);
+        return nullptr;
+      }
+      size_ = size;
+    }
+    return reinterpret_cast<uint8_t*>(buffer_);
+  }
+
+  /*!
+   * Run a multiplication with cuBLAS.
+   * The matrices are row-major: C^T = op(B)^T * op(A)^T is calculated
+   * column-major.
+   *
+   *  \param[in]  gemm   : cuBLAS function (cublasSgemm or cublasDgemm)
+   *  \param[in]  others : see Gemm::Run
+   *
+   *  \return     Run on the GPU?
+   */
+  template <typename Dtype, typename Func>
+  bool Run(const Func& gemm, bool trans_a, bool trans_b,
+           uint32_t m, uint32_t n, uint32_t k,
+           Dtype alpha, const Dtype* a, uint32_t lda,
+           const Dtype* b, uint32_t ldb,
+           Dtype beta, Dtype* c, uint32_t ldc) {
+    if (type_ != DEVICE_CUDA || !m || !n || !k ||
+        uint64_t(m) * n * k < kMinSize) {
+      return false;
+    }
+    size_t size_a = Span(trans_a ? k : m, trans_a ? m : k, lda) *
+                    sizeof(Dtype);
+    size_t size_b = Span(trans_b ? n : k, trans_b ? k : n, ldb) *
+                    sizeof(Dtype);
+    size_t size_c = Span(m, n, ldc) * sizeof(Dtype);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint8_t* buffer = Buffer(size_a, size_b, size_c);
+    if (!buffer) {
+      return false;
+    }
+    Dtype* dev_a = reinterpret_cast<Dtype*>(buffer);
+    Dtype* dev_b = reinterpret_cast<Dtype*>(buffer + size_a);
+    Dtype* dev_c = reinterpret_cast<Dtype*>(buffer + size_a + size_b);
+    bool res =
+      cudaMemcpy(dev_a, a, size_a, cudaMemcpyHostToDevice) == cudaSuccess &&
+      cudaMemcpy(dev_b, b, size_b, cudaMemcpyHostToDevice) == cudaSuccess &&
+      (beta == Dtype(0) ||
+       cudaMemcpy(dev_c, c, size_c, cudaMemcpyHostToDevice) == cudaSuccess) &&
+      gemm(handle_, trans_b ? CUBLAS_OP_T : CUBLAS_OP_N,
+           trans_a ? CUBLAS_OP_T : CUBLAS_OP_N, int(n), int(m), int(k),
+           &alpha, dev_b, int(ldb), dev_a, int(lda), &beta,
+           dev_c, int(ldc)) == CUBLAS_STATUS_SUCCESS &&
+      cudaMemcpy(c, dev_c, size_c, cudaMemcpyDeviceToHost) == cudaSuccess;
+    if (!res) {
+      Report(kWarning, "GPU matrix multiplication failed, running it on the "
+             "CPU");
+    }
+    return res;
+  }
+#endif  // JIK_USE_CUDA
+
+
+  // Public methods
+ public:
+  /*!
+   * Destructor.
+   */
+  ~Device() {
+#ifdef JIK_USE_CUDA
+    if (handle_) {
+      cublasDestroy(handle_);
+    }
+    cudaFree(buffer_);
+#endif  // JIK_USE_CUDA
+  }
+
+  Device(const Device&)            = delete;
+  Device& operator=(const Device&) = delete;
+
+  /*!
+   * Get the process device.
+   *
+   *  \return Device
+   */
+  static Device& Get() {
+    static Device device;
+    return device;
+  }
+
+  /*!
+   * Select the device.
+   *
+   *  \param[in]  name: device name ("cpu" or "cuda")
+   *
+   *  \return     Available?
+   */
+  bool Set(const char* name) {
+    if (!std::strcmp(name, "cpu")) {
+      type_ = DEVICE_CPU;
+      return true;
+    }
+    if (std::strcmp(name, "cuda")) {
+      Report(kWarning, "Unknown device '%s'", name);
+      return false;
+    }
+#ifdef JIK_USE_CUDA
+    int num_gpu = 0;
+    if (!handle_ && (cudaGetDeviceCount(&num_gpu) != cudaSuccess ||
+                     !num_gpu ||
+                     cublasCreate(&handle_) != CUBLAS_STATUS_SUCCESS)) {
+      handle_ = nullptr;
+      Report(kWarning, "No CUDA GPU available");
+      return false;
+    }
+    type_ = DEVICE_CUDA;
+    return true;
+#else
+    Report(kWarning, "Not built with CUDA (USE_CUDA)");
+    return false;
+#endif  // JIK_USE_CUDA
+  }
+
+  /*!
+   * Get the device type.
+   *
+   *  \return Device type
+   */
+  E_DEVICE Type() const {
+    return type_;
+  }
+
+  /*!
+   * Run a matrix multiplication on the device, if it's large enough
+   * (C = alpha * op(A) * op(B) + beta * C, see Gemm::Run).
+   *
+   *  \param[in]  others: see Gemm::Run
+   *
+   *  \return     Run on the device? (false: to run on the CPU)
+   */
+  template <typename Dtype>
+  bool Gemm(bool trans_a, bool trans_b, uint32_t m, uint32_t n, uint32_t k,
+            Dtype alpha, const Dtype* a, uint32_t lda,
+            const Dtype* b, uint32_t ldb,
+            Dtype beta, Dtype* c, uint32_t ldc) {
+    return false;
+  }
+};
+
+
+#ifdef JIK_USE_CUDA
+/*!
+ * Run a single precision matrix multiplication on the device.
+ */
+template <>
+inline bool Device::Gemm<float>(bool trans_a, bool trans_b,
+                                uint32_t m, uint32_t n, uint32_t k,
+                                float alpha, const float* a, uint32_t lda,
+                                const float* b, uint32_t ldb,
+                                float beta, float* c, uint32_t ldc) {
+  return Run(cublasSgemm, trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb,
+             beta, c, ldc);
+}
+
+/*!
+ * Run a double precision matrix multiplication on the device.
+ */
+template <>
+inline bool Device::Gemm<double>(bool trans_a, bool trans_b,
+                                 uint32_t m, uint32_t n, uint32_t k,
+                                 double alpha, const double* a, uint32_t lda,
+                                 const double* b, uint32_t ldb,
+                                 double beta, double* c, uint32_t ldc) {
+  return Run(cublasDgemm, trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb,
+             beta, c, ldc);
+}
+#endif  // JIK_USE_CUDA
+
+
+}  // namespace jik
+
+
+#endif  // CORE_DEVICE_H_
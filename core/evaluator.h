@@ -0,0 +1,198 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_EVALUATOR_H_
+#define CORE_EVALUATOR_H_
+
+
+#include <core/log.h>
+#include <core/model.h>
+#include <core/thread_pool.h>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Evaluator
+ *  \brief  Evaluation of a model being trained, in the background
+ *
+ * Each worker has its own replica of the model, created by a factory and
+ * planned for inference (its own activations). An evaluation copies the
+ * current weights of the trained model to the replicas (a snapshot, see
+ * Model::CopyWeight), then returns: the testing set is split in one
+ * contiguous shard per worker, tested in parallel on the worker threads
+ * while the training goes on, and the correct predictions of the shards are
+ * added up for the accuracy (see Model::TestRange).
+ *
+ * The workers don't use the thread pool (see ThreadPool::Serial): they run
+ * next to the training threads. An evaluation waits for the previous one to
+ * be done.
+ */
+template <typename Dtype>
+class Evaluator {
+  // Public types
+ public:
+  typedef Dtype Type;
+  typedef std::function<std::unique_ptr<Model<Dtype>>()> Factory;
+
+
+  // Protected attributes
+ protected:
+  std::vector<std::unique_ptr<Model<Dtype>>>
+              replica_;  // Model replicas (one per worker)
+  std::thread thread_;   // Evaluation thread
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Test the replicas on their shard and report the accuracy (evaluation
+   * thread, also testing the first shard).
+   *
+   *  \param[in]  step: training step
+   */
+  void Run(uint32_t step) {
+    uint32_t size      = replica_[0]->TestSize();
+    uint32_t num_shard = uint32_t(replica_.size());
+    std::vector<uint64_t> num_correct(num_shard, 0);
+    auto test = [&](uint32_t shard) {
+      ThreadPool::Serial serial;
+      num_correct[shard] = replica_[shard]->TestRange(
+        uint32_t(uint64_t(size) * shard / num_shard),
+        uint32_t(uint64_t(size) * (shard + 1) / num_shard));
+    };
+
+    std::vector<std::thread> worker;
+    for (uint32_t shard = 1; shard < num_shard; ++shard) {
+      worker.emplace_back(test, shard);
+    }
+    test(0);
+    for (std::thread& thread : worker) {
+      thread.join();
+    }
+
+    uint64_t total = 0;
+    for (uint64_t count : num_correct) {
+      total += count;
+    }
+    Report(kInfo, "Step #%d Accuracy: %f (%ld/%d)", step,
+           double(total) / size, total, size);
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   */
+  Evaluator() {}
+
+  /*!
+   * Destructor.
+   */
+  ~Evaluator() {
+    Wait();
+  }
+
+  Evaluator(const Evaluator&)            = delete;
+  Evaluator& operator=(const Evaluator&) = delete;
+
+  /*!
+   * Create the replicas.
+   *
+   *  \param[in]  factory   : create a model (same layers as the trained one)
+   *  \param[in]  num_worker: number of workers
+   *
+   *  \return     Error?
+   */
+  bool Start(const Factory& factory, uint32_t num_worker) {
+    Wait();
+    replica_.clear();
+    for (uint32_t i = 0; i < std::max(num_worker, 1u); ++i) {
+      std::unique_ptr<Model<Dtype>> model = factory();
+      if (!model || !model->TestSize()) {
+        Report(kWarning, "Evaluation needs a model tested by range");
+        replica_.clear();
+        return false;
+      }
+      model->Plan(State::PHASE_TEST);
+      replica_.push_back(std::move(model));
+    }
+    return true;
+  }
+
+  /*!
+   * Get the number of workers.
+   *
+   *  \return Number of workers (0: not started)
+   */
+  uint32_t NumWorker() const {
+    return uint32_t(replica_.size());
+  }
+
+  /*!
+   * Start evaluating a snapshot of the weights of a model (the accuracy is
+   * reported once done).
+   *
+   *  \param[in]  model: trained model
+   *  \param[in]  step : training step
+   *
+   *  \return     Error?
+   */
+  bool Test(Model<Dtype>* model, uint32_t step) {
+    Wait();
+    for (const std::unique_ptr<Model<Dtype>>& replica : replica_) {
+      if (!replica->CopyWeight(model)) {
+        return false;
+      }
+    }
+    if (!replica_.empty()) {
+      thread_ = std::thread(&Evaluator::Run, this, step);
+    }
+    return true;
+  }
+
+  /*!
+   * Wait for the current evaluation to be done.
+   */
+  void Wait() {
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_EVALUATOR_H_
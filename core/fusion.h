@@ -0,0 +1,218 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#ifndef CORE_FUSION_H_
+#define CORE_FUSION_H_
+
+
+#include <core/mat.h>
+#include <core/simd.h>
+#include <memory>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Fusion
+ *  \brief  Layers fused into the output loop of another one (inference)
+ *
+ * During inference, the batch normalization and scale layers only apply
+ * constant per-channel affine transforms, which can be merged together and
+ * with the bias of the layer producing their inputs (e.g. convolution or
+ * inner product), a ReLU activation possibly following:
+ *   out = max(scale * in + shift, 0)
+ *
+ * The producing layer applies the merged transform while writing its
+ * outputs, straight to the outputs of the last fused layer (see Out): the
+ * fused layers are then skipped, saving one sweep over the activations per
+ * layer (see Model::Fuse).
+ *
+ * The transform is calculated from the weights at the time the layers are
+ * fused, and is only used in the testing phase.
+ */
+template <typename Dtype>
+class Fusion {
+  // Public types
+ public:
+  typedef Dtype Type;
+
+
+  // Protected attributes
+ protected:
+  std::vector<Dtype>          scale_;  // Scale (per channel)
+  std::vector<Dtype>          shift_;  // Shift (per channel)
+  bool                        relu_;   // ReLU activation?
+  std::shared_ptr<Mat<Dtype>> out_;    // Outputs of the last fused layer
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   */
+  Fusion() {
+    relu_ = false;
+  }
+
+  /*!
+   * Destructor.
+   */
+  ~Fusion() {}
+
+  /*!
+   * Start a fusion with the identity transform (nothing fused yet).
+   *
+   *  \param[in]  num_channel: number of channels
+   *  \param[in]  bias       : bias of the producing layer (nullptr if none)
+   */
+  void Reset(uint32_t num_channel, const Dtype* bias) {
+    scale_.assign(num_channel, Dtype(1));
+    shift_.assign(num_channel, Dtype(0));
+    if (bias) {
+      shift_.assign(bias, bias + num_channel);
+    }
+    relu_ = false;
+    out_.reset();
+  }
+
+  /*!
+   * Check if some layers are fused.
+   *
+   *  \return Fused?
+   */
+  bool Active() const {
+    return out_ != nullptr;
+  }
+
+  /*!
+   * Check if the fusion ends with a ReLU (nothing else can be fused).
+   *
+   *  \return ReLU?
+   */
+  bool HasRelu() const {
+    return relu_;
+  }
+
+  /*!
+   * Get the outputs of the last fused layer.
+   *
+   *  \return Outputs
+   */
+  const std::shared_ptr<Mat<Dtype>>& Out() const {
+    return out_;
+  }
+
+  /*!
+   * Set the outputs of the last fused layer, activating the fusion.
+   *
+   *  \param[in]  out: outputs
+   */
+  void SetOut(const std::shared_ptr<Mat<Dtype>>& out) {
+    out_ = out;
+  }
+
+  /*!
+   * Fuse a normalization: out = (in - mean) * inv_std_dev
+   *
+   *  \param[in]  mean       : mean (per channel)
+   *  \param[in]  inv_std_dev: inverse of the standard deviation (per channel)
+   */
+  void Normalize(const Dtype* mean, const Dtype* inv_std_dev) {
+    for (size_t i = 0; i < scale_.size(); ++i) {
+      scale_[i] *= inv_std_dev[i];
+      shift_[i]  = (shift_[i] - mean[i]) * inv_std_dev[i];
+    }
+  }
+
+  /*!
+   * Fuse a scale: out = scale * in + bias
+   *
+   *  \param[in]  scale: scale (per channel)
+   *  \param[in]  bias : bias  (per channel, nullptr if none)
+   */
+  void Scale(const Dtype* scale, const Dtype* bias) {
+    for (size_t i = 0; i < scale_.size(); ++i) {
+      scale_[i] *= scale[i];
+      shift_[i] *= scale[i];
+      if (bias) {
+        shift_[i] += bias[i];
+      }
+    }
+  }
+
+  /*!
+   * Fuse a ReLU activation: out = max(in, 0)
+   */
+  void Relu() {
+    relu_ = true;
+  }
+
+  /*!
+   * Apply the fused layers on a range of the batch.
+   * The values are in the NCHW layout (in and out can be the same).
+   *
+   *  \param[in]  data_size  : number of values per channel (width * height)
+   *  \param[in]  batch_start: first batch
+   *  \param[in]  batch_end  : last batch (excluded)
+   *  \param[in]  in         : inputs (whole batch)
+   *
+   *  \param[out] out        : outputs (whole batch)
+   */
+  void Apply(uint32_t data_size, uint32_t batch_start, uint32_t batch_end,
+             const Dtype* in, Dtype* out) const {
+    uint32_t num_channel = uint32_t(scale_.size());
+    for (uint32_t batch = batch_start; batch < batch_end; ++batch) {
+      size_t offset = size_t(batch) * num_channel * data_size;
+      if (data_size == 1) {
+        // One value per channel (e.g. inner product)
+        for (uint32_t channel = 0; channel < num_channel; ++channel) {
+          Dtype val = scale_[channel] * in[offset + channel] +
+                      shift_[channel];
+          out[offset + channel] = relu_ && val < Dtype(0) ? Dtype(0) : val;
+        }
+        continue;
+      }
+      for (uint32_t channel = 0; channel < num_channel; ++channel) {
+        size_t channel_offset = offset + size_t(channel) * data_size;
+        if (relu_) {
+          Simd<Dtype>::ScaleRelu(data_size, in + channel_offset,
+                                 scale_[channel], shift_[channel],
+                                 out + channel_offset);
+        } else {
+          Simd<Dtype>::Scale(data_size, in + channel_offset, scale_[channel],
+                             shift_[channel], out + channel_offset);
+        }
+      }
+    }
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_FUSION_H_
@@ -0,0 +1,443 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#ifndef CORE_GEMM_H_
+#define CORE_GEMM_H_
+
+
+#include <core/device.h>
+#include <core/thread_pool.h>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#ifdef JIK_USE_CBLAS
+#include <cblas.h>
+#endif  // JIK_USE_CBLAS
+
+
+namespace jik {
+
+
+/*!
+ *  \struct Gemm
+ *  \brief  General matrix multiplication
+ *
+ * Calculates C = alpha * op(A) * op(B) + beta * C where op(X) is either X or
+ * its transpose, all the matrices being stored row-major:
+ *  + op(A) is a m*k matrix
+ *  + op(B) is a k*n matrix
+ *  + C     is a m*n matrix
+ *
+ * The default implementation is cache-blocked: op(B) is split into kc*nc
+ * panels and op(A) into mc*kc panels, both packed into contiguous buffers so
+ * the micro-kernel only reads memory sequentially while computing a
+ * mr*nr block of C held in registers.
+ *
+ * Large multiplications are split across the threads of the ThreadPool, each
+ * thread calculating a band of rows (or columns) of C: by default along the
+ * largest dimension of C, or as selected by the caller (see E_SPLIT, e.g.
+ * tuned with Tuner).
+ *
+ * Defining JIK_USE_CBLAS routes float and double matrices to an external
+ * BLAS library (cblas interface) instead. Defining JIK_USE_CUDA runs the
+ * large ones on the GPU when selected (see Device).
+ */
+template <typename Dtype>
+struct Gemm {
+  static const uint32_t kMR = 4;     // Micro-kernel rows
+  static const uint32_t kNR = 8;     // Micro-kernel columns
+  static const uint32_t kMC = 128;   // A panel rows
+  static const uint32_t kKC = 256;   // A/B panel depth
+  static const uint32_t kNC = 2048;  // B panel columns
+  static const uint64_t kParallelMin = 1 << 18;  // Minimum m*n*k to split
+
+  /*!
+   *  \enum   E_SPLIT
+   *  \brief  Split of a multiplication across the threads
+   */
+  enum E_SPLIT {
+    SPLIT_AUTO = 0,   // Along the largest dimension of C
+    SPLIT_ROW,        // Bands of rows of C
+    SPLIT_COL         // Bands of columns of C
+  };
+
+  /*!
+   * Pack a mc*kc block of op(A) into mr-row slivers.
+   *
+   *  \param[in]  trans: transpose A?
+   *  \param[in]  a    : A matrix (first element of the block)
+   *  \param[in]  lda  : A leading dimension
+   *  \param[in]  mc   : number of rows to pack
+   *  \param[in]  kc   : number of columns to pack
+   *
+   *  \param[out] pack : packed block
+   */
+  static void PackA(bool trans, const Dtype* a, uint32_t lda,
+                    uint32_t mc, uint32_t kc, Dtype* pack) {
+    for (uint32_t i = 0; i < mc; i += kMR) {
+      uint32_t mr = std::min(kMR, mc - i);
+      for (uint32_t p = 0; p < kc; ++p) {
+        for (uint32_t ir = 0; ir < mr; ++ir) {
+          pack[ir] = trans ? a[p * lda + i + ir] : a[(i + ir) * lda + p];
+        }
+        for (uint32_t ir = mr; ir < kMR; ++ir) {
+          pack[ir] = Dtype(0);
+        }
+        pack += kMR;
+      }
+    }
+  }
+
+  /*!
+   * Pack a kc*nc block of op(B) into nr-column slivers.
+   *
+   *  \param[in]  trans: transpose B?
+   *  \param[in]  b    : B matrix (first element of the block)
+   *  \param[in]  ldb  : B leading dimension
+   *  \param[in]  kc   : number of rows to pack
+   *  \param[in]  nc   : number of columns to pack
+   *
+   *  \param[out] pack : packed block
+   */
+  static void PackB(bool trans, const Dtype* b, uint32_t ldb,
+                    uint32_t kc, uint32_t nc, Dtype* pack) {
+    for (uint32_t j = 0; j < nc; j += kNR) {
+      uint32_t nr = std::min(kNR, nc - j);
+      for (uint32_t p = 0; p < kc; ++p) {
+        for (uint32_t jr = 0; jr < nr; ++jr) {
+          pack[jr] = trans ? b[(j + jr) * ldb + p] : b[p * ldb + j + jr];
+        }
+        for (uint32_t jr = nr; jr < kNR; ++jr) {
+          pack[jr] = Dtype(0);
+        }
+        pack += kNR;
+      }
+    }
+  }
+
+  /*!
+   * Micro-kernel: C[mr*nr] += alpha * A sliver * B sliver.
+   *
+   *  \param[in]  kc   : depth
+   *  \param[in]  alpha: scale
+   *  \param[in]  pa   : packed A sliver (kc * kMR)
+   *  \param[in]  pb   : packed B sliver (kc * kNR)
+   *  \param[in]  ldc  : C leading dimension
+   *  \param[in]  mr   : number of valid rows
+   *  \param[in]  nr   : number of valid columns
+   *
+   *  \param[out] c    : C block
+   */
+  static void Kernel(uint32_t kc, Dtype alpha, const Dtype* pa,
+                     const Dtype* pb, Dtype* c, uint32_t ldc,
+                     uint32_t mr, uint32_t nr) {
+    Dtype acc[kMR][kNR] = {};
+    for (uint32_t p = 0; p < kc; ++p, pa += kMR, pb += kNR) {
+      for (uint32_t i = 0; i < kMR; ++i) {
+        Dtype av = pa[i];
+        for (uint32_t j = 0; j < kNR; ++j) {
+          acc[i][j] += av * pb[j];
+        }
+      }
+    }
+    for (uint32_t i = 0; i < mr; ++i) {
+      for (uint32_t j = 0; j < nr; ++j) {
+        c[i * ldc + j] += alpha * acc[i][j];
+      }
+    }
+  }
+
+  /*!
+   * Scale a matrix (C = beta * C).
+   *
+   *  \param[in]  m   : number of rows
+   *  \param[in]  n   : number of columns
+   *  \param[in]  beta: scale
+   *  \param[in]  ldc : C leading dimension
+   *
+   *  \param[out] c   : C matrix
+   */
+  static void Scale(uint32_t m, uint32_t n, Dtype beta,
+                    Dtype* c, uint32_t ldc) {
+    if (beta == Dtype(1)) {
+      return;
+    }
+    for (uint32_t i = 0; i < m; ++i) {
+      Dtype* row = c + i * ldc;
+      if (beta == Dtype(0)) {
+        std::fill(row, row + n, Dtype(0));
+      } else {
+        for (uint32_t j = 0; j < n; ++j) {
+          row[j] *= beta;
+        }
+      }
+    }
+  }
+
+  /*!
+   * Matrix-vector product (n == 1), no packing needed.
+   *
+   *  \param[in]  trans_a: transpose A?
+   *  \param[in]  m      : op(A) number of rows
+   *  \param[in]  k      : op(A) number of columns
+   *  \param[in]  alpha  : scale
+   *  \param[in]  a      : A matrix
+   *  \param[in]  lda    : A leading dimension
+   *  \param[in]  b      : B vector
+   *  \param[in]  ldb    : B leading dimension (stride between elements)
+   *  \param[in]  ldc    : C leading dimension (stride between elements)
+   *
+   *  \param[out] c      : C vector
+   */
+  static void Gemv(bool trans_a, uint32_t m, uint32_t k, Dtype alpha,
+                   const Dtype* a, uint32_t lda, const Dtype* b, uint32_t ldb,
+                   Dtype* c, uint32_t ldc) {
+    if (!trans_a) {
+      // Dot product of each row of A with B
+      for (uint32_t i = 0; i < m; ++i) {
+        const Dtype* row = a + i * lda;
+        Dtype val = Dtype(0);
+        for (uint32_t p = 0; p < k; ++p) {
+          val += row[p] * b[p * ldb];
+        }
+        c[i * ldc] += alpha * val;
+      }
+    } else {
+      // Accumulate each row of A (column of op(A)) scaled by B
+      for (uint32_t p = 0; p < k; ++p) {
+        const Dtype* row = a + p * lda;
+        Dtype bv = alpha * b[p * ldb];
+        for (uint32_t i = 0; i < m; ++i) {
+          c[i * ldc] += row[i] * bv;
+        }
+      }
+    }
+  }
+
+  /*!
+   * Check if a multiplication is split across the threads (see E_SPLIT).
+   *
+   *  \param[in]  m: op(A) and C number of rows
+   *  \param[in]  n: op(B) and C number of columns
+   *  \param[in]  k: op(A) number of columns and op(B) number of rows
+   *
+   *  \return     Split?
+   */
+  static bool Split(uint32_t m, uint32_t n, uint32_t k) {
+    return m > 1 && n > 1 && uint64_t(m) * n * k >= kParallelMin &&
+           ThreadPool::Get().Parallel();
+  }
+
+  /*!
+   * General matrix multiplication.
+   * C = alpha * op(A) * op(B) + beta * C
+   *
+   *  \param[in]  trans_a: transpose A?
+   *  \param[in]  trans_b: transpose B?
+   *  \param[in]  m      : op(A) and C number of rows
+   *  \param[in]  n      : op(B) and C number of columns
+   *  \param[in]  k      : op(A) number of columns and op(B) number of rows
+   *  \param[in]  alpha  : op(A) * op(B) scale
+   *  \param[in]  a      : A matrix
+   *  \param[in]  lda    : A leading dimension
+   *  \param[in]  b      : B matrix
+   *  \param[in]  ldb    : B leading dimension
+   *  \param[in]  beta   : C scale
+   *  \param[in]  ldc    : C leading dimension
+   *  \param[in]  split  : split across the threads
+   *
+   *  \param[out] c      : C matrix
+   */
+  static void Run(bool trans_a, bool trans_b,
+                  uint32_t m, uint32_t n, uint32_t k,
+                  Dtype alpha, const Dtype* a, uint32_t lda,
+                  const Dtype* b, uint32_t ldb,
+                  Dtype beta, Dtype* c, uint32_t ldc,
+                  E_SPLIT split = SPLIT_AUTO) {
+    if (!m || !n) {
+      return;
+    }
+#ifdef JIK_USE_CUDA
+    if (Device::Get().Gemm(trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb,
+                           beta, c, ldc)) {
+      return;
+    }
+#endif  // JIK_USE_CUDA
+    Scale(m, n, beta, c, ldc);
+    if (!k || alpha == Dtype(0)) {
+      return;
+    }
+
+    if (n == 1) {
+      Gemv(trans_a, m, k, alpha, a, lda, b, trans_b ? 1 : ldb, c, ldc);
+      return;
+    }
+    if (m == 1) {
+      // C^T = op(B)^T * op(A)^T
+      Gemv(!trans_b, n, k, alpha, b, ldb, a, trans_a ? lda : 1, c, 1);
+      return;
+    }
+
+    if (!Split(m, n, k)) {
+      Blocked(trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb, c, ldc);
+      return;
+    }
+
+    // Split a dimension of C into bands of micro-kernel blocks
+    if (split == SPLIT_ROW || (split == SPLIT_AUTO && m >= n)) {
+      ParallelFor(0, (m + kMR - 1) / kMR,
+                  [&](uint32_t start, uint32_t end, uint32_t chunk) {
+        uint32_t row = start * kMR;
+        Blocked(trans_a, trans_b, std::min(end * kMR, m) - row, n, k, alpha,
+                trans_a ? a + row : a + row * lda, lda, b, ldb,
+                c + row * ldc, ldc);
+      });
+    } else {
+      ParallelFor(0, (n + kNR - 1) / kNR,
+                  [&](uint32_t start, uint32_t end, uint32_t chunk) {
+        uint32_t col = start * kNR;
+        Blocked(trans_a, trans_b, m, std::min(end * kNR, n) - col, k, alpha,
+                a, lda, trans_b ? b + col * ldb : b + col, ldb,
+                c + col, ldc);
+      });
+    }
+  }
+
+  /*!
+   * Cache-blocked matrix multiplication (single thread).
+   * C += alpha * op(A) * op(B)
+   *
+   *  \param[in]  trans_a: transpose A?
+   *  \param[in]  trans_b: transpose B?
+   *  \param[in]  m      : op(A) and C number of rows
+   *  \param[in]  n      : op(B) and C number of columns
+   *  \param[in]  k      : op(A) number of columns and op(B) number of rows
+   *  \param[in]  alpha  : op(A) * op(B) scale
+   *  \param[in]  a      : A matrix
+   *  \param[in]  lda    : A leading dimension
+   *  \param[in]  b      : B matrix
+   *  \param[in]  ldb    : B leading dimension
+   *  \param[in]  ldc    : C leading dimension
+   *
+   *  \param[out] c      : C matrix
+   */
+  static void Blocked(bool trans_a, bool trans_b,
+                      uint32_t m, uint32_t n, uint32_t k,
+                      Dtype alpha, const Dtype* a, uint32_t lda,
+                      const Dtype* b, uint32_t ldb, Dtype* c, uint32_t ldc) {
+    // Packing buffers, reused across calls
+    static thread_local std::vector<Dtype> pack_a;
+    static thread_local std::vector<Dtype> pack_b;
+    pack_a.resize(kMC * kKC);
+    pack_b.resize(kKC * kNC);
+
+    for (uint32_t jc = 0; jc < n; jc += kNC) {
+      uint32_t nc = std::min(kNC, n - jc);
+      for (uint32_t pc = 0; pc < k; pc += kKC) {
+        uint32_t kc = std::min(kKC, k - pc);
+        const Dtype* b_block = trans_b ? b + jc * ldb + pc : b + pc * ldb + jc;
+        PackB(trans_b, b_block, ldb, kc, nc, &pack_b[0]);
+        for (uint32_t ic = 0; ic < m; ic += kMC) {
+          uint32_t mc = std::min(kMC, m - ic);
+          const Dtype* a_block = trans_a ? a + pc * lda + ic :
+                                           a + ic * lda + pc;
+          PackA(trans_a, a_block, lda, mc, kc, &pack_a[0]);
+          for (uint32_t jr = 0; jr < nc; jr += kNR) {
+            uint32_t nr = std::min(kNR, nc - jr);
+            for (uint32_t ir = 0; ir < mc; ir += kMR) {
+              uint32_t mr = std::min(kMR, mc - ir);
+              Kernel(kc, alpha, &pack_a[ir * kc], &pack_b[jr * kc],
+                     c + (ic + ir) * ldc + jc + jr, ldc, mr, nr);
+            }
+          }
+        }
+      }
+    }
+  }
+};
+
+template <typename Dtype> const uint32_t Gemm<Dtype>::kMR;
+template <typename Dtype> const uint32_t Gemm<Dtype>::kNR;
+template <typename Dtype> const uint32_t Gemm<Dtype>::kMC;
+template <typename Dtype> const uint32_t Gemm<Dtype>::kKC;
+template <typename Dtype> const uint32_t Gemm<Dtype>::kNC;
+template <typename Dtype> const uint64_t Gemm<Dtype>::kParallelMin;
+
+
+#ifdef JIK_USE_CBLAS
+/*!
+ * General matrix multiplication (single precision, external BLAS).
+ */
+template <>
+inline void Gemm<float>::Run(bool trans_a, bool trans_b,
+                             uint32_t m, uint32_t n, uint32_t k,
+                             float alpha, const float* a, uint32_t lda,
+                             const float* b, uint32_t ldb,
+                             float beta, float* c, uint32_t ldc,
+                             E_SPLIT split) {
+  if (!m || !n) {
+    return;
+  }
+#ifdef JIK_USE_CUDA
+  if (Device::Get().Gemm(trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb,
+                         beta, c, ldc)) {
+    return;
+  }
+#endif  // JIK_USE_CUDA
+  cblas_sgemm(CblasRowMajor, trans_a ? CblasTrans : CblasNoTrans,
+              trans_b ? CblasTrans : CblasNoTrans, m, n, k,
+              alpha, a, lda, b, ldb, beta, c, ldc);
+}
+
+/*!
+ * General matrix multiplication (double precision, external BLAS).
+ */
+template <>
+inline void Gemm<double>::Run(bool trans_a, bool trans_b,
+                              uint32_t m, uint32_t n, uint32_t k,
+                              double alpha, const double* a, uint32_t lda,
+                              const double* b, uint32_t ldb,
+                              double beta, double* c, uint32_t ldc,
+                              E_SPLIT split) {
+  if (!m || !n) {
+    return;
+  }
+#ifdef JIK_USE_CUDA
+  if (Device::Get().Gemm(trans_a, trans_b, m, n, k, alpha, a, lda, b, ldb,
+                         beta, c, ldc)) {
+    return;
+  }
+#endif  // JIK_USE_CUDA
+  cblas_dgemm(CblasRowMajor, trans_a ? CblasTrans : CblasNoTrans,
+              trans_b ? CblasTrans : CblasNoTrans, m, n, k,
+              alpha, a, lda, b, ldb, beta, c, ldc);
+}
+#endif  // JIK_USE_CBLAS
+
+
+}  // namespace jik
+
+
+#endif  // CORE_GEMM_H_
@@ -0,0 +1,338 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_HALF_H_
+#define CORE_HALF_H_
+
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__F16C__) || defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+
+namespace jik {
+
+
+/*!
+ *  \struct Half
+ *  \brief  16-bit floating point storage
+ *
+ * Values are stored on 16 bits and converted from/to 32-bit floats when
+ * loaded in registers, all the calculations being done in fp32:
+ *  + bf16: the upper half of a fp32 (same range, 8-bit mantissa)
+ *  + fp16: IEEE half precision (range up to 65504, 11-bit mantissa)
+ * The conversions round to the nearest even value, and are vectorized with
+ * F16C (fp16), AVX-512 BF16 or AVX2 (bf16) when the code is built for them
+ * (AVX-512 BF16 flushes the fp32 denormals to zero).
+ */
+struct Half {
+  /*!
+   *  \enum   E_FORMAT
+   *  \brief  Storage format
+   */
+  enum E_FORMAT {
+    FORMAT_FP32 = 0,  // 32-bit float (no conversion)
+    FORMAT_BF16,      // bfloat16
+    FORMAT_FP16       // IEEE half precision
+  };
+
+  /*!
+   * Get the name of a format.
+   *
+   *  \param[in]  format: format
+   *
+   *  \return     Name
+   */
+  static const char* Name(E_FORMAT format) {
+    switch (format) {
+      case FORMAT_BF16: return "bf16";
+      case FORMAT_FP16: return "fp16";
+      default:          return "fp32";
+    }
+  }
+
+  /*!
+   * Get a format from its name.
+   *
+   *  \param[in]  name  : name ("fp32", "bf16" or "fp16")
+   *
+   *  \param[out] format: format
+   *  \return     Known format?
+   */
+  static bool Format(const char* name, E_FORMAT* format) {
+    for (int f = FORMAT_FP32; f <= FORMAT_FP16; ++f) {
+      if (!std::strcmp(name, Name(E_FORMAT(f)))) {
+        *format = E_FORMAT(f);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /*!
+   * Convert a float to bf16.
+   *
+   *  \param[in]  val: value
+   *
+   *  \return     bf16 value
+   */
+  static uint16_t ToBf16(float val) {
+    uint32_t bits;
+    std::memcpy(&bits, &val, sizeof(bits));
+    if ((bits & 0x7FFFFFFFu) > 0x7F800000u) {
+      // NaN: keep it quiet
+      return uint16_t((bits >> 16) | 0x40);
+    }
+    bits += 0x7FFFu + ((bits >> 16) & 1);
+    return uint16_t(bits >> 16);
+  }
+
+  /*!
+   * Convert a bf16 value to a float.
+   *
+   *  \param[in]  val: bf16 value
+   *
+   *  \return     Value
+   */
+  static float FromBf16(uint16_t val) {
+    uint32_t bits = uint32_t(val) << 16;
+    float    res;
+    std::memcpy(&res, &bits, sizeof(res));
+    return res;
+  }
+
+  /*!
+   * Convert a float to fp16.
+   *
+   *  \param[in]  val: value
+   *
+   *  \return     fp16 value
+   */
+  static uint16_t ToFp16(float val) {
+    uint32_t bits;
+    std::memcpy(&bits, &val, sizeof(bits));
+    uint16_t sign = uint16_t((bits >> 16) & 0x8000);
+    bits &= 0x7FFFFFFFu;
+    if (bits > 0x7F800000u) {
+      return sign | 0x7E00;                 // NaN
+    }
+    if (bits >= 0x477FF000u) {
+      return sign | 0x7C00;                 // Overflow: infinity
+    }
+    if (bits < 0x38800000u) {
+      // Subnormal (or zero): shift the mantissa, with its implicit bit
+      uint32_t shift = 126 - (bits >> 23);
+      if (shift > 24) {
+        return sign;
+      }
+      uint32_t mant = (bits & 0x7FFFFFu) | 0x800000u;
+      uint32_t res  = mant >> shift;
+      uint32_t rem  = mant & ((1u << shift) - 1);
+      uint32_t half = 1u << (shift - 1);
+      if (rem > half || (rem == half && (res & 1))) {
+        ++res;
+      }
+      return sign | uint16_t(res);
+    }
+    // Normal: rebias the exponent and round the mantissa (a carry goes to the
+    // exponent)
+    bits += 0xFFFu + ((bits >> 13) & 1) - (112u << 23);
+    return sign | uint16_t(bits >> 13);
+  }
+
+  /*!
+   * Convert a fp16 value to a float.
+   *
+   *  \param[in]  val: fp16 value
+   *
+   *  \return     Value
+   */
+  static float FromFp16(uint16_t val) {
+    uint32_t sign = uint32_t(val & 0x8000) << 16;
+    uint32_t exp  = (val >> 10) & 0x1F;
+    uint32_t mant = val & 0x3FF;
+    uint32_t bits;
+    if (exp == 0x1F) {
+      bits = sign | 0x7F800000u | (mant << 13);   // Infinity or NaN
+    } else if (exp) {
+      bits = sign | ((exp + 112) << 23) | (mant << 13);
+    } else if (mant) {
+      // Subnormal: normalize the mantissa
+      exp = 113;
+      while (!(mant & 0x400)) {
+        mant <<= 1;
+        --exp;
+      }
+      bits = sign | (exp << 23) | ((mant & 0x3FF) << 13);
+    } else {
+      bits = sign;
+    }
+    float res;
+    std::memcpy(&res, &bits, sizeof(res));
+    return res;
+  }
+
+  /*!
+   * Convert some values to 16 bits.
+   *
+   *  \param[in]  format: format (bf16 or fp16)
+   *  \param[in]  n     : number of values
+   *  \param[in]  in    : values
+   *  \param[out] out   : 16-bit values
+   */
+  template <typename Dtype>
+  static void Pack(E_FORMAT format, size_t n, const Dtype* in,
+                   uint16_t* out) {
+    if (format == FORMAT_BF16) {
+      for (size_t i = 0; i < n; ++i) {
+        out[i] = ToBf16(float(in[i]));
+      }
+    } else {
+      for (size_t i = 0; i < n; ++i) {
+        out[i] = ToFp16(float(in[i]));
+      }
+    }
+  }
+
+  /*!
+   * Convert some 16-bit values back.
+   *
+   *  \param[in]  format: format (bf16 or fp16)
+   *  \param[in]  n     : number of values
+   *  \param[in]  in    : 16-bit values
+   *  \param[out] out   : values
+   */
+  template <typename Dtype>
+  static void Unpack(E_FORMAT format, size_t n, const uint16_t* in,
+                     Dtype* out) {
+    if (format == FORMAT_BF16) {
+      for (size_t i = 0; i < n; ++i) {
+        out[i] = Dtype(FromBf16(in[i]));
+      }
+    } else {
+      for (size_t i = 0; i < n; ++i) {
+        out[i] = Dtype(FromFp16(in[i]));
+      }
+    }
+  }
+};
+
+
+/*!
+ * Convert some floats to 16 bits, by vectors.
+ *
+ *  \param[in]  format: format (bf16 or fp16)
+ *  \param[in]  n     : number of values
+ *  \param[in]  in    : values
+ *  \param[out] out   : 16-bit values
+ */
+template <>
+inline void Half::Pack<float>(E_FORMAT format, size_t n, const float* in,
+                              uint16_t* out) {
+  size_t i = 0;
+  if (format == FORMAT_BF16) {
+#if defined(__AVX512BF16__) && defined(__AVX512VL__)
+    for (; i + 16 <= n; i += 16) {
+      __m256bh res = _mm512_cvtneps_pbh(_mm512_loadu_ps(in + i));
+      std::memcpy(out + i, &res, sizeof(res));
+    }
+#elif defined(__AVX2__)
+    // bits + 0x7FFF + lsb, NaNs are not quieted (never produced by the
+    // layers)
+    const __m256i round = _mm256_set1_epi32(0x7FFF);
+    const __m256i one   = _mm256_set1_epi32(1);
+    for (; i + 8 <= n; i += 8) {
+      __m256i bits = _mm256_castps_si256(_mm256_loadu_ps(in + i));
+      __m256i lsb  = _mm256_and_si256(_mm256_srli_epi32(bits, 16), one);
+      bits = _mm256_srli_epi32(_mm256_add_epi32(_mm256_add_epi32(bits, round),
+                                                lsb), 16);
+      __m128i res = _mm_packus_epi32(_mm256_castsi256_si128(bits),
+                                     _mm256_extracti128_si256(bits, 1));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), res);
+    }
+#endif
+    for (; i < n; ++i) {
+      out[i] = ToBf16(in[i]);
+    }
+    return;
+  }
+#if defined(__F16C__)
+  for (; i + 8 <= n; i += 8) {
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                     _mm256_cvtps_ph(_mm256_loadu_ps(in + i),
+                                     _MM_FROUND_TO_NEAREST_INT));
+  }
+#endif
+  for (; i < n; ++i) {
+    out[i] = ToFp16(in[i]);
+  }
+}
+
+/*!
+ * Convert some 16-bit values back to floats, by vectors.
+ *
+ *  \param[in]  format: format (bf16 or fp16)
+ *  \param[in]  n     : number of values
+ *  \param[in]  in    : 16-bit values
+ *  \param[out] out   : values
+ */
+template <>
+inline void Half::Unpack<float>(E_FORMAT format, size_t n,
+                                const uint16_t* in, float* out) {
+  size_t i = 0;
+  if (format == FORMAT_BF16) {
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+      __m256i bits = _mm256_cvtepu16_epi32(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i)));
+      _mm256_storeu_ps(out + i,
+                       _mm256_castsi256_ps(_mm256_slli_epi32(bits, 16)));
+    }
+#endif
+    for (; i < n; ++i) {
+      out[i] = FromBf16(in[i]);
+    }
+    return;
+  }
+#if defined(__F16C__)
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(out + i, _mm256_cvtph_ps(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))));
+  }
+#endif
+  for (; i < n; ++i) {
+    out[i] = FromFp16(in[i]);
+  }
+}
+
+
+}  // namespace jik
+
+
+#endif  // CORE_HALF_H_
@@ -0,0 +1,295 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#ifndef CORE_IM2COL_H_
+#define CORE_IM2COL_H_
+
+
+#include <algorithm>
+#include <cstdint>
+
+
+namespace jik {
+
+
+/*!
+ *  \struct Im2Col
+ *  \brief  Convolution lowering (image to columns and back)
+ *
+ * An image of size width*height*channel is unrolled into a matrix with
+ * channel*filter_height*filter_width rows and out_height*out_width columns:
+ * each column stores the input values seen by the filter at a given output
+ * position (0 when it falls in the padding). The convolution then becomes a
+ * single matrix multiplication between the filters and this matrix.
+ */
+template <typename Dtype>
+struct Im2Col {
+  /*!
+   * Calculate the range of output positions [start, end) reading an input
+   * inside the image for a given filter tap.
+   *
+   *  \param[in]  tap    : filter tap
+   *  \param[in]  padding: padding
+   *  \param[in]  stride : stride
+   *  \param[in]  in_size: input size
+   *  \param[in]  out_sz : output size
+   *
+   *  \param[out] start  : first valid output position
+   *  \param[out] end    : last valid output position (excluded)
+   */
+  static void ValidRange(uint32_t tap, uint32_t padding, uint32_t stride,
+                         uint32_t in_size, uint32_t out_sz,
+                         uint32_t* start, uint32_t* end) {
+    // Output position o reads input o * stride - padding + tap
+    int32_t offset = int32_t(tap) - int32_t(padding);
+    int32_t s      = offset < 0 ? (-offset + stride - 1) / stride : 0;
+    int32_t e      = (int32_t(in_size) - offset + int32_t(stride) - 1) /
+                     int32_t(stride);
+    e              = std::max(int32_t(0), std::min(e, int32_t(out_sz)));
+    *start         = uint32_t(std::min(s, e));
+    *end           = uint32_t(e);
+  }
+
+  /*!
+   * Unroll an image into columns.
+   *
+   *  \param[in]  in           : input image (width*height*channel)
+   *  \param[in]  in_width     : input width
+   *  \param[in]  in_height    : input height
+   *  \param[in]  num_channel  : number of channels
+   *  \param[in]  filter_width : filter width
+   *  \param[in]  filter_height: filter height
+   *  \param[in]  padding_x    : row padding
+   *  \param[in]  padding_y    : column padding
+   *  \param[in]  stride_x     : row stride
+   *  \param[in]  stride_y     : column stride
+   *  \param[in]  out_width    : output width
+   *  \param[in]  out_height   : output height
+   *
+   *  \param[out] col          : columns
+   */
+  static void Forward(const Dtype* in, uint32_t in_width, uint32_t in_height,
+                      uint32_t num_channel,
+                      uint32_t filter_width, uint32_t filter_height,
+                      uint32_t padding_x, uint32_t padding_y,
+                      uint32_t stride_x, uint32_t stride_y,
+                      uint32_t out_width, uint32_t out_height, Dtype* col) {
+    uint32_t out_size = out_width * out_height;
+    for (uint32_t channel = 0; channel < num_channel; ++channel) {
+      const Dtype* in_plane = in + channel * in_width * in_height;
+      for (uint32_t y = 0; y < filter_height; ++y) {
+        uint32_t oy_start, oy_end;
+        ValidRange(y, padding_y, stride_y, in_height, out_height,
+                   &oy_start, &oy_end);
+        for (uint32_t x = 0; x < filter_width; ++x, col += out_size) {
+          uint32_t ox_start, ox_end;
+          ValidRange(x, padding_x, stride_x, in_width, out_width,
+                     &ox_start, &ox_end);
+          if (ox_start >= ox_end) {
+            // This tap only reads the padding
+            std::fill(col, col + out_size, Dtype(0));
+            continue;
+          }
+          std::fill(col, col + oy_start * out_width, Dtype(0));
+          for (uint32_t out_y = oy_start; out_y < oy_end; ++out_y) {
+            Dtype* col_row = col + out_y * out_width;
+            // First input read by the valid range of this row
+            const Dtype* in_row = in_plane +
+              (out_y * stride_y + y - padding_y) * in_width +
+              (ox_start * stride_x + x - padding_x);
+            std::fill(col_row, col_row + ox_start, Dtype(0));
+            if (stride_x == 1) {
+              std::copy(in_row, in_row + ox_end - ox_start,
+                        col_row + ox_start);
+            } else {
+              for (uint32_t out_x = ox_start; out_x < ox_end; ++out_x) {
+                col_row[out_x] = in_row[(out_x - ox_start) * stride_x];
+              }
+            }
+            std::fill(col_row + ox_end, col_row + out_width, Dtype(0));
+          }
+          std::fill(col + oy_end * out_width, col + out_size, Dtype(0));
+        }
+      }
+    }
+  }
+
+  /*!
+   * Accumulate columns back into an image (adjoint of Forward).
+   *
+   *  \param[in]  col          : columns
+   *  \param[in]  in_width     : input width
+   *  \param[in]  in_height    : input height
+   *  \param[in]  num_channel  : number of channels
+   *  \param[in]  filter_width : filter width
+   *  \param[in]  filter_height: filter height
+   *  \param[in]  padding_x    : row padding
+   *  \param[in]  padding_y    : column padding
+   *  \param[in]  stride_x     : row stride
+   *  \param[in]  stride_y     : column stride
+   *  \param[in]  out_width    : output width
+   *  \param[in]  out_height   : output height
+   *
+   *  \param[out] in           : input image (width*height*channel), += col
+   */
+  static void Backward(const Dtype* col, uint32_t in_width, uint32_t in_height,
+                       uint32_t num_channel,
+                       uint32_t filter_width, uint32_t filter_height,
+                       uint32_t padding_x, uint32_t padding_y,
+                       uint32_t stride_x, uint32_t stride_y,
+                       uint32_t out_width, uint32_t out_height, Dtype* in) {
+    uint32_t out_size = out_width * out_height;
+    for (uint32_t channel = 0; channel < num_channel; ++channel) {
+      Dtype* in_plane = in + channel * in_width * in_height;
+      for (uint32_t y = 0; y < filter_height; ++y) {
+        uint32_t oy_start, oy_end;
+        ValidRange(y, padding_y, stride_y, in_height, out_height,
+                   &oy_start, &oy_end);
+        for (uint32_t x = 0; x < filter_width; ++x, col += out_size) {
+          uint32_t ox_start, ox_end;
+          ValidRange(x, padding_x, stride_x, in_width, out_width,
+                     &ox_start, &ox_end);
+          if (ox_start >= ox_end) {
+            continue;
+          }
+          for (uint32_t out_y = oy_start; out_y < oy_end; ++out_y) {
+            const Dtype* col_row = col + out_y * out_width;
+            Dtype* in_row = in_plane +
+              (out_y * stride_y + y - padding_y) * in_width +
+              (ox_start * stride_x + x - padding_x);
+            for (uint32_t out_x = ox_start; out_x < ox_end; ++out_x) {
+              in_row[(out_x - ox_start) * stride_x] += col_row[out_x];
+            }
+          }
+        }
+      }
+    }
+  }
+
+  /*!
+   * Unroll an image in the NHWC layout (see Layout) into rows: each row
+   * stores the input values seen by the filter at a given output position,
+   * the channels of each filter tap being contiguous (filter_height *
+   * filter_width * channel values per row, one row per output position).
+   *
+   *  \param[in]  in           : input image (channel*width*height)
+   *  \param[in]  in_width     : input width
+   *  \param[in]  in_height    : input height
+   *  \param[in]  num_channel  : number of channels
+   *  \param[in]  filter_width : filter width
+   *  \param[in]  filter_height: filter height
+   *  \param[in]  padding_x    : row padding
+   *  \param[in]  padding_y    : column padding
+   *  \param[in]  stride_x     : row stride
+   *  \param[in]  stride_y     : column stride
+   *  \param[in]  out_width    : output width
+   *  \param[in]  out_height   : output height
+   *
+   *  \param[out] row          : rows
+   */
+  static void ForwardNhwc(const Dtype* in, uint32_t in_width,
+                          uint32_t in_height, uint32_t num_channel,
+                          uint32_t filter_width, uint32_t filter_height,
+                          uint32_t padding_x, uint32_t padding_y,
+                          uint32_t stride_x, uint32_t stride_y,
+                          uint32_t out_width, uint32_t out_height,
+                          Dtype* row) {
+    for (uint32_t out_y = 0; out_y < out_height; ++out_y) {
+      for (uint32_t out_x = 0; out_x < out_width; ++out_x) {
+        int32_t start_y = int32_t(out_y * stride_y) - int32_t(padding_y);
+        int32_t start_x = int32_t(out_x * stride_x) - int32_t(padding_x);
+        for (uint32_t y = 0; y < filter_height; ++y) {
+          int32_t in_y = start_y + int32_t(y);
+          for (uint32_t x = 0; x < filter_width; ++x, row += num_channel) {
+            int32_t in_x = start_x + int32_t(x);
+            if (in_y < 0 || uint32_t(in_y) >= in_height ||
+                in_x < 0 || uint32_t(in_x) >= in_width) {
+              std::fill(row, row + num_channel, Dtype(0));
+              continue;
+            }
+            const Dtype* pixel = in + (size_t(in_y) * in_width + in_x) *
+                                      num_channel;
+            std::copy(pixel, pixel + num_channel, row);
+          }
+        }
+      }
+    }
+  }
+
+  /*!
+   * Accumulate rows back into an image in the NHWC layout (adjoint of
+   * ForwardNhwc).
+   *
+   *  \param[in]  row          : rows
+   *  \param[in]  in_width     : input width
+   *  \param[in]  in_height    : input height
+   *  \param[in]  num_channel  : number of channels
+   *  \param[in]  filter_width : filter width
+   *  \param[in]  filter_height: filter height
+   *  \param[in]  padding_x    : row padding
+   *  \param[in]  padding_y    : column padding
+   *  \param[in]  stride_x     : row stride
+   *  \param[in]  stride_y     : column stride
+   *  \param[in]  out_width    : output width
+   *  \param[in]  out_height   : output height
+   *
+   *  \param[out] in           : input image (channel*width*height), += row
+   */
+  static void BackwardNhwc(const Dtype* row, uint32_t in_width,
+                           uint32_t in_height, uint32_t num_channel,
+                           uint32_t filter_width, uint32_t filter_height,
+                           uint32_t padding_x, uint32_t padding_y,
+                           uint32_t stride_x, uint32_t stride_y,
+                           uint32_t out_width, uint32_t out_height,
+                           Dtype* in) {
+    for (uint32_t out_y = 0; out_y < out_height; ++out_y) {
+      for (uint32_t out_x = 0; out_x < out_width; ++out_x) {
+        int32_t start_y = int32_t(out_y * stride_y) - int32_t(padding_y);
+        int32_t start_x = int32_t(out_x * stride_x) - int32_t(padding_x);
+        for (uint32_t y = 0; y < filter_height; ++y) {
+          int32_t in_y = start_y + int32_t(y);
+          for (uint32_t x = 0; x < filter_width; ++x, row += num_channel) {
+            int32_t in_x = start_x + int32_t(x);
+            if (in_y < 0 || uint32_t(in_y) >= in_height ||
+                in_x < 0 || uint32_t(in_x) >= in_width) {
+              continue;
+            }
+            Dtype* pixel = in + (size_t(in_y) * in_width + in_x) *
+                                num_channel;
+            for (uint32_t channel = 0; channel < num_channel; ++channel) {
+              pixel[channel] += row[channel];
+            }
+          }
+        }
+      }
+    }
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_IM2COL_H_
@@ -0,0 +1,361 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#ifndef CORE_INFERENCE_H_
+#define CORE_INFERENCE_H_
+
+
+#include <core/log.h>
+#include <core/model.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  InferenceSession
+ *  \brief  Inference of single samples, requested by several threads
+ *
+ * The requests are queued, then batched by some workers: a worker waits for
+ * a full batch, or for the oldest request to reach the maximum delay, and
+ * runs one forward pass on all the requests it took (see
+ * Model::SetBatchSize). The callers are blocked until their request is done.
+ *
+ * Each worker has its own replica of the model, created by a factory and
+ * fused and planned for inference (its own activations). The weights of
+ * all the replicas are mapped from the same model file: they are shared,
+ * read-only (see ModelFile).
+ *
+ * The inputs of a request are the outputs of the data layer for one sample.
+ * The data layer is skipped, its other outputs (labels) being set to -1:
+ * they are masked out of the loss. The outputs of a request are the last
+ * outputs of the loss layer (e.g. the probabilities of LayerSoftMaxLoss), or
+ * the output of the model without loss layer.
+ *
+ * The workers run their forward passes on the thread pool (see ParallelFor),
+ * one at a time: with several workers, a pool of 1 thread usually gives the
+ * best throughput.
+ */
+template <typename Dtype>
+class InferenceSession {
+  // Public types
+ public:
+  typedef Dtype Type;
+  typedef std::function<std::unique_ptr<Model<Dtype>>()> Factory;
+
+
+  // Protected types
+ protected:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Request {
+    const Dtype*      in;     // Inputs
+    Dtype*            out;    // Outputs
+    Clock::time_point start;  // Time the request was queued
+    bool              done;   // Done?
+  };
+
+  struct Worker {
+    std::unique_ptr<Model<Dtype>> model;   // Model replica
+    std::shared_ptr<Mat<Dtype>>   in;      // Inputs  (data layer outputs)
+    std::shared_ptr<Mat<Dtype>>   out;     // Outputs (loss layer outputs)
+    std::thread                   thread;  // Worker thread
+  };
+
+
+  // Protected attributes
+ protected:
+  uint32_t                max_batch_size_;  // Max batch size
+  Clock::duration         max_delay_;       // Max delay to fill a batch
+  uint32_t                in_size_;         // Number of inputs per request
+  uint32_t                out_size_;        // Number of outputs per request
+  std::vector<std::unique_ptr<Worker>>
+                          worker_;          // Workers
+  std::deque<Request*>    queue_;           // Requests to run
+  bool                    stop_;            // Stop the workers?
+  std::mutex              mutex_;           // Queue lock
+  std::condition_variable queue_cond_;      // Request queued
+  std::condition_variable done_cond_;       // Request done
+  uint64_t                num_request_;     // Number of requests done
+  uint64_t                num_batch_;       // Number of batches run
+  std::vector<double>     latency_;         // Latencies of the requests (s)
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Run the batches of requests (worker thread).
+   *
+   *  \param[in]  worker: worker
+   */
+  void Run(Worker* worker) {
+    State state(State::PHASE_TEST);
+    std::vector<Request*> batch;
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      // Wait for a full batch, or for the oldest request to be late enough
+      queue_cond_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (stop_) {
+        break;
+      }
+      Clock::time_point deadline = queue_.front()->start + max_delay_;
+      queue_cond_.wait_until(lock, deadline, [this] {
+        return stop_ || queue_.size() >= max_batch_size_;
+      });
+      if (queue_.empty()) {
+        // Taken by another worker
+        continue;
+      }
+      uint32_t batch_size = uint32_t(std::min(queue_.size(),
+                                              size_t(max_batch_size_)));
+      batch.assign(queue_.begin(), queue_.begin() + batch_size);
+      queue_.erase(queue_.begin(), queue_.begin() + batch_size);
+      lock.unlock();
+
+      // One forward pass on the whole batch
+      Dtype* in_data = worker->in->Data();
+      for (uint32_t i = 0; i < batch_size; ++i) {
+        std::copy(batch[i]->in, batch[i]->in + in_size_,
+                  in_data + size_t(i) * in_size_);
+      }
+      worker->model->SetBatchSize(batch_size);
+      worker->model->Forward(state, 1);
+      const Dtype* out_data = worker->out->Data();
+      for (uint32_t i = 0; i < batch_size; ++i) {
+        std::copy(out_data + size_t(i) * out_size_,
+                  out_data + size_t(i + 1) * out_size_, batch[i]->out);
+      }
+
+      lock.lock();
+      Clock::time_point now = Clock::now();
+      for (Request* request : batch) {
+        request->done = true;
+        if (latency_.size() < kMaxLatency) {
+          latency_.push_back(
+            std::chrono::duration<double>(now - request->start).count());
+        }
+      }
+      num_request_ += batch_size;
+      ++num_batch_;
+      done_cond_.notify_all();
+    }
+  }
+
+
+  // Public attributes
+ public:
+  static const size_t kMaxLatency = 1 << 20;  // Max latencies recorded
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  max_batch_size: max batch size (the batch size of the models
+   *                              created by the factory)
+   *  \param[in]  max_delay     : max delay to fill a batch (microseconds)
+   */
+  InferenceSession(uint32_t max_batch_size, uint32_t max_delay) {
+    max_batch_size_ = std::max(max_batch_size, 1u);
+    max_delay_      = std::chrono::duration_cast<Clock::duration>(
+                        std::chrono::microseconds(max_delay));
+    in_size_        = 0;
+    out_size_       = 0;
+    stop_           = false;
+    num_request_    = 0;
+    num_batch_      = 0;
+  }
+
+  /*!
+   * Destructor.
+   */
+  ~InferenceSession() {
+    Stop();
+  }
+
+  /*!
+   * Create the workers and start them. If a worker can't be created, none
+   * is started (the requests are refused).
+   *
+   *  \param[in]  factory   : create a model (batch size: max batch size)
+   *  \param[in]  model_path: path to the model file
+   *  \param[in]  num_worker: number of workers
+   *
+   *  \return     Error?
+   */
+  bool Start(const Factory& factory, const char* model_path,
+             uint32_t num_worker) {
+    Stop();
+
+    // Create all the replicas before starting any worker
+    std::vector<std::unique_ptr<Worker>> worker;
+    uint32_t in_size = 0, out_size = 0;
+    for (uint32_t i = 0; i < std::max(num_worker, 1u); ++i) {
+      std::unique_ptr<Worker> w(new Worker);
+      w->model = factory();
+      Model<Dtype>* model = w->model.get();
+      if (!model || !model->DataLayer()) {
+        Report(kWarning, "Inference needs a model with a data layer");
+        return false;
+      }
+      if (model->BatchSize() != max_batch_size_) {
+        Report(kWarning, "Model '%s' batch size is %d instead of %d",
+               model->Name(), model->BatchSize(), max_batch_size_);
+        return false;
+      }
+      if (!model->Load(model_path, true)) {
+        return false;
+      }
+      model->Fuse();
+      model->Plan(State::PHASE_TEST);
+
+      const std::vector<std::shared_ptr<Mat<Dtype>>>& data =
+        model->DataLayer()->Output();
+      w->in = data[0];
+      for (size_t j = 1; j < data.size(); ++j) {
+        data[j]->Set(Dtype(-1));
+      }
+      w->out = model->LossLayer() ?
+               model->LossLayer()->Output().back() : model->Out();
+      in_size  = w->in->Size()  / max_batch_size_;
+      out_size = w->out->Size() / max_batch_size_;
+      worker.push_back(std::move(w));
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    in_size_  = in_size;
+    out_size_ = out_size;
+    worker_   = std::move(worker);
+    stop_     = false;
+    for (const std::unique_ptr<Worker>& w : worker_) {
+      w->thread = std::thread(&InferenceSession::Run, this, w.get());
+    }
+    return true;
+  }
+
+  /*!
+   * Stop the workers, once the queued requests are done.
+   */
+  void Stop() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_cond_.wait(lock, [this] { return queue_.empty() ||
+                                            worker_.empty(); });
+      stop_ = true;
+      queue_cond_.notify_all();
+    }
+    for (const std::unique_ptr<Worker>& worker : worker_) {
+      if (worker->thread.joinable()) {
+        worker->thread.join();
+      }
+    }
+    worker_.clear();
+  }
+
+  /*!
+   * Get the number of inputs of a request.
+   *
+   *  \return Number of inputs
+   */
+  uint32_t InSize() const {
+    return in_size_;
+  }
+
+  /*!
+   * Get the number of outputs of a request.
+   *
+   *  \return Number of outputs
+   */
+  uint32_t OutSize() const {
+    return out_size_;
+  }
+
+  /*!
+   * Run a request, and wait for it to be done (thread-safe).
+   *
+   *  \param[in]  in : inputs  (InSize values)
+   *
+   *  \param[out] out: outputs (OutSize values)
+   *
+   *  \return     Error?
+   */
+  bool Infer(const Dtype* in, Dtype* out) {
+    Request request;
+    request.in    = in;
+    request.out   = out;
+    request.start = Clock::now();
+    request.done  = false;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (stop_ || worker_.empty()) {
+      return false;
+    }
+    queue_.push_back(&request);
+    queue_cond_.notify_all();
+    done_cond_.wait(lock, [&request] { return request.done; });
+    return true;
+  }
+
+  /*!
+   * Print the statistics of the requests done so far: throughput, average
+   * batch size and latencies.
+   *
+   *  \param[in]  duration: time spent running the requests (s)
+   */
+  void Print(double duration) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!num_batch_ || latency_.empty()) {
+      return;
+    }
+    std::vector<double> latency = latency_;
+    std::sort(latency.begin(), latency.end());
+    auto percentile = [&latency](double p) {
+      return latency[std::min(size_t(p * latency.size()),
+                              latency.size() - 1)] * 1000;
+    };
+    Report(kInfo, "Requests: %ld, %f requests/sec, average batch size: %f",
+           num_request_, num_request_ / duration,
+           double(num_request_) / num_batch_);
+    Report(kInfo, "Latency: p50 %f ms, p90 %f ms, p99 %f ms, max %f ms",
+           percentile(0.5), percentile(0.9), percentile(0.99),
+           latency.back() * 1000);
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_INFERENCE_H_
@@ -27,8 +27,12 @@
 #define CORE_LAYER_H_
 
 
+#include <core/fusion.h>
+#include <core/half.h>
 #include <core/mat.h>
 #include <core/param.h>
+#include <core/quantize.h>
+#include <core/sparse.h>
 #include <core/state.h>
 #include <memory>
 #include <vector>
@@ -122,17 +126,14 @@ class Layer {
   }
 
   /*!
-   * Set the batch size.
+   * Replace an input activation by another one of the same size, e.g. the
+   * same values in another layout (see Model::SetLayout).
    *
-   *  \param[in]  batch_size: batch size
+   *  \param[in]  i : input index
+   *  \param[in]  in: input activations
    */
-  void SetBatchSize(uint32_t batch_size) {
-    for (size_t i = 0; i < in_.size(); ++i) {
-      in_[i]->size[3] = batch_size;
-    }
-    for (size_t i = 0; i < out_.size(); ++i) {
-      out_[i]->size[3] = batch_size;
-    }
+  void SetInput(size_t i, const std::shared_ptr<Mat<Dtype>>& in) {
+    in_[i] = in;
   }
 
   /*!
@@ -162,6 +163,138 @@ class Layer {
     }
   }
 
+  /*!
+   * The weights were changed outside of a training step (e.g. copied from
+   * another model, see Model::CopyWeight): anything derived from them is
+   * dropped.
+   */
+  virtual void WeightChanged() {}
+
+  /*!
+   * Get the quantizer of the layer, if it supports int8 inference.
+   *
+   *  \return Quantizer (nullptr if none)
+   */
+  virtual Quantizer<Dtype>* GetQuantizer() {
+    return nullptr;
+  }
+
+  /*!
+   * Get the pruned filter of the layer, if it supports sparse inference.
+   *
+   *  \return Sparse filter (nullptr if none)
+   */
+  virtual SparseFilter<Dtype>* GetSparse() {
+    return nullptr;
+  }
+
+  /*!
+   * Set the precision of the intermediate activations the layer keeps for
+   * its backward pass (see Half), the calculations being still done in
+   * Dtype.
+   *
+   *  \param[in]  format: storage format
+   *
+   *  \return     Supported? (false if the layer keeps them in Dtype)
+   */
+  virtual bool SetPrecision(Half::E_FORMAT format) {
+    return false;
+  }
+
+  /*!
+   * Set the memory layout of the input and output activations (see Layout
+   * and Model::SetLayout). A layer supporting a layout tags its outputs.
+   *
+   *  \param[in]  layout: layout
+   *
+   *  \return     Supported? (by default, only NCHW)
+   */
+  virtual bool SetLayout(Layout::E_LAYOUT layout) {
+    return layout == Layout::NCHW;
+  }
+
+  /*!
+   * Check if the layer can run in place, its output using the memory of its
+   * input (see Model::Plan). The layer must be elementwise and its backward
+   * pass must not need the input values.
+   *
+   *  \return In place?
+   */
+  virtual bool InPlace() const {
+    return false;
+  }
+
+  /*!
+   * Check if the backward pass needs the values of the output, which a
+   * following layer running in place would overwrite (see Model::Plan).
+   *
+   *  \return Output needed?
+   */
+  virtual bool BackwardUsesOutput() const {
+    return true;
+  }
+
+  /*!
+   * Start fusing the following layers into this one, for inference (see
+   * Fusion and Model::Fuse).
+   *
+   *  \return Fusion, starting with the layer bias (nullptr if the layer
+   *          can't apply fused layers)
+   */
+  virtual Fusion<Dtype>* Fuse() {
+    return nullptr;
+  }
+
+  /*!
+   * Fuse this layer into a previous one, for inference (see Fusion).
+   *
+   *  \param[in]  fusion: fusion of the previous layer
+   *
+   *  \return     Fused? (false if the layer can't be fused)
+   */
+  virtual bool FuseInto(Fusion<Dtype>* fusion) const {
+    return false;
+  }
+
+  /*!
+   * Get the number of values of some activations or weights.
+   *
+   *  \param[in]  mat: list of matrices
+   *
+   *  \return     Number of values
+   */
+  static uint64_t NumValue(
+    const std::vector<std::shared_ptr<Mat<Dtype>>>& mat) {
+    uint64_t num_value = 0;
+    for (size_t i = 0; i < mat.size(); ++i) {
+      num_value += uint64_t(mat[i]->size[0]) * mat[i]->size[1] *
+                   mat[i]->size[2] * mat[i]->size[3];
+    }
+    return num_value;
+  }
+
+  /*!
+   * Estimate the number of floating point operations of the forward pass
+   * (see Profiler). The backward pass is counted as twice this number.
+   * By default, one operation per output value.
+   *
+   *  \return Number of operations
+   */
+  virtual uint64_t Flop() const {
+    return NumValue(out_);
+  }
+
+  /*!
+   * Estimate the number of bytes touched by the forward pass (see Profiler):
+   * the inputs and weights read, and the outputs written.
+   *
+   *  \return Number of bytes
+   */
+  uint64_t Bytes() const {
+    return (NumValue(in_) + NumValue(out_) + NumValue(weight_)) *
+           sizeof(Dtype);
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
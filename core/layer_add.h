@@ -29,6 +29,7 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/simd.h>
 #include <memory>
 #include <vector>
 
@@ -39,6 +40,9 @@ namespace jik {
 /*!
  *  \class  LayerAdd
  *  \brief  Matrices addition
+ *
+ * The second input can be shared by all the batches (batch size of 1), e.g.
+ * a bias stored once.
  */
 template <typename Dtype>
 class LayerAdd: public Layer<Dtype> {
@@ -60,9 +64,14 @@ class LayerAdd: public Layer<Dtype> {
            const std::vector<std::shared_ptr<Mat<Dtype>>>& in):
     Parent(name, in) {
     // Make sure we have 2 inputs and they have the same size
+    // (or the second one is shared by all the batches)
     Check(Parent::in_.size() == 2, "Layer '%s' must have 2 inputs",
           Parent::Name());
-    Check(Parent::in_[0]->Size() == Parent::in_[1]->Size(),
+    Check(Parent::in_[0]->Size() == Parent::in_[1]->Size() ||
+          (Parent::in_[0]->size[0] == Parent::in_[1]->size[0] &&
+           Parent::in_[0]->size[1] == Parent::in_[1]->size[1] &&
+           Parent::in_[0]->size[2] == Parent::in_[1]->size[2] &&
+           Parent::in_[1]->size[3] == 1),
           "Layer '%s' inputs must have the same size", Parent::Name());
 
     // Create 1 output, same size as the inputs
@@ -75,6 +84,15 @@ class LayerAdd: public Layer<Dtype> {
    */
   virtual ~LayerAdd() {}
 
+  /*!
+   * Check if the backward pass needs the values of the output.
+   *
+   *  \return Output needed?
+   */
+  virtual bool BackwardUsesOutput() const {
+    return false;
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -87,9 +105,12 @@ class LayerAdd: public Layer<Dtype> {
     const Dtype* in1_data = Parent::in_[0]->Data();
     const Dtype* in2_data = Parent::in_[1]->Data();
 
-    // out = in1 + in2
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      out_data[i] = in1_data[i] + in2_data[i];
+    // out = in1 + in2 (in2 being repeated if shared by all the batches)
+    uint32_t in2_size  = Parent::in_[1]->Size();
+    uint32_t num_slice = Parent::out_[0]->Size() / in2_size;
+    for (uint32_t slice = 0; slice < num_slice; ++slice) {
+      Simd<Dtype>::Add(in2_size, in1_data + slice * in2_size, in2_data,
+                       out_data + slice * in2_size);
     }
   }
 
@@ -106,11 +127,14 @@ class LayerAdd: public Layer<Dtype> {
     Dtype*       in2_deriv_data = Parent::in_[1]->DerivData();
 
     // in1_deriv = out_deriv
-    // in2_deriv = out_deriv
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      Dtype dv           = out_deriv_data[i];
-      in1_deriv_data[i] += dv;
-      in2_deriv_data[i] += dv;
+    // in2_deriv = out_deriv (summed over the batches if shared)
+    uint32_t in2_size  = Parent::in_[1]->Size();
+    uint32_t num_slice = Parent::out_[0]->Size() / in2_size;
+    for (uint32_t slice = 0; slice < num_slice; ++slice) {
+      const Dtype* out_deriv = out_deriv_data + slice * in2_size;
+      Simd<Dtype>::Accumulate(in2_size, out_deriv,
+                              in1_deriv_data + slice * in2_size);
+      Simd<Dtype>::Accumulate(in2_size, out_deriv, in2_deriv_data);
     }
   }
 };
@@ -29,6 +29,8 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/thread_pool.h>
+#include <algorithm>
 #include <memory>
 #include <cmath>
 #include <limits>
@@ -41,6 +43,10 @@ namespace jik {
 /*!
  *  \class  LayerBatchNorm
  *  \brief  Batch normalization
+ *
+ * In the NHWC layout (see Layout), the statistics and the normalization run
+ * over the pixels, the channels of a pixel being contiguous (vectorized),
+ * each thread accumulating its own sums.
  */
 template <typename Dtype>
 class LayerBatchNorm: public Layer<Dtype> {
@@ -56,6 +62,9 @@ class LayerBatchNorm: public Layer<Dtype> {
   std::shared_ptr<Mat<Dtype>> std_dev_cur_;      // Current standard deviation
   Dtype                       moving_avg_;       // Moving average
   Dtype                       moving_avg_frac_;  // Moving average fraction
+  Fusion<Dtype>               fusion_;           // Fused layers (inference)
+  std::vector<std::vector<Dtype>>
+                              sum_;              // Per-thread sums (NHWC)
 
 
   // Public methods
@@ -107,46 +116,242 @@ class LayerBatchNorm: public Layer<Dtype> {
   virtual ~LayerBatchNorm() {}
 
   /*!
-   * Calculate the mean and variance of a dataset.
+   * Calculate the mean and variance of a channel across all batches, in one
+   * pass: the sums of the values and squared values are shifted by the first
+   * value of the channel (no cancellation when the mean is large compared to
+   * the standard deviation).
    *
-   *  \param[in]  data     : dataset
-   *  \param[in]  data_size: dataset size
+   *  \param[in]  data       : values (NCHW layout)
+   *  \param[in]  data_size  : number of values per channel (width * height)
+   *  \param[in]  num_channel: number of channels
+   *  \param[in]  batch_size : batch size
+   *  \param[in]  channel    : channel
    *
-   *  \param[out] mean     : mean value
-   *  \param[out] variance : variance value
+   *  \param[out] mean       : mean value
+   *  \param[out] variance   : variance value
    */
   static void MeanVariance(const Dtype* data, uint32_t data_size,
-                           Dtype* mean, Dtype* variance) {
-    if (!data || !data_size) {
-      if (mean) {
-        *mean = Dtype(0);
-      }
-      if (variance) {
-        *variance = Dtype(0);
-      }
+                           uint32_t num_channel, uint32_t batch_size,
+                           uint32_t channel, Dtype* mean, Dtype* variance) {
+    if (!data_size || !batch_size) {
+      *mean     = Dtype(0);
+      *variance = Dtype(0);
       return;
     }
 
-    // Calculate the mean
-    Dtype mean_val = Dtype(0);
-    for (uint32_t i = 0; i < data_size; ++i) {
-      mean_val += data[i];
+    Dtype shift      = data[size_t(channel) * data_size];
+    Dtype sum        = Dtype(0);
+    Dtype sum_square = Dtype(0);
+    for (uint32_t batch = 0; batch < batch_size; ++batch) {
+      const Dtype* plane = data + (size_t(batch) * num_channel + channel) *
+                                  data_size;
+      for (uint32_t i = 0; i < data_size; ++i) {
+        Dtype dx    = plane[i] - shift;
+        sum        += dx;
+        sum_square += dx * dx;
+      }
     }
-    mean_val /= data_size;
-    if (mean) {
-      *mean = mean_val;
+
+    Dtype inv_size = Dtype(1) / (Dtype(data_size) * batch_size);
+    Dtype mean_dx  = sum * inv_size;
+    *mean          = shift + mean_dx;
+    *variance      = std::max(sum_square * inv_size - mean_dx * mean_dx,
+                              Dtype(0));
+  }
+
+  /*!
+   * Update the statistics of a channel (training only): current inverse
+   * standard deviation and global ones.
+   *
+   *  \param[in]  channel : channel
+   *  \param[in]  mean    : mean value
+   *  \param[in]  variance: variance value
+   */
+  void UpdateStat(uint32_t channel, Dtype mean, Dtype variance) {
+    Dtype* mean_data        = Parent::weight_[0]->Data();
+    Dtype* std_dev_data     = Parent::weight_[1]->Data();
+    Dtype* mean_cur_data    = mean_cur_->Data();
+    Dtype* std_dev_cur_data = std_dev_cur_->Data();
+
+    mean_cur_data[channel] = mean;
+
+    // Calculate the standard deviation from the variance
+    // We actually save the inverse of the standard deviation
+    // sqrt(var(in) + eps)
+    std_dev_cur_data[channel] = Dtype(1) / std::sqrt(variance +
+      std::numeric_limits<Dtype>::epsilon());
+
+    // Global mean and standard deviation
+    mean_data[channel] = (Dtype(1) - moving_avg_) * mean_data[channel] +
+                         moving_avg_ * mean_cur_data[channel];
+    std_dev_data[channel] =
+      (Dtype(1) - moving_avg_) * std_dev_data[channel] +
+      moving_avg_ * std_dev_cur_data[channel];
+  }
+
+  /*!
+   * Sum some values per channel over the pixels (NHWC layout), each thread
+   * accumulating its own sums (see sum_).
+   *
+   *  \param[in]  num_pixel  : number of pixels (all batches)
+   *  \param[in]  num_channel: number of channels
+   *  \param[in]  num_sum    : number of sums per channel
+   *  \param[in]  op         : called with (pixel, sums of the thread) to
+   *                           accumulate the values of a pixel
+   *
+   *  \param[out] sum        : sums (num_sum x num_channel)
+   */
+  template <typename Op>
+  void SumNhwc(uint32_t num_pixel, uint32_t num_channel, uint32_t num_sum,
+               const Op& op, Dtype* sum) {
+    sum_.resize(ThreadPool::Get().NumThread());
+    for (std::vector<Dtype>& thread_sum : sum_) {
+      thread_sum.assign(num_sum * num_channel, Dtype(0));
     }
+    ParallelFor(0, num_pixel, [&](uint32_t pixel_start, uint32_t pixel_end,
+                                  uint32_t chunk) {
+      for (uint32_t pixel = pixel_start; pixel < pixel_end; ++pixel) {
+        op(pixel, &sum_[chunk][0]);
+      }
+    });
+    std::fill(sum, sum + num_sum * num_channel, Dtype(0));
+    for (const std::vector<Dtype>& thread_sum : sum_) {
+      for (uint32_t i = 0; i < num_sum * num_channel; ++i) {
+        sum[i] += thread_sum[i];
+      }
+    }
+  }
 
-    if (variance) {
-      // Calculate the variance
-      Dtype variance_val = Dtype(0);
-      for (uint32_t i = 0; i < data_size; ++i) {
-        Dtype dx      = data[i] - mean_val;
-        variance_val += dx * dx;
+  /*!
+   * Forward pass in the NHWC layout.
+   *
+   *  \param[in]  update: update the statistics?
+   */
+  void ForwardNhwc(bool update) {
+    Dtype*       out_data     = Parent::out_[0]->Data();
+    const Dtype* in_data      = Parent::in_[0]->Data();
+    const Dtype* mean_data    = Parent::weight_[0]->Data();
+    const Dtype* std_dev_data = Parent::weight_[1]->Data();
+
+    uint32_t num_channel = Parent::out_[0]->size[2];
+    uint32_t num_pixel   = Parent::out_[0]->size[0] *
+                           Parent::out_[0]->size[1] *
+                           Parent::out_[0]->size[3];
+
+    if (update) {
+      // Sums of the values and squared values, shifted by the first pixel
+      // (see MeanVariance)
+      std::vector<Dtype> sum(2 * num_channel);
+      SumNhwc(num_pixel, num_channel, 2, [&](uint32_t pixel, Dtype* acc) {
+        const Dtype* in = in_data + size_t(pixel) * num_channel;
+        for (uint32_t channel = 0; channel < num_channel; ++channel) {
+          Dtype dx                   = in[channel] - in_data[channel];
+          acc[channel]              += dx;
+          acc[num_channel + channel] += dx * dx;
+        }
+      }, &sum[0]);
+      Dtype inv_size = Dtype(1) / Dtype(num_pixel);
+      for (uint32_t channel = 0; channel < num_channel; ++channel) {
+        Dtype mean_dx = sum[channel] * inv_size;
+        UpdateStat(channel, in_data[channel] + mean_dx,
+                   std::max(sum[num_channel + channel] * inv_size -
+                            mean_dx * mean_dx, Dtype(0)));
       }
-      variance_val /= data_size;
-      *variance = variance_val;
     }
+
+    // out = (in - mean) / sqrt(var(in) + eps)
+    ParallelFor(0, num_pixel, [&](uint32_t pixel_start, uint32_t pixel_end,
+                                  uint32_t) {
+      for (uint32_t pixel = pixel_start; pixel < pixel_end; ++pixel) {
+        size_t offset = size_t(pixel) * num_channel;
+        for (uint32_t channel = 0; channel < num_channel; ++channel) {
+          out_data[offset + channel] = (in_data[offset + channel] -
+                                        mean_data[channel]) *
+                                       std_dev_data[channel];
+        }
+      }
+    });
+  }
+
+  /*!
+   * Backward pass in the NHWC layout.
+   */
+  void BackwardNhwc() {
+    const Dtype* out_data       = Parent::out_[0]->Data();
+    const Dtype* out_deriv_data = Parent::out_[0]->DerivData();
+    Dtype*       in_deriv_data  = Parent::in_[0]->DerivData();
+    const Dtype* std_dev_data   = Parent::weight_[1]->Data();
+
+    uint32_t num_channel = Parent::out_[0]->size[2];
+    uint32_t num_pixel   = Parent::out_[0]->size[0] *
+                           Parent::out_[0]->size[1] *
+                           Parent::out_[0]->size[3];
+
+    // mean(out_deriv) and mean(out_deriv . out)
+    std::vector<Dtype> mean(2 * num_channel);
+    SumNhwc(num_pixel, num_channel, 2, [&](uint32_t pixel, Dtype* acc) {
+      size_t offset = size_t(pixel) * num_channel;
+      for (uint32_t channel = 0; channel < num_channel; ++channel) {
+        Dtype dv                    = out_deriv_data[offset + channel];
+        acc[channel]               += dv;
+        acc[num_channel + channel] += dv * out_data[offset + channel];
+      }
+    }, &mean[0]);
+    Dtype inv_size = Dtype(1) / Dtype(num_pixel);
+    for (Dtype& val : mean) {
+      val *= inv_size;
+    }
+
+    // in_deriv += (out_deriv - mean(out_deriv) - mean(out_deriv . out) .
+    //             out) / sqrt(var(in) + eps)
+    ParallelFor(0, num_pixel, [&](uint32_t pixel_start, uint32_t pixel_end,
+                                  uint32_t) {
+      for (uint32_t pixel = pixel_start; pixel < pixel_end; ++pixel) {
+        size_t offset = size_t(pixel) * num_channel;
+        for (uint32_t channel = 0; channel < num_channel; ++channel) {
+          in_deriv_data[offset + channel] +=
+            (out_deriv_data[offset + channel] - mean[channel] -
+             mean[num_channel + channel] * out_data[offset + channel]) *
+            std_dev_data[channel];
+        }
+      }
+    });
+  }
+
+  /*!
+   * Set the memory layout of the activations (see Layout).
+   *
+   *  \param[in]  layout: layout
+   *
+   *  \return     Supported?
+   */
+  virtual bool SetLayout(Layout::E_LAYOUT layout) {
+    Parent::out_[0]->layout = layout;
+    return true;
+  }
+
+  /*!
+   * Start fusing the following layers into this one, for inference (see
+   * Fusion).
+   *
+   *  \return Fusion, starting with the normalization
+   */
+  virtual Fusion<Dtype>* Fuse() {
+    fusion_.Reset(Parent::out_[0]->size[2], nullptr);
+    fusion_.Normalize(Parent::weight_[0]->Data(), Parent::weight_[1]->Data());
+    return &fusion_;
+  }
+
+  /*!
+   * Fuse this layer into a previous one, for inference (see Fusion).
+   *
+   *  \param[in]  fusion: fusion of the previous layer
+   *
+   *  \return     Fused?
+   */
+  virtual bool FuseInto(Fusion<Dtype>* fusion) const {
+    fusion->Normalize(Parent::weight_[0]->Data(), Parent::weight_[1]->Data());
+    return true;
   }
 
   /*!
@@ -157,12 +362,10 @@ class LayerBatchNorm: public Layer<Dtype> {
    *  \param[in]  state: state
    */
   virtual void Forward(const State& state) {
-    Dtype*       out_data         = Parent::out_[0]->Data();
-    const Dtype* in_data          = Parent::in_[0]->Data();
-    Dtype*       mean_data        = Parent::weight_[0]->Data();
-    Dtype*       std_dev_data     = Parent::weight_[1]->Data();
-    Dtype*       mean_cur_data    = mean_cur_->Data();
-    Dtype*       std_dev_cur_data = std_dev_cur_->Data();
+    Dtype*       out_data     = Parent::out_[0]->Data();
+    const Dtype* in_data      = Parent::in_[0]->Data();
+    const Dtype* mean_data    = Parent::weight_[0]->Data();
+    const Dtype* std_dev_data = Parent::weight_[1]->Data();
 
     uint32_t data_size   = Parent::out_[0]->size[0] * Parent::out_[0]->size[1];
     uint32_t num_channel = Parent::out_[0]->size[2];
@@ -170,53 +373,64 @@ class LayerBatchNorm: public Layer<Dtype> {
     if (!batch_size) {
       return;
     }
-    Dtype inv_batch_size = Dtype(1) / batch_size;
 
-    if (state.phase == State::PHASE_TRAIN) {
-      // Calculate the mean and variance for each channel across all batches
-      // We only do this during the training phase
-      // During testing, we only use the precomputed
-      // global mean and standard deviation
-      for (uint32_t channel = 0; channel < num_channel; ++channel) {
-        mean_cur_data[channel]    = Dtype(0);
-        std_dev_cur_data[channel] = Dtype(0);
-        for (uint32_t batch = 0; batch < batch_size; ++batch) {
-          uint32_t offset = (batch * num_channel + channel) * data_size;
-          Dtype mean_val, variance_val;
-          MeanVariance(in_data + offset, data_size, &mean_val, &variance_val);
-          mean_cur_data[channel]    += mean_val     * inv_batch_size;
-          std_dev_cur_data[channel] += variance_val * inv_batch_size;
-        }
+    // In the NHWC layout, each pixel is seen as a batch of one value per
+    // channel by the fused transform
+    bool nhwc = Parent::out_[0]->layout == Layout::NHWC;
 
-        // Calculate the standard deviation from the variance
-        // We actually save the inverse of the standard deviation
-        // sqrt(var(in) + eps)
-        std_dev_cur_data[channel] =
-          Dtype(1) / std::sqrt(std_dev_cur_data[channel] +
-          std::numeric_limits<Dtype>::epsilon());
-
-        // Global mean and standard deviation
-        mean_data[channel] = (Dtype(1) - moving_avg_) * mean_data[channel] +
-                             moving_avg_ * mean_cur_data[channel];
-        std_dev_data[channel] =
-          (Dtype(1) - moving_avg_) * std_dev_data[channel] +
-          moving_avg_ * std_dev_cur_data[channel];
-      }
+    // Inference with the following layers fused (see Fusion)
+    if (fusion_.Active() && state.phase == State::PHASE_TEST) {
+      fusion_.Apply(nhwc ? 1 : data_size, 0,
+                    nhwc ? batch_size * data_size : batch_size, in_data,
+                    fusion_.Out()->Data());
+      return;
+    }
 
-      // Update the moving average
-      moving_avg_ *= moving_avg_frac_;
+    // The statistics are only updated once per step: a forward pass run
+    // again (see Model::Checkpoint) normalizes with the same ones
+    bool update = state.phase == State::PHASE_TRAIN && !state.recompute;
+
+    if (nhwc) {
+      ForwardNhwc(update);
+      if (update) {
+        moving_avg_ *= moving_avg_frac_;
+      }
+      return;
     }
 
-    // Normalize each value with the mean and variance
-    // out = (in - mean) / sqrt(var(in) + eps)
-    for (uint32_t channel = 0; channel < num_channel; ++channel) {
-      for (uint32_t batch = 0; batch < batch_size; ++batch) {
-        uint32_t offset = (batch * num_channel + channel) * data_size;
-        for (uint32_t i = 0; i < data_size; ++i) {
-          out_data[offset + i] = (in_data[offset + i] - mean_data[channel]) *
-                                 std_dev_data[channel];
+    // The channels are processed in parallel, the statistics in one sweep
+    // over the inputs (training only) and the normalization in another one
+    ParallelFor(0, num_channel, [&](uint32_t channel_start,
+                                    uint32_t channel_end, uint32_t) {
+      for (uint32_t channel = channel_start; channel < channel_end;
+           ++channel) {
+        if (update) {
+          // Calculate the mean and variance for each channel across all
+          // batches. We only do this during the training phase. During
+          // testing, we only use the precomputed global mean and standard
+          // deviation
+          Dtype mean_val, variance_val;
+          MeanVariance(in_data, data_size, num_channel, batch_size, channel,
+                       &mean_val, &variance_val);
+          UpdateStat(channel, mean_val, variance_val);
+        }
+
+        // Normalize each value with the mean and variance
+        // out = (in - mean) / sqrt(var(in) + eps)
+        Dtype mean    = mean_data[channel];
+        Dtype std_dev = std_dev_data[channel];
+        for (uint32_t batch = 0; batch < batch_size; ++batch) {
+          size_t offset = (size_t(batch) * num_channel + channel) * data_size;
+          for (uint32_t i = 0; i < data_size; ++i) {
+            out_data[offset + i] = (in_data[offset + i] - mean) * std_dev;
+          }
         }
       }
+    });
+
+    // Update the moving average
+    if (update) {
+      moving_avg_ *= moving_avg_frac_;
     }
   }
 
@@ -237,38 +451,48 @@ class LayerBatchNorm: public Layer<Dtype> {
     uint32_t num_channel = Parent::out_[0]->size[2];
     uint32_t batch_size  = Parent::out_[0]->size[3];
 
-    // Temporary array to save "out_deriv . out" element-wise product
-    std::vector<Dtype> out_deriv_data_dot_out_data(data_size);
+    if (Parent::out_[0]->layout == Layout::NHWC) {
+      BackwardNhwc();
+      return;
+    }
 
     // in_deriv = (out_deriv - mean(out_deriv) -
     //            mean(out_deriv . out) . out) / sqrt(var(in) + eps)
-    for (uint32_t channel = 0; channel < num_channel; ++channel) {
-      for (uint32_t batch = 0; batch < batch_size; ++batch) {
-        uint32_t offset = (batch * num_channel + channel) * data_size;
-        // mean(out_deriv)
-        Dtype mean_out_deriv_data;
-        MeanVariance(out_deriv_data + offset, data_size,
-                     &mean_out_deriv_data, nullptr);
-        // out_deriv . out
-        for (uint32_t i = 0; i < data_size; ++i) {
-          out_deriv_data_dot_out_data[i] = out_deriv_data[offset + i] *
-                                           out_data[offset + i];
+    // The means are taken over the channel across all batches (one sweep),
+    // before updating the derivatives (another one)
+    Dtype inv_size = Dtype(1) / (Dtype(data_size) * batch_size);
+    ParallelFor(0, num_channel, [&](uint32_t channel_start,
+                                    uint32_t channel_end, uint32_t) {
+      for (uint32_t channel = channel_start; channel < channel_end;
+           ++channel) {
+        // mean(out_deriv) and mean(out_deriv . out)
+        Dtype sum_out_deriv         = Dtype(0);
+        Dtype sum_out_deriv_dot_out = Dtype(0);
+        for (uint32_t batch = 0; batch < batch_size; ++batch) {
+          size_t offset = (size_t(batch) * num_channel + channel) * data_size;
+          for (uint32_t i = 0; i < data_size; ++i) {
+            sum_out_deriv         += out_deriv_data[offset + i];
+            sum_out_deriv_dot_out += out_deriv_data[offset + i] *
+                                     out_data[offset + i];
+          }
         }
-        // mean(out_deriv . out)
-        Dtype mean_out_deriv_data_dot_out_data;
-        MeanVariance(&out_deriv_data_dot_out_data[0], data_size,
-                     &mean_out_deriv_data_dot_out_data, nullptr);
+        Dtype mean_out_deriv         = sum_out_deriv         * inv_size;
+        Dtype mean_out_deriv_dot_out = sum_out_deriv_dot_out * inv_size;
+
         // (out_deriv - mean(out_deriv) - mean(out_deriv . out) . out) /
         // sqrt(var(in) + eps)
         // We re-use 1 / sqrt(var(in) + eps) calculated during the forward pass
-        for (uint32_t i = 0; i < data_size; ++i) {
-          in_deriv_data[offset + i] +=
-            (out_deriv_data[offset + i] - mean_out_deriv_data -
-            mean_out_deriv_data_dot_out_data * out_data[offset + i]) *
-            std_dev_data[channel];
+        Dtype std_dev = std_dev_data[channel];
+        for (uint32_t batch = 0; batch < batch_size; ++batch) {
+          size_t offset = (size_t(batch) * num_channel + channel) * data_size;
+          for (uint32_t i = 0; i < data_size; ++i) {
+            in_deriv_data[offset + i] +=
+              (out_deriv_data[offset + i] - mean_out_deriv -
+              mean_out_deriv_dot_out * out_data[offset + i]) * std_dev;
+          }
         }
       }
-    }
+    });
   }
 };
 
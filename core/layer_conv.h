@@ -29,9 +29,15 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/gemm.h>
+#include <core/im2col.h>
 #include <core/rand.h>
+#include <core/thread_pool.h>
+#include <core/tuner.h>
+#include <algorithm>
 #include <memory>
 #include <vector>
+#include <string>
 #include <cmath>
 
 
@@ -41,6 +47,34 @@ namespace jik {
 /*!
  *  \class  LayerConv
  *  \brief  Matrix convolution
+ *
+ * The convolution algorithm is selected with the "algo" parameter:
+ *  + "im2col" (default): each image is lowered into a matrix of columns
+ *    (see Im2Col) so the forward pass, the input derivatives and the filter
+ *    derivatives are all calculated with matrix multiplications
+ *  + "direct": straightforward nested loops, no extra memory
+ *  + "winograd" (default for 3x3 filters with a stride of 1): the forward
+ *    pass is calculated on 4x4 input tiles producing 2x2 output tiles,
+ *    F(2x2, 3x3), with 16 multiplications per tile instead of 36. The tiles
+ *    are transformed (V = B^T d B), multiplied by the transformed filter
+ *    (U = G g G^T) with one matrix multiplication per tile position over the
+ *    input channels, and transformed back (Y = A^T M A). The transformed
+ *    filter is kept until the weights change, i.e. the next backward pass
+ *    (or Model::Fuse after loading some weights). The backward pass is done
+ *    with im2col
+ *
+ * Without an "algo" parameter (or "auto"), the fastest of these algorithms
+ * is selected for each input shape, batch size and number of threads when
+ * the Tuner is enabled (the direct convolution only for inference, its
+ * backward pass being slower).
+ *
+ * In the NHWC layout (see SetLayout), the convolution is always lowered to
+ * matrix multiplications, one row per output position (see
+ * Im2Col::ForwardNhwc): the outputs of a pixel are contiguous, and so are
+ * the inputs of each filter tap. The filter is reordered to match (cached
+ * like the Winograd transform).
+ *
+ * The batch is split across the threads of the ThreadPool.
  */
 template <typename Dtype>
 class LayerConv: public Layer<Dtype> {
@@ -49,90 +83,59 @@ class LayerConv: public Layer<Dtype> {
   typedef Dtype         Type;
   typedef Layer<Dtype>  Parent;
 
-
-  // Protected attributes
- protected:
-  uint32_t num_output_;     // Number of outputs
-  uint32_t filter_width_;   // Convolution kernel filter width
-  uint32_t filter_height_;  // Convolution kernel filter height
-  uint32_t padding_x_;      // Row padding
-  uint32_t padding_y_;      // Column padding
-  uint32_t stride_x_;       // Row stride
-  uint32_t stride_y_;       // Column stride
-  uint32_t out_width_;      // Output width
-  uint32_t out_height_;     // Output height
-
-
-  // Public methods
- public:
   /*!
-   * Constructor.
-   *
-   *  \param[in]  name : layer name
-   *  \param[in]  in   : input activations
-   *  \param[in]  param: parameters
+   *  \enum   E_ALGO
+   *  \brief  Convolution algorithm
    */
-  LayerConv(const char*                                     name,
-            const std::vector<std::shared_ptr<Mat<Dtype>>>& in,
-            const Param&                                    param):
-    Parent(name, in) {
-    // Make sure we have 1 input
-    Check(Parent::in_.size() == 1, "Layer '%s' must have 1 input",
-          Parent::Name());
-
-    // Parameters
-    bool use_bias;
-    param.Get("use_bias"     , true, &use_bias);
-    param.Get("num_output"   , &num_output_);
-    param.Get("filter_width" , &filter_width_);
-    param.Get("filter_height", &filter_height_);
-    param.Get("padding_x"    , &padding_x_);
-    param.Get("padding_y"    , &padding_y_);
-    param.Get("stride_x"     , &stride_x_);
-    param.Get("stride_y"     , &stride_y_);
+  enum E_ALGO {
+    ALGO_DIRECT = 0,  // Nested loops
+    ALGO_IM2COL,      // Lowering to matrix multiplications
+    ALGO_WINOGRAD     // Winograd F(2x2, 3x3) (forward pass)
+  };
 
-    // Calculate the output width and height based on padding and stride
-    out_width_ = (Parent::in_[0]->size[0] +
-                 2 * padding_x_ - filter_width_)  / stride_x_ + 1;
-    out_height_ = (Parent::in_[0]->size[1] +
-                  2 * padding_y_ - filter_height_) / stride_y_ + 1;
 
-    // Number of inputs
-    uint32_t num_input = Parent::in_[0]->size[2];
-
-    // Create 2 weights: kernel filter and bias
-    Parent::weight_.resize(use_bias ? 2 : 1);
-
-    // Initialize the filter matrix with some random values
-    // (gaussian distribution)
-    Parent::weight_[0] = Rand<Dtype>::GenMatGauss(
-      filter_width_, filter_height_, num_input, num_output_, Dtype(0),
-      std::sqrt(Dtype(1) / (filter_width_ * filter_height_ * num_input)));
-
-    // Create the bias and initialize it to 0
-    if (use_bias) {
-      Parent::weight_[1] = std::make_shared<Mat<Dtype>>(1, 1, num_output_);
-    }
-
-    // Create 1 output, same size as the input
-    Parent::out_.resize(1);
-    Parent::out_[0] = std::make_shared<Mat<Dtype>>(
-      out_width_, out_height_, num_output_, Parent::in_[0]->size[3]);
-  }
+  // Protected attributes
+ protected:
+  E_ALGO                          algo_;           // Convolution algorithm
+  uint32_t                        num_output_;     // Number of outputs
+  uint32_t                        filter_width_;   // Filter width
+  uint32_t                        filter_height_;  // Filter height
+  uint32_t                        padding_x_;      // Row padding
+  uint32_t                        padding_y_;      // Column padding
+  uint32_t                        stride_x_;       // Row stride
+  uint32_t                        stride_y_;       // Column stride
+  uint32_t                        out_width_;      // Output width
+  uint32_t                        out_height_;     // Output height
+  std::vector<std::vector<Dtype>> col_;            // Columns workspace
+                                                   // (im2col, per thread)
+  ThreadDeriv<Dtype>              filter_deriv_;   // Filter derivatives
+                                                   // (per thread)
+  ThreadDeriv<Dtype>              bias_deriv_;     // Bias derivatives
+                                                   // (per thread)
+  Quantizer<Dtype>                quant_;          // Quantizer
+                                                   // (int8 inference)
+  Fusion<Dtype>                   fusion_;         // Fused layers
+                                                   // (inference)
+  Layout::E_LAYOUT                layout_;         // Activations layout
+  std::vector<Dtype>              xfilter_;        // Transformed filter
+                                                   // (Winograd or NHWC)
+  const Dtype*                    xfilter_source_; // Filter transformed
+                                                   // (nullptr if outdated)
+  bool                            tune_;           // Algorithm tuned?
+  std::string                     tune_key_;       // Last tuned shape
+  std::vector<std::vector<Dtype>> xfilter_deriv_;  // Filter derivatives
+                                                   // (NHWC, per thread)
 
-  /*!
-   * Destructor.
-   */
-  virtual ~LayerConv() {}
 
+  // Protected methods
+ protected:
   /*!
-   * Forward pass.
-   * The forward pass calculates the outputs activations
-   * in regard to the inputs activations and weights.
+   * Forward pass (direct convolution) on a range of the batch.
    *
-   *  \param[in]  state: state
+   *  \param[in]  batch_start: first batch
+   *  \param[in]  batch_end  : last batch (excluded)
    */
-  virtual void Forward(const State& state) {
+  void ForwardDirect(uint32_t batch_start, uint32_t batch_end) {
     Dtype*       out_data    = Parent::out_[0]->Data();
     const Dtype* in_data     = Parent::in_[0]->Data();
     const Dtype* filter_data = Parent::weight_[0]->Data();
@@ -142,20 +145,12 @@ class LayerConv: public Layer<Dtype> {
     uint32_t in_width   = Parent::in_[0]->size[0];
     uint32_t in_height  = Parent::in_[0]->size[1];
     uint32_t num_input  = Parent::in_[0]->size[2];
-    uint32_t batch_size = Parent::in_[0]->size[3];
 
     // out = filter * in + bias
     // Notes: This is a fairly non-optimized way to perform convolution
-    //        One trick is to linearize all the images of the mini-batch into a
-    //        big 2D matrix (down from a 4D matrix), effectively converting one
-    //        images into a 1D column, each row storing a different image from
-    //        the mini-batch
-    //        We also should be using a good linear algebra library (BLAS,
-    //        Eigen, etc.) to perform the matrix multiplication: it will be
-    //        much faster and padding/stride will be handled more efficiently
-    //        All these optimizations are beyond the scope of this project but
-    //        would be welcome additions
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
+    //        See ForwardIm2Col for the version lowering the convolution
+    //        to a matrix multiplication
+    for (uint32_t batch = batch_start; batch < batch_end; ++batch) {
       uint32_t in_offset  = in_width   * in_height   * num_input   * batch;
       uint32_t out_offset = out_width_ * out_height_ * num_output_ * batch;
       for (uint32_t channel = 0; channel < num_output_; ++channel) {
@@ -202,30 +197,33 @@ class LayerConv: public Layer<Dtype> {
   }
 
   /*!
-   * Backward pass.
-   * The backward pass calculates the inputs activations and weights
-   * derivatives in regard to the outputs activations derivatives.
+   * Backward pass (direct convolution) on a range of the batch.
    *
-   *  \param[in]  state: state
+   *  \param[in]  batch_start: first batch
+   *  \param[in]  batch_end  : last batch (excluded)
+   *  \param[in]  chunk      : chunk index (per-thread data)
    */
-  virtual void Backward(const State& state) {
+  void BackwardDirect(uint32_t batch_start, uint32_t batch_end,
+                      uint32_t chunk) {
     const Dtype* out_deriv_data    = Parent::out_[0]->DerivData();
     const Dtype* in_data           = Parent::in_[0]->Data();
     Dtype*       in_deriv_data     = Parent::in_[0]->DerivData();
     const Dtype* filter_data       = Parent::weight_[0]->Data();
-    Dtype*       filter_deriv_data = Parent::weight_[0]->DerivData();
+    Dtype*       filter_deriv_data = filter_deriv_.Data(chunk,
+                                       Parent::weight_[0]->DerivData());
     Dtype*       bias_deriv_data   = (Parent::weight_.size() > 1) ?
-                                     Parent::weight_[1]->DerivData() : nullptr;
+                                     bias_deriv_.Data(chunk,
+                                       Parent::weight_[1]->DerivData()) :
+                                     nullptr;
 
     uint32_t in_width   = Parent::in_[0]->size[0];
     uint32_t in_height  = Parent::in_[0]->size[1];
     uint32_t num_input  = Parent::in_[0]->size[2];
-    uint32_t batch_size = Parent::in_[0]->size[3];
 
     // in_deriv     = filter * out_deriv
     // filter_deriv = in * out_deriv
     // bias_deriv   = out_deriv
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
+    for (uint32_t batch = batch_start; batch < batch_end; ++batch) {
       uint32_t in_offset  = in_width   * in_height   * num_input   * batch;
       uint32_t out_offset = out_width_ * out_height_ * num_output_ * batch;
       for (uint32_t channel = 0; channel < num_output_; ++channel) {
@@ -256,7 +254,9 @@ class LayerConv: public Layer<Dtype> {
                   uint32_t in_index =
                     in_offset + (in_channel * in_height + in_y) * in_width +
                     in_x;
-                  in_deriv_data[in_index] += filter_data[filter_index] * dv;
+                  if (in_deriv_data) {
+                    in_deriv_data[in_index] += filter_data[filter_index] * dv;
+                  }
                   filter_deriv_data[filter_index] += in_data[in_index] * dv;
                 }
               }
@@ -269,6 +269,804 @@ class LayerConv: public Layer<Dtype> {
       }
     }
   }
+
+  /*!
+   * Transform the filter, if outdated:
+   *  + NHWC layout: num_output x (filter_height * filter_width * num_input)
+   *    matrix, the inputs of each filter tap being contiguous
+   *  + Winograd: U = G g G^T for each output and input, stored as 16
+   *    matrices (one per tile position) of num_output x num_input values
+   */
+  void TransformFilter() {
+    const Dtype* filter_data = Parent::weight_[0]->Data();
+    if (xfilter_source_ == filter_data) {
+      return;
+    }
+    uint32_t num_input = Parent::in_[0]->size[2];
+    if (layout_ == Layout::NHWC) {
+      uint32_t num_tap = filter_width_ * filter_height_;
+      xfilter_.resize(num_output_ * num_input * num_tap);
+      for (uint32_t channel = 0; channel < num_output_; ++channel) {
+        const Dtype* filter  = filter_data + channel * num_input * num_tap;
+        Dtype*       xfilter = &xfilter_[channel * num_input * num_tap];
+        for (uint32_t in_channel = 0; in_channel < num_input; ++in_channel) {
+          for (uint32_t tap = 0; tap < num_tap; ++tap) {
+            xfilter[tap * num_input + in_channel] =
+              filter[in_channel * num_tap + tap];
+          }
+        }
+      }
+      xfilter_source_ = filter_data;
+      return;
+    }
+    uint32_t num_pair  = num_output_ * num_input;
+    xfilter_.resize(16 * num_pair);
+    for (uint32_t pair = 0; pair < num_pair; ++pair) {
+      const Dtype* g = filter_data + pair * 9;
+      // G g (4x3), G = [1 0 0; 1/2 1/2 1/2; 1/2 -1/2 1/2; 0 0 1]
+      Dtype gg[4][3];
+      for (uint32_t x = 0; x < 3; ++x) {
+        gg[0][x] = g[x];
+        gg[1][x] = Dtype(0.5) * (g[x] + g[3 + x] + g[6 + x]);
+        gg[2][x] = Dtype(0.5) * (g[x] - g[3 + x] + g[6 + x]);
+        gg[3][x] = g[6 + x];
+      }
+      // (G g) G^T (4x4)
+      for (uint32_t y = 0; y < 4; ++y) {
+        Dtype* u = &xfilter_[(y * 4) * num_pair + pair];
+        u[0]            = gg[y][0];
+        u[num_pair]     = Dtype(0.5) * (gg[y][0] + gg[y][1] + gg[y][2]);
+        u[2 * num_pair] = Dtype(0.5) * (gg[y][0] - gg[y][1] + gg[y][2]);
+        u[3 * num_pair] = gg[y][2];
+      }
+    }
+    xfilter_source_ = filter_data;
+  }
+
+  /*!
+   * Forward pass (Winograd F(2x2, 3x3)) on a range of the batch.
+   * The tiles of several images are multiplied at once, so the matrix
+   * multiplications stay large on small images.
+   *
+   *  \param[in]  batch_start: first batch
+   *  \param[in]  batch_end  : last batch (excluded)
+   *  \param[in]  chunk      : chunk index (per-thread data)
+   *  \param[in]  fused      : apply the fused layers (see Fusion)?
+   */
+  void ForwardWinograd(uint32_t batch_start, uint32_t batch_end,
+                       uint32_t chunk, bool fused) {
+    // Minimum number of tiles multiplied at once
+    const uint32_t kMinTile = 256;
+
+    Dtype*       out_data  = fused ? fusion_.Out()->Data() :
+                             Parent::out_[0]->Data();
+    const Dtype* in_data   = Parent::in_[0]->Data();
+    const Dtype* bias_data = (Parent::weight_.size() > 1) ?
+                             Parent::weight_[1]->Data() : nullptr;
+
+    uint32_t in_width   = Parent::in_[0]->size[0];
+    uint32_t in_height  = Parent::in_[0]->size[1];
+    uint32_t num_input  = Parent::in_[0]->size[2];
+
+    uint32_t in_size   = in_width * in_height * num_input;
+    uint32_t out_size  = out_width_ * out_height_;
+    uint32_t tile_x    = (out_width_  + 1) / 2;
+    uint32_t tile_y    = (out_height_ + 1) / 2;
+    uint32_t num_tile  = tile_x * tile_y;
+    uint32_t num_image = std::max(1u, kMinTile / num_tile);
+
+    // Transformed tiles V (16 x num_input x tiles) followed by the products
+    // M (16 x num_output x tiles)
+    uint32_t max_tile = std::min(num_image, batch_end - batch_start) *
+                        num_tile;
+    std::vector<Dtype>& col = col_[chunk];
+    col.resize(16 * (num_input + num_output_) * max_tile);
+    Dtype* v_data = &col[0];
+    Dtype* m_data = v_data + 16 * num_input * max_tile;
+
+    for (uint32_t batch = batch_start; batch < batch_end;
+         batch += num_image) {
+      uint32_t batch_last = std::min(batch + num_image, batch_end);
+      uint32_t group_tile = (batch_last - batch) * num_tile;
+
+      // V = B^T d B, B^T = [1 0 -1 0; 0 1 1 0; 0 -1 1 0; 0 1 0 -1]
+      for (uint32_t image = batch; image < batch_last; ++image) {
+        for (uint32_t channel = 0; channel < num_input; ++channel) {
+          const Dtype* in = in_data + in_size * image +
+                            channel * in_width * in_height;
+          for (uint32_t ty = 0; ty < tile_y; ++ty) {
+            for (uint32_t tx = 0; tx < tile_x; ++tx) {
+              int32_t start_x = int32_t(2 * tx) - int32_t(padding_x_);
+              int32_t start_y = int32_t(2 * ty) - int32_t(padding_y_);
+              bool inside = start_x >= 0 && start_y >= 0 &&
+                            uint32_t(start_x) + 4 <= in_width &&
+                            uint32_t(start_y) + 4 <= in_height;
+              Dtype d[4][4];
+              for (int32_t y = 0; y < 4; ++y) {
+                int32_t      in_y = start_y + y;
+                const Dtype* row  = in + in_y * int32_t(in_width) + start_x;
+                if (inside) {
+                  std::copy(row, row + 4, d[y]);
+                  continue;
+                }
+                for (int32_t x = 0; x < 4; ++x) {
+                  int32_t in_x = start_x + x;
+                  d[y][x] = (in_x < 0 || uint32_t(in_x) >= in_width ||
+                             in_y < 0 || uint32_t(in_y) >= in_height) ?
+                            Dtype(0) : row[x];
+                }
+              }
+              Dtype bd[4][4];
+              for (uint32_t x = 0; x < 4; ++x) {
+                bd[0][x] = d[0][x] - d[2][x];
+                bd[1][x] = d[1][x] + d[2][x];
+                bd[2][x] = d[2][x] - d[1][x];
+                bd[3][x] = d[1][x] - d[3][x];
+              }
+              uint32_t tile   = (image - batch) * num_tile +
+                                ty * tile_x + tx;
+              Dtype*   v      = v_data + channel * group_tile + tile;
+              uint32_t stride = num_input * group_tile;
+              for (uint32_t y = 0; y < 4; ++y) {
+                Dtype* vy = v + 4 * y * stride;
+                vy[0]          = bd[y][0] - bd[y][2];
+                vy[stride]     = bd[y][1] + bd[y][2];
+                vy[2 * stride] = bd[y][2] - bd[y][1];
+                vy[3 * stride] = bd[y][1] - bd[y][3];
+              }
+            }
+          }
+        }
+      }
+
+      // M = U V, one matrix multiplication per tile position
+      for (uint32_t pos = 0; pos < 16; ++pos) {
+        Gemm<Dtype>::Run(false, false, num_output_, group_tile, num_input,
+                         Dtype(1),
+                         &xfilter_[pos * num_output_ * num_input],
+                         num_input,
+                         v_data + pos * num_input * group_tile, group_tile,
+                         Dtype(0),
+                         m_data + pos * num_output_ * group_tile, group_tile);
+      }
+
+      // Y = A^T M A, A^T = [1 1 1 0; 0 1 -1 -1]
+      uint32_t stride = num_output_ * group_tile;
+      for (uint32_t image = batch; image < batch_last; ++image) {
+        Dtype* out_batch_data = out_data + out_size * num_output_ * image;
+        for (uint32_t channel = 0; channel < num_output_; ++channel) {
+          Dtype* out  = out_batch_data + channel * out_size;
+          Dtype  bias = (bias_data && !fused) ? bias_data[channel] :
+                                                Dtype(0);
+          for (uint32_t ty = 0; ty < tile_y; ++ty) {
+            for (uint32_t tx = 0; tx < tile_x; ++tx) {
+              uint32_t     tile = (image - batch) * num_tile +
+                                  ty * tile_x + tx;
+              const Dtype* m    = m_data + channel * group_tile + tile;
+              Dtype am[2][4];
+              for (uint32_t x = 0; x < 4; ++x) {
+                const Dtype* mx = m + x * stride;
+                am[0][x] = mx[0] + mx[4 * stride] + mx[8 * stride];
+                am[1][x] = mx[4 * stride] - mx[8 * stride] -
+                           mx[12 * stride];
+              }
+              uint32_t out_x = 2 * tx;
+              uint32_t out_y = 2 * ty;
+              for (uint32_t y = 0; y < 2 && out_y + y < out_height_; ++y) {
+                Dtype* out_row = out + (out_y + y) * out_width_ + out_x;
+                out_row[0] = am[y][0] + am[y][1] + am[y][2] + bias;
+                if (out_x + 1 < out_width_) {
+                  out_row[1] = am[y][1] - am[y][2] - am[y][3] + bias;
+                }
+              }
+            }
+          }
+        }
+        if (fused) {
+          // The bias is part of the fused transform
+          fusion_.Apply(out_size, image, image + 1, out_data, out_data);
+        }
+      }
+    }
+  }
+
+  /*!
+   * Forward pass (NHWC layout, im2col + matrix multiplication) on a range of
+   * the batch.
+   *
+   *  \param[in]  batch_start: first batch
+   *  \param[in]  batch_end  : last batch (excluded)
+   *  \param[in]  chunk      : chunk index (per-thread data)
+   *  \param[in]  fused      : apply the fused layers (see Fusion)?
+   */
+  void ForwardNhwc(uint32_t batch_start, uint32_t batch_end, uint32_t chunk,
+                   bool fused) {
+    Dtype*       out_data  = fused ? fusion_.Out()->Data() :
+                             Parent::out_[0]->Data();
+    const Dtype* in_data   = Parent::in_[0]->Data();
+    const Dtype* bias_data = (Parent::weight_.size() > 1) ?
+                             Parent::weight_[1]->Data() : nullptr;
+
+    uint32_t in_width   = Parent::in_[0]->size[0];
+    uint32_t in_height  = Parent::in_[0]->size[1];
+    uint32_t num_input  = Parent::in_[0]->size[2];
+
+    uint32_t in_size  = in_width * in_height * num_input;
+    uint32_t out_size = out_width_ * out_height_;
+    uint32_t col_size = num_input * filter_height_ * filter_width_;
+
+    // out = im2col(in) * filter^T + bias
+    // im2col(in) is a out_size*col_size matrix and the (reordered) filter a
+    // num_output*col_size one
+    std::vector<Dtype>& col = col_[chunk];
+    col.resize(out_size * col_size);
+
+    for (uint32_t batch = batch_start; batch < batch_end; ++batch) {
+      Dtype* out_batch_data = out_data + out_size * num_output_ * batch;
+      Im2Col<Dtype>::ForwardNhwc(in_data + in_size * batch,
+                                 in_width, in_height, num_input,
+                                 filter_width_, filter_height_,
+                                 padding_x_, padding_y_,
+                                 stride_x_, stride_y_,
+                                 out_width_, out_height_, &col[0]);
+      Gemm<Dtype>::Run(false, true, out_size, num_output_, col_size,
+                       Dtype(1), &col[0], col_size, &xfilter_[0], col_size,
+                       Dtype(0), out_batch_data, num_output_);
+      if (fused) {
+        // The bias is part of the fused transform, the pixels are seen as
+        // batches of one value per channel
+        fusion_.Apply(1, batch * out_size, (batch + 1) * out_size, out_data,
+                      out_data);
+      } else if (bias_data) {
+        for (uint32_t i = 0; i < out_size; ++i) {
+          Dtype* out_pixel_data = out_batch_data + i * num_output_;
+          for (uint32_t channel = 0; channel < num_output_; ++channel) {
+            out_pixel_data[channel] += bias_data[channel];
+          }
+        }
+      }
+    }
+  }
+
+  /*!
+   * Backward pass (NHWC layout, im2col + matrix multiplication) on a range
+   * of the batch.
+   *
+   *  \param[in]  batch_start: first batch
+   *  \param[in]  batch_end  : last batch (excluded)
+   *  \param[in]  chunk      : chunk index (per-thread data)
+   */
+  void BackwardNhwc(uint32_t batch_start, uint32_t batch_end,
+                    uint32_t chunk) {
+    const Dtype* out_deriv_data    = Parent::out_[0]->DerivData();
+    const Dtype* in_data           = Parent::in_[0]->Data();
+    Dtype*       in_deriv_data     = Parent::in_[0]->DerivData();
+    Dtype*       filter_deriv_data = filter_deriv_.Data(chunk,
+                                       Parent::weight_[0]->DerivData());
+    Dtype*       bias_deriv_data   = (Parent::weight_.size() > 1) ?
+                                     bias_deriv_.Data(chunk,
+                                       Parent::weight_[1]->DerivData()) :
+                                     nullptr;
+
+    uint32_t in_width   = Parent::in_[0]->size[0];
+    uint32_t in_height  = Parent::in_[0]->size[1];
+    uint32_t num_input  = Parent::in_[0]->size[2];
+
+    uint32_t in_size  = in_width * in_height * num_input;
+    uint32_t out_size = out_width_ * out_height_;
+    uint32_t col_size = num_input * filter_height_ * filter_width_;
+    uint32_t num_tap  = filter_height_ * filter_width_;
+
+    // filter_deriv = out_deriv^T * im2col(in) (reordered filter)
+    // in_deriv     = col2im(out_deriv * filter)
+    // bias_deriv   = out_deriv
+    std::vector<Dtype>& col          = col_[chunk];
+    std::vector<Dtype>& xfilter_deriv = xfilter_deriv_[chunk];
+    col.resize(out_size * col_size);
+    xfilter_deriv.assign(num_output_ * col_size, Dtype(0));
+
+    for (uint32_t batch = batch_start; batch < batch_end; ++batch) {
+      const Dtype* out_deriv_batch_data = out_deriv_data +
+                                          out_size * num_output_ * batch;
+      Im2Col<Dtype>::ForwardNhwc(in_data + in_size * batch,
+                                 in_width, in_height, num_input,
+                                 filter_width_, filter_height_,
+                                 padding_x_, padding_y_,
+                                 stride_x_, stride_y_,
+                                 out_width_, out_height_, &col[0]);
+      Gemm<Dtype>::Run(true, false, num_output_, col_size, out_size,
+                       Dtype(1), out_deriv_batch_data, num_output_,
+                       &col[0], col_size,
+                       Dtype(1), &xfilter_deriv[0], col_size);
+      if (in_deriv_data) {
+        Gemm<Dtype>::Run(false, false, out_size, col_size, num_output_,
+                         Dtype(1), out_deriv_batch_data, num_output_,
+                         &xfilter_[0], col_size,
+                         Dtype(0), &col[0], col_size);
+        Im2Col<Dtype>::BackwardNhwc(&col[0], in_width, in_height, num_input,
+                                    filter_width_, filter_height_,
+                                    padding_x_, padding_y_,
+                                    stride_x_, stride_y_,
+                                    out_width_, out_height_,
+                                    in_deriv_data + in_size * batch);
+      }
+      if (bias_deriv_data) {
+        for (uint32_t i = 0; i < out_size; ++i) {
+          const Dtype* out_deriv_pixel_data = out_deriv_batch_data +
+                                              i * num_output_;
+          for (uint32_t channel = 0; channel < num_output_; ++channel) {
+            bias_deriv_data[channel] += out_deriv_pixel_data[channel];
+          }
+        }
+      }
+    }
+
+    // Back to the filter order
+    for (uint32_t channel = 0; channel < num_output_; ++channel) {
+      const Dtype* xderiv = &xfilter_deriv[channel * col_size];
+      Dtype*       deriv  = filter_deriv_data + channel * col_size;
+      for (uint32_t in_channel = 0; in_channel < num_input; ++in_channel) {
+        for (uint32_t tap = 0; tap < num_tap; ++tap) {
+          deriv[in_channel * num_tap + tap] +=
+            xderiv[tap * num_input + in_channel];
+        }
+      }
+    }
+  }
+
+  /*!
+   * Forward pass (im2col + matrix multiplication) on a range of the batch.
+   *
+   *  \param[in]  batch_start: first batch
+   *  \param[in]  batch_end  : last batch (excluded)
+   *  \param[in]  chunk      : chunk index (per-thread data)
+   *  \param[in]  int8       : int8 inference (see Quantizer)?
+   *  \param[in]  fused      : apply the fused layers (see Fusion)?
+   */
+  void ForwardIm2Col(uint32_t batch_start, uint32_t batch_end,
+                     uint32_t chunk, bool int8, bool fused) {
+    Dtype*       out_data    = fused ? fusion_.Out()->Data() :
+                               Parent::out_[0]->Data();
+    const Dtype* in_data     = Parent::in_[0]->Data();
+    const Dtype* filter_data = Parent::weight_[0]->Data();
+    const Dtype* bias_data   = (Parent::weight_.size() > 1) ?
+                               Parent::weight_[1]->Data() : nullptr;
+
+    uint32_t in_width   = Parent::in_[0]->size[0];
+    uint32_t in_height  = Parent::in_[0]->size[1];
+    uint32_t num_input  = Parent::in_[0]->size[2];
+
+    uint32_t in_size  = in_width * in_height * num_input;
+    uint32_t out_size = out_width_ * out_height_;
+    uint32_t col_size = num_input * filter_height_ * filter_width_;
+
+    // out = filter * im2col(in) + bias
+    // The filter is a num_output*col_size matrix and
+    // im2col(in) a col_size*out_size matrix
+    std::vector<Dtype>& col = col_[chunk];
+    col.resize(col_size * out_size);
+
+    for (uint32_t batch = batch_start; batch < batch_end; ++batch) {
+      Dtype* out_batch_data = out_data + out_size * num_output_ * batch;
+      Im2Col<Dtype>::Forward(in_data + in_size * batch,
+                             in_width, in_height, num_input,
+                             filter_width_, filter_height_,
+                             padding_x_, padding_y_, stride_x_, stride_y_,
+                             out_width_, out_height_, &col[0]);
+      if (int8) {
+        quant_.ForwardCol(out_size, &col[0], chunk, out_batch_data);
+      } else {
+        Gemm<Dtype>::Run(false, false, num_output_, out_size, col_size,
+                         Dtype(1), filter_data, col_size, &col[0], out_size,
+                         Dtype(0), out_batch_data, out_size);
+      }
+      if (fused) {
+        // The bias is part of the fused transform
+        fusion_.Apply(out_size, batch, batch + 1, out_data, out_data);
+      } else if (bias_data) {
+        for (uint32_t channel = 0; channel < num_output_; ++channel) {
+          Dtype* out_channel_data = out_batch_data + channel * out_size;
+          for (uint32_t i = 0; i < out_size; ++i) {
+            out_channel_data[i] += bias_data[channel];
+          }
+        }
+      }
+    }
+  }
+
+  /*!
+   * Backward pass (im2col + matrix multiplication) on a range of the batch.
+   *
+   *  \param[in]  batch_start: first batch
+   *  \param[in]  batch_end  : last batch (excluded)
+   *  \param[in]  chunk      : chunk index (per-thread data)
+   */
+  void BackwardIm2Col(uint32_t batch_start, uint32_t batch_end,
+                      uint32_t chunk) {
+    const Dtype* out_deriv_data    = Parent::out_[0]->DerivData();
+    const Dtype* in_data           = Parent::in_[0]->Data();
+    Dtype*       in_deriv_data     = Parent::in_[0]->DerivData();
+    const Dtype* filter_data       = Parent::weight_[0]->Data();
+    Dtype*       filter_deriv_data = filter_deriv_.Data(chunk,
+                                       Parent::weight_[0]->DerivData());
+    Dtype*       bias_deriv_data   = (Parent::weight_.size() > 1) ?
+                                     bias_deriv_.Data(chunk,
+                                       Parent::weight_[1]->DerivData()) :
+                                     nullptr;
+
+    uint32_t in_width   = Parent::in_[0]->size[0];
+    uint32_t in_height  = Parent::in_[0]->size[1];
+    uint32_t num_input  = Parent::in_[0]->size[2];
+
+    uint32_t in_size  = in_width * in_height * num_input;
+    uint32_t out_size = out_width_ * out_height_;
+    uint32_t col_size = num_input * filter_height_ * filter_width_;
+
+    // filter_deriv = out_deriv * im2col(in)^T
+    // in_deriv     = col2im(filter^T * out_deriv)
+    // bias_deriv   = out_deriv
+    // The same workspace is used for im2col(in) and filter^T * out_deriv
+    std::vector<Dtype>& col = col_[chunk];
+    col.resize(col_size * out_size);
+
+    for (uint32_t batch = batch_start; batch < batch_end; ++batch) {
+      const Dtype* out_deriv_batch_data = out_deriv_data +
+                                          out_size * num_output_ * batch;
+      Im2Col<Dtype>::Forward(in_data + in_size * batch,
+                             in_width, in_height, num_input,
+                             filter_width_, filter_height_,
+                             padding_x_, padding_y_, stride_x_, stride_y_,
+                             out_width_, out_height_, &col[0]);
+      Gemm<Dtype>::Run(false, true, num_output_, col_size, out_size,
+                       Dtype(1), out_deriv_batch_data, out_size,
+                       &col[0], out_size,
+                       Dtype(1), filter_deriv_data, col_size);
+      if (in_deriv_data) {
+        Gemm<Dtype>::Run(true, false, col_size, out_size, num_output_,
+                         Dtype(1), filter_data, col_size,
+                         out_deriv_batch_data, out_size,
+                         Dtype(0), &col[0], out_size);
+        Im2Col<Dtype>::Backward(&col[0], in_width, in_height, num_input,
+                                filter_width_, filter_height_,
+                                padding_x_, padding_y_, stride_x_, stride_y_,
+                                out_width_, out_height_,
+                                in_deriv_data + in_size * batch);
+      }
+      if (bias_deriv_data) {
+        for (uint32_t channel = 0; channel < num_output_; ++channel) {
+          const Dtype* out_deriv_channel_data = out_deriv_batch_data +
+                                                channel * out_size;
+          for (uint32_t i = 0; i < out_size; ++i) {
+            bias_deriv_data[channel] += out_deriv_channel_data[i];
+          }
+        }
+      }
+    }
+  }
+
+
+  /*!
+   * Forward pass with the current algorithm.
+   *
+   *  \param[in]  int8 : int8 inference?
+   *  \param[in]  fused: inference with the fused layers?
+   */
+  void ForwardAlgo(bool int8, bool fused) {
+    bool nhwc     = layout_ == Layout::NHWC;
+    bool winograd = algo_ == ALGO_WINOGRAD && !int8 && !nhwc;
+    if (winograd || nhwc) {
+      TransformFilter();
+    }
+
+    col_.resize(ThreadPool::Get().NumThread());
+    quant_.SetNumChunk(ThreadPool::Get().NumThread());
+    ParallelFor(0, Parent::in_[0]->size[3],
+                [this, int8, fused, nhwc, winograd](uint32_t batch_start,
+                                                    uint32_t batch_end,
+                                                    uint32_t chunk) {
+      if (nhwc) {
+        ForwardNhwc(batch_start, batch_end, chunk, fused);
+      } else if (winograd) {
+        ForwardWinograd(batch_start, batch_end, chunk, fused);
+      } else if (algo_ != ALGO_DIRECT || int8 || fused) {
+        ForwardIm2Col(batch_start, batch_end, chunk, int8, fused);
+      } else {
+        ForwardDirect(batch_start, batch_end);
+      }
+    });
+  }
+
+  /*!
+   * Select the fastest algorithm for the current input shape, batch size,
+   * number of threads and phase (see Tuner): the forward pass for
+   * inference, the forward and backward passes for training.
+   *
+   *  \param[in]  state: state
+   */
+  void Tune(const State& state) {
+    const Mat<Dtype>& in = *Parent::in_[0];
+    bool test = state.phase == State::PHASE_TEST;
+    std::string key = "conv" + std::to_string(8 * sizeof(Dtype)) + " in " +
+      std::to_string(in.size[0]) + "x" + std::to_string(in.size[1]) + "x" +
+      std::to_string(in.size[2]) + "x" + std::to_string(in.size[3]) +
+      " filter " + std::to_string(filter_width_) + "x" +
+      std::to_string(filter_height_) + "x" + std::to_string(num_output_) +
+      " stride " + std::to_string(stride_x_) + "x" +
+      std::to_string(stride_y_) + " pad " + std::to_string(padding_x_) +
+      "x" + std::to_string(padding_y_) + " threads " +
+      std::to_string(ThreadPool::Get().Parallel() ?
+                     ThreadPool::Get().NumThread() : 1) +
+      (test ? " test" : " train");
+    if (key == tune_key_) {
+      return;
+    }
+    tune_key_ = key;
+
+    std::vector<E_ALGO>      algo = {ALGO_IM2COL};
+    std::vector<std::string> name = {"im2col"};
+    if (filter_width_ == 3 && filter_height_ == 3 &&
+        stride_x_ == 1 && stride_y_ == 1) {
+      algo.push_back(ALGO_WINOGRAD);
+      name.push_back("winograd");
+    }
+    if (test) {
+      algo.push_back(ALGO_DIRECT);
+      name.push_back("direct");
+    }
+    // In training, the backward pass is timed too (it drops the Winograd
+    // transform of the filter, done again by the next forward pass), the
+    // derivatives it changes being restored after
+    std::vector<std::shared_ptr<Mat<Dtype>>> mat = Parent::in_;
+    Parent::GetWeight(&mat);
+    std::vector<std::vector<Dtype>> deriv(mat.size());
+    for (size_t j = 0; !test && j < mat.size(); ++j) {
+      if (mat[j]->deriv) {
+        deriv[j].assign(mat[j]->DerivData(),
+                        mat[j]->DerivData() + mat[j]->deriv->Size());
+      }
+    }
+    algo_ = algo[Tuner::Get().Tune(key, name, [&](uint32_t i) {
+      algo_ = algo[i];
+      ForwardAlgo(false, false);
+      if (!test) {
+        Backward(state);
+      }
+    })];
+    for (size_t j = 0; !test && j < mat.size(); ++j) {
+      if (mat[j]->deriv) {
+        std::copy(deriv[j].begin(), deriv[j].end(), mat[j]->DerivData());
+      }
+    }
+  }
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  name : layer name
+   *  \param[in]  in   : input activations
+   *  \param[in]  param: parameters
+   */
+  LayerConv(const char*                                     name,
+            const std::vector<std::shared_ptr<Mat<Dtype>>>& in,
+            const Param&                                    param):
+    Parent(name, in) {
+    // Make sure we have 1 input
+    Check(Parent::in_.size() == 1, "Layer '%s' must have 1 input",
+          Parent::Name());
+
+    // Parameters
+    bool use_bias;
+    param.Get("use_bias"     , true, &use_bias);
+    param.Get("num_output"   , &num_output_);
+    param.Get("filter_width" , &filter_width_);
+    param.Get("filter_height", &filter_height_);
+    param.Get("padding_x"    , &padding_x_);
+    param.Get("padding_y"    , &padding_y_);
+    param.Get("stride_x"     , &stride_x_);
+    param.Get("stride_y"     , &stride_y_);
+
+    // Convolution algorithm
+    std::string algo;
+    param.Get("algo", &algo);
+    bool winograd = filter_width_ == 3 && filter_height_ == 3 &&
+                    stride_x_ == 1 && stride_y_ == 1;
+    tune_ = algo.empty() || algo == "auto";
+    if (tune_) {
+      algo_ = winograd ? ALGO_WINOGRAD : ALGO_IM2COL;
+    } else if (algo == "im2col") {
+      algo_ = ALGO_IM2COL;
+    } else if (algo == "direct") {
+      algo_ = ALGO_DIRECT;
+    } else if (algo == "winograd") {
+      if (!winograd) {
+        Report(kWarning, "Layer '%s' can't use the Winograd algorithm (3x3 "
+               "filter, stride of 1), falling back to im2col",
+               Parent::Name());
+      }
+      algo_ = winograd ? ALGO_WINOGRAD : ALGO_IM2COL;
+    } else {
+      Report(kError, "Layer '%s' has an unknown algorithm '%s'",
+             Parent::Name(), algo.c_str());
+    }
+    layout_         = Layout::NCHW;
+    xfilter_source_ = nullptr;
+
+    // Calculate the output width and height based on padding and stride
+    out_width_ = (Parent::in_[0]->size[0] +
+                 2 * padding_x_ - filter_width_)  / stride_x_ + 1;
+    out_height_ = (Parent::in_[0]->size[1] +
+                  2 * padding_y_ - filter_height_) / stride_y_ + 1;
+
+    // Number of inputs
+    uint32_t num_input = Parent::in_[0]->size[2];
+
+    // Create 2 weights: kernel filter and bias
+    Parent::weight_.resize(use_bias ? 2 : 1);
+
+    // Initialize the filter matrix with some random values
+    // (gaussian distribution)
+    Parent::weight_[0] = Rand<Dtype>::GenMatGauss(
+      filter_width_, filter_height_, num_input, num_output_, Dtype(0),
+      std::sqrt(Dtype(1) / (filter_width_ * filter_height_ * num_input)));
+
+    // Create the bias and initialize it to 0
+    if (use_bias) {
+      Parent::weight_[1] = std::make_shared<Mat<Dtype>>(1, 1, num_output_);
+    }
+
+    // Create 1 output, same size as the input
+    Parent::out_.resize(1);
+    Parent::out_[0] = std::make_shared<Mat<Dtype>>(
+      out_width_, out_height_, num_output_, Parent::in_[0]->size[3]);
+
+    // The filter can be quantized (one scale per output)
+    quant_.SetFilter(Parent::weight_[0], num_output_);
+  }
+
+  /*!
+   * Destructor.
+   */
+  virtual ~LayerConv() {}
+
+  /*!
+   * Check if the backward pass needs the values of the output.
+   *
+   *  \return Output needed?
+   */
+  virtual bool BackwardUsesOutput() const {
+    return false;
+  }
+
+  /*!
+   * Get the quantizer of the layer.
+   *
+   *  \return Quantizer
+   */
+  virtual Quantizer<Dtype>* GetQuantizer() {
+    // No int8 inference in the NHWC layout
+    return layout_ == Layout::NCHW ? &quant_ : nullptr;
+  }
+
+  /*!
+   * Set the memory layout of the activations (see Layout).
+   *
+   *  \param[in]  layout: layout
+   *
+   *  \return     Supported? (not in int8)
+   */
+  virtual bool SetLayout(Layout::E_LAYOUT layout) {
+    if (layout != Layout::NCHW &&
+        quant_.Mode() != Quantizer<Dtype>::MODE_FLOAT) {
+      return false;
+    }
+    layout_                 = layout;
+    xfilter_source_         = nullptr;
+    Parent::out_[0]->layout = layout;
+    return true;
+  }
+
+  /*!
+   * The weights were changed outside of a training step: the transformed
+   * filter is dropped.
+   */
+  virtual void WeightChanged() {
+    xfilter_source_ = nullptr;
+  }
+
+  /*!
+   * Start fusing the following layers into this one, for inference (see
+   * Fusion).
+   *
+   *  \return Fusion, starting with the bias
+   */
+  virtual Fusion<Dtype>* Fuse() {
+    xfilter_source_ = nullptr;
+    fusion_.Reset(num_output_, (Parent::weight_.size() > 1) ?
+                  Parent::weight_[1]->Data() : nullptr);
+    return &fusion_;
+  }
+
+  /*!
+   * Estimate the number of floating point operations of the forward pass.
+   *
+   *  \return Number of operations
+   */
+  virtual uint64_t Flop() const {
+    // Each output value is a dot product over the filter (one per channel)
+    return 2 * Parent::NumValue(Parent::out_) *
+           Parent::in_[0]->size[2] * filter_height_ * filter_width_;
+  }
+
+  /*!
+   * Forward pass.
+   * The forward pass calculates the outputs activations
+   * in regard to the inputs activations and weights.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Forward(const State& state) {
+    // Reduced precision inference and fused layers (always lowered to
+    // im2col)
+    if (quant_.Mode() == Quantizer<Dtype>::MODE_CALIBRATE) {
+      const Mat<Dtype>& in = *Parent::in_[0];
+      quant_.Calibrate(in.Data(), in.size[0] * in.size[1] * in.size[2] *
+                                  in.size[3]);
+    }
+    bool int8  = quant_.Mode() == Quantizer<Dtype>::MODE_INT8 &&
+                 state.phase == State::PHASE_TEST;
+    bool fused = fusion_.Active() && state.phase == State::PHASE_TEST;
+
+    // Fastest algorithm for the shape (see Tuner)
+    if (tune_ && Tuner::Get().Enabled() && layout_ == Layout::NCHW &&
+        !int8 && !fused) {
+      Tune(state);
+    }
+    ForwardAlgo(int8, fused);
+  }
+
+  /*!
+   * Backward pass.
+   * The backward pass calculates the inputs activations and weights
+   * derivatives in regard to the outputs activations derivatives.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Backward(const State& state) {
+    bool nhwc = layout_ == Layout::NHWC;
+    if (nhwc) {
+      TransformFilter();
+    }
+
+    // Each thread accumulates its own weight derivatives
+    col_.resize(ThreadPool::Get().NumThread());
+    xfilter_deriv_.resize(nhwc ? ThreadPool::Get().NumThread() : 0);
+    filter_deriv_.Reset(Parent::weight_[0]->Size());
+    if (Parent::weight_.size() > 1) {
+      bias_deriv_.Reset(Parent::weight_[1]->Size());
+    }
+    ParallelFor(0, Parent::in_[0]->size[3],
+                [this, nhwc](uint32_t batch_start, uint32_t batch_end,
+                             uint32_t chunk) {
+      if (nhwc) {
+        BackwardNhwc(batch_start, batch_end, chunk);
+      } else if (algo_ != ALGO_DIRECT) {
+        BackwardIm2Col(batch_start, batch_end, chunk);
+      } else {
+        BackwardDirect(batch_start, batch_end, chunk);
+      }
+    });
+
+    // Sum the derivatives accumulated by each thread
+    filter_deriv_.Reduce(Parent::weight_[0]->DerivData());
+    if (Parent::weight_.size() > 1) {
+      bias_deriv_.Reduce(Parent::weight_[1]->DerivData());
+    }
+
+    // The weights are about to be updated
+    xfilter_source_ = nullptr;
+  }
 };
 
 
@@ -28,6 +28,7 @@
 
 
 #include <core/layer.h>
+#include <core/data_pipeline.h>
 
 
 namespace jik {
@@ -35,6 +36,15 @@ namespace jik {
 /*!
  *  \class  LayerData
  *  \brief  Data base class
+ *
+ * The training batches can be prefetched by a DataPipeline: the subclass
+ * gives the number of training samples and copies a sample in a batch (see
+ * NumTrainSample and FillTrainSample), and only has to call Prefetch at the
+ * beginning of its forward pass.
+ *
+ * As the samples are copied on the producer thread, a subclass filling them
+ * from its own attributes must stop the pipeline in its destructor (see
+ * StopPrefetch).
  */
 template <typename Dtype>
 class LayerData: public Layer<Dtype> {
@@ -44,19 +54,112 @@ class LayerData: public Layer<Dtype> {
   typedef Layer<Dtype>  Parent;
 
 
+  // Protected attributes
+ protected:
+  DataPipeline<Dtype> pipeline_;      // Training batches pipeline
+  uint32_t            num_prefetch_;  // Number of batches to prefetch
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Get the number of training samples (for the pipeline).
+   *
+   *  \return Number of training samples
+   */
+  virtual uint32_t NumTrainSample() const {
+    return 0;
+  }
+
+  /*!
+   * Copy a training sample in a batch (called on the producer thread).
+   *
+   *  \param[in]  sample: sample index
+   *  \param[in]  batch : index in the batch
+   *
+   *  \param[out] data  : batch (one buffer per output)
+   */
+  virtual void FillTrainSample(uint32_t sample, uint32_t batch,
+                               typename DataPipeline<Dtype>::Batch* data) {}
+
+  /*!
+   * Get the next prefetched training batch in the outputs (the pipeline is
+   * started on the first call, and restarted if the batch size changed).
+   *
+   *  \param[in]  state: state
+   *
+   *  \return     Batch prefetched? (if not, the subclass fills the outputs)
+   */
+  bool Prefetch(const State& state) {
+    if (state.phase != State::PHASE_TRAIN || !num_prefetch_) {
+      return false;
+    }
+    // The batches already produced have the previous batch size
+    if (pipeline_.Running() &&
+        pipeline_.BatchSize() != Parent::out_[0]->size[3]) {
+      pipeline_.Stop();
+    }
+    if (!pipeline_.Running()) {
+      pipeline_.Start(NumTrainSample(), Parent::out_,
+                      [this](uint32_t sample, uint32_t batch,
+                             typename DataPipeline<Dtype>::Batch* data) {
+                        FillTrainSample(sample, batch, data);
+                      }, num_prefetch_);
+      if (!pipeline_.Running()) {
+        return false;
+      }
+    }
+    pipeline_.Next(Parent::out_);
+    return true;
+  }
+
+  /*!
+   * Stop prefetching the training batches.
+   */
+  void StopPrefetch() {
+    pipeline_.Stop();
+  }
+
+
   // Public methods
  public:
   /*!
    * Constructor.
    *
-   *  \param[in]  name : layer name
+   *  \param[in]  name        : layer name
+   *  \param[in]  num_prefetch: number of training batches to prefetch
+   *                            (0 = none)
    */
-  explicit LayerData(const char* name): Parent(name, {}) {}
+  explicit LayerData(const char* name, uint32_t num_prefetch = 0):
+    Parent(name, {}), num_prefetch_(num_prefetch) {}
 
   /*!
    * Destructor.
    */
-  virtual ~LayerData() {}
+  virtual ~LayerData() {
+    StopPrefetch();
+  }
+
+  /*!
+   * Only train on a shard of the training samples, e.g. one per rank in
+   * data-parallel training (the training batches must be prefetched).
+   *
+   *  \param[in]  shard    : shard index
+   *  \param[in]  num_shard: number of shards
+   */
+  void SetShard(uint32_t shard, uint32_t num_shard) {
+    StopPrefetch();
+    pipeline_.SetShard(shard, num_shard);
+  }
+
+  /*!
+   * Check if the backward pass needs the values of the output.
+   *
+   *  \return Output needed?
+   */
+  virtual bool BackwardUsesOutput() const {
+    return false;
+  }
 
   /*!
    * Backward pass.
@@ -29,9 +29,10 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/rand.h>
+#include <core/simd.h>
 #include <memory>
 #include <limits>
-#include <random>
 #include <vector>
 
 
@@ -52,7 +53,22 @@ class LayerDropout: public Layer<Dtype> {
 
   // Protected attributes
  protected:
-  Dtype prob_;  // Probability to drop
+  Dtype    prob_;    // Probability to drop
+  uint64_t stream_;  // Random stream of the masks (see Philox)
+  uint32_t step_;    // Number of masks generated
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Copy the input to the output, unless the layer runs in place (the
+   * output then already is the input, see Model::Plan).
+   */
+  void Copy() {
+    if (Parent::out_[0]->Data() != Parent::in_[0]->Data()) {
+      Parent::out_[0]->data = Parent::in_[0]->data;
+    }
+  }
 
 
   // Public methods
@@ -75,8 +91,9 @@ class LayerDropout: public Layer<Dtype> {
     // Probability to drop
     param.Get("prob", &prob_);
 
-    // Create the mask and initialize it to 0
-    Parent::out_[1] = std::make_shared<Mat<Dtype>>(Parent::in_[0]->size);
+    // Each forward pass draws the next mask of the layer stream
+    stream_ = Philox::NewStream();
+    step_   = 0;
 
     // Create 2 outputs, same size as the input
     // The first input is the result of the dropout, the second is the mask
@@ -92,6 +109,36 @@ class LayerDropout: public Layer<Dtype> {
    */
   virtual ~LayerDropout() {}
 
+  /*!
+   * Set the memory layout of the activations (elementwise: any layout).
+   *
+   *  \param[in]  layout: layout
+   *
+   *  \return     Supported?
+   */
+  virtual bool SetLayout(Layout::E_LAYOUT layout) {
+    Parent::out_[0]->layout = layout;
+    return true;
+  }
+
+  /*!
+   * Check if the layer can run in place (see Model::Plan).
+   *
+   *  \return In place?
+   */
+  virtual bool InPlace() const {
+    return true;
+  }
+
+  /*!
+   * Check if the backward pass needs the values of the output.
+   *
+   *  \return Output needed?
+   */
+  virtual bool BackwardUsesOutput() const {
+    return false;
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -102,39 +149,42 @@ class LayerDropout: public Layer<Dtype> {
   virtual void Forward(const State& state) {
     if (state.phase != State::PHASE_TRAIN) {
       // Dropout only during the training phase
-      Parent::out_[0]->data = Parent::in_[0]->data;
+      Copy();
       return;
     }
 
     // out = mask * in
-    if (prob_ < std::numeric_limits<Dtype>::epsilon()) {
+    if (state.recompute) {
+      // Keep the mask of the first forward pass (see Model::Checkpoint)
+      Simd<Dtype>::Mult(Parent::out_[0]->Size(), Parent::out_[1]->Data(),
+                        Parent::in_[0]->Data(), Parent::out_[0]->Data());
+    } else if (prob_ < std::numeric_limits<Dtype>::epsilon()) {
       // Nothing to drop: just copy the input to the output
-      Parent::out_[0]->data = Parent::in_[0]->data;
+      Copy();
       Parent::out_[1]->Set(Dtype(1));
     } else if (prob_ > Dtype(1) - std::numeric_limits<Dtype>::epsilon()) {
       // Drop everything: zero out the data
       Parent::out_[0]->Zero();
       Parent::out_[1]->Zero();
     } else {
-      std::random_device rd;
-      std::mt19937 gen(rd());
-      std::uniform_real_distribution<Dtype> dist(Dtype(0), Dtype(1));
-
-      Dtype* mask_data = Parent::out_[1]->Data();
-      Dtype scale = Dtype(1) / (Dtype(1) - prob_);
-      for (uint32_t i = 0; i < Parent::out_[1]->Size(); ++i) {
-        if (dist(gen) < prob_) {
-          mask_data[i] = Dtype(0);
-        } else {
-          mask_data[i] = scale;
+      // A value is dropped if its 24 random bits are below the threshold
+      // (same as a uniform value in [0, 1) below the probability)
+      uint32_t threshold = uint32_t(prob_ * Dtype(16777216));
+      Dtype    scale     = Dtype(1) / (Dtype(1) - prob_);
+
+      Dtype*       mask_data = Parent::out_[1]->Data();
+      Dtype*       out_data  = Parent::out_[0]->Data();
+      const Dtype* in_data   = Parent::in_[0]->Data();
+      Philox::Generate(stream_, step_++, Parent::out_[1]->Size(),
+                       [=](uint32_t begin, uint32_t end,
+                           const uint32_t* value) {
+        Dtype* mask = mask_data + begin;
+        for (uint32_t i = 0; i < end - begin; ++i) {
+          mask[i] = ((value[i] >> 8) < threshold) ? Dtype(0) : scale;
         }
-      }
-
-      Dtype*       out_data = Parent::out_[0]->Data();
-      const Dtype* in_data  = Parent::in_[0]->Data();
-      for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-        out_data[i] = mask_data[i] * in_data[i];
-      }
+        Simd<Dtype>::Mult(end - begin, mask, in_data + begin,
+                          out_data + begin);
+      });
     }
   }
 
@@ -151,9 +201,8 @@ class LayerDropout: public Layer<Dtype> {
     Dtype*       in_deriv_data  = Parent::in_[0]->DerivData();
 
     // in_deriv = mask * out_deriv
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      in_deriv_data[i] += mask_data[i] * out_deriv_data[i];
-    }
+    Simd<Dtype>::MultAccumulate(Parent::out_[0]->Size(), mask_data,
+                                out_deriv_data, in_deriv_data);
   }
 };
 
@@ -29,6 +29,7 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/simd.h>
 #include <memory>
 #include <vector>
 
@@ -70,6 +71,15 @@ class LayerEltwiseMult: public Layer<Dtype> {
     Parent::out_[0] = std::make_shared<Mat<Dtype>>(Parent::in_[0]->size);
   }
 
+  /*!
+   * Check if the backward pass needs the values of the output.
+   *
+   *  \return Output needed?
+   */
+  virtual bool BackwardUsesOutput() const {
+    return false;
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -83,9 +93,7 @@ class LayerEltwiseMult: public Layer<Dtype> {
     const Dtype* in2_data = Parent::in_[1]->Data();
 
     // out = in1 . in2 ("." = Hadamard product)
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      out_data[i] = in1_data[i] * in2_data[i];
-    }
+    Simd<Dtype>::Mult(Parent::out_[0]->Size(), in1_data, in2_data, out_data);
   }
 
   /*!
@@ -104,11 +112,10 @@ class LayerEltwiseMult: public Layer<Dtype> {
 
     // in1_deriv = in2 * out_deriv
     // in2_deriv = in1 * out_deriv
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      Dtype dv           = out_deriv_data[i];
-      in1_deriv_data[i] += in2_data[i] * dv;
-      in2_deriv_data[i] += in1_data[i] * dv;
-    }
+    Simd<Dtype>::MultAccumulate(Parent::out_[0]->Size(), in2_data,
+                                out_deriv_data, in1_deriv_data);
+    Simd<Dtype>::MultAccumulate(Parent::out_[0]->Size(), in1_data,
+                                out_deriv_data, in2_deriv_data);
   }
 };
 
@@ -29,6 +29,7 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/simd.h>
 #include <memory>
 #include <vector>
 
@@ -85,6 +86,24 @@ class EltwiseScaleLayer: public Layer<Dtype> {
    */
   virtual ~EltwiseScaleLayer() {}
 
+  /*!
+   * Check if the layer can run in place (see Model::Plan).
+   *
+   *  \return In place?
+   */
+  virtual bool InPlace() const {
+    return true;
+  }
+
+  /*!
+   * Check if the backward pass needs the values of the output.
+   *
+   *  \return Output needed?
+   */
+  virtual bool BackwardUsesOutput() const {
+    return false;
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -97,9 +116,8 @@ class EltwiseScaleLayer: public Layer<Dtype> {
     const Dtype* in_data  = Parent::in_[0]->Data();
 
     // out = in * scale + bias
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      out_data[i] = in_data[i] * scale_ + bias_;
-    }
+    Simd<Dtype>::Scale(Parent::out_[0]->Size(), in_data, scale_, bias_,
+                       out_data);
   }
 
   /*!
@@ -114,9 +132,8 @@ class EltwiseScaleLayer: public Layer<Dtype> {
     Dtype*       in_deriv_data  = Parent::in_[0]->DerivData();
 
     // in_deriv = out_deriv * scale
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      in_deriv_data[i] += out_deriv_data[i] * scale_;
-    }
+    Simd<Dtype>::ScaleAccumulate(Parent::out_[0]->Size(), out_deriv_data,
+                                 scale_, in_deriv_data);
   }
 };
 
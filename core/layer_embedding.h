@@ -0,0 +1,163 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_LAYER_EMBEDDING_H_
+#define CORE_LAYER_EMBEDDING_H_
+
+
+#include <core/layer.h>
+#include <core/log.h>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  LayerEmbedding
+ *  \brief  Embedding lookup
+ *
+ * Equivalent to multiplying the table by a one-hot vector, without building
+ * the one-hot vector nor doing the multiplication:
+ *  + the first input is the table: size[0] is the embedding size and size[1]
+ *    the number of entries, each entry being stored contiguously
+ *  + the second input holds the index of the entry to look up for each batch
+ *    (size 1x1x1xb)
+ *  + the output gets the looked up entries (size[0]x1x1xb)
+ *
+ * The table derivative is sparse: the backward pass only accumulates into the
+ * rows looked up, recording them so the solvers only update these rows.
+ */
+template <typename Dtype>
+class LayerEmbedding: public Layer<Dtype> {
+  // Public types
+ public:
+  typedef Dtype         Type;
+  typedef Layer<Dtype>  Parent;
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  name: layer name
+   *  \param[in]  in  : input activations (table and indices)
+   */
+  LayerEmbedding(const char*                                     name,
+                 const std::vector<std::shared_ptr<Mat<Dtype>>>& in):
+    Parent(name, in) {
+    // Make sure we have 2 inputs: a table and an index per batch
+    Check(Parent::in_.size() == 2, "Layer '%s' must have 2 inputs",
+          Parent::Name());
+    Check(Parent::in_[0]->size[2] == 1 && Parent::in_[0]->size[3] == 1,
+          "Layer '%s' table must be 2D", Parent::Name());
+    Check(Parent::in_[1]->Size() == Parent::in_[1]->size[3],
+          "Layer '%s' must have 1 index per batch", Parent::Name());
+
+    // The table derivative only has the rows looked up
+    Parent::in_[0]->sparse = true;
+
+    // Create 1 output: an entry per batch
+    Parent::out_.resize(1);
+    Parent::out_[0] = std::make_shared<Mat<Dtype>>(Parent::in_[0]->size[0],
+                                                   1, 1,
+                                                   Parent::in_[1]->size[3]);
+  }
+
+  /*!
+   * Destructor.
+   */
+  virtual ~LayerEmbedding() {}
+
+  /*!
+   * Check if the backward pass needs the values of the output.
+   *
+   *  \return Output needed?
+   */
+  virtual bool BackwardUsesOutput() const {
+    return false;
+  }
+
+  /*!
+   * Forward pass.
+   * The forward pass calculates the outputs activations
+   * in regard to the inputs activations and weights.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Forward(const State& state) {
+    Dtype*       out_data   = Parent::out_[0]->Data();
+    const Dtype* table_data = Parent::in_[0]->Data();
+    const Dtype* index_data = Parent::in_[1]->Data();
+
+    // out[batch] = table[index[batch]]
+    uint32_t row_size   = Parent::in_[0]->size[0];
+    uint32_t batch_size = Parent::in_[1]->size[3];
+    for (uint32_t batch = 0; batch < batch_size; ++batch) {
+      uint32_t row = uint32_t(index_data[batch]);
+      std::memcpy(out_data + batch * row_size, table_data + row * row_size,
+                  row_size * sizeof(Dtype));
+    }
+  }
+
+  /*!
+   * Backward pass.
+   * The backward pass calculates the inputs activations and weights
+   * derivatives in regard to the outputs activations derivatives.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Backward(const State& state) {
+    const Dtype* out_deriv_data   = Parent::out_[0]->DerivData();
+    Dtype*       table_deriv_data = Parent::in_[0]->DerivData();
+    const Dtype* index_data       = Parent::in_[1]->Data();
+    if (!table_deriv_data) {
+      return;
+    }
+
+    // table_deriv[index[batch]] += out_deriv[batch]
+    uint32_t row_size   = Parent::in_[0]->size[0];
+    uint32_t batch_size = Parent::in_[1]->size[3];
+    for (uint32_t batch = 0; batch < batch_size; ++batch) {
+      uint32_t     row         = uint32_t(index_data[batch]);
+      const Dtype* out_deriv   = out_deriv_data   + batch * row_size;
+      Dtype*       table_deriv = table_deriv_data + row   * row_size;
+      for (uint32_t i = 0; i < row_size; ++i) {
+        table_deriv[i] += out_deriv[i];
+      }
+      Parent::in_[0]->AddDerivRow(row);
+    }
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_LAYER_EMBEDDING_H_
@@ -29,8 +29,11 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/gemm.h>
 #include <core/rand.h>
+#include <core/tuner.h>
 #include <memory>
+#include <string>
 #include <vector>
 #include <cmath>
 
@@ -41,6 +44,13 @@ namespace jik {
 /*!
  *  \class  LayerInnerProduct
  *  \brief  Inner Product (aka fully connected) layer
+ *
+ * The batch is multiplied at once (see Gemm), split across the threads along
+ * the batch or the outputs: the fastest split is selected for each shape,
+ * batch size and number of threads when the Tuner is enabled.
+ *
+ * Once pruned, the inference only goes through the blocks of the filter left
+ * (see SparseFilter), the groups of outputs being split across the threads.
  */
 template <typename Dtype>
 class LayerInnerProduct: public Layer<Dtype> {
@@ -50,6 +60,55 @@ class LayerInnerProduct: public Layer<Dtype> {
   typedef Layer<Dtype>  Parent;
 
 
+  // Protected attributes
+ protected:
+  Quantizer<Dtype> quant_;      // Quantizer (int8 inference)
+  SparseFilter<Dtype>
+                   sparse_;     // Pruned filter (sparse inference)
+  Fusion<Dtype>    fusion_;     // Fused layers (inference)
+  typename Gemm<Dtype>::E_SPLIT
+                   split_;      // Split of the forward pass across threads
+  std::string      tune_key_;   // Last tuned shape
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Select the fastest split of the forward pass across the threads for the
+   * current batch size and number of threads (see Tuner).
+   *
+   *  \param[in]  in_data    : inputs
+   *  \param[in]  filter_data: filter
+   *  \param[in]  num_batch  : batch size
+   *  \param[in]  num_in     : number of inputs
+   *  \param[in]  num_out    : number of outputs
+   *
+   *  \param[out] out_data   : outputs (without the bias)
+   */
+  void Tune(const Dtype* in_data, const Dtype* filter_data,
+            uint32_t num_batch, uint32_t num_in, uint32_t num_out,
+            Dtype* out_data) {
+    std::string key = "ip" + std::to_string(8 * sizeof(Dtype)) + " in " +
+                      std::to_string(num_in) + "x" +
+                      std::to_string(num_batch) + " out " +
+                      std::to_string(num_out) + " threads " +
+                      std::to_string(ThreadPool::Get().NumThread());
+    if (key == tune_key_) {
+      return;
+    }
+    tune_key_ = key;
+
+    const typename Gemm<Dtype>::E_SPLIT split[] = {Gemm<Dtype>::SPLIT_ROW,
+                                                   Gemm<Dtype>::SPLIT_COL};
+    split_ = split[Tuner::Get().Tune(key, {"batch", "output"},
+                                     [&](uint32_t i) {
+      Gemm<Dtype>::Run(false, true, num_batch, num_out, num_in,
+                       Dtype(1), in_data, num_in, filter_data, num_in,
+                       Dtype(0), out_data, num_out, split[i]);
+    })];
+  }
+
+
   // Public methods
  public:
   /*!
@@ -93,6 +152,12 @@ class LayerInnerProduct: public Layer<Dtype> {
     Parent::out_.resize(1);
     Parent::out_[0] = std::make_shared<Mat<Dtype>>(
       1, 1, num_output, Parent::in_[0]->size[3]);
+
+    // The filter can be quantized (one scale per output) or pruned
+    quant_.SetFilter(Parent::weight_[0], num_output);
+    sparse_.SetFilter(Parent::weight_[0], num_output);
+
+    split_ = Gemm<Dtype>::SPLIT_AUTO;
   }
 
   /*!
@@ -100,6 +165,67 @@ class LayerInnerProduct: public Layer<Dtype> {
    */
   virtual ~LayerInnerProduct() {}
 
+  /*!
+   * Check if the backward pass needs the values of the output.
+   *
+   *  \return Output needed?
+   */
+  virtual bool BackwardUsesOutput() const {
+    return false;
+  }
+
+  /*!
+   * Get the quantizer of the layer.
+   *
+   *  \return Quantizer
+   */
+  virtual Quantizer<Dtype>* GetQuantizer() {
+    return &quant_;
+  }
+
+  /*!
+   * Get the pruned filter of the layer.
+   *
+   *  \return Sparse filter
+   */
+  virtual SparseFilter<Dtype>* GetSparse() {
+    return &sparse_;
+  }
+
+  /*!
+   * The weights were changed outside of a training step.
+   */
+  virtual void WeightChanged() {
+    sparse_.WeightChanged();
+  }
+
+  /*!
+   * Start fusing the following layers into this one, for inference (see
+   * Fusion).
+   *
+   *  \return Fusion, starting with the bias
+   */
+  virtual Fusion<Dtype>* Fuse() {
+    fusion_.Reset(Parent::out_[0]->size[2], (Parent::weight_.size() > 1) ?
+                  Parent::weight_[1]->Data() : nullptr);
+    return &fusion_;
+  }
+
+  /*!
+   * Estimate the number of floating point operations of the forward pass.
+   *
+   *  \return Number of operations
+   */
+  virtual uint64_t Flop() const {
+    // Each block left of a pruned filter is applied to each input row
+    if (sparse_.Active()) {
+      return 2 * uint64_t(Parent::in_[0]->size[3]) * sparse_.NumBlock() *
+             SparseFilter<Dtype>::kBlock;
+    }
+    // Each output value is a dot product over the inputs
+    return 2 * Parent::NumValue(Parent::out_) * Parent::weight_[0]->size[0];
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -108,7 +234,11 @@ class LayerInnerProduct: public Layer<Dtype> {
    *  \param[in]  state: state
    */
   virtual void Forward(const State& state) {
-    Dtype*       out_data    = Parent::out_[0]->Data();
+    // Inference with the following layers fused (see Fusion)
+    bool fused = fusion_.Active() && state.phase == State::PHASE_TEST;
+
+    Dtype*       out_data    = fused ? fusion_.Out()->Data() :
+                               Parent::out_[0]->Data();
     const Dtype* in_data     = Parent::in_[0]->Data();
     const Dtype* filter_data = Parent::weight_[0]->Data();
     const Dtype* bias_data   = (Parent::weight_.size() > 1) ?
@@ -118,19 +248,51 @@ class LayerInnerProduct: public Layer<Dtype> {
     uint32_t num_in    = Parent::weight_[0]->size[0];
     uint32_t num_batch = Parent::in_[0]->size[3];
 
-    // out = filter * in + bias
-    for (uint32_t batch = 0; batch < num_batch; ++batch) {
-      uint32_t in_offset  = num_in * batch;
-      uint32_t out_offset = num_out * batch;
-      for (uint32_t i = 0; i < num_out; ++i) {
-        Dtype ip = Dtype(0);
-        for (uint32_t j = 0; j < num_in; ++j) {
-          uint32_t filter_index = num_in * i + j;
-          ip += in_data[in_offset + j] * filter_data[filter_index];
-        }
-        out_data[out_offset + i] = ip;
-        if (bias_data) {
-          out_data[out_offset + i] += bias_data[i];
+    if (quant_.Mode() == Quantizer<Dtype>::MODE_CALIBRATE) {
+      quant_.Calibrate(in_data, num_batch * num_in);
+    }
+
+    // out = in * filter^T + bias
+    // The batch is processed at once: in is a num_batch*num_in matrix
+    if (quant_.Mode() == Quantizer<Dtype>::MODE_INT8 &&
+        state.phase == State::PHASE_TEST) {
+      // int8 inference, the batch being split across the threads
+      quant_.SetNumChunk(ThreadPool::Get().NumThread());
+      ParallelFor(0, num_batch, [&](uint32_t batch_start, uint32_t batch_end,
+                                    uint32_t chunk) {
+        quant_.ForwardRow(batch_end - batch_start,
+                          in_data + num_in * batch_start, chunk,
+                          out_data + num_out * batch_start);
+      });
+    } else if (sparse_.Active() && state.phase == State::PHASE_TEST) {
+      // Sparse inference, the groups of outputs being split across the
+      // threads
+      if (!sparse_.Packed()) {
+        sparse_.Pack();
+      }
+      ParallelFor(0, sparse_.NumGroup(), [&](uint32_t group_start,
+                                             uint32_t group_end, uint32_t) {
+        sparse_.ForwardRow(group_start, group_end, num_batch, in_data,
+                           out_data);
+      });
+    } else {
+      // Fastest split across the threads (see Tuner)
+      if (Tuner::Get().Enabled() && Gemm<Dtype>::Split(num_batch, num_out,
+                                                      num_in)) {
+        Tune(in_data, filter_data, num_batch, num_in, num_out, out_data);
+      }
+      Gemm<Dtype>::Run(false, true, num_batch, num_out, num_in,
+                       Dtype(1), in_data, num_in, filter_data, num_in,
+                       Dtype(0), out_data, num_out, split_);
+    }
+    if (fused) {
+      // The bias is part of the fused transform
+      fusion_.Apply(1, 0, num_batch, out_data, out_data);
+    } else if (bias_data) {
+      for (uint32_t batch = 0; batch < num_batch; ++batch) {
+        Dtype* out_batch_data = out_data + num_out * batch;
+        for (uint32_t i = 0; i < num_out; ++i) {
+          out_batch_data[i] += bias_data[i];
         }
       }
     }
@@ -156,21 +318,22 @@ class LayerInnerProduct: public Layer<Dtype> {
     uint32_t num_in    = Parent::weight_[0]->size[0];
     uint32_t num_batch = Parent::in_[0]->size[3];
 
-    // in_deriv     = filter * out_deriv
-    // filter_deriv = in * out_deriv
+    // in_deriv     = out_deriv * filter
+    // filter_deriv = out_deriv^T * in
     // bias_deriv   = out_deriv
-    for (uint32_t batch = 0; batch < num_batch; ++batch) {
-      uint32_t in_offset  = num_in  * batch;
-      uint32_t out_offset = num_out * batch;
-      for (uint32_t i = 0; i < num_out; ++i) {
-        Dtype dv = out_deriv_data[out_offset + i];
-        for (uint32_t j = 0; j < num_in; ++j) {
-          uint32_t filter_index            = num_in * i + j;
-          in_deriv_data[in_offset + j]    += dv * filter_data[filter_index];
-          filter_deriv_data[filter_index] += dv * in_data[in_offset + j];
-        }
-        if (bias_deriv_data) {
-          bias_deriv_data[i] += dv;
+    if (in_deriv_data) {
+      Gemm<Dtype>::Run(false, false, num_batch, num_in, num_out,
+                       Dtype(1), out_deriv_data, num_out, filter_data, num_in,
+                       Dtype(1), in_deriv_data, num_in);
+    }
+    Gemm<Dtype>::Run(true, false, num_out, num_in, num_batch,
+                     Dtype(1), out_deriv_data, num_out, in_data, num_in,
+                     Dtype(1), filter_deriv_data, num_in);
+    if (bias_deriv_data) {
+      for (uint32_t batch = 0; batch < num_batch; ++batch) {
+        const Dtype* out_deriv_batch_data = out_deriv_data + num_out * batch;
+        for (uint32_t i = 0; i < num_out; ++i) {
+          bias_deriv_data[i] += out_deriv_batch_data[i];
         }
       }
     }
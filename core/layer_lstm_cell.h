@@ -0,0 +1,452 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_LAYER_LSTM_CELL_H_
+#define CORE_LAYER_LSTM_CELL_H_
+
+
+#include <core/half.h>
+#include <core/layer.h>
+#include <core/log.h>
+#include <core/gemm.h>
+#include <core/simd.h>
+#include <core/thread_pool.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  LayerLstmCell
+ *  \brief  Fused LSTM cell
+ *
+ * One step of a LSTM cell in a single layer. The inputs are the input vector
+ * x (X), the previous hidden state h (H), the previous cell state c (H), the
+ * gates weights W (4H x (X + H)) and the gates bias b (4H). The outputs are
+ * the new hidden state and the new cell state. The weights and bias are
+ * shared by all the batches (batch size of 1).
+ *
+ * The 4 gates (input, forget, output, cell write) of all the batches are
+ * computed with one matrix multiplication over the concatenated [x, h]
+ * vectors:
+ *   [i, f, o, g] = W * [x, h] + b
+ *   i, f, o      = sigmoid(i, f, o)
+ *   g            = tanh(g)
+ *   c'           = f * c + i * g
+ *   h'           = o * tanh(c')
+ * All the element-wise operations are done in one pass, forward and backward.
+ *
+ * In 16-bit precision (see SetPrecision), [x, h], the gates and tanh(c') are
+ * kept for the backward pass in bf16 or fp16, and only expanded to Dtype in
+ * a per-thread scratch shared by all the cells (e.g. all the steps of an
+ * unrolled model) while a cell runs. The derivatives live in that scratch.
+ */
+template <typename Dtype>
+class LayerLstmCell: public Layer<Dtype> {
+  // Public types
+ public:
+  typedef Dtype         Type;
+  typedef Layer<Dtype>  Parent;
+
+
+  // Protected attributes
+ protected:
+  std::shared_ptr<Mat<Dtype>> xh_;     // Concatenated [x, h] (+ derivative)
+  std::shared_ptr<Mat<Dtype>> gate_;   // Activated gates (+ derivative)
+  std::shared_ptr<Mat<Dtype>> tanhc_;  // tanh(c')
+  Half::E_FORMAT              precision_;  // Storage of [x, h], gates, tanhc
+  Buffer<uint16_t>            xh16_;       // 16-bit [x, h]
+  Buffer<uint16_t>            gate16_;     // 16-bit activated gates
+  Buffer<uint16_t>            tanhc16_;    // 16-bit tanh(c')
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Get a scratch buffer of the current thread, shared by all the cells.
+   *
+   *  \param[in]  index: buffer index
+   *  \param[in]  size : number of values
+   *
+   *  \return     Buffer data
+   */
+  static Dtype* Scratch(size_t index, size_t size) {
+    static thread_local std::vector<Dtype> scratch[5];
+    if (scratch[index].size() < size) {
+      scratch[index].resize(size);
+    }
+    return scratch[index].data();
+  }
+
+  /*!
+   * Create the intermediate activations in Dtype.
+   */
+  void CreateIntermediate() {
+    uint32_t xh_size    = Parent::in_[0]->size[0] + Parent::in_[1]->size[0];
+    uint32_t h_size     = Parent::in_[1]->size[0];
+    uint32_t batch_size = Parent::in_[0]->size[3];
+    xh_    = std::make_shared<Mat<Dtype>>(xh_size, 1, 1, batch_size);
+    gate_  = std::make_shared<Mat<Dtype>>(4 * h_size, 1, 1, batch_size);
+    tanhc_ = std::make_shared<Mat<Dtype>>(h_size, 1, 1, batch_size, false);
+  }
+
+  /*!
+   * Gates activations and cell update on a range of batches.
+   *
+   *  \param[in]  gate_data  : gates (before activation)
+   *  \param[in]  batch_start: first batch
+   *  \param[in]  batch_end  : last batch (excluded)
+   *
+   *  \param[out] gate_data  : activated gates
+   *  \param[out] tanhc_data : tanh(c')
+   */
+  void ForwardGates(Dtype* gate_data, Dtype* tanhc_data,
+                    uint32_t batch_start, uint32_t batch_end) {
+    const Dtype* c_data     = Parent::in_[2]->Data();
+    Dtype*       h_out_data = Parent::out_[0]->Data();
+    Dtype*       c_out_data = Parent::out_[1]->Data();
+
+    uint32_t h_size = Parent::in_[1]->size[0];
+
+    for (uint32_t batch = batch_start; batch < batch_end; ++batch) {
+      const Dtype* c      = c_data     + batch * h_size;
+      Dtype*       h_out  = h_out_data + batch * h_size;
+      Dtype*       c_out  = c_out_data + batch * h_size;
+      Dtype*       tanhc  = tanhc_data + batch * h_size;
+      Dtype*       gate_i = gate_data  + batch * 4 * h_size;
+      Dtype*       gate_f = gate_i + h_size;
+      Dtype*       gate_o = gate_f + h_size;
+      Dtype*       gate_g = gate_o + h_size;
+      // The i, f and o gates are contiguous
+      Simd<Dtype>::Sigmoid(3 * h_size, gate_i, gate_i);
+      Simd<Dtype>::Tanh(h_size, gate_g, gate_g);
+      Simd<Dtype>::Mult(h_size, gate_f, c, c_out);
+      Simd<Dtype>::MultAccumulate(h_size, gate_i, gate_g, c_out);
+      Simd<Dtype>::Tanh(h_size, c_out, tanhc);
+      Simd<Dtype>::Mult(h_size, gate_o, tanhc, h_out);
+    }
+
+    // Keep the values needed by the backward pass
+    if (precision_ != Half::FORMAT_FP32) {
+      size_t offset = size_t(batch_start) * h_size;
+      size_t size   = size_t(batch_end - batch_start) * h_size;
+      Half::Pack(precision_, 4 * size, gate_data + 4 * offset,
+                 gate16_.data() + 4 * offset);
+      Half::Pack(precision_, size, tanhc_data + offset,
+                 tanhc16_.data() + offset);
+    }
+  }
+
+  /*!
+   * Gates derivatives (before activation) and previous cell state
+   * derivatives on a range of batches.
+   *
+   *  \param[in]  gate_data  : activated gates
+   *  \param[in]  tanhc_data : tanh(c')
+   *  \param[in]  batch_start: first batch
+   *  \param[in]  batch_end  : last batch (excluded)
+   *
+   *  \param[out] dgate_data : gates derivatives
+   */
+  void BackwardGates(Dtype* gate_data, Dtype* tanhc_data, Dtype* dgate_data,
+                     uint32_t batch_start, uint32_t batch_end) {
+    const Dtype* c_data       = Parent::in_[2]->Data();
+    const Dtype* h_out_deriv  = Parent::out_[0]->DerivData();
+    const Dtype* c_out_deriv  = Parent::out_[1]->DerivData();
+    Dtype*       c_deriv_data = Parent::in_[2]->DerivData();
+
+    uint32_t h_size = Parent::in_[1]->size[0];
+
+    // Expand the values kept by the forward pass
+    if (precision_ != Half::FORMAT_FP32) {
+      size_t offset = size_t(batch_start) * h_size;
+      size_t size   = size_t(batch_end - batch_start) * h_size;
+      Half::Unpack(precision_, 4 * size, gate16_.data() + 4 * offset,
+                   gate_data + 4 * offset);
+      Half::Unpack(precision_, size, tanhc16_.data() + offset,
+                   tanhc_data + offset);
+    }
+
+    for (uint32_t batch = batch_start; batch < batch_end; ++batch) {
+      const Dtype* c      = c_data      + batch * h_size;
+      const Dtype* dh_out = h_out_deriv + batch * h_size;
+      const Dtype* dc_out = c_out_deriv + batch * h_size;
+      const Dtype* tanhc  = tanhc_data  + batch * h_size;
+      const Dtype* gate_i = gate_data   + batch * 4 * h_size;
+      const Dtype* gate_f = gate_i + h_size;
+      const Dtype* gate_o = gate_f + h_size;
+      const Dtype* gate_g = gate_o + h_size;
+      Dtype*       dgate  = dgate_data  + batch * 4 * h_size;
+      Dtype*       dc     = c_deriv_data ? c_deriv_data + batch * h_size :
+                                           nullptr;
+      for (uint32_t i = 0; i < h_size; ++i) {
+        // dc' = dc' + dh' * o * (1 - tanh(c')^2)
+        Dtype dcell = dc_out[i] + dh_out[i] * gate_o[i] *
+                      (Dtype(1) - tanhc[i] * tanhc[i]);
+        Dtype di    = dcell * gate_g[i];
+        Dtype df    = dcell * c[i];
+        Dtype d_o   = dh_out[i] * tanhc[i];
+        Dtype dg    = dcell * gate_i[i];
+        dgate[i]              = di  * gate_i[i] * (Dtype(1) - gate_i[i]);
+        dgate[h_size + i]     = df  * gate_f[i] * (Dtype(1) - gate_f[i]);
+        dgate[2 * h_size + i] = d_o * gate_o[i] * (Dtype(1) - gate_o[i]);
+        dgate[3 * h_size + i] = dg  * (Dtype(1) - gate_g[i] * gate_g[i]);
+        if (dc) {
+          dc[i] += dcell * gate_f[i];
+        }
+      }
+    }
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  name: layer name
+   *  \param[in]  in  : input vector, previous hidden state, previous cell
+   *                    state, gates weights and gates bias
+   */
+  LayerLstmCell(const char*                                     name,
+                const std::vector<std::shared_ptr<Mat<Dtype>>>& in):
+    Parent(name, in) {
+    // Make sure we have 5 inputs and they have compatible sizes
+    Check(Parent::in_.size() == 5, "Layer '%s' must have 5 inputs",
+          Parent::Name());
+    uint32_t x_size     = Parent::in_[0]->size[0];
+    uint32_t h_size     = Parent::in_[1]->size[0];
+    uint32_t batch_size = Parent::in_[0]->size[3];
+    for (size_t i = 0; i < Parent::in_.size(); ++i) {
+      Check(Parent::in_[i]->size[2] == 1 &&
+            Parent::in_[i]->size[3] == (i < 3 ? batch_size : 1),
+            "Layer '%s' inputs must have compatible sizes", Parent::Name());
+    }
+    Check(Parent::in_[0]->size[1] == 1 && Parent::in_[1]->size[1] == 1 &&
+          Parent::in_[2]->size[0] == h_size &&
+          Parent::in_[2]->size[1] == 1 &&
+          Parent::in_[3]->size[0] == 4 * h_size &&
+          Parent::in_[3]->size[1] == x_size + h_size &&
+          Parent::in_[4]->size[0] == 4 * h_size &&
+          Parent::in_[4]->size[1] == 1,
+          "Layer '%s' inputs must have compatible sizes", Parent::Name());
+
+    // Create 2 outputs: the new hidden state and the new cell state
+    Parent::out_.resize(2);
+    Parent::out_[0] = std::make_shared<Mat<Dtype>>(Parent::in_[1]->size);
+    Parent::out_[1] = std::make_shared<Mat<Dtype>>(Parent::in_[2]->size);
+
+    // Intermediate activations used by the backward pass
+    precision_ = Half::FORMAT_FP32;
+    CreateIntermediate();
+  }
+
+  /*!
+   * Destructor.
+   */
+  virtual ~LayerLstmCell() {}
+
+  /*!
+   * Set the precision of [x, h], the gates and tanh(c') kept for the
+   * backward pass.
+   *
+   *  \param[in]  format: storage format
+   *
+   *  \return     Supported?
+   */
+  virtual bool SetPrecision(Half::E_FORMAT format) {
+    if (format == precision_) {
+      return true;
+    }
+    precision_ = format;
+    if (format == Half::FORMAT_FP32) {
+      xh16_.clear();
+      gate16_.clear();
+      tanhc16_.clear();
+      CreateIntermediate();
+      return true;
+    }
+    size_t h_size     = Parent::in_[1]->size[0];
+    size_t batch_size = Parent::in_[0]->size[3];
+    xh16_.resize((Parent::in_[0]->size[0] + h_size) * batch_size);
+    gate16_.resize(4 * h_size * batch_size);
+    tanhc16_.resize(h_size * batch_size);
+    xh_.reset();
+    gate_.reset();
+    tanhc_.reset();
+    return true;
+  }
+
+  /*!
+   * Estimate the number of floating point operations of the forward pass.
+   *
+   *  \return Number of operations
+   */
+  virtual uint64_t Flop() const {
+    // The gates matrix multiplication dominates: [x, h] * W^T
+    uint64_t xh_size = Parent::in_[0]->size[0] + Parent::in_[1]->size[0];
+    return 2 * uint64_t(Parent::out_[0]->size[3]) * 4 *
+           Parent::in_[1]->size[0] * xh_size;
+  }
+
+  /*!
+   * Forward pass.
+   * The forward pass calculates the outputs activations
+   * in regard to the inputs activations and weights.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Forward(const State& state) {
+    const Dtype* x_data    = Parent::in_[0]->Data();
+    const Dtype* h_data    = Parent::in_[1]->Data();
+    const Dtype* w_data    = Parent::in_[3]->Data();
+    const Dtype* b_data    = Parent::in_[4]->Data();
+
+    uint32_t x_size     = Parent::in_[0]->size[0];
+    uint32_t h_size     = Parent::in_[1]->size[0];
+    uint32_t xh_size    = x_size + h_size;
+    uint32_t batch_size = Parent::out_[0]->size[3];
+
+    bool   half       = precision_ != Half::FORMAT_FP32;
+    Dtype* xh_data    = half ? Scratch(0, xh_size * batch_size) :
+                               xh_->Data();
+    Dtype* gate_data  = half ? Scratch(1, 4 * h_size * batch_size) :
+                               gate_->Data();
+    Dtype* tanhc_data = half ? Scratch(2, h_size * batch_size) :
+                               tanhc_->Data();
+
+    // Concatenate [x, h] and start the gates from the bias
+    for (uint32_t batch = 0; batch < batch_size; ++batch) {
+      const Dtype* x  = x_data  + batch * x_size;
+      const Dtype* h  = h_data  + batch * h_size;
+      Dtype*       xh = xh_data + batch * xh_size;
+      std::copy(x, x + x_size, xh);
+      std::copy(h, h + h_size, xh + x_size);
+      std::copy(b_data, b_data + 4 * h_size, gate_data + batch * 4 * h_size);
+    }
+
+    // All the batches at once: gate^T += [x, h]^T * W^T
+    Gemm<Dtype>::Run(false, true, batch_size, 4 * h_size, xh_size,
+                     Dtype(1), xh_data, xh_size, w_data, xh_size,
+                     Dtype(1), gate_data, 4 * h_size);
+    if (half) {
+      Half::Pack(precision_, xh_size * batch_size, xh_data, xh16_.data());
+    }
+
+    ParallelFor(0, batch_size,
+                [this, gate_data, tanhc_data](uint32_t batch_start,
+                                              uint32_t batch_end, uint32_t) {
+      ForwardGates(gate_data, tanhc_data, batch_start, batch_end);
+    });
+  }
+
+  /*!
+   * Backward pass.
+   * The backward pass calculates the inputs activations and weights
+   * derivatives in regard to the outputs activations derivatives.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Backward(const State& state) {
+    const Dtype* w_data        = Parent::in_[3]->Data();
+    Dtype*       x_deriv_data  = Parent::in_[0]->DerivData();
+    Dtype*       h_deriv_data  = Parent::in_[1]->DerivData();
+    Dtype*       w_deriv_data  = Parent::in_[3]->DerivData();
+    Dtype*       b_deriv_data  = Parent::in_[4]->DerivData();
+
+    uint32_t x_size     = Parent::in_[0]->size[0];
+    uint32_t h_size     = Parent::in_[1]->size[0];
+    uint32_t xh_size    = x_size + h_size;
+    uint32_t batch_size = Parent::out_[0]->size[3];
+
+    bool   half          = precision_ != Half::FORMAT_FP32;
+    Dtype* gate_data     = half ? Scratch(1, 4 * h_size * batch_size) :
+                                  gate_->Data();
+    Dtype* tanhc_data    = half ? Scratch(2, h_size * batch_size) :
+                                  tanhc_->Data();
+    Dtype* dgate_data    = half ? Scratch(3, 4 * h_size * batch_size) :
+                                  gate_->DerivData();
+    Dtype* xh_deriv_data = half ? Scratch(4, xh_size * batch_size) :
+                                  xh_->DerivData();
+
+    ParallelFor(0, batch_size,
+                [this, gate_data, tanhc_data, dgate_data](
+                  uint32_t batch_start, uint32_t batch_end, uint32_t) {
+      BackwardGates(gate_data, tanhc_data, dgate_data, batch_start,
+                    batch_end);
+    });
+
+    // b_deriv += sum(gate_deriv)
+    if (b_deriv_data) {
+      for (uint32_t batch = 0; batch < batch_size; ++batch) {
+        const Dtype* dgate = dgate_data + batch * 4 * h_size;
+        for (uint32_t i = 0; i < 4 * h_size; ++i) {
+          b_deriv_data[i] += dgate[i];
+        }
+      }
+    }
+
+    // W_deriv += gate_deriv * [x, h]^T
+    if (w_deriv_data) {
+      Dtype* xh_data = half ? Scratch(0, xh_size * batch_size) : xh_->Data();
+      if (half) {
+        Half::Unpack(precision_, xh_size * batch_size, xh16_.data(), xh_data);
+      }
+      Gemm<Dtype>::Run(true, false, 4 * h_size, xh_size, batch_size,
+                       Dtype(1), dgate_data, 4 * h_size, xh_data, xh_size,
+                       Dtype(1), w_deriv_data, xh_size);
+    }
+
+    // [x, h]_deriv^T = gate_deriv^T * W
+    Gemm<Dtype>::Run(false, false, batch_size, xh_size, 4 * h_size,
+                     Dtype(1), dgate_data, 4 * h_size, w_data, xh_size,
+                     Dtype(0), xh_deriv_data, xh_size);
+    for (uint32_t batch = 0; batch < batch_size; ++batch) {
+      const Dtype* dxh = xh_deriv_data + batch * xh_size;
+      if (x_deriv_data) {
+        Dtype* dx = x_deriv_data + batch * x_size;
+        for (uint32_t i = 0; i < x_size; ++i) {
+          dx[i] += dxh[i];
+        }
+      }
+      if (h_deriv_data) {
+        Dtype* dh = h_deriv_data + batch * h_size;
+        for (uint32_t i = 0; i < h_size; ++i) {
+          dh[i] += dxh[x_size + i];
+        }
+      }
+    }
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_LAYER_LSTM_CELL_H_
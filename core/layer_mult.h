@@ -29,6 +29,7 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/gemm.h>
 #include <memory>
 #include <vector>
 
@@ -39,6 +40,10 @@ namespace jik {
 /*!
  *  \class  LayerMult
  *  \brief  Matrices multiplication
+ *
+ * The first input can be shared by all the batches (batch size of 1), e.g.
+ * weights stored once. If the second input is a vector, all the batches are
+ * then multiplied at once.
  */
 template <typename Dtype>
 class LayerMult: public Layer<Dtype> {
@@ -64,14 +69,43 @@ class LayerMult: public Layer<Dtype> {
           Parent::Name());
     Check(Parent::in_[0]->size[1] == Parent::in_[1]->size[0] &&
           Parent::in_[0]->size[2] == Parent::in_[1]->size[2] &&
-          Parent::in_[0]->size[3] == Parent::in_[1]->size[3],
+          (Parent::in_[0]->size[3] == Parent::in_[1]->size[3] ||
+           Parent::in_[0]->size[3] == 1),
           "Layer '%s' inputs must have compatible sizes", Parent::Name());
 
     // Create 1 output
     Parent::out_.resize(1);
     Parent::out_[0] = std::make_shared<Mat<Dtype>>(
       Parent::in_[0]->size[0], Parent::in_[1]->size[1],
-      Parent::in_[0]->size[2], Parent::in_[0]->size[3]);
+      Parent::in_[0]->size[2], Parent::in_[1]->size[3]);
+  }
+
+  /*!
+   * Check if the first input is shared by all the batches.
+   *
+   *  \return Shared?
+   */
+  bool Shared() const {
+    return Parent::in_[0]->size[3] == 1 && Parent::out_[0]->size[3] > 1;
+  }
+
+  /*!
+   * Check if the backward pass needs the values of the output.
+   *
+   *  \return Output needed?
+   */
+  virtual bool BackwardUsesOutput() const {
+    return false;
+  }
+
+  /*!
+   * Estimate the number of floating point operations of the forward pass.
+   *
+   *  \return Number of operations
+   */
+  virtual uint64_t Flop() const {
+    // Each output value is a dot product over a row of the first input
+    return 2 * Parent::NumValue(Parent::out_) * Parent::in_[1]->size[0];
   }
 
   /*!
@@ -97,23 +131,29 @@ class LayerMult: public Layer<Dtype> {
     uint32_t num_channel = Parent::out_[0]->size[2];
     uint32_t batch_size  = Parent::out_[0]->size[3];
 
+    bool shared = Shared();
+    if (shared && n == 1) {
+      // All the batches at once: out^T = in2^T * in1^T
+      for (uint32_t channel = 0; channel < num_channel; ++channel) {
+        Gemm<Dtype>::Run(false, true, batch_size, m, k,
+                         Dtype(1), in2_data + channel * in2_size,
+                         num_channel * in2_size,
+                         in1_data + channel * in1_size, k,
+                         Dtype(0), out_data + channel * out_size,
+                         num_channel * out_size);
+      }
+      return;
+    }
+
     // out = in1 * in2
     for (uint32_t batch = 0; batch < batch_size; ++batch) {
       for (uint32_t channel = 0; channel < num_channel; ++channel) {
         uint32_t offset     = channel + num_channel * batch;
-        uint32_t in1_offset = offset * in1_size;
-        uint32_t in2_offset = offset * in2_size;
-        uint32_t out_offset = offset * out_size;
-        for (uint32_t i = 0, ia = 0, ic = 0; i < m; ++i, ia += k, ic += n) {
-          for (uint32_t j = 0, jb = 0, jc = 0; j < n; ++j, ++jb, ++jc) {
-            uint32_t index  = out_offset + jc + ic;
-            out_data[index] = Dtype(0);
-            for (uint32_t l = 0, la = 0, lb = 0; l < k; ++l, ++la, lb += n) {
-              out_data[index] += in1_data[in1_offset + la + ia] *
-                                 in2_data[in2_offset + lb + jb];
-            }
-          }
-        }
+        uint32_t in1_offset = shared ? channel : offset;
+        Gemm<Dtype>::Run(false, false, m, n, k,
+                         Dtype(1), in1_data + in1_offset * in1_size, k,
+                         in2_data + offset * in2_size, n,
+                         Dtype(0), out_data + offset * out_size, n);
       }
     }
   }
@@ -143,24 +183,53 @@ class LayerMult: public Layer<Dtype> {
     uint32_t num_channel = Parent::out_[0]->size[2];
     uint32_t batch_size  = Parent::out_[0]->size[3];
 
-    // in1_deriv = in2 * out_deriv
-    // in2_deriv = in1 * out_deriv
+    bool shared = Shared();
+    if (shared && n == 1) {
+      // All the batches at once:
+      // in1_deriv   = out_deriv^T * in2^T
+      // in2_deriv^T = out_deriv^T * in1
+      for (uint32_t channel = 0; channel < num_channel; ++channel) {
+        uint32_t in1_offset = channel * in1_size;
+        uint32_t in2_offset = channel * in2_size;
+        uint32_t out_offset = channel * out_size;
+        if (in1_deriv_data) {
+          Gemm<Dtype>::Run(true, false, m, k, batch_size,
+                           Dtype(1), out_deriv_data + out_offset,
+                           num_channel * out_size,
+                           in2_data + in2_offset, num_channel * in2_size,
+                           Dtype(1), in1_deriv_data + in1_offset, k);
+        }
+        if (in2_deriv_data) {
+          Gemm<Dtype>::Run(false, false, batch_size, k, m,
+                           Dtype(1), out_deriv_data + out_offset,
+                           num_channel * out_size,
+                           in1_data + in1_offset, k,
+                           Dtype(1), in2_deriv_data + in2_offset,
+                           num_channel * in2_size);
+        }
+      }
+      return;
+    }
+
+    // in1_deriv = out_deriv * in2^T
+    // in2_deriv = in1^T * out_deriv
     for (uint32_t batch = 0; batch < batch_size; ++batch) {
       for (uint32_t channel = 0; channel < num_channel; ++channel) {
         uint32_t offset     = channel + num_channel * batch;
-        uint32_t in1_offset = offset * in1_size;
+        uint32_t in1_offset = (shared ? channel : offset) * in1_size;
         uint32_t in2_offset = offset * in2_size;
         uint32_t out_offset = offset * out_size;
-        for (uint32_t i = 0; i < m; ++i) {
-          for (uint32_t j = 0; j < n; ++j) {
-            Dtype dv = out_deriv_data[out_offset + n * i + j];
-            for (uint32_t l = 0; l < k; ++l) {
-              uint32_t i1 = in1_offset + k * i + l;
-              uint32_t i2 = in2_offset + n * l + j;
-              in1_deriv_data[i1] += in2_data[i2] * dv;
-              in2_deriv_data[i2] += in1_data[i1] * dv;
-            }
-          }
+        if (in1_deriv_data) {
+          Gemm<Dtype>::Run(false, true, m, k, n,
+                           Dtype(1), out_deriv_data + out_offset, n,
+                           in2_data + in2_offset, n,
+                           Dtype(1), in1_deriv_data + in1_offset, k);
+        }
+        if (in2_deriv_data) {
+          Gemm<Dtype>::Run(true, false, k, n, m,
+                           Dtype(1), in1_data + in1_offset, k,
+                           out_deriv_data + out_offset, n,
+                           Dtype(1), in2_deriv_data + in2_offset, n);
         }
       }
     }
@@ -29,6 +29,7 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <algorithm>
 #include <memory>
 #include <vector>
 
@@ -58,6 +59,10 @@ class LayerPool: public Layer<Dtype> {
   uint32_t stride_y_;       // Column stride
   uint32_t out_width_;      // Output width
   uint32_t out_height_;     // Output height
+  uint32_t inner_x_begin_;  // First output column with its window inside
+  uint32_t inner_x_end_;    // Last output column with its window inside
+  uint32_t inner_y_begin_;  // First output row with its window inside
+  uint32_t inner_y_end_;    // Last output row with its window inside
 
 
   // Public methods
@@ -91,6 +96,12 @@ class LayerPool: public Layer<Dtype> {
     out_height_ = (Parent::in_[0]->size[1] + 2 * padding_y_ - filter_height_) /
                   stride_y_ + 1;
 
+    // Outputs having their whole window inside the input (no bound check)
+    Inner(Parent::in_[0]->size[0], filter_width_, padding_x_, stride_x_,
+          out_width_, &inner_x_begin_, &inner_x_end_);
+    Inner(Parent::in_[0]->size[1], filter_height_, padding_y_, stride_y_,
+          out_height_, &inner_y_begin_, &inner_y_end_);
+
     // Create 1 output
     Parent::out_.resize(1);
     Parent::out_[0] = std::make_shared<Mat<Dtype>>(out_width_, out_height_,
@@ -101,6 +112,51 @@ class LayerPool: public Layer<Dtype> {
    * Destructor.
    */
   virtual ~LayerPool() {}
+
+  /*!
+   * Get the range of outputs along a dimension having their whole window
+   * inside the input.
+   *
+   *  \param[in]  in_size : input size
+   *  \param[in]  filter  : filter size
+   *  \param[in]  padding : padding
+   *  \param[in]  stride  : stride
+   *  \param[in]  out_size: output size
+   *
+   *  \param[out] begin   : first output
+   *  \param[out] end     : last output (excluded)
+   */
+  static void Inner(uint32_t in_size, uint32_t filter, uint32_t padding,
+                    uint32_t stride, uint32_t out_size,
+                    uint32_t* begin, uint32_t* end) {
+    *begin = std::min((padding + stride - 1) / stride, out_size);
+    *end   = in_size + padding >= filter ?
+             std::min((in_size + padding - filter) / stride + 1, out_size) : 0;
+    *end   = std::max(*end, *begin);
+  }
+
+  /*!
+   * Check if the pooling has a fast path: square window of 2 or 3 values,
+   * stride 2 (see LayerPoolMax and LayerPoolAvg).
+   *
+   *  \return Window size (0 if none)
+   */
+  uint32_t FastSize() const {
+    if (filter_width_ != filter_height_ || stride_x_ != 2 || stride_y_ != 2 ||
+        (filter_width_ != 2 && filter_width_ != 3)) {
+      return 0;
+    }
+    return filter_width_;
+  }
+
+  /*!
+   * Check if the backward pass needs the values of the output.
+   *
+   *  \return Output needed?
+   */
+  virtual bool BackwardUsesOutput() const {
+    return false;
+  }
 };
 
 
@@ -28,8 +28,9 @@
 
 
 #include <core/layer_pool.h>
+#include <core/thread_pool.h>
+#include <algorithm>
 #include <memory>
-#include <limits>
 #include <vector>
 
 
@@ -68,61 +69,152 @@ class LayerPoolAvg: public LayerPool<Dtype> {
   virtual ~LayerPoolAvg() {}
 
   /*!
-   * Forward pass.
-   * The forward pass calculates the outputs activations
-   * in regard to the inputs activations and weights.
+   * Average pooling of a plane (one channel of a batch), or its backward pass
+   * (the padding is not counted in the averages).
+   * The windows inside the input skip the bound checks, and are unrolled for
+   * the fast paths (see LayerPool::FastSize).
    *
-   *  \param[in]  state: state
+   *  \param[in]  out_deriv: output derivative plane (backward only)
+   *  \param[in]  in       : input plane (forward only)
+   *
+   *  \param[out] out      : output plane (forward only)
+   *  \param[out] in_deriv : input derivative plane (backward only)
    */
-  virtual void Forward(const State& state) {
-    Dtype*       out_data = Parent::out_[0]->Data();
-    const Dtype* in_data  = Parent::in_[0]->Data();
-
-    uint32_t in_width    = Parent::in_[0]->size[0];
-    uint32_t in_height   = Parent::in_[0]->size[1];
-    uint32_t num_channel = Parent::in_[0]->size[2];
-    uint32_t batch_size  = Parent::in_[0]->size[3];
+  template <uint32_t kSize, bool kBackward>
+  void Plane(const Dtype* out_deriv, const Dtype* in, Dtype* out,
+             Dtype* in_deriv) const {
+    uint32_t in_width      = Parent::in_[0]->size[0];
+    uint32_t in_height     = Parent::in_[0]->size[1];
+    uint32_t filter_width  = kSize ? kSize : Parent::filter_width_;
+    uint32_t filter_height = kSize ? kSize : Parent::filter_height_;
+    uint32_t stride_x      = kSize ? 2     : Parent::stride_x_;
+    uint32_t stride_y      = kSize ? 2     : Parent::stride_y_;
+
+    for (uint32_t out_y = 0; out_y < Parent::out_height_; ++out_y) {
+      int32_t  start_y     = int32_t(out_y * stride_y) -
+                             int32_t(Parent::padding_y_);
+      uint32_t y_begin     = uint32_t(std::max(start_y, 0));
+      uint32_t y_end       = uint32_t(std::min(start_y +
+                                               int32_t(filter_height),
+                                               int32_t(in_height)));
+      bool     inner_y     = out_y >= Parent::inner_y_begin_ &&
+                             out_y <  Parent::inner_y_end_;
+      uint32_t inner_begin = inner_y ? Parent::inner_x_begin_ :
+                                       Parent::out_width_;
+      uint32_t inner_end   = inner_y ? Parent::inner_x_end_ :
+                                       Parent::out_width_;
+      uint32_t out_row     = out_y * Parent::out_width_;
+
+      // Windows partly outside the input (clipped)
+      auto border = [&](uint32_t out_x) {
+        int32_t  start_x = int32_t(out_x * stride_x) -
+                           int32_t(Parent::padding_x_);
+        uint32_t x_begin = uint32_t(std::max(start_x, 0));
+        uint32_t x_end   = uint32_t(std::min(start_x + int32_t(filter_width),
+                                             int32_t(in_width)));
+        Dtype    scale   = Dtype(1) / ((x_end - x_begin) * (y_end - y_begin));
+        Dtype    val     = kBackward ? out_deriv[out_row + out_x] * scale :
+                                       Dtype(0);
+        for (uint32_t y = y_begin; y < y_end; ++y) {
+          for (uint32_t x = x_begin; x < x_end; ++x) {
+            if (kBackward) {
+              in_deriv[y * in_width + x] += val;
+            } else {
+              val += in[y * in_width + x];
+            }
+          }
+        }
+        if (!kBackward) {
+          out[out_row + out_x] = val * scale;
+        }
+      };
+      for (uint32_t out_x = 0; out_x < inner_begin; ++out_x) {
+        border(out_x);
+      }
 
-    // out = ave(in, kernel_x, kernel_y)
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      uint32_t in_offset  = in_width * in_height * num_channel * batch;
-      uint32_t out_offset = Parent::out_width_ * Parent::out_height_ *
-                            num_channel * batch;
-      for (uint32_t channel = 0; channel < num_channel; ++channel) {
-        int32_t start_x = -Parent::padding_x_;
-        for (uint32_t out_x = 0; out_x < Parent::out_width_;
-          start_x += Parent::stride_x_, ++out_x) {
-          int32_t start_y = -Parent::padding_y_;
-          for (uint32_t out_y = 0; out_y < Parent::out_height_;
-            start_y += Parent::stride_y_, ++out_y) {
-            Dtype val      = Dtype(0);
-            uint32_t count = 0;
-            for (uint32_t x = 0; x < Parent::filter_width_; ++x) {
-              int32_t in_x = start_x + x;
-              if (in_x < 0 || uint32_t(in_x) >= in_width) {
-                continue;
-              }
-              for (uint32_t y = 0; y < Parent::filter_height_; ++y) {
-                int32_t in_y = start_y + y;
-                if (in_y < 0 || uint32_t(in_y) >= in_height) {
-                  continue;
-                }
-                uint32_t in_index =
-                  in_offset + (channel * in_height + in_y) * in_width + in_x;
-                val += in_data[in_index];
-                ++count;
-              }
+      // Windows inside the input (no bound check)
+      Dtype scale = Dtype(1) / (filter_width * filter_height);
+      for (uint32_t out_x = inner_begin; out_x < inner_end; ++out_x) {
+        uint32_t start = start_y * in_width + out_x * stride_x -
+                         Parent::padding_x_;
+        Dtype    val   = kBackward ? out_deriv[out_row + out_x] * scale :
+                                     Dtype(0);
+        for (uint32_t y = 0; y < filter_height; ++y) {
+          for (uint32_t x = 0; x < filter_width; ++x) {
+            if (kBackward) {
+              in_deriv[start + y * in_width + x] += val;
+            } else {
+              val += in[start + y * in_width + x];
             }
-            uint32_t out_index =
-              out_offset + (channel * Parent::out_height_ + out_y) *
-              Parent::out_width_ + out_x;
-            out_data[out_index] = val / count;
           }
         }
+        if (!kBackward) {
+          out[out_row + out_x] = val * scale;
+        }
+      }
+
+      for (uint32_t out_x = inner_end; out_x < Parent::out_width_; ++out_x) {
+        border(out_x);
       }
     }
   }
 
+  /*!
+   * Run the forward or backward pass on all the planes (channels of each
+   * batch), in parallel.
+   *
+   *  \param[in]  out_deriv: output derivative (backward only)
+   *  \param[in]  in       : input (forward only)
+   *
+   *  \param[out] out      : output (forward only)
+   *  \param[out] in_deriv : input derivative (backward only)
+   */
+  template <bool kBackward>
+  void Run(const Dtype* out_deriv, const Dtype* in, Dtype* out,
+           Dtype* in_deriv) const {
+    uint32_t in_size   = Parent::in_[0]->size[0] * Parent::in_[0]->size[1];
+    uint32_t out_size  = Parent::out_width_ * Parent::out_height_;
+    uint32_t num_plane = Parent::in_[0]->size[2] * Parent::in_[0]->size[3];
+    uint32_t fast_size = Parent::FastSize();
+
+    ParallelFor(0, num_plane,
+                [&](uint32_t plane_start, uint32_t plane_end, uint32_t) {
+      for (uint32_t plane = plane_start; plane < plane_end; ++plane) {
+        size_t in_offset  = size_t(plane) * in_size;
+        size_t out_offset = size_t(plane) * out_size;
+        const Dtype* plane_out_deriv = kBackward ? out_deriv + out_offset :
+                                                   nullptr;
+        const Dtype* plane_in        = kBackward ? nullptr : in + in_offset;
+        Dtype*       plane_out       = kBackward ? nullptr : out + out_offset;
+        Dtype*       plane_in_deriv  = kBackward ? in_deriv + in_offset :
+                                                   nullptr;
+        if (fast_size == 2) {
+          Plane<2, kBackward>(plane_out_deriv, plane_in, plane_out,
+                              plane_in_deriv);
+        } else if (fast_size == 3) {
+          Plane<3, kBackward>(plane_out_deriv, plane_in, plane_out,
+                              plane_in_deriv);
+        } else {
+          Plane<0, kBackward>(plane_out_deriv, plane_in, plane_out,
+                              plane_in_deriv);
+        }
+      }
+    });
+  }
+
+  /*!
+   * Forward pass.
+   * The forward pass calculates the outputs activations
+   * in regard to the inputs activations and weights.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Forward(const State& state) {
+    // out = ave(in, kernel_x, kernel_y)
+    Run<false>(nullptr, Parent::in_[0]->Data(), Parent::out_[0]->Data(),
+               nullptr);
+  }
+
   /*!
    * Backward pass.
    * The backward pass calculates the inputs activations and weights
@@ -131,48 +223,9 @@ class LayerPoolAvg: public LayerPool<Dtype> {
    *  \param[in]  state: state
    */
   virtual void Backward(const State& state) {
-    const Dtype* out_deriv_data = Parent::out_[0]->DerivData();
-    Dtype*       in_deriv_data  = Parent::in_[0]->DerivData();
-
-    uint32_t in_width    = Parent::in_[0]->size[0];
-    uint32_t in_height   = Parent::in_[0]->size[1];
-    uint32_t num_channel = Parent::in_[0]->size[2];
-    uint32_t batch_size  = Parent::in_[0]->size[3];
-
-    // in_deriv = out_deriv
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      uint32_t in_offset  = in_width * in_height * num_channel * batch;
-      uint32_t out_offset = Parent::out_width_ * Parent::out_height_ *
-                            num_channel * batch;
-      for (uint32_t channel = 0; channel < num_channel; ++channel) {
-        int32_t start_x = -Parent::padding_x_;
-        for (uint32_t out_x = 0; out_x < Parent::out_width_;
-          start_x += Parent::stride_x_, ++out_x) {
-          int32_t start_y = -Parent::padding_y_;
-          for (uint32_t out_y = 0; out_y < Parent::out_height_;
-            start_y += Parent::stride_y_, ++out_y) {
-            uint32_t out_index =
-              out_offset + (channel * Parent::out_height_ + out_y) *
-              Parent::out_width_ + out_x;
-            for (uint32_t x = 0; x < Parent::filter_width_; ++x) {
-              int32_t in_x = start_x + x;
-              if (in_x < 0 || uint32_t(in_x) >= in_width) {
-                continue;
-              }
-              for (uint32_t y = 0; y < Parent::filter_height_; ++y) {
-                int32_t in_y = start_y + y;
-                if (in_y < 0 || uint32_t(in_y) >= in_height) {
-                  continue;
-                }
-                uint32_t in_index =
-                  in_offset + (channel * in_height + in_y) * in_width + in_x;
-                in_deriv_data[in_index] += out_deriv_data[out_index];
-              }
-            }
-          }
-        }
-      }
-    }
+    // in_deriv = out_deriv / count, spread on each window
+    Run<true>(Parent::out_[0]->DerivData(), nullptr, nullptr,
+              Parent::in_[0]->DerivData());
   }
 };
 
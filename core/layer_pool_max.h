@@ -28,6 +28,8 @@
 
 
 #include <core/layer_pool.h>
+#include <core/thread_pool.h>
+#include <algorithm>
 #include <memory>
 #include <limits>
 #include <vector>
@@ -39,6 +41,10 @@ namespace jik {
 /*!
  *  \class  LayerPoolMax
  *  \brief  Matrice max pooling
+ *
+ * In the NHWC layout (see Layout), the windows are scanned once for all the
+ * channels of a pixel, the maxima of the channels being updated together
+ * (vectorized).
  */
 template <typename Dtype>
 class LayerPoolMax: public LayerPool<Dtype> {
@@ -60,7 +66,15 @@ class LayerPoolMax: public LayerPool<Dtype> {
   LayerPoolMax(const char*                                     name,
                const std::vector<std::shared_ptr<Mat<Dtype>>>& in,
                const Param&                                    param):
-    Parent(name, in, param) {}
+    Parent(name, in, param) {
+    // Create 1 more output, same size as the outputs, to save the index of
+    // the maximum of each window in its input plane (training only, exact
+    // as long as a plane has less than 2^24 values for float)
+    // There's no derivative as we don't backpropagate it
+    Parent::out_.resize(2);
+    Parent::out_[1] = std::make_shared<Mat<Dtype>>(Parent::out_[0]->size,
+                                                   false);
+  }
 
   /*!
    * Destructor.
@@ -68,62 +82,223 @@ class LayerPoolMax: public LayerPool<Dtype> {
   virtual ~LayerPoolMax() {}
 
   /*!
-   * Forward pass.
-   * The forward pass calculates the outputs activations
-   * in regard to the inputs activations and weights.
+   * Set the memory layout of the activations (see Layout).
    *
-   *  \param[in]  state: state
+   *  \param[in]  layout: layout
+   *
+   *  \return     Supported?
    */
-  virtual void Forward(const State& state) {
-    Dtype*       out_data = Parent::out_[0]->Data();
-    const Dtype* in_data  = Parent::in_[0]->Data();
+  virtual bool SetLayout(Layout::E_LAYOUT layout) {
+    Parent::out_[0]->layout = layout;
+    Parent::out_[1]->layout = layout;
+    return true;
+  }
+
+  /*!
+   * Max pooling of some output rows in the NHWC layout.
+   *
+   *  \param[in]  row_start: first output row (all batches)
+   *  \param[in]  row_end  : last output row (excluded)
+   *  \param[in]  index    : save the index of the maximum of each window in
+   *                         its input plane?
+   */
+  void ForwardNhwc(uint32_t row_start, uint32_t row_end, bool index) {
+    Dtype*       out_data   = Parent::out_[0]->Data();
+    Dtype*       index_data = Parent::out_[1]->Data();
+    const Dtype* in_data    = Parent::in_[0]->Data();
 
     uint32_t in_width    = Parent::in_[0]->size[0];
     uint32_t in_height   = Parent::in_[0]->size[1];
     uint32_t num_channel = Parent::in_[0]->size[2];
-    uint32_t batch_size  = Parent::in_[0]->size[3];
+    uint32_t in_size     = in_width * in_height;
 
-    // out = max(in, kernel_x, kernel_y)
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      uint32_t in_offset  = in_width * in_height * num_channel * batch;
-      uint32_t out_offset = Parent::out_width_ * Parent::out_height_ *
-                            num_channel * batch;
-      for (uint32_t channel = 0; channel < num_channel; ++channel) {
-        int32_t start_x = -Parent::padding_x_;
-        for (uint32_t out_x = 0; out_x < Parent::out_width_;
-          start_x += Parent::stride_x_, ++out_x) {
-          int32_t start_y = -Parent::padding_y_;
-          for (uint32_t out_y = 0; out_y < Parent::out_height_;
-            start_y += Parent::stride_y_, ++out_y) {
-            Dtype val = -std::numeric_limits<Dtype>::max();
-            for (uint32_t x = 0; x < Parent::filter_width_; ++x) {
-              int32_t in_x = start_x + x;
-              if (in_x < 0 || uint32_t(in_x) >= in_width) {
-                continue;
+    for (uint32_t row = row_start; row < row_end; ++row) {
+      uint32_t     batch   = row / Parent::out_height_;
+      uint32_t     out_y   = row % Parent::out_height_;
+      int32_t      start_y = int32_t(out_y * Parent::stride_y_) -
+                             int32_t(Parent::padding_y_);
+      const Dtype* in      = in_data + size_t(batch) * in_size * num_channel;
+      for (uint32_t out_x = 0; out_x < Parent::out_width_; ++out_x) {
+        int32_t start_x = int32_t(out_x * Parent::stride_x_) -
+                          int32_t(Parent::padding_x_);
+        size_t  offset  = (size_t(row) * Parent::out_width_ + out_x) *
+                          num_channel;
+        Dtype*  out     = out_data + offset;
+        Dtype*  out_idx = index ? index_data + offset : nullptr;
+        std::fill(out, out + num_channel,
+                  -std::numeric_limits<Dtype>::max());
+        if (out_idx) {
+          std::fill(out_idx, out_idx + num_channel, Dtype(0));
+        }
+        for (uint32_t y = 0; y < Parent::filter_height_; ++y) {
+          int32_t in_y = start_y + y;
+          if (in_y < 0 || uint32_t(in_y) >= in_height) {
+            continue;
+          }
+          for (uint32_t x = 0; x < Parent::filter_width_; ++x) {
+            int32_t in_x = start_x + x;
+            if (in_x < 0 || uint32_t(in_x) >= in_width) {
+              continue;
+            }
+            uint32_t     pos   = in_y * in_width + in_x;
+            const Dtype* pixel = in + size_t(pos) * num_channel;
+            if (out_idx) {
+              for (uint32_t channel = 0; channel < num_channel; ++channel) {
+                bool larger      = pixel[channel] > out[channel];
+                out[channel]     = larger ? pixel[channel] : out[channel];
+                out_idx[channel] = larger ? Dtype(pos) : out_idx[channel];
               }
-              for (uint32_t y = 0; y < Parent::filter_height_; ++y) {
-                int32_t in_y = start_y + y;
-                if (in_y < 0 || uint32_t(in_y) >= in_height) {
-                  continue;
-                }
-                uint32_t in_index =
-                  in_offset + (channel * in_height + in_y) * in_width + in_x;
-                Dtype curr = in_data[in_index];
-                if (curr > val) {
-                  val = curr;
-                }
+            } else {
+              for (uint32_t channel = 0; channel < num_channel; ++channel) {
+                out[channel] = std::max(out[channel], pixel[channel]);
               }
             }
-            uint32_t out_index =
-              out_offset + (channel * Parent::out_height_ + out_y) *
-              Parent::out_width_ + out_x;
-            out_data[out_index] = val;
           }
         }
       }
     }
   }
 
+  /*!
+   * Max pooling of a plane (one channel of a batch).
+   * The windows inside the input skip the bound checks, and are unrolled for
+   * the fast paths (see LayerPool::FastSize).
+   *
+   *  \param[in]  in   : input plane
+   *
+   *  \param[out] out  : output plane
+   *  \param[out] index: index of the maximum of each window in the input
+   *                     plane (nullptr if not needed)
+   */
+  template <uint32_t kSize>
+  void ForwardPlane(const Dtype* in, Dtype* out, Dtype* index) const {
+    uint32_t in_width      = Parent::in_[0]->size[0];
+    uint32_t in_height     = Parent::in_[0]->size[1];
+    uint32_t filter_width  = kSize ? kSize : Parent::filter_width_;
+    uint32_t filter_height = kSize ? kSize : Parent::filter_height_;
+    uint32_t stride_x      = kSize ? 2     : Parent::stride_x_;
+    uint32_t stride_y      = kSize ? 2     : Parent::stride_y_;
+
+    for (uint32_t out_y = 0; out_y < Parent::out_height_; ++out_y) {
+      int32_t  start_y     = int32_t(out_y * stride_y) -
+                             int32_t(Parent::padding_y_);
+      Dtype*   out_row     = out + out_y * Parent::out_width_;
+      Dtype*   index_row   = index ? index + out_y * Parent::out_width_ :
+                                     nullptr;
+      bool     inner_y     = out_y >= Parent::inner_y_begin_ &&
+                             out_y <  Parent::inner_y_end_;
+      uint32_t inner_begin = inner_y ? Parent::inner_x_begin_ :
+                                       Parent::out_width_;
+      uint32_t inner_end   = inner_y ? Parent::inner_x_end_ :
+                                       Parent::out_width_;
+
+      // Windows partly outside the input
+      auto border = [&](uint32_t out_x) {
+        int32_t  start_x   = int32_t(out_x * stride_x) -
+                             int32_t(Parent::padding_x_);
+        Dtype    val       = -std::numeric_limits<Dtype>::max();
+        uint32_t val_index = 0;
+        for (uint32_t y = 0; y < filter_height; ++y) {
+          int32_t in_y = start_y + y;
+          if (in_y < 0 || uint32_t(in_y) >= in_height) {
+            continue;
+          }
+          for (uint32_t x = 0; x < filter_width; ++x) {
+            int32_t in_x = start_x + x;
+            if (in_x < 0 || uint32_t(in_x) >= in_width) {
+              continue;
+            }
+            Dtype curr = in[in_y * in_width + in_x];
+            if (curr > val) {
+              val       = curr;
+              val_index = in_y * in_width + in_x;
+            }
+          }
+        }
+        out_row[out_x] = val;
+        if (index_row) {
+          index_row[out_x] = Dtype(val_index);
+        }
+      };
+      for (uint32_t out_x = 0; out_x < inner_begin; ++out_x) {
+        border(out_x);
+      }
+
+      // Windows inside the input (no bound check, branch-free)
+      for (uint32_t out_x = inner_begin; out_x < inner_end; ++out_x) {
+        uint32_t     start      = start_y * in_width + out_x * stride_x -
+                                  Parent::padding_x_;
+        const Dtype* window     = in + start;
+        Dtype        val        = window[0];
+        uint32_t     val_offset = 0;
+        for (uint32_t y = 0; y < filter_height; ++y) {
+          for (uint32_t x = 0; x < filter_width; ++x) {
+            uint32_t offset = y * in_width + x;
+            Dtype    curr   = window[offset];
+            bool     larger = curr > val;
+            val             = larger ? curr   : val;
+            val_offset      = larger ? offset : val_offset;
+          }
+        }
+        out_row[out_x] = val;
+        if (index_row) {
+          index_row[out_x] = Dtype(start + val_offset);
+        }
+      }
+
+      for (uint32_t out_x = inner_end; out_x < Parent::out_width_; ++out_x) {
+        border(out_x);
+      }
+    }
+  }
+
+  /*!
+   * Forward pass.
+   * The forward pass calculates the outputs activations
+   * in regard to the inputs activations and weights.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Forward(const State& state) {
+    Dtype*       out_data   = Parent::out_[0]->Data();
+    Dtype*       index_data = Parent::out_[1]->Data();
+    const Dtype* in_data    = Parent::in_[0]->Data();
+
+    uint32_t in_size   = Parent::in_[0]->size[0] * Parent::in_[0]->size[1];
+    uint32_t out_size  = Parent::out_width_ * Parent::out_height_;
+    uint32_t num_plane = Parent::in_[0]->size[2] * Parent::in_[0]->size[3];
+    uint32_t fast_size = Parent::FastSize();
+
+    // The indices of the maxima are only needed by the backward pass
+    bool save_index = state.phase == State::PHASE_TRAIN;
+
+    if (Parent::out_[0]->layout == Layout::NHWC) {
+      ParallelFor(0, Parent::out_height_ * Parent::out_[0]->size[3],
+                  [&](uint32_t row_start, uint32_t row_end, uint32_t) {
+        ForwardNhwc(row_start, row_end, save_index);
+      });
+      return;
+    }
+
+    // out = max(in, kernel_x, kernel_y)
+    ParallelFor(0, num_plane,
+                [&](uint32_t plane_start, uint32_t plane_end, uint32_t) {
+      for (uint32_t plane = plane_start; plane < plane_end; ++plane) {
+        const Dtype* in    = in_data  + size_t(plane) * in_size;
+        Dtype*       out   = out_data + size_t(plane) * out_size;
+        Dtype*       index = save_index ? index_data + size_t(plane) *
+                                          out_size : nullptr;
+        if (fast_size == 2) {
+          ForwardPlane<2>(in, out, index);
+        } else if (fast_size == 3) {
+          ForwardPlane<3>(in, out, index);
+        } else {
+          ForwardPlane<0>(in, out, index);
+        }
+      }
+    });
+  }
+
   /*!
    * Backward pass.
    * The backward pass calculates the inputs activations and weights
@@ -133,55 +308,49 @@ class LayerPoolMax: public LayerPool<Dtype> {
    */
   virtual void Backward(const State& state) {
     const Dtype* out_deriv_data = Parent::out_[0]->DerivData();
-    const Dtype* in_data        = Parent::in_[0]->Data();
+    const Dtype* index_data     = Parent::out_[1]->Data();
     Dtype*       in_deriv_data  = Parent::in_[0]->DerivData();
 
-    uint32_t in_width    = Parent::in_[0]->size[0];
-    uint32_t in_height   = Parent::in_[0]->size[1];
-    uint32_t num_channel = Parent::in_[0]->size[2];
-    uint32_t batch_size  = Parent::in_[0]->size[3];
-
-    // in_deriv = out_deriv
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      uint32_t in_offset  = in_width * in_height * num_channel * batch;
-      uint32_t out_offset = Parent::out_width_ * Parent::out_height_ *
-                            num_channel * batch;
-      for (uint32_t channel = 0; channel < num_channel; ++channel) {
-        int32_t start_x = -Parent::padding_x_;
-        for (uint32_t out_x = 0; out_x < Parent::out_width_;
-          start_x += Parent::stride_x_, ++out_x) {
-          int32_t start_y = -Parent::padding_y_;
-          for (uint32_t out_y = 0; out_y < Parent::out_height_;
-            start_y += Parent::stride_y_, ++out_y) {
-            Dtype val          = -std::numeric_limits<Dtype>::max();
-            uint32_t val_index = 0;
-            for (uint32_t x = 0; x < Parent::filter_width_; ++x) {
-              int32_t in_x = start_x + x;
-              if (in_x < 0 || uint32_t(in_x) >= in_width) {
-                continue;
-              }
-              for (uint32_t y = 0; y < Parent::filter_height_; ++y) {
-                int32_t in_y = start_y + y;
-                if (in_y < 0 || uint32_t(in_y) >= in_height) {
-                  continue;
-                }
-                uint32_t in_index =
-                  in_offset + (channel * in_height + in_y) * in_width + in_x;
-                Dtype curr = in_data[in_index];
-                if (curr > val) {
-                  val       = curr;
-                  val_index = in_index;
-                }
-              }
+    uint32_t in_size   = Parent::in_[0]->size[0] * Parent::in_[0]->size[1];
+    uint32_t out_size  = Parent::out_width_ * Parent::out_height_;
+    uint32_t num_plane = Parent::in_[0]->size[2] * Parent::in_[0]->size[3];
+
+    if (Parent::out_[0]->layout == Layout::NHWC) {
+      // The windows of a batch overlap: one batch per thread at a time
+      uint32_t num_channel = Parent::in_[0]->size[2];
+      ParallelFor(0, Parent::out_[0]->size[3],
+                  [&](uint32_t batch_start, uint32_t batch_end, uint32_t) {
+        for (uint32_t batch = batch_start; batch < batch_end; ++batch) {
+          size_t       out_offset = size_t(batch) * out_size * num_channel;
+          const Dtype* out_deriv  = out_deriv_data + out_offset;
+          const Dtype* index      = index_data     + out_offset;
+          Dtype*       in_deriv   = in_deriv_data  +
+                                    size_t(batch) * in_size * num_channel;
+          for (uint32_t i = 0; i < out_size; ++i) {
+            for (uint32_t channel = 0; channel < num_channel; ++channel) {
+              size_t val = size_t(i) * num_channel + channel;
+              in_deriv[size_t(index[val]) * num_channel + channel] +=
+                out_deriv[val];
             }
-            uint32_t out_index =
-              out_offset + (channel * Parent::out_height_ + out_y) *
-              Parent::out_width_ + out_x;
-            in_deriv_data[val_index] += out_deriv_data[out_index];
           }
         }
-      }
+      });
+      return;
     }
+
+    // in_deriv = out_deriv, routed to the maximum of each window (saved by
+    // the forward pass)
+    ParallelFor(0, num_plane,
+                [&](uint32_t plane_start, uint32_t plane_end, uint32_t) {
+      for (uint32_t plane = plane_start; plane < plane_end; ++plane) {
+        const Dtype* out_deriv = out_deriv_data + size_t(plane) * out_size;
+        const Dtype* index     = index_data     + size_t(plane) * out_size;
+        Dtype*       in_deriv  = in_deriv_data  + size_t(plane) * in_size;
+        for (uint32_t i = 0; i < out_size; ++i) {
+          in_deriv[uint32_t(index[i])] += out_deriv[i];
+        }
+      }
+    });
   }
 };
 
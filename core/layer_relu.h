@@ -29,8 +29,8 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/simd.h>
 #include <memory>
-#include <algorithm>
 #include <vector>
 
 
@@ -74,6 +74,39 @@ class LayerRelu: public Layer<Dtype> {
    */
   virtual ~LayerRelu() {}
 
+  /*!
+   * Set the memory layout of the activations (elementwise: any layout).
+   *
+   *  \param[in]  layout: layout
+   *
+   *  \return     Supported?
+   */
+  virtual bool SetLayout(Layout::E_LAYOUT layout) {
+    Parent::out_[0]->layout = layout;
+    return true;
+  }
+
+  /*!
+   * Check if the layer can run in place (see Model::Plan).
+   *
+   *  \return In place?
+   */
+  virtual bool InPlace() const {
+    return true;
+  }
+
+  /*!
+   * Fuse this layer into a previous one, for inference (see Fusion).
+   *
+   *  \param[in]  fusion: fusion of the previous layer
+   *
+   *  \return     Fused?
+   */
+  virtual bool FuseInto(Fusion<Dtype>* fusion) const {
+    fusion->Relu();
+    return true;
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -87,9 +120,7 @@ class LayerRelu: public Layer<Dtype> {
 
     // RELU activation is thresholded at zero
     // out = in if in > 0, 0 otherwise
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      out_data[i] = std::max(Dtype(0), in_data[i]);
-    }
+    Simd<Dtype>::Relu(Parent::out_[0]->Size(), in_data, out_data);
   }
 
   /*!
@@ -105,11 +136,8 @@ class LayerRelu: public Layer<Dtype> {
     Dtype*       in_deriv_data  = Parent::in_[0]->DerivData();
 
     // in_deriv = out_deriv if out > 0, 0 otherwise
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      if (out_data[i] > Dtype(0)) {
-        in_deriv_data[i] += out_deriv_data[i];
-      }
-    }
+    Simd<Dtype>::ReluDeriv(Parent::out_[0]->Size(), out_data, out_deriv_data,
+                           in_deriv_data);
   }
 };
 
@@ -0,0 +1,233 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_LAYER_REORDER_H_
+#define CORE_LAYER_REORDER_H_
+
+
+#include <core/layer.h>
+#include <core/log.h>
+#include <core/thread_pool.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include <string>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  LayerReorder
+ *  \brief  Memory layout conversion
+ *
+ * Copy the input activations in another layout (see Layout), set with the
+ * "layout" parameter ("nchw" or "nhwc"). The values don't change, only their
+ * order in memory: each image is transposed between a channels x pixels and
+ * a pixels x channels matrix, by blocks.
+ */
+template <typename Dtype>
+class LayerReorder: public Layer<Dtype> {
+  // Public types
+ public:
+  typedef Dtype         Type;
+  typedef Layer<Dtype>  Parent;
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Transpose the images of a range of the batch.
+   *
+   *  \param[in]  in         : input values (whole batch)
+   *  \param[in]  num_row    : number of rows of an input image
+   *  \param[in]  num_col    : number of columns of an input image
+   *  \param[in]  batch_start: first batch
+   *  \param[in]  batch_end  : last batch (excluded)
+   *  \param[in]  accumulate : add to the outputs instead of replacing them?
+   *
+   *  \param[out] out        : output values (whole batch)
+   */
+  static void Transpose(const Dtype* in, uint32_t num_row, uint32_t num_col,
+                        uint32_t batch_start, uint32_t batch_end,
+                        bool accumulate, Dtype* out) {
+    // Block of values read and written at once (cache friendly)
+    const uint32_t kBlock = 16;
+
+    size_t image_size = size_t(num_row) * num_col;
+    for (uint32_t batch = batch_start; batch < batch_end; ++batch) {
+      const Dtype* in_image  = in  + batch * image_size;
+      Dtype*       out_image = out + batch * image_size;
+      for (uint32_t row0 = 0; row0 < num_row; row0 += kBlock) {
+        uint32_t row1 = std::min(row0 + kBlock, num_row);
+        for (uint32_t col0 = 0; col0 < num_col; col0 += kBlock) {
+          uint32_t col1 = std::min(col0 + kBlock, num_col);
+          for (uint32_t row = row0; row < row1; ++row) {
+            const Dtype* in_row = in_image + size_t(row) * num_col;
+            for (uint32_t col = col0; col < col1; ++col) {
+              Dtype& val = out_image[size_t(col) * num_row + row];
+              val = accumulate ? val + in_row[col] : in_row[col];
+            }
+          }
+        }
+      }
+    }
+  }
+
+  /*!
+   * Get the size of the input images seen as matrices.
+   *
+   *  \param[out] num_row: number of rows
+   *  \param[out] num_col: number of columns
+   */
+  void ImageSize(uint32_t* num_row, uint32_t* num_col) const {
+    uint32_t num_pixel   = Parent::in_[0]->size[0] * Parent::in_[0]->size[1];
+    uint32_t num_channel = Parent::in_[0]->size[2];
+    bool     nchw        = Parent::in_[0]->layout == Layout::NCHW;
+    *num_row = nchw ? num_channel : num_pixel;
+    *num_col = nchw ? num_pixel   : num_channel;
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  name : layer name
+   *  \param[in]  in   : input activations
+   *  \param[in]  param: parameters
+   */
+  LayerReorder(const char*                                     name,
+               const std::vector<std::shared_ptr<Mat<Dtype>>>& in,
+               const Param&                                    param):
+    Parent(name, in) {
+    // Make sure we have 1 input
+    Check(Parent::in_.size() == 1, "Layer '%s' must have 1 input",
+          Parent::Name());
+
+    // Parameters
+    std::string layout_name;
+    param.Get("layout", &layout_name);
+    Layout::E_LAYOUT layout = Layout::NCHW;
+    if (!Layout::Get(layout_name.c_str(), &layout)) {
+      Report(kError, "Layer '%s' has an unknown layout '%s'",
+             Parent::Name(), layout_name.c_str());
+    }
+
+    // Create 1 output, same size as the input
+    Parent::out_.resize(1);
+    Parent::out_[0] = std::make_shared<Mat<Dtype>>(Parent::in_[0]->size);
+    Parent::out_[0]->layout = layout;
+  }
+
+  /*!
+   * Destructor.
+   */
+  virtual ~LayerReorder() {}
+
+  /*!
+   * Check if the backward pass needs the values of the output.
+   *
+   *  \return Output needed?
+   */
+  virtual bool BackwardUsesOutput() const {
+    return false;
+  }
+
+  /*!
+   * Estimate the number of floating point operations of the forward pass.
+   *
+   *  \return Number of operations (none, only copies)
+   */
+  virtual uint64_t Flop() const {
+    return 0;
+  }
+
+  /*!
+   * Forward pass.
+   * The forward pass calculates the outputs activations
+   * in regard to the inputs activations and weights.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Forward(const State& state) {
+    Dtype*       out_data = Parent::out_[0]->Data();
+    const Dtype* in_data  = Parent::in_[0]->Data();
+
+    uint32_t num_row, num_col;
+    ImageSize(&num_row, &num_col);
+    if (Parent::in_[0]->layout == Parent::out_[0]->layout ||
+        Parent::in_[0]->AnyLayout()) {
+      std::copy(in_data, in_data + Parent::out_[0]->Size(), out_data);
+      return;
+    }
+
+    // out = in^T (per image)
+    ParallelFor(0, Parent::out_[0]->size[3],
+                [&](uint32_t batch_start, uint32_t batch_end, uint32_t) {
+      Transpose(in_data, num_row, num_col, batch_start, batch_end, false,
+                out_data);
+    });
+  }
+
+  /*!
+   * Backward pass.
+   * The backward pass calculates the inputs activations and weights
+   * derivatives in regard to the outputs activations derivatives.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Backward(const State& state) {
+    const Dtype* out_deriv_data = Parent::out_[0]->DerivData();
+    Dtype*       in_deriv_data  = Parent::in_[0]->DerivData();
+    if (!in_deriv_data) {
+      return;
+    }
+
+    // in_deriv += out_deriv^T (per image)
+    uint32_t num_row, num_col;
+    ImageSize(&num_row, &num_col);
+    if (Parent::in_[0]->layout == Parent::out_[0]->layout ||
+        Parent::in_[0]->AnyLayout()) {
+      for (uint32_t i = 0; i < Parent::in_[0]->Size(); ++i) {
+        in_deriv_data[i] += out_deriv_data[i];
+      }
+      return;
+    }
+    ParallelFor(0, Parent::out_[0]->size[3],
+                [&](uint32_t batch_start, uint32_t batch_end, uint32_t) {
+      Transpose(out_deriv_data, num_col, num_row, batch_start, batch_end,
+                true, in_deriv_data);
+    });
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_LAYER_REORDER_H_
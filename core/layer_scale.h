@@ -93,6 +93,28 @@ class LayerScale: public Layer<Dtype> {
    */
   virtual ~LayerScale() {}
 
+  /*!
+   * Check if the backward pass needs the values of the output.
+   *
+   *  \return Output needed?
+   */
+  virtual bool BackwardUsesOutput() const {
+    return false;
+  }
+
+  /*!
+   * Fuse this layer into a previous one, for inference (see Fusion).
+   *
+   *  \param[in]  fusion: fusion of the previous layer
+   *
+   *  \return     Fused?
+   */
+  virtual bool FuseInto(Fusion<Dtype>* fusion) const {
+    fusion->Scale(Parent::weight_[0]->Data(), (Parent::weight_.size() > 1) ?
+                  Parent::weight_[1]->Data() : nullptr);
+    return true;
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
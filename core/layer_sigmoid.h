@@ -29,8 +29,8 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/simd.h>
 #include <memory>
-#include <cmath>
 #include <vector>
 
 
@@ -74,6 +74,27 @@ class LayerSigmoid: public Layer<Dtype> {
    */
   virtual ~LayerSigmoid() {}
 
+  /*!
+   * Set the memory layout of the activations (elementwise: any layout).
+   *
+   *  \param[in]  layout: layout
+   *
+   *  \return     Supported?
+   */
+  virtual bool SetLayout(Layout::E_LAYOUT layout) {
+    Parent::out_[0]->layout = layout;
+    return true;
+  }
+
+  /*!
+   * Check if the layer can run in place (see Model::Plan).
+   *
+   *  \return In place?
+   */
+  virtual bool InPlace() const {
+    return true;
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -86,9 +107,7 @@ class LayerSigmoid: public Layer<Dtype> {
     const Dtype* in_data  = Parent::in_[0]->Data();
 
     // out = 1 / (1 + exp(-in))
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      out_data[i] = Dtype(1) / (Dtype(1) + std::exp(-in_data[i]));
-    }
+    Simd<Dtype>::Sigmoid(Parent::out_[0]->Size(), in_data, out_data);
   }
 
   /*!
@@ -104,10 +123,8 @@ class LayerSigmoid: public Layer<Dtype> {
     Dtype*       in_deriv_data  = Parent::in_[0]->DerivData();
 
     // in_deriv = out * (1 - out) * out_deriv
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      Dtype val         = out_data[i];
-      in_deriv_data[i] += val * (Dtype(1) - val) * out_deriv_data[i];
-    }
+    Simd<Dtype>::SigmoidDeriv(Parent::out_[0]->Size(), out_data,
+                              out_deriv_data, in_deriv_data);
   }
 };
 
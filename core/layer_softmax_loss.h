@@ -28,8 +28,9 @@
 
 
 #include <core/layer_loss.h>
+#include <core/simd.h>
+#include <core/thread_pool.h>
 #include <memory>
-#include <cmath>
 #include <vector>
 
 
@@ -39,6 +40,9 @@ namespace jik {
 /*!
  *  \class  LayerSoftMaxLoss
  *  \brief  Softmax + multinomial logistic loss function
+ *
+ * A negative label masks its batch out: it doesn't add to the loss and
+ * doesn't get any derivative (e.g. padding in a batch of sequences).
  */
 template <typename Dtype>
 class LayerSoftMaxLoss: public LayerLoss<Dtype> {
@@ -48,6 +52,11 @@ class LayerSoftMaxLoss: public LayerLoss<Dtype> {
   typedef LayerLoss<Dtype>  Parent;
 
 
+  // Protected attributes
+ protected:
+  std::vector<Dtype> batch_loss_;  // Loss of each batch
+
+
   // Public methods
  public:
   /*!
@@ -101,34 +110,28 @@ class LayerSoftMaxLoss: public LayerLoss<Dtype> {
       return;
     }
 
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      // Find the max value for the current data
-      uint32_t offset = batch * data_size;
-      Dtype val_max   = in_data[offset];
-      for (uint32_t i = 1; i < data_size; ++i) {
-        if (in_data[offset + i] > val_max) {
-          val_max = in_data[offset + i];
+    // out = softmax(in), and the cross entropy between the prediction
+    // (output of the network) and the label (true probability), from the
+    // log-softmax: -log(out[label]) = log(sum(exp(in))) - in[label]
+    batch_loss_.resize(batch_size);
+    ParallelFor(0, batch_size, [&](uint32_t batch_start, uint32_t batch_end,
+                                   uint32_t) {
+      for (uint32_t batch = batch_start; batch < batch_end; ++batch) {
+        size_t offset = size_t(batch) * data_size;
+        Dtype  lse    = Simd<Dtype>::Softmax(data_size, in_data + offset,
+                                             out_data + offset);
+        batch_loss_[batch] = Dtype(0);
+        if (label_data[batch] >= Dtype(0)) {
+          batch_loss_[batch] = lse - in_data[offset +
+                                             uint32_t(label_data[batch])];
         }
       }
+    });
 
-      // out = norm(exp(in - max))
-      Dtype sum = Dtype(0);
-      for (uint32_t i = 0; i < data_size; ++i) {
-        out_data[offset + i] = std::exp(in_data[offset + i] - val_max);
-        sum                 += out_data[offset + i];
-      }
-      sum = Dtype(1) / sum;
-      for (uint32_t i = 0; i < data_size; ++i) {
-        out_data[offset + i] *= sum;
-      }
-    }
-
-    // Cross entropy between the prediction (output of the network)
-    // and the label (true probability)
+    // Summed in order (same loss whatever the number of threads)
     Dtype inv_size = Dtype(1) / batch_size;
     for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      uint32_t index = batch * data_size + uint32_t(label_data[batch]);
-      loss_data[0] -= std::log(out_data[index]) * inv_size;
+      loss_data[0] += batch_loss_[batch] * inv_size;
     }
   }
 
@@ -141,17 +144,26 @@ class LayerSoftMaxLoss: public LayerLoss<Dtype> {
    */
   virtual void Backward(const State& state) {
     Dtype*       in_deriv_data = Parent::in_[0]->DerivData();
+    const Dtype* out_data      = Parent::out_[1]->Data();
     const Dtype* label_data    = Parent::in_[1]->Data();
 
     uint32_t data_size  = Parent::out_[1]->size[0] * Parent::out_[1]->size[1] *
                           Parent::out_[1]->size[2];
     uint32_t batch_size = Parent::out_[1]->size[3];
 
-    Parent::in_[0]->deriv->data = Parent::out_[1]->data;
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      uint32_t index        = batch * data_size + uint32_t(label_data[batch]);
-      in_deriv_data[index] -= Dtype(1);
-    }
+    // in_deriv += out - one_hot(label)
+    ParallelFor(0, batch_size, [&](uint32_t batch_start, uint32_t batch_end,
+                                   uint32_t) {
+      for (uint32_t batch = batch_start; batch < batch_end; ++batch) {
+        if (label_data[batch] < Dtype(0)) {
+          continue;
+        }
+        size_t offset = size_t(batch) * data_size;
+        Simd<Dtype>::Accumulate(data_size, out_data + offset,
+                                in_deriv_data + offset);
+        in_deriv_data[offset + uint32_t(label_data[batch])] -= Dtype(1);
+      }
+    });
   }
 };
 
@@ -29,8 +29,8 @@
 
 #include <core/layer.h>
 #include <core/log.h>
+#include <core/simd.h>
 #include <memory>
-#include <cmath>
 #include <vector>
 
 
@@ -74,6 +74,27 @@ class LayerTanh: public Layer<Dtype> {
    */
   virtual ~LayerTanh() {}
 
+  /*!
+   * Set the memory layout of the activations (elementwise: any layout).
+   *
+   *  \param[in]  layout: layout
+   *
+   *  \return     Supported?
+   */
+  virtual bool SetLayout(Layout::E_LAYOUT layout) {
+    Parent::out_[0]->layout = layout;
+    return true;
+  }
+
+  /*!
+   * Check if the layer can run in place (see Model::Plan).
+   *
+   *  \return In place?
+   */
+  virtual bool InPlace() const {
+    return true;
+  }
+
   /*!
    * Forward pass.
    * The forward pass calculates the outputs activations
@@ -86,9 +107,7 @@ class LayerTanh: public Layer<Dtype> {
     const Dtype* in_data  = Parent::in_[0]->Data();
 
     // out = tanh(in)
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      out_data[i] = std::tanh(in_data[i]);
-    }
+    Simd<Dtype>::Tanh(Parent::out_[0]->Size(), in_data, out_data);
   }
 
   /*!
@@ -104,10 +123,8 @@ class LayerTanh: public Layer<Dtype> {
     Dtype*       in_deriv_data  = Parent::in_[0]->DerivData();
 
     // in_deriv = (1 - out^2) * out_deriv
-    for (uint32_t i = 0; i < Parent::out_[0]->Size(); ++i) {
-      Dtype val         = out_data[i];
-      in_deriv_data[i] += (Dtype(1) - val * val) * out_deriv_data[i];
-    }
+    Simd<Dtype>::TanhDeriv(Parent::out_[0]->Size(), out_data, out_deriv_data,
+                           in_deriv_data);
   }
 };
 
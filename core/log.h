@@ -27,13 +27,28 @@
 #define CORE_LOG_H_
 
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <cstdarg>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <ctime>
 
 
+// Lowest level of the reported messages (see LogLevel), the others being
+// skipped before being formatted
+#ifndef JIK_LOG_LEVEL
+#define JIK_LOG_LEVEL 0
+#endif  // JIK_LOG_LEVEL
+
+
 namespace jik {
 
 
@@ -42,141 +57,344 @@ const char*  kLogInternalError = "Internal error";
 
 
 /*!
- * Write a log.
+ * Log levels.
+ */
+enum LogLevel {
+  kInfo = 0,  // Information
+  kWarning,   // Warning
+  kError      // Error (will terminate the process)
+};
+
+const LogLevel kLogLevel = LogLevel(JIK_LOG_LEVEL);
+
+
+/*!
+ *  \class  Logger
+ *  \brief  Asynchronous log
  *
- *  \param[in]  log_file_path: path to the log file
- *  \param[in]  msg          : log message (printf style)
+ * The messages are formatted by the threads reporting them in the slots of
+ * a ring buffer, without lock: a thread claims a slot by incrementing the
+ * write index, and publishes it with the slot sequence number.
  *
- *  \return     Error?
+ * A background thread periodically writes the published messages to stderr,
+ * with their timestamp, and to the log file if any (see SetFile), or as soon
+ * as the ring is half full. When the ring is full, the reporting threads
+ * wait for it. The log file is rotated by this thread once it's too large.
+ * The errors are written before the process terminates (see Report).
+ *
+ * A single log is shared by the whole process (see Get). In debug, the
+ * messages and the traces (see LogTrace) are written to "trace.log".
  */
-bool LogMsg(const std::string& log_file_path, const char* msg = nullptr, ...) {
-  const size_t kLogFileSizeMax = 0x10000000;
+class Logger {
+  // Public attributes
+ public:
+  static const uint32_t kNumSlot  = 1024;   // Number of slots in the ring
+  static const size_t   kSlotSize = 0x400;  // Max message size
+
+
+  // Protected types
+ protected:
+  typedef std::chrono::system_clock Clock;
+
+  struct Slot {
+    std::atomic<uint64_t> seq;            // Sequence number
+    LogLevel              level;          // Level
+    bool                  trace;          // Trace (log file only)?
+    Clock::time_point     time;           // Time reported
+    char                  msg[kSlotSize]; // Message
+  };
+
+
+  // Protected attributes
+ protected:
+  std::unique_ptr<Slot[]> slot_;           // Ring buffer
+  std::atomic<uint64_t>   write_;          // Next slot to claim
+  std::atomic<uint64_t>   read_;           // Next slot to write
+  std::mutex              mutex_;          // Writing lock
+  std::condition_variable cond_;           // Ring half full, or stop
+  std::thread             thread_;         // Writing thread
+  bool                    stop_;           // Stop the writing thread?
+  std::string             file_path_;      // Log file path
+  std::FILE*              file_;           // Log file
+  size_t                  file_size_;      // Log file size (bytes)
+  size_t                  max_file_size_;  // Log file size before rotation
+  std::string             line_;           // Lines being written
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Open the log file (writing lock taken).
+   *
+   *  \param[in]  mode: opening mode
+   */
+  void OpenFile(const char* mode) {
+    if (file_) {
+      std::fclose(file_);
+      file_ = nullptr;
+    }
+    file_size_ = 0;
+    if (file_path_.empty()) {
+      return;
+    }
+    file_ = std::fopen(file_path_.c_str(), mode);
+    if (file_) {
+      std::fseek(file_, 0, SEEK_END);
+      int64_t size = std::ftell(file_);
+      file_size_   = size > 0 ? size_t(size) : 0;
+    }
+  }
 
-  if (!msg || !*msg) {
-    msg = kLogInternalError;
+  /*!
+   * Rename the log file as "<path>.1" (the previous one is deleted), and
+   * start a new one (writing lock taken).
+   */
+  void RotateFile() {
+    std::fclose(file_);
+    file_ = nullptr;
+    std::string old_path = file_path_ + ".1";
+    std::remove(old_path.c_str());
+    std::rename(file_path_.c_str(), old_path.c_str());
+    OpenFile("wt");
   }
 
-  // Open the file: we open and close this file each time we write
-  // a log so if the application crashes, we still get the logs
-  std::FILE* log_file = std::fopen(log_file_path.c_str(), "at");
-  if (!log_file) {
-    return false;
+  /*!
+   * Write the published messages (writing lock taken).
+   */
+  void WriteSlots() {
+    line_.clear();
+    std::time_t last_time = 0;
+    char time[0x20]       = "";
+    uint64_t read = read_.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot& slot = slot_[read % kNumSlot];
+      if (slot.seq.load(std::memory_order_acquire) != read + 1) {
+        break;
+      }
+
+      // The timestamps are formatted here, not by the reporting threads
+      std::time_t now = Clock::to_time_t(slot.time);
+      if (now != last_time) {
+        std::strftime(time, sizeof(time), "%Y-%m-%d %H:%M:%S",
+                      std::localtime(&now));
+        last_time = now;
+      }
+      if (slot.trace) {
+        if (file_) {
+          std::fprintf(file_, "%s\n", slot.msg);
+          file_size_ += std::strlen(slot.msg) + 1;
+        }
+      } else {
+        const char* smsg = slot.level == kWarning ? "Warning" :
+                           slot.level == kError   ? "Error"   : "Info";
+        line_ += std::string("[") + smsg + " @ " + time + "]: " + slot.msg +
+                 "\n";
+      }
+
+      // Free the slot for the next lap
+      slot.seq.store(read + kNumSlot, std::memory_order_release);
+      read_.store(++read, std::memory_order_relaxed);
+    }
+
+    if (line_.empty()) {
+      return;
+    }
+    std::fwrite(line_.data(), 1, line_.size(), stderr);
+    if (file_) {
+      std::fwrite(line_.data(), 1, line_.size(), file_);
+      file_size_ += line_.size();
+    }
   }
 
-  // Log file size
-  std::fseek(log_file, 0, SEEK_END);
-  int64_t log_file_size = std::ftell(log_file);
-  if (log_file_size < 0) {
-    return false;
+  /*!
+   * Writing thread loop.
+   */
+  void Run() {
+    // Period of the writes
+    const std::chrono::milliseconds kPeriod(10);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stop_) {
+      cond_.wait_for(lock, kPeriod);
+      WriteSlots();
+      if (file_) {
+        std::fflush(file_);
+        if (file_size_ > max_file_size_) {
+          RotateFile();
+        }
+      }
+    }
   }
-  std::fseek(log_file, 0, SEEK_SET);
 
-  // If the file is too large, we delete it
-  if (log_file_size > int64_t(kLogFileSizeMax)) {
-    std::fclose(log_file);
-    log_file = std::fopen(log_file_path.c_str(), "wt");
-    if (!log_file) {
-      return false;
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   */
+  Logger() {
+    slot_.reset(new Slot[kNumSlot]);
+    for (uint32_t i = 0; i < kNumSlot; ++i) {
+      slot_[i].seq.store(i, std::memory_order_relaxed);
     }
+    write_         = 0;
+    read_          = 0;
+    stop_          = false;
+    file_          = nullptr;
+    file_size_     = 0;
+    max_file_size_ = 0x10000000;
+#ifdef DEBUG
+    SetFile("trace.log");
+#endif  // DEBUG
+    thread_ = std::thread(&Logger::Run, this);
   }
 
-  // Log message
-  char fmsg[kLogStrMaxSize];
-  std::va_list args;
-  va_start(args, msg);
-  std::vsnprintf(fmsg, kLogStrMaxSize, msg, args);
-  va_end(args);
+  /*!
+   * Destructor: the remaining messages are written.
+   */
+  ~Logger() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cond_.notify_one();
+    thread_.join();
+    WriteSlots();
+    if (file_) {
+      std::fclose(file_);
+    }
+  }
+
+  Logger(const Logger&)            = delete;
+  Logger& operator=(const Logger&) = delete;
+
+  /*!
+   * Get the process log.
+   *
+   *  \return Log
+   */
+  static Logger& Get() {
+    static Logger logger;
+    return logger;
+  }
 
-  // Write the log
-  std::fprintf(log_file, "%s\n", fmsg);
+  /*!
+   * Also write the messages to a file (appended), renamed as "<path>.1" once
+   * larger than a max size.
+   *
+   *  \param[in]  file_path    : path to the log file (empty: none)
+   *  \param[in]  max_file_size: max size of the log file (bytes)
+   */
+  void SetFile(const std::string& file_path,
+               size_t max_file_size = 0x10000000) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    file_path_     = file_path;
+    max_file_size_ = max_file_size;
+    OpenFile("at");
+  }
 
-  // Close the file
-  std::fclose(log_file);
+  /*!
+   * Format a message in a slot of the ring buffer (lock-free).
+   *
+   *  \param[in]  level: level
+   *  \param[in]  trace: trace (log file only)?
+   *  \param[in]  msg  : message (printf style)
+   *  \param[in]  args : message arguments
+   *
+   */
+  void Write(LogLevel level, bool trace, const char* msg,
+             std::va_list args) {
+    // Claim a free slot
+    uint64_t pos = write_.load(std::memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+      slot = &slot_[pos % kNumSlot];
+      int64_t diff = int64_t(slot->seq.load(std::memory_order_acquire)) -
+                     int64_t(pos);
+      if (!diff) {
+        if (write_.compare_exchange_weak(pos, pos + 1,
+                                         std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        // Not written yet since the previous lap: full
+        cond_.notify_one();
+        std::this_thread::yield();
+        pos = write_.load(std::memory_order_relaxed);
+      } else {
+        pos = write_.load(std::memory_order_relaxed);
+      }
+    }
 
-  return true;
-}
+    slot->level = level;
+    slot->trace = trace;
+    slot->time  = Clock::now();
+    std::vsnprintf(slot->msg, kSlotSize, msg, args);
+
+    // Publish it, and wake the writing thread up if the ring is half full
+    slot->seq.store(pos + 1, std::memory_order_release);
+    if (pos + 1 - read_.load(std::memory_order_relaxed) >= kNumSlot / 2) {
+      cond_.notify_one();
+    }
+  }
+
+  /*!
+   * Write the queued messages now.
+   */
+  void Flush() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    WriteSlots();
+    if (file_) {
+      std::fflush(file_);
+    }
+  }
+};
 
 
 /*!
- * Write a trace (debug only).
+ * Write a trace in the log file (debug only).
  *
  *  \param[in]  msg: trace message (printf style)
  */
 void LogTrace(const char* msg = nullptr, ...) {
 #ifdef DEBUG
-  const char* kLogDefaultFile = "trace.log";
+  if (!msg || !*msg) {
+    msg = kLogInternalError;
+  }
 
-  // Trace message
-  char fmsg[kLogStrMaxSize];
   std::va_list args;
   va_start(args, msg);
-  std::vsnprintf(fmsg, kLogStrMaxSize, msg, args);
+  Logger::Get().Write(kInfo, true, msg, args);
   va_end(args);
-  LogMsg(kLogDefaultFile, fmsg);
 #endif  // DEBUG
 }
 
 
-/*!
- * Log levels.
- */
-enum LogLevel {
-  kInfo = 0,  // Information
-  kWarning,   // Warning
-  kError      // Error (will terminate the process)
-};
-
-
 /*!
  * Report something.
+ * The messages below JIK_LOG_LEVEL are skipped, except the errors.
  *
  *  \param[in]  level: report state
  *  \param[in]  msg  : message (printf style)
  */
 void Report(LogLevel level, const char* msg = nullptr, ...) {
+  if (level < kLogLevel && level != kError) {
+    return;
+  }
+
   if (!msg || !*msg) {
     msg = kLogInternalError;
   }
 
-  char fmsg[kLogStrMaxSize];
+  Logger& logger = Logger::Get();
   std::va_list args;
   va_start(args, msg);
-  std::vsnprintf(fmsg, kLogStrMaxSize, msg, args);
+  logger.Write(level, false, msg, args);
   va_end(args);
 
-  // State message
-  const char* smsg;
-  switch (level) {
-    // Warning
-    case kWarning: {
-      smsg = "Warning";
-      break;
-    }
-
-    // Error
-    case kError: {
-      smsg = "Error";
-      break;
-    }
-
-    // Information
-    default: {
-      smsg = "Info";
-      break;
-    }
-  }
-
-  // Add a timestamp to the message
-  const size_t kTimeSize = 0x20;
-  char time[kTimeSize];
-  std::time_t now;
-  std::time(&now);
-  std::strftime(time, kTimeSize, "%Y-%m-%d %H:%M:%S", std::localtime(&now));
-  std::fprintf(stderr, "[%s @ %s]: %s\n", smsg, time, fmsg);
-  LogTrace(fmsg);
-
   if (level == kError) {
     // In case of error, terminate the process
+    logger.Flush();
     std::exit(1);
   }
 }
@@ -203,7 +421,7 @@ void Check(bool check, const char* msg, ...) {
   std::vsnprintf(fmsg, kLogStrMaxSize, msg, args);
   va_end(args);
 
-  Report(kError, fmsg);
+  Report(kError, "%s", fmsg);
 }
 
 
@@ -27,14 +27,69 @@
 #define CORE_MAT_H_
 
 
-#include <vector>
+#include <core/buffer.h>
+#include <algorithm>
 #include <memory>
 #include <cstring>
+#include <vector>
 
 
 namespace jik {
 
 
+/*!
+ *  \struct Layout
+ *  \brief  Memory layout of the activations
+ *
+ * The dimensions of a matrix (see Mat) don't change with the layout, only
+ * the order of the values in memory:
+ *  + NCHW (default): width fastest, then height, channel and batch, i.e. one
+ *    plane per channel
+ *  + NHWC: channel fastest, then width, height and batch, i.e. the channels
+ *    of a pixel are contiguous and the loops over them can be vectorized
+ * Both are the same when there's a single channel or a single pixel.
+ */
+struct Layout {
+  /*!
+   *  \enum   E_LAYOUT
+   *  \brief  Layout
+   */
+  enum E_LAYOUT {
+    NCHW = 0,  // Channel planes
+    NHWC       // Channels last
+  };
+
+  /*!
+   * Get the name of a layout.
+   *
+   *  \param[in]  layout: layout
+   *
+   *  \return     Name
+   */
+  static const char* Name(E_LAYOUT layout) {
+    return layout == NHWC ? "nhwc" : "nchw";
+  }
+
+  /*!
+   * Get a layout from its name.
+   *
+   *  \param[in]  name  : name ("nchw" or "nhwc")
+   *
+   *  \param[out] layout: layout
+   *  \return     Known layout?
+   */
+  static bool Get(const char* name, E_LAYOUT* layout) {
+    for (int l = NCHW; l <= NHWC; ++l) {
+      if (!std::strcmp(name, Name(E_LAYOUT(l)))) {
+        *layout = E_LAYOUT(l);
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+
 /*!
  *  \class  Mat
  *  \brief  Matrix class
@@ -55,6 +110,22 @@ namespace jik {
  * in some framework. The fact that we are setting the dimensions to 4 is to
  * allow implicit reshaping when going from fully-connected layers to
  * convolution layers (or vice versa).
+ *
+ * The data is 64-byte aligned and comes from the current Arena, if any (see
+ * Arena::Scope): the matrices of a model, including their derivatives, are
+ * then packed in the same slab instead of being allocated one by one.
+ *
+ * The batch size can change without reallocating (see SetBatchSize): the
+ * data is allocated for the largest batch (see Capacity), and only the
+ * values of the current batch are used (see Size).
+ *
+ * The values are in the NCHW layout, unless tagged otherwise (see Layout and
+ * Model::SetLayout); the derivative has the layout of the data.
+ *
+ * The derivative can be sparse by rows (see sparse), e.g. for an embedding
+ * table where only the looked up rows get a derivative. Whoever writes the
+ * derivative of a row then records it (see AddDerivRow): clearing the
+ * derivative and updating the weights only touch these rows.
  */
 template <typename Dtype>
 class Mat {
@@ -65,9 +136,12 @@ class Mat {
 
   // Public attributes
  public:
-  uint32_t                    size[4];  // Matrix size
-  std::vector<Dtype>          data;     // Matrix data
-  std::shared_ptr<Mat<Dtype>> deriv;    // Derived matrix (gradiants)
+  uint32_t                    size[4];    // Matrix size
+  Buffer<Dtype>               data;       // Matrix data
+  std::shared_ptr<Mat<Dtype>> deriv;      // Derived matrix (gradiants)
+  bool                        sparse;     // Sparse derivative (by rows)?
+  std::vector<uint32_t>       deriv_row;  // Rows of the sparse derivative
+  Layout::E_LAYOUT            layout;     // Memory layout
 
 
   // Public methods
@@ -77,6 +151,8 @@ class Mat {
    */
   Mat() {
     size[0] = size[1] = size[2] = size[3] = 0;
+    sparse  = false;
+    layout  = Layout::NCHW;
   }
 
   /*!
@@ -94,6 +170,8 @@ class Mat {
     size[1] = m;
     size[2] = d;
     size[3] = b;
+    sparse  = false;
+    layout  = Layout::NCHW;
     data.resize(size[0] * size[1] * size[2] * size[3], Dtype(0));
     if (init_deriv) {
       deriv = std::make_shared<Mat<Dtype>>(size, false);
@@ -163,37 +241,118 @@ class Mat {
   }
 
   /*!
-   * Get the matrix size (1D).
+   * Get the matrix size (1D), for the current batch size.
    *
    *  \return Matrix size (1D)
    */
   uint32_t Size() const {
+    return size[0] * size[1] * size[2] * size[3];
+  }
+
+  /*!
+   * Get the number of values allocated (1D), for the largest batch size.
+   *
+   *  \return Number of values allocated
+   */
+  uint32_t Capacity() const {
     return uint32_t(data.size());
   }
 
+  /*!
+   * Get the largest batch size the data is allocated for.
+   *
+   *  \return Largest batch size
+   */
+  uint32_t MaxBatchSize() const {
+    uint32_t batch_data_size = size[0] * size[1] * size[2];
+    if (!batch_data_size) {
+      return 0;
+    }
+    return Capacity() / batch_data_size;
+  }
+
+  /*!
+   * Set the batch size (and the one of the derivative), without
+   * reallocating: it must not be larger than MaxBatchSize.
+   *
+   *  \param[in]  batch_size: batch size
+   */
+  void SetBatchSize(uint32_t batch_size) {
+    size[3] = batch_size;
+    if (deriv) {
+      deriv->size[3] = batch_size;
+    }
+  }
+
+  /*!
+   * Check if the values are stored the same way in both layouts (a single
+   * channel or a single pixel).
+   *
+   *  \return Layout independent?
+   */
+  bool AnyLayout() const {
+    return size[2] == 1 || size[0] * size[1] == 1;
+  }
+
   /*!
    * Set the matrix to a special value.
    *
    *  \param  val: value
    */
   void Set(Dtype val) {
-    std::fill(data.begin(), data.end(), val);
+    std::fill(data.begin(), data.begin() + std::min(Size(), Capacity()),
+              val);
   }
 
   /*!
    * Zero out the matrix.
    */
   void Zero() {
-    std::memset(&data[0], 0, data.size() * sizeof(Dtype));
+    if (data.empty()) {
+      return;
+    }
+    std::memset(&data[0], 0, std::min(Size(), Capacity()) * sizeof(Dtype));
   }
 
   /*!
    * Zero out the derivative matrix.
    */
   void ZeroDeriv() {
-    if (deriv) {
-      std::memset(&deriv->data[0], 0, deriv->data.size() * sizeof(Dtype));
+    if (!deriv) {
+      return;
+    }
+    if (sparse) {
+      // Only the rows having a derivative
+      uint32_t row_size = size[0];
+      for (uint32_t row : deriv_row) {
+        std::memset(&deriv->data[row * row_size], 0,
+                    row_size * sizeof(Dtype));
+      }
+      deriv_row.clear();
+      return;
     }
+    deriv->Zero();
+  }
+
+  /*!
+   * Record a row of a sparse derivative.
+   *
+   *  \param[in]  row: row index
+   */
+  void AddDerivRow(uint32_t row) {
+    deriv_row.push_back(row);
+  }
+
+  /*!
+   * Get the rows of a sparse derivative.
+   *
+   *  \return Rows (sorted, without duplicates)
+   */
+  const std::vector<uint32_t>& DerivRow() {
+    std::sort(deriv_row.begin(), deriv_row.end());
+    deriv_row.erase(std::unique(deriv_row.begin(), deriv_row.end()),
+                    deriv_row.end());
+    return deriv_row;
   }
 };
 
@@ -0,0 +1,258 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#ifndef CORE_MEMORY_STATS_H_
+#define CORE_MEMORY_STATS_H_
+
+
+#include <core/log.h>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  MemoryStats
+ *  \brief  Accounting of the memory of the matrices
+ *
+ * Every matrix storage (see Buffer) is counted as an allocation, whether it
+ * comes from an arena or from the heap, and the heap memory (the arena slabs
+ * and the matrices allocated outside of an arena) is tracked while it is
+ * live, along with its peak. The counters are always updated (one atomic
+ * operation per allocation); enabling the stats asks the model to measure
+ * the peak of each layer pass from a mark (see Mark), and the model and the
+ * solver to report them (see Model::PrintMemory and Solver::Train).
+ *
+ * Once a training step has run, the following steps are not expected to
+ * allocate anything: a Forbid scope turns any allocation on its thread into
+ * an error, reporting the size of the offending matrix. Only the thread of
+ * the scope is checked (e.g. not the prefetching threads).
+ *
+ * A single instance is shared by the whole process (see Get).
+ */
+class MemoryStats {
+  // Public types
+ public:
+  /*!
+   *  \class  Forbid
+   *  \brief  Forbid the allocations on this thread for the lifetime of the
+   *          scope
+   */
+  class Forbid {
+    // Protected attributes
+   protected:
+    bool prev_;   // Previously forbidden?
+
+
+    // Public methods
+   public:
+    /*!
+     * Constructor.
+     *
+     *  \param[in]  forbid: forbid the allocations?
+     */
+    explicit Forbid(bool forbid = true) {
+      prev_                    = MemoryStats::Forbidden();
+      MemoryStats::Forbidden() = forbid;
+    }
+
+    /*!
+     * Destructor.
+     */
+    ~Forbid() {
+      MemoryStats::Forbidden() = prev_;
+    }
+
+    Forbid(const Forbid&)            = delete;
+    Forbid& operator=(const Forbid&) = delete;
+  };
+
+
+  // Protected attributes
+ protected:
+  bool                  enabled_;     // Report the stats?
+  std::atomic<int64_t>  live_;        // Live heap memory (bytes)
+  std::atomic<int64_t>  peak_;        // Peak heap memory (bytes)
+  std::atomic<int64_t>  mark_peak_;   // Peak heap memory since the mark
+  std::atomic<uint64_t> num_alloc_;   // Number of allocations
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Constructor.
+   */
+  MemoryStats() : live_(0), peak_(0), mark_peak_(0), num_alloc_(0) {
+    enabled_ = false;
+  }
+
+  /*!
+   * Check if the allocations are forbidden on this thread.
+   *
+   *  \return Reference to the flag
+   */
+  static bool& Forbidden() {
+    static thread_local bool forbidden = false;
+    return forbidden;
+  }
+
+  /*!
+   * Raise a peak to the live memory.
+   *
+   *  \param[in]  live: live memory (bytes)
+   *
+   *  \param[out] peak: peak memory (bytes)
+   */
+  static void RaisePeak(int64_t live, std::atomic<int64_t>* peak) {
+    int64_t prev = peak->load(std::memory_order_relaxed);
+    while (live > prev &&
+           !peak->compare_exchange_weak(prev, live,
+                                        std::memory_order_relaxed)) {}
+  }
+
+
+  // Public methods
+ public:
+  MemoryStats(const MemoryStats&)            = delete;
+  MemoryStats& operator=(const MemoryStats&) = delete;
+
+  /*!
+   * Get the process memory stats.
+   *
+   *  \return Memory stats
+   */
+  static MemoryStats& Get() {
+    static MemoryStats stats;
+    return stats;
+  }
+
+  /*!
+   * Enable the reports.
+   *
+   *  \param[in]  enabled: report the stats?
+   */
+  void Enable(bool enabled = true) {
+    enabled_ = enabled;
+  }
+
+  /*!
+   * Check if the reports are enabled.
+   *
+   *  \return Enabled?
+   */
+  bool Enabled() const {
+    return enabled_;
+  }
+
+  /*!
+   * Count the allocation of a matrix storage.
+   *
+   *  \param[in]  size: size (bytes)
+   */
+  void Count(size_t size) {
+    if (Forbidden()) {
+      Report(kError, "Allocating %ld byte(s) in the steady state", size);
+    }
+    num_alloc_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  /*!
+   * Track some heap memory being allocated.
+   *
+   *  \param[in]  size: size (bytes)
+   */
+  void Reserve(size_t size) {
+    int64_t live = live_.fetch_add(int64_t(size),
+                                   std::memory_order_relaxed) + int64_t(size);
+    RaisePeak(live, &peak_);
+    RaisePeak(live, &mark_peak_);
+  }
+
+  /*!
+   * Track some heap memory being freed.
+   *
+   *  \param[in]  size: size (bytes)
+   */
+  void Release(size_t size) {
+    live_.fetch_sub(int64_t(size), std::memory_order_relaxed);
+  }
+
+  /*!
+   * Get the live heap memory.
+   *
+   *  \return Size (bytes)
+   */
+  size_t Live() const {
+    return size_t(live_.load(std::memory_order_relaxed));
+  }
+
+  /*!
+   * Get the peak heap memory.
+   *
+   *  \return Size (bytes)
+   */
+  size_t Peak() const {
+    return size_t(peak_.load(std::memory_order_relaxed));
+  }
+
+  /*!
+   * Start measuring the peak heap memory from now (see PeakSinceMark). The
+   * memory allocated meanwhile by the other threads is measured as well.
+   *
+   *  \return Live heap memory (bytes)
+   */
+  size_t Mark() {
+    int64_t live = live_.load(std::memory_order_relaxed);
+    mark_peak_.store(live, std::memory_order_relaxed);
+    return size_t(live);
+  }
+
+  /*!
+   * Get the peak heap memory since the last mark (see Mark).
+   *
+   *  \return Size (bytes)
+   */
+  size_t PeakSinceMark() const {
+    return size_t(mark_peak_.load(std::memory_order_relaxed));
+  }
+
+  /*!
+   * Get the number of allocations so far.
+   *
+   *  \return Number of allocations
+   */
+  uint64_t NumAlloc() const {
+    return num_alloc_.load(std::memory_order_relaxed);
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_MEMORY_STATS_H_
@@ -27,14 +27,25 @@
 #define CORE_MODEL_H_
 
 
+#include <core/arena.h>
 #include <core/log.h>
 #include <core/layer.h>
 #include <core/layer_data.h>
 #include <core/layer_loss.h>
+#include <core/layer_reorder.h>
+#include <core/memory_stats.h>
+#include <core/model_file.h>
+#include <core/profiler.h>
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
+#include <functional>
+#include <map>
 #include <memory>
+#include <set>
 #include <vector>
 #include <string>
+#include <typeinfo>
 
 
 namespace jik {
@@ -46,6 +57,14 @@ namespace jik {
  *
  * A model is an execution graph composed of a
  * stack of layers with a defined input and output.
+ *
+ * The model owns a memory arena: the layers created while it is current
+ * (see Arena::Scope) have their activations and derivatives in one slab.
+ *
+ * For training, the layers can be split into checkpointed segments (see
+ * Checkpoint): only the activations at the boundaries of the segments are
+ * kept, the ones inside a segment share their memory with the other
+ * segments and are recomputed during the backward pass.
  */
 template <typename Dtype>
 class Model {
@@ -53,6 +72,8 @@ class Model {
  public:
   typedef Dtype Type;
 
+  static const size_t kNoSegment = size_t(-1);  // Not in a segment
+
 
   // Protected attributes
  protected:
@@ -60,6 +81,18 @@ class Model {
   std::vector<std::shared_ptr<Layer<Dtype>>> layer_;  // List of layers
   std::shared_ptr<Mat<Dtype>>                in_;     // Input  of the model
   std::shared_ptr<Mat<Dtype>>                out_;    // Output of the model
+  Arena                                      arena_;  // Memory arena
+  std::vector<bool>                          fused_;  // Layers fused into
+                                                      // a previous one
+  std::function<void(size_t)>                hook_;   // Backward hook
+  std::vector<size_t>                        segment_;    // Segments bounds
+  std::vector<size_t>                        layer_seg_;  // Layers segment
+  std::vector<std::vector<std::shared_ptr<Mat<Dtype>>>>
+                                             inner_;      // Segments inner
+                                                          // activations
+  size_t                                     resident_;   // Segment computed
+  std::vector<size_t>                        layer_peak_; // Layers peak
+                                                          // heap memory
 
 
   // Public methods
@@ -71,7 +104,8 @@ class Model {
    */
   explicit Model(const char* name) {
     Check(name && *name, "A graph must have a name");
-    name_ = name;
+    name_     = name;
+    resident_ = kNoSegment;
   }
 
   /*!
@@ -88,11 +122,25 @@ class Model {
     return name_.c_str();
   }
 
+  /*!
+   * Get the memory arena.
+   *
+   *  \return Memory arena
+   */
+  Arena* Memory() {
+    return &arena_;
+  }
+
   /*!
    * Clear the layers.
    */
   void Clear() {
     layer_.clear();
+    fused_.clear();
+    segment_.clear();
+    layer_seg_.clear();
+    inner_.clear();
+    resident_ = kNoSegment;
   }
 
   /*!
@@ -104,6 +152,20 @@ class Model {
     return in_->size[3];
   }
 
+  /*!
+   * Estimate the number of floating point operations of a forward pass
+   * (see Layer::Flop).
+   *
+   *  \return Number of operations
+   */
+  uint64_t Flop() const {
+    uint64_t flop = 0;
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      flop += layer_[i]->Flop();
+    }
+    return flop;
+  }
+
   /*!
    * Get the input of the model.
    *
@@ -135,13 +197,160 @@ class Model {
   }
 
   /*!
-   * Read the graph from a file stream.
+   * Copy the weights of another model having the same layers, e.g. a
+   * snapshot of the model being trained (see Evaluator).
+   *
+   *  \param[in]  model: model to copy
+   *
+   *  \return     Error?
+   */
+  bool CopyWeight(Model<Dtype>* model) {
+    std::vector<std::shared_ptr<Mat<Dtype>>> src, dst;
+    model->GetWeight(&src);
+    GetWeight(&dst);
+    if (src.size() != dst.size()) {
+      Report(kWarning, "Model '%s' has %ld weight(s) instead of %ld",
+             Name(), dst.size(), src.size());
+      return false;
+    }
+    for (size_t i = 0; i < src.size(); ++i) {
+      if (src[i]->Size() != dst[i]->Size()) {
+        Report(kWarning, "Model '%s' weight %ld has %d value(s) instead of "
+               "%d", Name(), i, dst[i]->Size(), src[i]->Size());
+        return false;
+      }
+      std::copy(src[i]->Data(), src[i]->Data() + src[i]->Size(),
+                dst[i]->Data());
+    }
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      layer_[i]->WeightChanged();
+    }
+    return true;
+  }
+
+  /*!
+   * Get the name of a layer (its index if it has no name).
+   *
+   *  \param[in]  i: layer index
+   *
+   *  \return     Layer name
+   */
+  std::string LayerName(size_t i) const {
+    return *layer_[i]->Name() ? layer_[i]->Name() :
+           "layer" + std::to_string(i);
+  }
+
+  /*!
+   * Get all the layers weights as tensors, with their names
+   * ("<layer name>.<index>").
+   * The filter of a layer running in int8 is replaced by its quantized
+   * version ("<layer name>.0.int8"), its scales ("<layer name>.0.scale")
+   * and its input range ("<layer name>.0.range"), see Quantizer.
+   * The filter of a pruned layer is replaced by the values of its blocks
+   * ("<layer name>.0.sparse"), their inputs ("<layer name>.0.index") and the
+   * first block of each group ("<layer name>.0.offset"), see SparseFilter.
+   *
+   *  \param[out] tensor: list of tensors
+   */
+  void GetTensor(
+    std::vector<typename ModelFile<Dtype>::Tensor>* tensor) const {
+    tensor->clear();
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      std::string prefix = LayerName(i) + ".";
+      std::vector<std::shared_ptr<Mat<Dtype>>> weight;
+      layer_[i]->GetWeight(&weight);
+      const Quantizer<Dtype>* quant  = layer_[i]->GetQuantizer();
+      SparseFilter<Dtype>*    sparse = layer_[i]->GetSparse();
+      for (size_t j = 0; j < weight.size(); ++j) {
+        std::string name = prefix + std::to_string(j);
+        if (!j && quant && quant->Mode() == Quantizer<Dtype>::MODE_INT8) {
+          std::shared_ptr<Mat<int8_t>> qfilter;
+          std::shared_ptr<Mat<Dtype>>  scale, range;
+          quant->GetTensor(&qfilter, &scale, &range);
+          tensor->push_back(ModelFile<Dtype>::Describe(name + ".int8",
+                                                       qfilter));
+          tensor->push_back(ModelFile<Dtype>::Describe(name + ".scale",
+                                                       scale));
+          tensor->push_back(ModelFile<Dtype>::Describe(name + ".range",
+                                                       range));
+          continue;
+        }
+        if (!j && sparse && sparse->Active()) {
+          if (!sparse->Packed()) {
+            sparse->Pack();
+          }
+          std::shared_ptr<Mat<Dtype>>   value;
+          std::shared_ptr<Mat<int32_t>> index, offset;
+          sparse->GetTensor(&value, &index, &offset);
+          tensor->push_back(ModelFile<Dtype>::Describe(name + ".sparse",
+                                                       value));
+          tensor->push_back(ModelFile<Dtype>::Describe(name + ".index",
+                                                       index));
+          tensor->push_back(ModelFile<Dtype>::Describe(name + ".offset",
+                                                       offset));
+          continue;
+        }
+        tensor->push_back(ModelFile<Dtype>::Describe(name, weight[j]));
+      }
+    }
+  }
+
+  /*!
+   * Switch the layers saved quantized in a file stream to int8, and the
+   * layers saved pruned to their compressed blocks, sized as in the file
+   * (see ModelFile, the position is kept).
    *
    *  \param[in]  fp: file stream
    *
-   *  \return     Data size read from the file
+   *  \return     Error?
    */
-  size_t Read(std::FILE* fp) const {
+  bool ReadMode(std::FILE* fp) const {
+    std::vector<std::string> name;
+    std::vector<uint32_t>    size;
+    if (!ModelFile<Dtype>::Names(fp, &name, &size)) {
+      return false;
+    }
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      Quantizer<Dtype>* quant = layer_[i]->GetQuantizer();
+      if (quant && std::find(name.begin(), name.end(),
+                             LayerName(i) + ".0.int8") != name.end()) {
+        quant->SetMode(Quantizer<Dtype>::MODE_INT8);
+      }
+      SparseFilter<Dtype>* sparse = layer_[i]->GetSparse();
+      size_t index = std::find(name.begin(), name.end(),
+                               LayerName(i) + ".0.index") - name.begin();
+      if (sparse && index < name.size()) {
+        sparse->Resize(size[4 * index]);
+      }
+    }
+    return true;
+  }
+
+  /*!
+   * Expand the compressed blocks read from a file into the filters of the
+   * pruned layers (see SparseFilter).
+   *
+   *  \return Error?
+   */
+  bool Unpack() const {
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      SparseFilter<Dtype>* sparse = layer_[i]->GetSparse();
+      if (sparse && sparse->Active() && !sparse->Unpack()) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /*!
+   * Read the graph from a file stream in the legacy format (weights only,
+   * each prefixed by its number of values).
+   *
+   *  \param[in]  fp: file stream
+   *
+   *  \return     Data size read from the file (0 on error)
+   */
+  size_t ReadLegacy(std::FILE* fp) const {
     size_t res = 0;
     for (size_t i = 0; i < layer_.size(); ++i) {
       std::vector<std::shared_ptr<Mat<Dtype>>> weight;
@@ -149,75 +358,102 @@ class Model {
       for (const std::shared_ptr<Mat<Dtype>>& w : weight) {
         // Read the number of weights
         uint32_t weight_size;
-        res += std::fread(reinterpret_cast<void*>(&weight_size), 1,
-                          sizeof(uint32_t), fp);
+        if (std::fread(reinterpret_cast<void*>(&weight_size), 1,
+                       sizeof(uint32_t), fp) != sizeof(uint32_t)) {
+          Report(kError, "Model file is truncated");
+          return 0;
+        }
+        res += sizeof(uint32_t);
         // Check the number of weights in the file is matching
         if (w->Size() != weight_size) {
           Report(kError, "Weights from file is not matching current model");
-          return res;
+          return 0;
         }
         // Read the weights
-        res += std::fread(reinterpret_cast<void*>(w->Data()), 1,
-                          sizeof(Dtype) * weight_size, fp);
+        size_t bytes = sizeof(Dtype) * weight_size;
+        if (std::fread(reinterpret_cast<void*>(w->Data()), 1, bytes, fp) !=
+            bytes) {
+          Report(kError, "Model file is truncated");
+          return 0;
+        }
+        res += bytes;
       }
     }
     return res;
   }
 
   /*!
-   * Write the graph in a file stream.
+   * Read the graph from a file stream (see ModelFile, or the legacy format).
    *
    *  \param[in]  fp: file stream
    *
-   *  \return     Data size written to the file
+   *  \return     Data size read from the file (0 on error)
    */
-  size_t Write(std::FILE* fp) const {
-    size_t res = 0;
-    for (size_t i = 0; i < layer_.size(); ++i) {
-      std::vector<std::shared_ptr<Mat<Dtype>>> weight;
-      layer_[i]->GetWeight(&weight);
-      for (const std::shared_ptr<Mat<Dtype>>& w : weight) {
-        // Write the number of weights
-        uint32_t weight_size = w->Size();
-        res += std::fwrite(reinterpret_cast<void*>(&weight_size), 1,
-                           sizeof(uint32_t), fp);
-        // Write the weights
-        res += std::fwrite(reinterpret_cast<void*>(w->Data()), 1,
-                           sizeof(Dtype) * weight_size, fp);
-      }
+  size_t Read(std::FILE* fp) const {
+    if (!ModelFile<Dtype>::Detect(fp)) {
+      return ReadLegacy(fp);
     }
-    return res;
+    if (!ReadMode(fp)) {
+      return 0;
+    }
+    std::vector<typename ModelFile<Dtype>::Tensor> tensor;
+    GetTensor(&tensor);
+    size_t size = ModelFile<Dtype>::Read(fp, tensor);
+    return size && Unpack() ? size : 0;
+  }
+
+  /*!
+   * Write the graph in a file stream (see ModelFile).
+   *
+   *  \param[in]  fp: file stream
+   *
+   *  \return     Data size written to the file (0 on error)
+   */
+  size_t Write(std::FILE* fp) const {
+    std::vector<typename ModelFile<Dtype>::Tensor> tensor;
+    GetTensor(&tensor);
+    return ModelFile<Dtype>::Write(fp, tensor);
   }
 
   /*!
    * Read the graph from disk.
+   * The file can be mapped in memory instead of being read, the weights then
+   * pointing straight to the mapping (e.g. for a model only used for
+   * inference, to start faster).
    *
    *  \param[in]  file_path: path to the file
+   *  \param[in]  map      : map the file in memory?
    *
-   *  \return     Data size read from the file
+   *  \return     Data size read from the file (0 on error)
    */
-  size_t Load(const char* file_path) const {
+  size_t Load(const char* file_path, bool map = false) const {
     if (!file_path || !*file_path) {
       Report(kError, "Invalid file name");
       return 0;
     }
-    std::FILE* fp = std::fopen(file_path, "r");
+    std::FILE* fp = std::fopen(file_path, "rb");
     if (!fp) {
       Report(kError, "Can't open file '%s' for read", file_path);
       return 0;
     }
+    if (map && ModelFile<Dtype>::Detect(fp)) {
+      bool res = ReadMode(fp);
+      std::fclose(fp);
+      if (!res) {
+        return 0;
+      }
+      std::vector<typename ModelFile<Dtype>::Tensor> tensor;
+      GetTensor(&tensor);
+      size_t size = ModelFile<Dtype>::Map(file_path, tensor);
+      return size && Unpack() ? size : 0;
+    }
     size_t size = Read(fp);
     std::fclose(fp);
-    if (!size) {
-      // Nothing to write
-      std::remove(file_path);
-      return 0;
-    }
     return size;
   }
 
   /*!
-   * Save the graph on disk.
+   * Save the graph on disk (atomically, see ModelFile::Save).
    *
    *  \param[in]  file_path: path to the file
    *
@@ -228,19 +464,9 @@ class Model {
       Report(kError, "Invalid file name");
       return 0;
     }
-    std::FILE* fp = std::fopen(file_path, "wb");
-    if (!fp) {
-      Report(kError, "Can't open file '%s' for write", file_path);
-      return 0;
-    }
-    size_t size = Write(fp);
-    std::fclose(fp);
-    if (!size) {
-      // Nothing to write
-      std::remove(file_path);
-      return 0;
-    }
-    return size;
+    std::vector<typename ModelFile<Dtype>::Tensor> tensor;
+    GetTensor(&tensor);
+    return ModelFile<Dtype>::Save(file_path, tensor);
   }
 
   /*!
@@ -274,33 +500,985 @@ class Model {
   }
 
   /*!
-   * Set the batch size.
+   * Get the largest batch size the activations are allocated for, i.e. the
+   * batch size the model was created with.
+   *
+   *  \return Largest batch size
+   */
+  uint32_t MaxBatchSize() const {
+    return in_->MaxBatchSize();
+  }
+
+  /*!
+   * Set the batch size of the activations, without reallocating them (see
+   * Mat::SetBatchSize): the layers only process the current batch, e.g. the
+   * last one of a dataset, being smaller. It can't be larger than the batch
+   * size the model was created with (see MaxBatchSize).
+   *
+   * The weights (some layers take them as inputs, e.g. in recurrent models)
+   * and the activations shared by all the batches (allocated for a single
+   * one) are left untouched.
    *
    *  \param[in]  batch_size: batch size
+   *
+   *  \return     Error?
    */
-  void SetBatchSize(uint32_t batch_size) {
+  bool SetBatchSize(uint32_t batch_size) {
+    uint32_t max_batch_size = MaxBatchSize();
+    if (batch_size > max_batch_size) {
+      Report(kError, "Batch size %d is larger than the one of model '%s' "
+             "(%d)", batch_size, Name(), max_batch_size);
+      return false;
+    }
+
+    std::vector<std::shared_ptr<Mat<Dtype>>> weight;
+    GetWeight(&weight);
+    std::set<const Mat<Dtype>*> skip;
+    for (const std::shared_ptr<Mat<Dtype>>& w : weight) {
+      skip.insert(w.get());
+    }
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      for (const std::vector<std::shared_ptr<Mat<Dtype>>>* mats :
+           {&layer_[i]->Input(), &layer_[i]->Output()}) {
+        for (const std::shared_ptr<Mat<Dtype>>& mat : *mats) {
+          // The activations of the fused layers are released (see Plan)
+          if (skip.count(mat.get()) ||
+              (mat->Capacity() && mat->MaxBatchSize() < max_batch_size)) {
+            continue;
+          }
+          mat->SetBatchSize(batch_size);
+        }
+      }
+    }
+    return true;
+  }
+
+  /*!
+   * Check if some layers are running in int8 (see Quantizer).
+   *
+   *  \return Quantized?
+   */
+  bool Quantized() const {
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      const Quantizer<Dtype>* quant = layer_[i]->GetQuantizer();
+      if (quant && quant->Mode() == Quantizer<Dtype>::MODE_INT8) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /*!
+   * Set the quantization mode of the layers supporting int8 inference
+   * (see Quantizer). Post-training quantization is done by calibrating the
+   * model (MODE_CALIBRATE) on a pass over some data, e.g. the testing set,
+   * before switching to MODE_INT8.
+   *
+   *  \param[in]  mode: quantization mode
+   */
+  void SetQuantMode(typename Quantizer<Dtype>::E_MODE mode) {
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      Quantizer<Dtype>* quant = layer_[i]->GetQuantizer();
+      if (quant) {
+        quant->SetMode(mode);
+      }
+    }
+  }
+
+  /*!
+   * Prune the layers supporting it (see SparseFilter): the blocks of their
+   * filter with the smallest magnitude are set to 0, and the layers switch
+   * to sparse inference. Pruning again with a higher sparsity prunes more
+   * blocks (e.g. gradually while training, see Solver::SetPrune).
+   *
+   *  \param[in]  sparsity: fraction of the blocks to prune in each layer
+   *
+   *  \return     Number of layers pruned
+   */
+  uint32_t Prune(Dtype sparsity) {
+    uint32_t num_layer = 0;
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      SparseFilter<Dtype>* sparse = layer_[i]->GetSparse();
+      if (sparse) {
+        sparse->Prune(sparsity);
+        ++num_layer;
+      }
+    }
+    return num_layer;
+  }
+
+  /*!
+   * Set the pruned blocks of the filters back to 0, after the weights were
+   * updated (see Prune).
+   */
+  void ApplyMask() {
     for (size_t i = 0; i < layer_.size(); ++i) {
-      layer_[i]->SetBatchSize(batch_size);
+      SparseFilter<Dtype>* sparse = layer_[i]->GetSparse();
+      if (sparse && sparse->Active()) {
+        sparse->ApplyMask();
+      }
     }
   }
 
+  /*!
+   * Set the precision of the activations kept for the backward pass by the
+   * layers supporting it (see Layer::SetPrecision): 16-bit formats halve
+   * their memory and bandwidth, while the weights, their derivatives and the
+   * solver state stay in Dtype.
+   *
+   *  \param[in]  format: storage format
+   *
+   *  \return     Number of layers supporting it
+   */
+  uint32_t SetPrecision(Half::E_FORMAT format) {
+    uint32_t num_layer = 0;
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      num_layer += layer_[i]->SetPrecision(format);
+    }
+    return num_layer;
+  }
+
+  /*!
+   * Set the memory layout of the activations (see Layout): the layers
+   * supporting it switch to it, the other ones staying in NCHW, and a
+   * reorder layer (see LayerReorder) is inserted before a layer wherever one
+   * of its inputs is in the other layout (once per activations). Layers
+   * consuming a NHWC activations then run on their NHWC copy, e.g. a
+   * convolutional network gets one reorder after its data layer and one
+   * before its first inner product.
+   * It must be called once, right after creating the model (before fusing,
+   * planning or checkpointing it).
+   *
+   *  \param[in]  layout: layout
+   *
+   *  \return     Number of reorder layers inserted
+   */
+  uint32_t SetLayout(Layout::E_LAYOUT layout) {
+    Check(fused_.empty() && segment_.empty(), "The layout of model '%s' "
+          "must be set before fusing, planning or checkpointing it", Name());
+    if (layout == Layout::NCHW) {
+      return 0;
+    }
+
+    // Activations copied in another layout
+    std::map<const Mat<Dtype>*, std::shared_ptr<Mat<Dtype>>> copy;
+    uint32_t num_reorder = 0;
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      std::shared_ptr<Layer<Dtype>> layer = layer_[i];
+      Layout::E_LAYOUT layer_layout = layer->SetLayout(layout) ? layout :
+                                      Layout::NCHW;
+      for (size_t j = 0; j < layer->Input().size(); ++j) {
+        std::shared_ptr<Mat<Dtype>> in = layer->Input()[j];
+        if (in->layout == layer_layout || in->AnyLayout()) {
+          continue;
+        }
+        std::shared_ptr<Mat<Dtype>>& in_copy = copy[in.get()];
+        if (!in_copy) {
+          Param param;
+          param.Add("layout", Layout::Name(layer_layout));
+          std::string name = LayerName(i) + "." + Layout::Name(layer_layout);
+          std::shared_ptr<Layer<Dtype>> reorder =
+            std::make_shared<LayerReorder<Dtype>>(name.c_str(),
+              std::vector<std::shared_ptr<Mat<Dtype>>>{in}, param);
+          layer_.insert(layer_.begin() + i++, reorder);
+          in_copy = reorder->Output()[0];
+          ++num_reorder;
+        }
+        layer->SetInput(j, in_copy);
+      }
+    }
+    return num_reorder;
+  }
+
+  /*!
+   * Check if the outputs of a layer are only used as the input of the next
+   * one (so the next one can be fused, see Fuse).
+   *
+   *  \param[in]  i: layer index
+   *
+   *  \return     Only used by the next layer?
+   */
+  bool OnlyFeedsNext(size_t i) const {
+    if (i + 1 >= layer_.size() || layer_[i]->Output().size() != 1) {
+      return false;
+    }
+    const std::shared_ptr<Mat<Dtype>>& out = layer_[i]->Output()[0];
+    if (out == in_ || out == out_) {
+      return false;
+    }
+    for (size_t j = 0; j < layer_.size(); ++j) {
+      const std::vector<std::shared_ptr<Mat<Dtype>>>& in = layer_[j]->Input();
+      if (j != i + 1 && std::find(in.begin(), in.end(), out) != in.end()) {
+        return false;
+      }
+    }
+    return layer_[i + 1]->Input().size() == 1 &&
+           layer_[i + 1]->Input()[0] == out;
+  }
+
+  /*!
+   * Fuse the layers for inference (see Fusion): the batch normalization,
+   * scale and ReLU layers following a convolution, inner product or batch
+   * normalization are applied in the output loop of that layer, and skipped
+   * in the testing phase.
+   * The fused transforms are calculated from the current weights, the model
+   * must be fused again if they change (e.g. after training or loading).
+   *
+   *  \return Number of layers fused
+   */
+  uint32_t Fuse() {
+    uint32_t num_fused = 0;
+    fused_.assign(layer_.size(), false);
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      Fusion<Dtype>* fusion = layer_[i]->Fuse();
+      if (!fusion) {
+        continue;
+      }
+      size_t j = i;
+      while (!fusion->HasRelu() && OnlyFeedsNext(j) &&
+             layer_[j + 1]->FuseInto(fusion)) {
+        fused_[++j] = true;
+      }
+      if (j > i) {
+        fusion->SetOut(layer_[j]->Output()[0]);
+        num_fused += uint32_t(j - i);
+      }
+      i = j;
+    }
+    return num_fused;
+  }
+
+  /*!
+   * Get the memory used by the activations of the layers, each buffer being
+   * counted once (see Plan).
+   *
+   *  \return Memory (bytes, derivatives included)
+   */
+  size_t ActivationMemory() const {
+    std::map<const Dtype*, size_t> mem;
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      for (const std::shared_ptr<Mat<Dtype>>& out : layer_[i]->Output()) {
+        size_t& size = mem[out->Data()];
+        size = std::max(size, size_t(out->Capacity()));
+        if (out->deriv) {
+          size_t& deriv_size = mem[out->DerivData()];
+          deriv_size = std::max(deriv_size,
+                                size_t(out->deriv->Capacity()));
+        }
+      }
+    }
+    mem.erase(nullptr);
+    size_t res = 0;
+    for (const std::pair<const Dtype* const, size_t>& m : mem) {
+      res += m.second * sizeof(Dtype);
+    }
+    return res;
+  }
+
+  /*!
+   * Print the memory of the layers as a table: the activations, gradients
+   * (derivatives of the activations and weights), weights and solver state
+   * of the weights, adding up to the live memory of a layer. A buffer is
+   * counted once, for the first layer using it (see Plan), and the layers
+   * are aggregated as in the profiler (see Profiler::Label).
+   *
+   * The peak memory of a layer adds the largest heap memory allocated during
+   * one of its passes (e.g. scratch buffers, or the first allocation of
+   * some activations), measured while the memory stats are enabled (see
+   * MemoryStats::Mark): the table is best printed after a pass.
+   *
+   *  \param[in]  state: solver state memory of the weights (bytes, indexed
+   *                     by the weight data, see Solver::StateMemory)
+   *
+   *  \return     Total live memory (bytes)
+   */
+  size_t PrintMemory(const std::map<const Dtype*, size_t>& state = {}) const {
+    enum E_MEM {
+      MEM_ACTIVATION = 0,
+      MEM_GRADIENT,
+      MEM_WEIGHT,
+      MEM_STATE,
+      MEM_COUNT
+    };
+    struct Row {
+      std::string label;             // Layer label
+      size_t      byte[MEM_COUNT];   // Memory (bytes)
+      size_t      peak;              // Peak heap memory of a pass (bytes)
+    };
+
+    std::vector<Row>              row;
+    std::map<std::string, size_t> row_index;
+    std::set<const Dtype*>        counted;
+    size_t                        total[MEM_COUNT] = {};
+    size_t                        total_peak = 0;
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      const Layer<Dtype>& layer = *layer_[i];
+      std::string label = Profiler::Label(layer.Name(), typeid(layer));
+      std::map<std::string, size_t>::const_iterator itr =
+        row_index.find(label);
+      size_t index = itr != row_index.end() ? itr->second : row.size();
+      if (index == row.size()) {
+        Row r = {};
+        r.label = label;
+        row.push_back(r);
+        row_index[label] = index;
+      }
+      if (i < layer_peak_.size()) {
+        row[index].peak = std::max(row[index].peak, layer_peak_[i]);
+        total_peak      = std::max(total_peak, layer_peak_[i]);
+      }
+
+      auto add = [&](E_MEM mem, const std::shared_ptr<Mat<Dtype>>& mat) {
+        if (mat && mat->Data() && counted.insert(mat->Data()).second) {
+          size_t byte = size_t(mat->Capacity()) * sizeof(Dtype);
+          row[index].byte[mem] += byte;
+          total[mem]           += byte;
+        }
+      };
+      for (const std::shared_ptr<Mat<Dtype>>& in : layer.Input()) {
+        add(MEM_ACTIVATION, in);
+        add(MEM_GRADIENT  , in->deriv);
+      }
+      for (const std::shared_ptr<Mat<Dtype>>& out : layer.Output()) {
+        add(MEM_ACTIVATION, out);
+        add(MEM_GRADIENT  , out->deriv);
+      }
+      std::vector<std::shared_ptr<Mat<Dtype>>> weight;
+      layer.GetWeight(&weight);
+      for (const std::shared_ptr<Mat<Dtype>>& w : weight) {
+        typename std::map<const Dtype*, size_t>::const_iterator s =
+          state.find(w->Data());
+        if (s != state.end() && counted.count(w->Data()) == 0) {
+          row[index].byte[MEM_STATE] += s->second;
+          total[MEM_STATE]           += s->second;
+        }
+        add(MEM_WEIGHT  , w);
+        add(MEM_GRADIENT, w->deriv);
+      }
+    }
+
+    auto print = [](const char* label, const size_t byte[MEM_COUNT],
+                    size_t peak) {
+      size_t live = 0;
+      for (uint32_t mem = 0; mem < MEM_COUNT; ++mem) {
+        live += byte[mem];
+      }
+      Report(kInfo, "%-32s %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f", label,
+             byte[MEM_ACTIVATION] * 1e-6, byte[MEM_GRADIENT] * 1e-6,
+             byte[MEM_WEIGHT] * 1e-6, byte[MEM_STATE] * 1e-6, live * 1e-6,
+             (live + peak) * 1e-6);
+      return live;
+    };
+    size_t total_byte = total[MEM_ACTIVATION] + total[MEM_GRADIENT] +
+                        total[MEM_WEIGHT] + total[MEM_STATE];
+    Report(kInfo, "Memory (%.3f MB in %ld layer(s)):", total_byte * 1e-6,
+           layer_.size());
+    Report(kInfo, "%-32s %10s %10s %10s %10s %10s %10s", "Layer (MB)",
+           "Act", "Grad", "Weight", "State", "Live", "Peak");
+    for (const Row& r : row) {
+      print(r.label.c_str(), r.byte, r.peak);
+    }
+    return print("Total", total, total_peak);
+  }
+
+  /*!
+   * Check if an activation can share its memory (see Plan): it must be the
+   * output of a layer, but not of the first or the last layer (e.g. data or
+   * loss, read after the forward pass), nor the input or output of the
+   * model.
+   *
+   *  \param[in]  mat: activation
+   *
+   *  \return     Can share its memory?
+   */
+  bool Shareable(const std::shared_ptr<Mat<Dtype>>& mat) const {
+    if (layer_.size() < 3 || mat == in_ || mat == out_) {
+      return false;
+    }
+    const std::vector<std::shared_ptr<Mat<Dtype>>>& first =
+      layer_.front()->Output();
+    const std::vector<std::shared_ptr<Mat<Dtype>>>& last =
+      layer_.back()->Output();
+    if (std::find(first.begin(), first.end(), mat) != first.end() ||
+        std::find(last.begin(), last.end(), mat) != last.end()) {
+      return false;
+    }
+    for (size_t i = 1; i + 1 < layer_.size(); ++i) {
+      const std::vector<std::shared_ptr<Mat<Dtype>>>& out =
+        layer_[i]->Output();
+      if (std::find(out.begin(), out.end(), mat) != out.end()) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /*!
+   * Split some layers into checkpointed segments (see Checkpoint).
+   *
+   *  \param[in]  bound: first layer of each segment, followed by the end of
+   *                     the last one (empty: no checkpointing)
+   */
+  void SetSegment(const std::vector<size_t>& bound) {
+    segment_ = bound;
+    inner_.clear();
+    resident_ = kNoSegment;
+    layer_seg_.assign(layer_.size(), kNoSegment);
+    if (segment_.size() < 2) {
+      segment_.clear();
+      return;
+    }
+    inner_.resize(segment_.size() - 1);
+    for (size_t s = 0; s + 1 < segment_.size(); ++s) {
+      for (size_t i = segment_[s]; i < segment_[s + 1]; ++i) {
+        layer_seg_[i] = s;
+      }
+    }
+  }
+
+  /*!
+   * Split the layers between the first and the last one (e.g. data and loss)
+   * into segments of about the same number of layers, for gradient
+   * checkpointing: once planned (see Plan), the activations inside a
+   * segment share their memory with the other segments, and the forward
+   * pass of a segment is run again before its backward pass. Only the
+   * activations at the boundaries of the segments stay alive for the whole
+   * step, trading about one more forward pass for a lower peak memory.
+   * The model must be planned for training afterwards.
+   *
+   *  \param[in]  num_segment: number of segments (0: square root of the
+   *                           number of layers)
+   *
+   *  \return     Number of segments (0: no checkpointing)
+   */
+  virtual uint32_t Checkpoint(uint32_t num_segment = 0) {
+    size_t num_layer = layer_.size() > 2 ? layer_.size() - 2 : 0;
+    if (!num_segment) {
+      num_segment = uint32_t(std::lround(std::sqrt(double(num_layer))));
+    }
+    num_segment = uint32_t(std::min(size_t(num_segment), num_layer));
+    std::vector<size_t> bound;
+    if (num_segment > 1) {
+      for (uint32_t s = 0; s <= num_segment; ++s) {
+        bound.push_back(1 + num_layer * s / num_segment);
+      }
+    }
+    SetSegment(bound);
+    return uint32_t(inner_.size());
+  }
+
+  /*!
+   * Get the segment a layer is recomputed in: all the layers of a segment
+   * but the last one, whose outputs are kept.
+   *
+   *  \param[in]  i: layer index
+   *
+   *  \return     Segment (kNoSegment if the layer isn't recomputed)
+   */
+  size_t RecomputedIn(size_t i) const {
+    if (i >= layer_seg_.size() || layer_seg_[i] == kNoSegment ||
+        i + 1 == segment_[layer_seg_[i] + 1]) {
+      return kNoSegment;
+    }
+    return layer_seg_[i];
+  }
+
+  /*!
+   * Get the activations inside the segments: outputs of a recomputed layer
+   * (see RecomputedIn) only read by the layers of the same segment. The
+   * outputs read by nobody (e.g. a loss or a dropout mask) are kept.
+   *
+   *  \param[out] inner: segment of each activation inside a segment
+   */
+  void InnerActivation(std::map<const Mat<Dtype>*, size_t>* inner) const {
+    inner->clear();
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      size_t s = RecomputedIn(i);
+      if (s == kNoSegment) {
+        continue;
+      }
+      for (const std::shared_ptr<Mat<Dtype>>& out : layer_[i]->Output()) {
+        if (Shareable(out)) {
+          (*inner)[out.get()] = s;
+        }
+      }
+    }
+    std::set<const Mat<Dtype>*> read, outside;
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      for (const std::shared_ptr<Mat<Dtype>>& in : layer_[i]->Input()) {
+        typename std::map<const Mat<Dtype>*, size_t>::const_iterator itr =
+          inner->find(in.get());
+        if (itr == inner->end()) {
+          continue;
+        }
+        read.insert(in.get());
+        if (layer_seg_[i] != itr->second) {
+          outside.insert(in.get());
+        }
+      }
+    }
+    for (typename std::map<const Mat<Dtype>*, size_t>::iterator itr =
+         inner->begin(); itr != inner->end();) {
+      if (!read.count(itr->first) || outside.count(itr->first)) {
+        itr = inner->erase(itr);
+      } else {
+        ++itr;
+      }
+    }
+  }
+
+  /*!
+   * Run the layers supporting it in place (training, see Plan).
+   * With checkpointing, the input of a recomputed layer must be recomputed
+   * too, and the input of the other layers must be kept.
+   */
+  void PlanInPlace() {
+    std::map<const Mat<Dtype>*, size_t> inner;
+    InnerActivation(&inner);
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      const std::shared_ptr<Layer<Dtype>>& layer = layer_[i];
+      if (!layer->InPlace() || layer->Input().size() != 1) {
+        continue;
+      }
+      const std::shared_ptr<Mat<Dtype>>& in  = layer->Input()[0];
+      const std::shared_ptr<Mat<Dtype>>& out = layer->Output()[0];
+      if (!Shareable(in) || in->Capacity() != out->Capacity()) {
+        continue;
+      }
+      size_t in_seg = inner.count(in.get()) ? inner[in.get()] : kNoSegment;
+      if (in_seg != RecomputedIn(i)) {
+        continue;
+      }
+
+      // The input must only be used by this layer, and its producer must not
+      // need it anymore
+      bool res = true;
+      for (size_t j = 0; j < layer_.size() && res; ++j) {
+        const std::vector<std::shared_ptr<Mat<Dtype>>>& in_j =
+          layer_[j]->Input();
+        const std::vector<std::shared_ptr<Mat<Dtype>>>& out_j =
+          layer_[j]->Output();
+        if (j != i && std::find(in_j.begin(), in_j.end(), in) != in_j.end()) {
+          res = false;
+        }
+        if (std::find(out_j.begin(), out_j.end(), in) != out_j.end() &&
+            layer_[j]->BackwardUsesOutput()) {
+          res = false;
+        }
+      }
+      if (res) {
+        out->data.Share(in->data, out->Capacity());
+      }
+    }
+  }
+
+  /*!
+   * Share the memory of the activations inside the checkpointed segments
+   * (training, see Plan). The segments are never alive at the same time: the
+   * buffers of each segment (values and derivatives, the activations running
+   * in place sharing the same one) are sorted by size, and the n-th buffer
+   * of all the segments uses the memory of the largest of them.
+   */
+  void PlanCheckpoint() {
+    std::map<const Mat<Dtype>*, size_t> inner;
+    InnerActivation(&inner);
+
+    // Buffers and the segment they are used in: a buffer also used by an
+    // activation kept is left apart
+    struct Block {
+      std::vector<Buffer<Dtype>*> user;  // Buffers using the memory
+      size_t                      size;  // Size (values)
+      size_t                      seg;   // Segment
+    };
+    std::map<const Dtype*, Block> block;
+    for (size_t s = 0; s < inner_.size(); ++s) {
+      inner_[s].clear();
+    }
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      for (const std::shared_ptr<Mat<Dtype>>& mat : layer_[i]->Output()) {
+        size_t s = inner.count(mat.get()) ? inner[mat.get()] : kNoSegment;
+        if (s != kNoSegment) {
+          inner_[s].push_back(mat);
+        }
+        for (Buffer<Dtype>* buf : {&mat->data, mat->deriv ?
+                                   &mat->deriv->data : nullptr}) {
+          if (!buf || buf->empty()) {
+            continue;
+          }
+          Block& b = block[buf->data()];
+          if (b.user.empty()) {
+            b.size = 0;
+            b.seg  = s;
+          } else if (b.seg != s) {
+            b.seg = kNoSegment;
+          }
+          if (std::find(b.user.begin(), b.user.end(), buf) == b.user.end()) {
+            b.user.push_back(buf);
+            b.size = std::max(b.size, buf->size());
+          }
+        }
+      }
+    }
+
+    // Blocks of each segment, the largest first
+    std::vector<std::vector<Block*>> seg_block(inner_.size());
+    for (std::pair<const Dtype* const, Block>& b : block) {
+      if (b.second.seg != kNoSegment) {
+        seg_block[b.second.seg].push_back(&b.second);
+      }
+    }
+    for (std::vector<Block*>& b : seg_block) {
+      std::stable_sort(b.begin(), b.end(), [](const Block* b0,
+                                              const Block* b1) {
+        return b0->size > b1->size;
+      });
+    }
+
+    // Point the n-th block of each segment to the memory of the largest one
+    for (size_t n = 0;; ++n) {
+      Block* largest = nullptr;
+      for (const std::vector<Block*>& b : seg_block) {
+        if (n < b.size() && (!largest || b[n]->size > largest->size)) {
+          largest = b[n];
+        }
+      }
+      if (!largest) {
+        break;
+      }
+      for (const std::vector<Block*>& b : seg_block) {
+        if (n >= b.size() || b[n] == largest) {
+          continue;
+        }
+        for (Buffer<Dtype>* buf : b[n]->user) {
+          buf->Share(*largest->user[0], buf->size());
+        }
+      }
+    }
+  }
+
+  /*!
+   * Share the memory of the activations not alive at the same time
+   * (inference, see Plan).
+   */
+  void PlanShared() {
+    // Layers actually running (not fused) and the activations they read or
+    // write: a layer having some layers fused writes to the outputs of the
+    // last one (see Fusion)
+    std::vector<size_t> step;
+    std::vector<std::vector<std::shared_ptr<Mat<Dtype>>>> in, out;
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      if (i < fused_.size() && fused_[i]) {
+        continue;
+      }
+      size_t last = i;
+      while (last + 1 < fused_.size() && fused_[last + 1]) {
+        ++last;
+      }
+      step.push_back(i);
+      in.push_back(layer_[i]->Input());
+      out.push_back(last > i ? layer_[last]->Output() : layer_[i]->Output());
+    }
+
+    // Lifetime of each activation (first and last step using it)
+    std::map<Mat<Dtype>*, std::pair<size_t, size_t>> life;
+    for (size_t s = 0; s < step.size(); ++s) {
+      for (const std::vector<std::shared_ptr<Mat<Dtype>>>* mats :
+           {&in[s], &out[s]}) {
+        for (const std::shared_ptr<Mat<Dtype>>& mat : *mats) {
+          if (!life.count(mat.get())) {
+            life[mat.get()] = std::make_pair(s, s);
+          }
+          life[mat.get()].second = s;
+        }
+      }
+    }
+
+    // The activations of the fused layers are never used
+    for (size_t i = 0; i < layer_.size(); ++i) {
+      for (const std::shared_ptr<Mat<Dtype>>& mat : layer_[i]->Output()) {
+        if (Shareable(mat) && !life.count(mat.get())) {
+          mat->data.clear();
+          mat->deriv.reset();
+        }
+      }
+    }
+
+    // Assign the activations to some blocks of memory, in the order of the
+    // steps: a block is free again once all its activations are dead
+    struct Block {
+      std::vector<std::shared_ptr<Mat<Dtype>>> mat;   // Activations
+      size_t                                   size;  // Size (values)
+      size_t                                   last;  // Last step used
+    };
+    std::vector<Block> block;
+    std::map<Mat<Dtype>*, size_t> block_index;
+    for (size_t s = 0; s < step.size(); ++s) {
+      const std::shared_ptr<Layer<Dtype>>& layer = layer_[step[s]];
+      for (size_t o = 0; o < out[s].size(); ++o) {
+        const std::shared_ptr<Mat<Dtype>>& mat = out[s][o];
+        const std::pair<size_t, size_t>& mat_life = life[mat.get()];
+        if (!Shareable(mat) || mat_life.first != s ||
+            block_index.count(mat.get())) {
+          continue;
+        }
+
+        // In place: the input dies here, take its block
+        size_t b = block.size();
+        if (!o && layer->InPlace() && in[s].size() == 1 &&
+            block_index.count(in[s][0].get())) {
+          size_t in_b = block_index[in[s][0].get()];
+          if (block[in_b].last == s && block[in_b].size >= mat->Capacity()) {
+            b = in_b;
+          }
+        }
+
+        // Otherwise the smallest free block large enough (or the largest
+        // one, growing it)
+        if (b == block.size()) {
+          size_t size = mat->Capacity();
+          size_t best = block.size();
+          for (size_t i = 0; i < block.size(); ++i) {
+            if (block[i].last >= s) {
+              continue;
+            }
+            bool fit      = block[i].size >= size;
+            bool best_fit = best < block.size() && block[best].size >= size;
+            if (best == block.size() ||
+                (fit && (!best_fit || block[i].size < block[best].size)) ||
+                (!fit && !best_fit && block[i].size > block[best].size)) {
+              best = i;
+            }
+          }
+          b = best;
+        }
+        if (b == block.size()) {
+          block.push_back(Block());
+          block.back().size = 0;
+        }
+        block[b].mat.push_back(mat);
+        block[b].size = std::max(block[b].size, size_t(mat->Capacity()));
+        block[b].last = mat_life.second;
+        block_index[mat.get()] = b;
+      }
+    }
+
+    // Point the activations of each block to the memory of the largest one,
+    // no derivative needed
+    for (const Block& b : block) {
+      const std::shared_ptr<Mat<Dtype>>* largest = &b.mat[0];
+      for (const std::shared_ptr<Mat<Dtype>>& mat : b.mat) {
+        if (mat->Capacity() > (*largest)->Capacity()) {
+          largest = &mat;
+        }
+      }
+      for (const std::shared_ptr<Mat<Dtype>>& mat : b.mat) {
+        if (mat != *largest) {
+          mat->data.Share((*largest)->data, mat->Capacity());
+        }
+        mat->deriv.reset();
+      }
+    }
+  }
+
+  /*!
+   * Plan the memory of the activations, to reduce the memory used:
+   *  + training: the elementwise layers supporting it run in place (see
+   *    Layer::InPlace), the derivatives being kept apart
+   *  + inference: the activations share the same memory once they are dead
+   *    (e.g. the input of a layer is reused by the output of the next one),
+   *    and the derivatives are released: the model can only be used for
+   *    inference afterwards
+   * A model used for inference must be fused first (see Fuse).
+   * A model trained with gradient checkpointing must be split into segments
+   * first (see Checkpoint): the activations inside the segments, and their
+   * derivatives, then also share their memory with the other segments.
+   *
+   *  \param[in]  phase: phase the model is used for
+   *
+   *  \return     Memory used by the activations (bytes, see ActivationMemory)
+   */
+  size_t Plan(State::E_PHASE phase) {
+    if (phase == State::PHASE_TRAIN) {
+      PlanInPlace();
+      PlanCheckpoint();
+    } else {
+      PlanShared();
+    }
+    return ActivationMemory();
+  }
+
   /*!
    * Clear the derivatives.
    */
-  void ClearDeriv() {
+  virtual void ClearDeriv() {
     for (size_t i = 0; i < layer_.size(); ++i) {
       layer_[i]->ClearDeriv();
     }
   }
 
   /*!
-   * Forward pass.
+   * Record the peak heap memory of a layer pass (see PrintMemory).
+   *
+   *  \param[in]  i   : layer index
+   *  \param[in]  live: live heap memory before the pass (see
+   *                    MemoryStats::Mark)
+   */
+  void RecordPeak(size_t i, size_t live) {
+    size_t peak = MemoryStats::Get().PeakSinceMark();
+    if (layer_peak_.size() < layer_.size()) {
+      layer_peak_.resize(layer_.size());
+    }
+    if (peak > live) {
+      layer_peak_[i] = std::max(layer_peak_[i], peak - live);
+    }
+  }
+
+  /*!
+   * Forward pass of a layer, timed if the profiler is enabled, and its peak
+   * memory measured if the memory stats are enabled.
+   *
+   *  \param[in]  i    : layer index
+   *  \param[in]  state: state
+   */
+  void ForwardLayer(size_t i, const State& state) {
+    const std::shared_ptr<Layer<Dtype>>& layer = layer_[i];
+    if (i < layer_seg_.size() && layer_seg_[i] != kNoSegment) {
+      resident_ = layer_seg_[i];
+    }
+    MemoryStats& memory = MemoryStats::Get();
+    size_t live = memory.Enabled() ? memory.Mark() : 0;
+    Profiler& profiler = Profiler::Get();
+    if (!profiler.Enabled()) {
+      layer->Forward(state);
+    } else {
+      Profiler::Clock::time_point start = Profiler::Now();
+      layer->Forward(state);
+      profiler.Record(layer.get(), layer->Name(), typeid(*layer),
+                      Profiler::PASS_FORWARD, start, layer->Flop(),
+                      layer->Bytes());
+    }
+    if (memory.Enabled()) {
+      RecordPeak(i, live);
+    }
+  }
+
+  /*!
+   * Backward pass of a layer, timed if the profiler is enabled, and its peak
+   * memory measured if the memory stats are enabled.
    *
+   *  \param[in]  i    : layer index
    *  \param[in]  state: state
    */
-  void Forward(const State& state) {
+  void BackwardLayer(size_t i, const State& state) {
+    const std::shared_ptr<Layer<Dtype>>& layer = layer_[i];
+    MemoryStats& memory = MemoryStats::Get();
+    size_t live = memory.Enabled() ? memory.Mark() : 0;
+    Profiler& profiler = Profiler::Get();
+    if (!profiler.Enabled()) {
+      layer->Backward(state);
+    } else {
+      Profiler::Clock::time_point start = Profiler::Now();
+      layer->Backward(state);
+      // The backward pass calculates the derivatives of both the inputs and
+      // the weights: about twice the work of the forward pass
+      profiler.Record(layer.get(), layer->Name(), typeid(*layer),
+                      Profiler::PASS_BACKWARD, start, 2 * layer->Flop(),
+                      2 * layer->Bytes());
+    }
+    if (memory.Enabled()) {
+      RecordPeak(i, live);
+    }
+    if (hook_) {
+      hook_(i);
+    }
+  }
+
+  /*!
+   * Set a function called after each layer backward pass, with the layer
+   * index (e.g. to start reducing the derivatives done, see DataParallel).
+   *
+   *  \param[in]  hook: function (empty to remove it)
+   */
+  void SetBackwardHook(const std::function<void(size_t)>& hook) {
+    hook_ = hook;
+  }
+
+  /*!
+   * Get the first layer using a matrix, as an input or a weight: its
+   * derivative is complete once the backward pass of this layer is done.
+   *
+   *  \param[in]  mat: matrix
+   *
+   *  \return     Layer index (0 if not found)
+   */
+  size_t FirstUse(const std::shared_ptr<Mat<Dtype>>& mat) const {
     for (size_t i = 0; i < layer_.size(); ++i) {
-      layer_[i]->Forward(state);
+      const std::vector<std::shared_ptr<Mat<Dtype>>>& in = layer_[i]->Input();
+      std::vector<std::shared_ptr<Mat<Dtype>>> weight;
+      layer_[i]->GetWeight(&weight);
+      if (std::find(in.begin(), in.end(), mat) != in.end() ||
+          std::find(weight.begin(), weight.end(), mat) != weight.end()) {
+        return i;
+      }
+    }
+    return 0;
+  }
+
+  /*!
+   * Forward pass.
+   *
+   *  \param[in]  state: state
+   *  \param[in]  first: first layer to run (e.g. 1 to skip the data layer,
+   *                     its outputs being set by the caller)
+   */
+  void Forward(const State& state, size_t first = 0) {
+    bool test = state.phase == State::PHASE_TEST;
+    for (size_t i = first; i < layer_.size(); ++i) {
+      if (test && i < fused_.size() && fused_[i]) {
+        continue;
+      }
+      ForwardLayer(i, state);
+    }
+  }
+
+  /*!
+   * Prepare the backward pass of a checkpointed segment (see Checkpoint):
+   * run its forward pass again if the activations inside it were
+   * overwritten by another segment, and clear their derivatives (shared
+   * with the other segments).
+   *
+   *  \param[in]  s    : segment
+   *  \param[in]  end  : last layer of the backward pass (excluded)
+   *  \param[in]  state: state
+   */
+  void Recompute(size_t s, size_t end, const State& state) {
+    if (s != resident_) {
+      State recompute = state;
+      recompute.recompute = true;
+      for (size_t i = segment_[s]; i < end && i + 1 < segment_[s + 1]; ++i) {
+        ForwardLayer(i, recompute);
+      }
+    }
+    for (const std::shared_ptr<Mat<Dtype>>& mat : inner_[s]) {
+      mat->ZeroDeriv();
+    }
+  }
+
+  /*!
+   * Backward pass over some layers, the forward pass being done.
+   *
+   *  \param[in]  state: state
+   *  \param[in]  begin: first layer
+   *  \param[in]  end  : last layer (excluded)
+   */
+  void BackwardRange(const State& state, size_t begin, size_t end) {
+    for (size_t i = end; i > begin; --i) {
+      size_t s = i - 1 < layer_seg_.size() ? layer_seg_[i - 1] : kNoSegment;
+      if (s != kNoSegment && (i == end || i >= layer_seg_.size() ||
+                               layer_seg_[i] != s)) {
+        Recompute(s, i, state);
+      }
+      BackwardLayer(i - 1, state);
     }
   }
 
@@ -310,10 +1488,7 @@ class Model {
    *  \param[in]  state: state
    */
   void Backward(const State& state) {
-    size_t offset = layer_.size() - 1;
-    for (size_t i = 0; i < layer_.size(); ++i) {
-      layer_[offset - i]->Backward(state);
-    }
+    BackwardRange(state, 0, layer_.size());
   }
 
   /*!
@@ -374,14 +1549,47 @@ class Model {
     return Loss();
   }
 
+  /*!
+   * Get the number of testing samples, for a model tested by range.
+   *
+   *  \return Number of testing samples (0: not tested by range)
+   */
+  virtual uint32_t TestSize() {
+    return 0;
+  }
+
+  /*!
+   * Model testing (inference) on a range of the testing samples, e.g. a
+   * shard of the testing set (see Evaluator).
+   *
+   *  \param[in]  begin: first sample
+   *  \param[in]  end  : last sample (excluded)
+   *
+   *  \return     Number of correct predictions
+   */
+  virtual uint64_t TestRange(uint32_t begin, uint32_t end) {
+    return 0;
+  }
+
   /*!
    * Model testing (inference).
+   * By default, the correct predictions are counted on the whole testing set
+   * (see TestRange).
    *
    *  \return Accuracy
    */
-  virtual Dtype Test() = 0;
+  virtual Dtype Test() {
+    uint32_t size = TestSize();
+    if (!size) {
+      return Dtype(0);
+    }
+    return Dtype(double(TestRange(0, size)) / size);
+  }
 };
 
+template <typename Dtype>
+const size_t Model<Dtype>::kNoSegment;
+
 
 }  // namespace jik
 
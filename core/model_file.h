@@ -0,0 +1,639 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_MODEL_FILE_H_
+#define CORE_MODEL_FILE_H_
+
+
+#include <core/log.h>
+#include <core/mat.h>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+namespace jik {
+
+
+/*!
+ *  \class  ModelFile
+ *  \brief  Model file (versioned, named tensors)
+ *
+ * File layout (native byte order):
+ *  + header: magic "JIKMODEL", version, number of tensors, table size
+ *  + tensor table, for each tensor: name length, name, data type, size
+ *    (4 dimensions), offset and size (in bytes) of the data in the file
+ *  + tensor data, each starting at a 64-byte aligned offset
+ *
+ * The tensors are matched by name when reading a file, the shape and data
+ * type having to be the same as the model. A tensor can be a matrix of any
+ * supported data type (see Tensor), e.g. the int8 filters of a quantized
+ * model next to its Dtype biases, or the int32 indices of a pruned filter.
+ *
+ * Since the data is aligned, the file can be mapped in memory and the
+ * matrices pointed straight to the mapping (see Map): nothing is copied and
+ * the pages are only loaded when used. The mapping is private: writing into
+ * the weights (e.g. fine-tuning) never changes the file.
+ */
+template <typename Dtype>
+class ModelFile {
+  // Public types
+ public:
+  typedef Dtype Type;
+
+  static const uint32_t kVersion   = 1;    // File version
+  static const uint32_t kAlignment = 64;   // Data alignment (bytes)
+
+  /*!
+   * Data type of a tensor
+   */
+  enum DataType {
+    kFloat32 = 0,   // 32-bit floating point
+    kFloat64 = 1,   // 64-bit floating point
+    kInt8    = 2,   // 8-bit integer
+    kInt32   = 3    // 32-bit integer
+  };
+
+  /*!
+   *  \struct Tensor
+   *  \brief  Matrix to read or write (of any data type, see Describe)
+   */
+  struct Tensor {
+    std::string name;                     // Tensor name
+    uint32_t    type;                     // Data type
+    uint32_t    size[4];                  // Tensor size
+    uint8_t*    data;                     // Data
+    uint64_t    bytes;                    // Data size (bytes)
+    std::function<void(const std::shared_ptr<uint8_t>&)> wrap;
+                                          // Point the matrix to some memory
+  };
+
+
+  // Protected types
+ protected:
+  /*!
+   *  \struct Header
+   *  \brief  File header
+   */
+  struct Header {
+    char     magic[8];     // Magic ("JIKMODEL")
+    uint32_t version;      // File version
+    uint32_t num_tensor;   // Number of tensors
+    uint64_t table_size;   // Tensor table size (bytes)
+  };
+
+  /*!
+   *  \struct Entry
+   *  \brief  Tensor table entry
+   */
+  struct Entry {
+    std::string name;      // Tensor name
+    uint32_t    type;      // Data type
+    uint32_t    size[4];   // Tensor size
+    uint64_t    offset;    // Data offset in the file (bytes)
+    uint64_t    bytes;     // Data size (bytes)
+  };
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Get the magic of the file.
+   *
+   *  \return Magic (8 characters)
+   */
+  static const char* Magic() {
+    return "JIKMODEL";
+  }
+
+  /*!
+   * Get the data type of some values.
+   *
+   *  \return Data type
+   */
+  static uint32_t TypeOf(const float*)   { return kFloat32; }
+  static uint32_t TypeOf(const double*)  { return kFloat64; }
+  static uint32_t TypeOf(const int8_t*)  { return kInt8;    }
+  static uint32_t TypeOf(const int32_t*) { return kInt32;   }
+
+  /*!
+   * Round an offset up to the data alignment.
+   *
+   *  \param[in]  offset: offset (bytes)
+   *
+   *  \return     Aligned offset (bytes)
+   */
+  static uint64_t Align(uint64_t offset) {
+    return (offset + kAlignment - 1) & ~uint64_t(kAlignment - 1);
+  }
+
+  /*!
+   * Append a value to the tensor table.
+   *
+   *  \param[in]  val  : value
+   *  \param[out] table: tensor table
+   */
+  template <typename T>
+  static void Append(const T& val, std::vector<uint8_t>* table) {
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(&val);
+    table->insert(table->end(), data, data + sizeof(T));
+  }
+
+  /*!
+   * Get a value from the tensor table.
+   *
+   *  \param[in]  table : tensor table
+   *  \param[in]  size  : tensor table size
+   *  \param[in]  pos   : position in the table
+   *  \param[out] val   : value
+   *
+   *  \return     Error?
+   */
+  template <typename T>
+  static bool Extract(const uint8_t* table, uint64_t size, uint64_t* pos,
+                      T* val) {
+    if (*pos + sizeof(T) > size) {
+      return false;
+    }
+    std::memcpy(val, table + *pos, sizeof(T));
+    *pos += sizeof(T);
+    return true;
+  }
+
+  /*!
+   * Check the header of a file.
+   *
+   *  \param[in]  header: header
+   *
+   *  \return     Error?
+   */
+  static bool CheckHeader(const Header& header) {
+    if (std::memcmp(header.magic, Magic(), sizeof(header.magic))) {
+      Report(kError, "Not a model file");
+      return false;
+    }
+    if (header.version != kVersion) {
+      Report(kError, "Model file version %d is not supported (expected %d)",
+             header.version, kVersion);
+      return false;
+    }
+    return true;
+  }
+
+  /*!
+   * Parse the tensor table.
+   *
+   *  \param[in]  header: header
+   *  \param[in]  table : tensor table
+   *  \param[out] entry : tensors
+   *
+   *  \return     Error?
+   */
+  static bool ParseTable(const Header& header, const uint8_t* table,
+                         std::vector<Entry>* entry) {
+    // Each entry takes at least its fixed fields (name size, type, size,
+    // offset and data size): a count not fitting in the table is corrupted
+    const uint64_t kMinEntry = 6 * sizeof(uint32_t) + 2 * sizeof(uint64_t);
+    if (uint64_t(header.num_tensor) * kMinEntry > header.table_size) {
+      Report(kError, "Model file tensor table is corrupted");
+      return false;
+    }
+    uint64_t pos = 0;
+    entry->resize(header.num_tensor);
+    for (Entry& e : *entry) {
+      uint32_t name_size;
+      if (!Extract(table, header.table_size, &pos, &name_size) ||
+          pos + name_size > header.table_size) {
+        Report(kError, "Model file tensor table is corrupted");
+        return false;
+      }
+      e.name.assign(reinterpret_cast<const char*>(table + pos), name_size);
+      pos += name_size;
+      if (!Extract(table, header.table_size, &pos, &e.type)    ||
+          !Extract(table, header.table_size, &pos, &e.size[0]) ||
+          !Extract(table, header.table_size, &pos, &e.size[1]) ||
+          !Extract(table, header.table_size, &pos, &e.size[2]) ||
+          !Extract(table, header.table_size, &pos, &e.size[3]) ||
+          !Extract(table, header.table_size, &pos, &e.offset)  ||
+          !Extract(table, header.table_size, &pos, &e.bytes)) {
+        Report(kError, "Model file tensor table is corrupted");
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /*!
+   * Find the entry of a tensor.
+   *
+   *  \param[in]  entry    : entries of the file
+   *  \param[in]  tensor   : tensor
+   *  \param[in]  file_size: file size (bytes)
+   *
+   *  \return     Entry (nullptr if not found or not matching the tensor)
+   */
+  static const Entry* Find(const std::vector<Entry>& entry,
+                           const Tensor& tensor, uint64_t file_size) {
+    for (const Entry& e : entry) {
+      if (e.name != tensor.name) {
+        continue;
+      }
+      if (e.type != tensor.type || e.size[0] != tensor.size[0] ||
+          e.size[1] != tensor.size[1] || e.size[2] != tensor.size[2] ||
+          e.size[3] != tensor.size[3] || e.bytes != tensor.bytes) {
+        Report(kError, "Weights '%s' from file is not matching current "
+               "model", tensor.name.c_str());
+        return nullptr;
+      }
+      if (e.offset + e.bytes > file_size || e.offset % kAlignment) {
+        Report(kError, "Model file is truncated");
+        return nullptr;
+      }
+      return &e;
+    }
+    Report(kError, "Weights '%s' not found in file", tensor.name.c_str());
+    return nullptr;
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Check if a file stream is a model file (the position is kept).
+   *
+   *  \param[in]  fp: file stream
+   *
+   *  \return     Model file?
+   */
+  static bool Detect(std::FILE* fp) {
+    long pos = std::ftell(fp);
+    char magic[8];
+    bool res = std::fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+               !std::memcmp(magic, Magic(), sizeof(magic));
+    std::fseek(fp, pos, SEEK_SET);
+    return res;
+  }
+
+  /*!
+   * Describe a matrix as a tensor.
+   *
+   *  \param[in]  name: tensor name
+   *  \param[in]  mat : matrix
+   *
+   *  \return     Tensor
+   */
+  template <typename T>
+  static Tensor Describe(const std::string&             name,
+                         const std::shared_ptr<Mat<T>>& mat) {
+    Tensor tensor;
+    tensor.name  = name;
+    tensor.type  = TypeOf(mat->Data());
+    std::memcpy(tensor.size, mat->size, sizeof(tensor.size));
+    tensor.data  = reinterpret_cast<uint8_t*>(mat->Data());
+    tensor.bytes = uint64_t(mat->Size()) * sizeof(T);
+    tensor.wrap  = [mat](const std::shared_ptr<uint8_t>& mem) {
+      mat->data.Wrap(mem, mat->Size());
+    };
+    return tensor;
+  }
+
+  /*!
+   * Describe some memory of fixed size as a tensor (e.g. the weights of a
+   * StaticGraph). The memory can't be pointed elsewhere: a mapped file is
+   * copied into it.
+   *
+   *  \param[in]  name: tensor name
+   *  \param[in]  data: data
+   *  \param[in]  size: tensor size (4 dimensions)
+   *
+   *  \return     Tensor
+   */
+  template <typename T>
+  static Tensor Describe(const std::string& name, T* data,
+                         const uint32_t size[4]) {
+    Tensor tensor;
+    tensor.name  = name;
+    tensor.type  = TypeOf(data);
+    std::memcpy(tensor.size, size, sizeof(tensor.size));
+    tensor.data  = reinterpret_cast<uint8_t*>(data);
+    tensor.bytes = uint64_t(size[0]) * size[1] * size[2] * size[3] *
+                   sizeof(T);
+    uint64_t bytes = tensor.bytes;
+    tensor.wrap  = [data, bytes](const std::shared_ptr<uint8_t>& mem) {
+      std::memcpy(data, mem.get(), bytes);
+    };
+    return tensor;
+  }
+
+  /*!
+   * Get the names of the tensors of a file stream (the position is kept).
+   *
+   *  \param[in]  fp  : file stream
+   *
+   *  \param[out] name: tensors names
+   *  \param[out] size: tensors sizes (4 values per tensor, optional)
+   *  \return     Error?
+   */
+  static bool Names(std::FILE* fp, std::vector<std::string>* name,
+                    std::vector<uint32_t>* size = nullptr) {
+    long pos = std::ftell(fp);
+    std::fseek(fp, 0, SEEK_END);
+    uint64_t file_size = uint64_t(std::ftell(fp) - pos);
+    std::fseek(fp, pos, SEEK_SET);
+    Header header;
+    std::vector<uint8_t> table;
+    std::vector<Entry> entry;
+    bool res = std::fread(&header, 1, sizeof(header), fp) == sizeof(header) &&
+               CheckHeader(header);
+    if (res && sizeof(header) + header.table_size > file_size) {
+      Report(kError, "Model file is truncated");
+      res = false;
+    }
+    if (res) {
+      table.resize(header.table_size);
+      res = std::fread(table.data(), 1, table.size(), fp) == table.size() &&
+            ParseTable(header, table.data(), &entry);
+    }
+    std::fseek(fp, pos, SEEK_SET);
+    name->clear();
+    if (size) {
+      size->clear();
+    }
+    for (const Entry& e : entry) {
+      name->push_back(e.name);
+      if (size) {
+        size->insert(size->end(), e.size, e.size + 4);
+      }
+    }
+    return res;
+  }
+
+  /*!
+   * Write some tensors in a file stream.
+   *
+   *  \param[in]  fp    : file stream
+   *  \param[in]  tensor: tensors
+   *
+   *  \return     Data size written to the file (0 on error)
+   */
+  static size_t Write(std::FILE* fp, const std::vector<Tensor>& tensor) {
+    // Table size, to get the data offsets
+    uint64_t table_size = 0;
+    for (const Tensor& t : tensor) {
+      table_size += sizeof(uint32_t) + t.name.size() +
+                    5 * sizeof(uint32_t) + 2 * sizeof(uint64_t);
+    }
+
+    // Tensor table
+    std::vector<uint8_t> table;
+    std::vector<uint64_t> offset(tensor.size());
+    uint64_t curr = Align(sizeof(Header) + table_size);
+    for (size_t i = 0; i < tensor.size(); ++i) {
+      const Tensor& t = tensor[i];
+      offset[i] = curr;
+      Append(uint32_t(t.name.size()), &table);
+      table.insert(table.end(), t.name.begin(), t.name.end());
+      Append(t.type, &table);
+      for (uint32_t d = 0; d < 4; ++d) {
+        Append(t.size[d], &table);
+      }
+      Append(curr, &table);
+      Append(t.bytes, &table);
+      curr = Align(curr + t.bytes);
+    }
+
+    // Header
+    Header header;
+    std::memcpy(header.magic, Magic(), sizeof(header.magic));
+    header.version    = kVersion;
+    header.num_tensor = uint32_t(tensor.size());
+    header.table_size = table_size;
+
+    size_t res = std::fwrite(&header, 1, sizeof(header), fp);
+    res += std::fwrite(table.data(), 1, table.size(), fp);
+
+    // Data, padded to be aligned
+    static const uint8_t kPad[kAlignment] = {0};
+    for (size_t i = 0; i < tensor.size(); ++i) {
+      if (offset[i] > res) {
+        res += std::fwrite(kPad, 1, offset[i] - res, fp);
+      }
+      res += std::fwrite(tensor[i].data, 1, tensor[i].bytes, fp);
+    }
+    if (res != (tensor.empty() ? sizeof(header) + table.size() :
+                offset.back() + tensor.back().bytes)) {
+      Report(kError, "Can't write model file");
+      return 0;
+    }
+    return res;
+  }
+
+  /*!
+   * Write some tensors to a file, atomically: they are written to a
+   * temporary file ("<path>.tmp") flushed to the disk, which then replaces
+   * the file. A crash while writing leaves the previous file intact.
+   *
+   *  \param[in]  file_path: path to the file
+   *  \param[in]  tensor   : tensors
+   *
+   *  \return     Data size written to the file (0 on error)
+   */
+  static size_t Save(const char* file_path, const std::vector<Tensor>& tensor) {
+    std::string tmp_path = std::string(file_path) + ".tmp";
+    std::FILE* fp = std::fopen(tmp_path.c_str(), "wb");
+    if (!fp) {
+      Report(kError, "Can't open file '%s' for write", tmp_path.c_str());
+      return 0;
+    }
+    size_t res = Write(fp, tensor);
+    bool synced = !std::fflush(fp);
+#ifndef _WIN32
+    synced = synced && !fsync(fileno(fp));
+#endif
+    synced = !std::fclose(fp) && synced;
+#ifdef _WIN32
+    // The rename doesn't replace an existing file
+    std::remove(file_path);
+#endif
+    if (!res || !synced || std::rename(tmp_path.c_str(), file_path)) {
+      std::remove(tmp_path.c_str());
+      Report(kError, "Can't write model file '%s'", file_path);
+      return 0;
+    }
+    return res;
+  }
+
+  /*!
+   * Read some tensors from a file stream (copying the data).
+   *
+   *  \param[in]  fp    : file stream
+   *  \param[in]  tensor: tensors
+   *
+   *  \return     Data size read from the file (0 on error)
+   */
+  static size_t Read(std::FILE* fp, const std::vector<Tensor>& tensor) {
+    // File size (to check the offsets)
+    long start = std::ftell(fp);
+    std::fseek(fp, 0, SEEK_END);
+    uint64_t file_size = uint64_t(std::ftell(fp) - start);
+    std::fseek(fp, start, SEEK_SET);
+
+    // Header and tensor table
+    Header header;
+    if (std::fread(&header, 1, sizeof(header), fp) != sizeof(header)) {
+      Report(kError, "Model file is truncated");
+      return 0;
+    }
+    if (!CheckHeader(header)) {
+      return 0;
+    }
+    if (header.table_size > file_size) {
+      Report(kError, "Model file is truncated");
+      return 0;
+    }
+    std::vector<uint8_t> table(header.table_size);
+    std::vector<Entry> entry;
+    if (std::fread(table.data(), 1, table.size(), fp) != table.size()) {
+      Report(kError, "Model file is truncated");
+      return 0;
+    }
+    if (!ParseTable(header, table.data(), &entry)) {
+      return 0;
+    }
+
+    // Data
+    size_t res = sizeof(header) + table.size();
+    for (const Tensor& t : tensor) {
+      const Entry* e = Find(entry, t, file_size);
+      if (!e) {
+        return 0;
+      }
+      std::fseek(fp, start + long(e->offset), SEEK_SET);
+      if (std::fread(t.data, 1, e->bytes, fp) != e->bytes) {
+        Report(kError, "Model file is truncated");
+        return 0;
+      }
+      res += e->bytes;
+    }
+    return res;
+  }
+
+  /*!
+   * Map a file in memory and point some tensors to the mapping (no copy).
+   * Where memory mapping is not available (Windows), the file is read.
+   *
+   *  \param[in]  file_path: path to the file
+   *  \param[in]  tensor   : tensors
+   *
+   *  \return     Data size mapped (0 on error)
+   */
+  static size_t Map(const char* file_path, const std::vector<Tensor>& tensor) {
+#ifndef _WIN32
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
+      Report(kError, "Can't open file '%s' for read", file_path);
+      return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < off_t(sizeof(Header))) {
+      close(fd);
+      Report(kError, "Model file is truncated");
+      return 0;
+    }
+    uint64_t file_size = uint64_t(st.st_size);
+    void* addr = mmap(nullptr, file_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      Report(kError, "Can't map file '%s'", file_path);
+      return 0;
+    }
+    std::shared_ptr<uint8_t> mem(reinterpret_cast<uint8_t*>(addr),
+                                 [file_size](uint8_t* data) {
+                                   munmap(data, file_size);
+                                 });
+
+    // Header and tensor table
+    Header header;
+    std::memcpy(&header, mem.get(), sizeof(header));
+    if (!CheckHeader(header)) {
+      return 0;
+    }
+    if (sizeof(header) + header.table_size > file_size) {
+      Report(kError, "Model file is truncated");
+      return 0;
+    }
+    std::vector<Entry> entry;
+    if (!ParseTable(header, mem.get() + sizeof(header), &entry)) {
+      return 0;
+    }
+
+    // Point the tensors to their data
+    std::vector<const Entry*> found(tensor.size());
+    for (size_t i = 0; i < tensor.size(); ++i) {
+      found[i] = Find(entry, tensor[i], file_size);
+      if (!found[i]) {
+        return 0;
+      }
+    }
+    size_t res = sizeof(header) + header.table_size;
+    for (size_t i = 0; i < tensor.size(); ++i) {
+      tensor[i].wrap(std::shared_ptr<uint8_t>(mem, mem.get() +
+                                              found[i]->offset));
+      res += found[i]->bytes;
+    }
+    return res;
+#else
+    std::FILE* fp = std::fopen(file_path, "rb");
+    if (!fp) {
+      Report(kError, "Can't open file '%s' for read", file_path);
+      return 0;
+    }
+    size_t res = Read(fp, tensor);
+    std::fclose(fp);
+    return res;
+#endif
+  }
+};
+
+
+template <typename Dtype> const uint32_t ModelFile<Dtype>::kVersion;
+template <typename Dtype> const uint32_t ModelFile<Dtype>::kAlignment;
+
+
+}  // namespace jik
+
+
+#endif  // CORE_MODEL_FILE_H_
@@ -0,0 +1,426 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_PROFILER_H_
+#define CORE_PROFILER_H_
+
+
+#include <core/log.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <typeinfo>
+#include <unordered_map>
+#include <vector>
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Profiler
+ *  \brief  Per-layer timing of the forward and backward passes
+ *
+ * When enabled, the model times each layer forward and backward pass with a
+ * steady clock (wall time) and records it along with an estimate of the
+ * floating point operations and bytes touched by the layer (see Layer::Flop
+ * and Layer::Bytes). A disabled profiler costs one test per layer and pass.
+ *
+ * The layers are aggregated by name (the layers sharing a name, e.g. the
+ * unnamed layers of the unrolled recurrent models, are aggregated by type)
+ * and printed as a table sorted by time (see Print). The individual calls
+ * can also be recorded and saved as a Chrome trace (see WriteTrace), to be
+ * opened with chrome://tracing or https://ui.perfetto.dev.
+ *
+ * A single profiler is shared by the whole process (see Get).
+ */
+class Profiler {
+  // Public types
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  enum E_PASS {
+    PASS_FORWARD = 0,
+    PASS_BACKWARD,
+    PASS_COUNT
+  };
+
+
+  // Protected types
+ protected:
+  struct Stat {
+    std::string name;                 // Layer name
+    uint64_t    num_call[PASS_COUNT]; // Number of calls
+    double      time[PASS_COUNT];     // Total time (s)
+    uint64_t    flop[PASS_COUNT];     // Total number of operations
+    uint64_t    byte[PASS_COUNT];     // Total number of bytes touched
+  };
+
+  struct Event {
+    uint32_t stat;   // Stat index
+    uint32_t pass;   // Pass
+    uint32_t tid;    // Thread
+    int64_t  start;  // Start time since the profiler was enabled (us)
+    int64_t  dur;    // Duration (us)
+    uint64_t flop;   // Number of operations
+    uint64_t byte;   // Number of bytes touched
+  };
+
+
+  // Protected attributes
+ protected:
+  static const size_t                  kMaxEvent = 1 << 20;  // Max events
+  bool                                 enabled_;   // Enabled?
+  bool                                 trace_;     // Record the events?
+  Clock::time_point                    origin_;    // Enabling time
+  std::mutex                           mutex_;     // Stats lock
+  std::vector<Stat>                    stat_;      // Stats
+  std::map<std::string, uint32_t>      name_;      // Stat index per name
+  std::unordered_map<const void*,
+                     uint32_t>         key_;       // Stat index per layer
+  std::vector<Event>                   event_;     // Recorded events
+  std::unordered_map<size_t, uint32_t> thread_;    // Thread indices
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Get a readable type name: namespace and template arguments are removed.
+   *
+   *  \param[in]  type: type
+   *
+   *  \return     Type name
+   */
+  static std::string TypeName(const std::type_info& type) {
+    std::string name = type.name();
+#ifdef __GNUG__
+    int   status    = 0;
+    char* demangled = abi::__cxa_demangle(name.c_str(), nullptr, nullptr,
+                                          &status);
+    if (demangled) {
+      if (!status) {
+        name = demangled;
+      }
+      std::free(demangled);
+    }
+#endif
+    size_t pos = name.find('<');
+    if (pos != std::string::npos) {
+      name.erase(pos);
+    }
+    pos = name.rfind("::");
+    if (pos != std::string::npos) {
+      name.erase(0, pos + 2);
+    }
+    return name;
+  }
+
+  /*!
+   * Get the stat index of a layer, creating it the first time.
+   *
+   *  \param[in]  key : layer
+   *  \param[in]  name: layer name
+   *  \param[in]  type: layer type
+   *
+   *  \return     Stat index
+   */
+  uint32_t StatIndex(const void* key, const char* name,
+                     const std::type_info& type) {
+    std::unordered_map<const void*, uint32_t>::const_iterator itr =
+      key_.find(key);
+    if (itr != key_.end()) {
+      return itr->second;
+    }
+
+    std::string label = Label(name, type);
+    std::map<std::string, uint32_t>::const_iterator name_itr =
+      name_.find(label);
+    uint32_t index;
+    if (name_itr != name_.end()) {
+      index = name_itr->second;
+    } else {
+      index = uint32_t(stat_.size());
+      Stat stat = {};
+      stat.name = label;
+      stat_.push_back(stat);
+      name_[label] = index;
+    }
+    key_[key] = index;
+    return index;
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   */
+  Profiler() {
+    enabled_ = false;
+    trace_   = false;
+  }
+
+  /*!
+   * Destructor.
+   */
+  ~Profiler() {}
+
+  /*!
+   * Get the process profiler.
+   *
+   *  \return Profiler
+   */
+  static Profiler& Get() {
+    static Profiler profiler;
+    return profiler;
+  }
+
+  /*!
+   * Get the label of a layer in the table (see Print): its name and type,
+   * or only its type if it has no name.
+   *
+   *  \param[in]  name: layer name
+   *  \param[in]  type: layer type
+   *
+   *  \return     Label
+   */
+  static std::string Label(const char* name, const std::type_info& type) {
+    std::string label = TypeName(type);
+    if (name && *name) {
+      label = std::string(name) + " (" + label + ")";
+    }
+    return label;
+  }
+
+  /*!
+   * Enable the profiler, clearing the previous records.
+   *
+   *  \param[in]  trace: record each call for a trace (see WriteTrace)?
+   */
+  void Enable(bool trace = false) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stat_.clear();
+    name_.clear();
+    key_.clear();
+    event_.clear();
+    thread_.clear();
+    trace_   = trace;
+    origin_  = Clock::now();
+    enabled_ = true;
+  }
+
+  /*!
+   * Disable the profiler, keeping the records.
+   */
+  void Disable() {
+    enabled_ = false;
+  }
+
+  /*!
+   * Check if the profiler is enabled.
+   *
+   *  \return Enabled?
+   */
+  bool Enabled() const {
+    return enabled_;
+  }
+
+  /*!
+   * Get the current time, to start timing a call.
+   *
+   *  \return Current time
+   */
+  static Clock::time_point Now() {
+    return Clock::now();
+  }
+
+  /*!
+   * Record a call ending now.
+   *
+   *  \param[in]  key  : layer (identifies the layer between the calls)
+   *  \param[in]  name : layer name
+   *  \param[in]  type : layer type
+   *  \param[in]  pass : pass
+   *  \param[in]  start: time the call started (see Now)
+   *  \param[in]  flop : number of operations of the call
+   *  \param[in]  byte : number of bytes touched by the call
+   */
+  void Record(const void* key, const char* name, const std::type_info& type,
+              E_PASS pass, Clock::time_point start, uint64_t flop,
+              uint64_t byte) {
+    Clock::time_point end = Clock::now();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    uint32_t index = StatIndex(key, name, type);
+    Stat&    stat  = stat_[index];
+    ++stat.num_call[pass];
+    stat.time[pass] += std::chrono::duration<double>(end - start).count();
+    stat.flop[pass] += flop;
+    stat.byte[pass] += byte;
+
+    if (!trace_ || event_.size() >= kMaxEvent) {
+      return;
+    }
+    size_t thread_hash = std::hash<std::thread::id>()(
+      std::this_thread::get_id());
+    std::unordered_map<size_t, uint32_t>::const_iterator thread_itr =
+      thread_.find(thread_hash);
+    uint32_t tid;
+    if (thread_itr != thread_.end()) {
+      tid = thread_itr->second;
+    } else {
+      tid = uint32_t(thread_.size());
+      thread_[thread_hash] = tid;
+    }
+    Event event;
+    event.stat  = index;
+    event.pass  = pass;
+    event.tid   = tid;
+    event.start = std::chrono::duration_cast<std::chrono::microseconds>(
+      start - origin_).count();
+    event.dur   = std::chrono::duration_cast<std::chrono::microseconds>(
+      end - start).count();
+    event.flop  = flop;
+    event.byte  = byte;
+    event_.push_back(event);
+  }
+
+  /*!
+   * Print the records as a table, the layers sorted by total time.
+   */
+  void Print() {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::vector<uint32_t> order(stat_.size());
+    double total_time = 0;
+    for (uint32_t i = 0; i < order.size(); ++i) {
+      order[i]    = i;
+      total_time += stat_[i].time[PASS_FORWARD] + stat_[i].time[PASS_BACKWARD];
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [this](uint32_t a, uint32_t b) {
+      return stat_[a].time[PASS_FORWARD] + stat_[a].time[PASS_BACKWARD] >
+             stat_[b].time[PASS_FORWARD] + stat_[b].time[PASS_BACKWARD];
+    });
+
+    Report(kInfo, "Profile (%.3f s in %ld layer(s)):", total_time,
+           order.size());
+    Report(kInfo, "%-32s %10s %10s %10s %6s %9s %9s", "Layer",
+           "Fwd (ms)", "Bwd (ms)", "Calls", "%", "GFLOP/s", "GB/s");
+    for (uint32_t index : order) {
+      const Stat& stat = stat_[index];
+      double   time     = stat.time[PASS_FORWARD] + stat.time[PASS_BACKWARD];
+      uint64_t flop     = stat.flop[PASS_FORWARD] + stat.flop[PASS_BACKWARD];
+      uint64_t byte     = stat.byte[PASS_FORWARD] + stat.byte[PASS_BACKWARD];
+      uint64_t num_call = stat.num_call[PASS_FORWARD] +
+                          stat.num_call[PASS_BACKWARD];
+      Report(kInfo, "%-32s %10.3f %10.3f %10lu %6.2f %9.3f %9.3f",
+             stat.name.c_str(),
+             stat.time[PASS_FORWARD]  * 1e3,
+             stat.time[PASS_BACKWARD] * 1e3,
+             static_cast<unsigned long>(num_call),  // NOLINT(runtime/int)
+             total_time > 0 ? 100 * time / total_time : 0.,
+             time > 0 ? flop * 1e-9 / time : 0.,
+             time > 0 ? byte * 1e-9 / time : 0.);
+    }
+  }
+
+  /*!
+   * Print the records and save the trace, if enabled.
+   *
+   *  \param[in]  trace_path: path to the trace file (nullptr if none)
+   */
+  void Finish(const char* trace_path = nullptr) {
+    if (!enabled_) {
+      return;
+    }
+    Print();
+    if (trace_path) {
+      if (WriteTrace(trace_path)) {
+        Report(kInfo, "Saving trace '%s' (%ld event(s))", trace_path,
+               event_.size());
+      } else {
+        Report(kWarning, "Can't save trace '%s'", trace_path);
+      }
+    }
+  }
+
+  /*!
+   * Save the recorded calls as a Chrome trace (JSON).
+   *
+   *  \param[in]  file_path: path to the trace file
+   *
+   *  \return     Error?
+   */
+  bool WriteTrace(const char* file_path) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::FILE* file = std::fopen(file_path, "wt");
+    if (!file) {
+      return false;
+    }
+    static const char* kPassName[PASS_COUNT] = {"forward", "backward"};
+    std::fprintf(file, "{\"traceEvents\":[\n");
+    for (size_t i = 0; i < event_.size(); ++i) {
+      const Event& event = event_[i];
+      std::string  name;
+      for (char c : stat_[event.stat].name) {
+        if (c == '"' || c == '\\') {
+          name += '\\';
+        }
+        name += c;
+      }
+      std::fprintf(file, "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                   "\"ts\":%lld,\"dur\":%lld,\"pid\":0,\"tid\":%u,"
+                   "\"args\":{\"flop\":%llu,\"bytes\":%llu}}%s\n",
+                   name.c_str(), kPassName[event.pass],
+                   static_cast<long long>(event.start),  // NOLINT
+                   static_cast<long long>(event.dur),    // NOLINT
+                   event.tid,
+                   static_cast<unsigned long long>(event.flop),  // NOLINT
+                   static_cast<unsigned long long>(event.byte),  // NOLINT
+                   (i + 1 < event_.size()) ? "," : "");
+    }
+    std::fprintf(file, "],\"displayTimeUnit\":\"ms\"}\n");
+    return std::fclose(file) == 0;
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_PROFILER_H_
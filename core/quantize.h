@@ -0,0 +1,489 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_QUANTIZE_H_
+#define CORE_QUANTIZE_H_
+
+
+#include <core/log.h>
+#include <core/mat.h>
+#include <core/thread_pool.h>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Quantizer
+ *  \brief  Reduced precision (int8) inference of a layer
+ *
+ * Post-training quantization of the weights of a layer computing, for each
+ * output channel, a dot product of its filter with the inputs (e.g. inner
+ * product or convolution):
+ *  + the filter of each output channel is quantized to int8 with its own
+ *    scale (max(|filter|) / 127)
+ *  + the inputs are quantized to int8 with a single scale, calibrated from
+ *    the largest input value seen on a pass over some data (e.g. the testing
+ *    set, see MODE_CALIBRATE)
+ *  + the dot products are accumulated in int32 and scaled back to Dtype
+ *
+ * The quantized filter, scales and input range replace the filter when the
+ * model is saved (see Model::GetTensor), making the file about 4 times
+ * smaller.
+ *
+ * The dot products go 4 at a time, sharing the loads of the first vector,
+ * with AVX-512 VNNI, AVX2 or NEON when available (int8 values widened to
+ * int16, multiplied and added in pairs to int32).
+ *
+ * The int8 mode is only used for inference (testing phase): training still
+ * uses the Dtype filter.
+ */
+template <typename Dtype>
+class Quantizer {
+  // Public types
+ public:
+  typedef Dtype Type;
+
+  /*!
+   *  \enum   E_MODE
+   *  \brief  Quantization mode
+   */
+  enum E_MODE {
+    MODE_FLOAT = 0,   // Dtype inference (no quantization)
+    MODE_CALIBRATE,   // Dtype inference, recording the input range
+    MODE_INT8         // int8 inference
+  };
+
+
+  // Protected attributes
+ protected:
+  E_MODE                            mode_;      // Quantization mode
+  std::shared_ptr<Mat<Dtype>>       filter_;    // Filter (Dtype)
+  uint32_t                          num_out_;   // Number of output channels
+  std::shared_ptr<Mat<int8_t>>      qfilter_;   // Filter (int8)
+  std::shared_ptr<Mat<Dtype>>       scale_;     // Filter scales (per output)
+  std::shared_ptr<Mat<Dtype>>       range_;     // Input range (max(|in|))
+  std::vector<std::vector<int8_t>>  qin_;       // Inputs (int8, per chunk)
+  std::vector<std::vector<int32_t>> acc_;       // Accumulators (per chunk)
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Quantize a value.
+   *
+   *  \param[in]  val: value (scaled)
+   *
+   *  \return     Quantized value
+   */
+  static int8_t Round(Dtype val) {
+    val = std::min(std::max(val, Dtype(-127)), Dtype(127));
+    return int8_t(int32_t(val + (val < Dtype(0) ? Dtype(-0.5) : Dtype(0.5))));
+  }
+
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+  /*!
+   * Add the two halves of a 512-bit vector.
+   *
+   *  \param[in]  v: vector (16 values)
+   *
+   *  \return     Vector (8 values)
+   */
+  static __m256i Fold(__m512i v) {
+    // The zero-masked extractions (all lanes set) leave no lane undefined
+    return _mm256_add_epi32(_mm512_maskz_extracti64x4_epi64(0xF, v, 0),
+                            _mm512_maskz_extracti64x4_epi64(0xF, v, 1));
+  }
+#endif
+
+  /*!
+   * Dot products of a int8 vector with 4 others.
+   *
+   *  \param[in]  n  : vectors size
+   *  \param[in]  a  : first vector
+   *  \param[in]  b  : other vectors (4, one every ldb values)
+   *  \param[in]  ldb: other vectors stride
+   *
+   *  \param[out] c  : dot products (4)
+   */
+  static void Dot4(uint32_t n, const int8_t* a, const int8_t* b, uint32_t ldb,
+                   int32_t* c) {
+    const int8_t* b0 = b;
+    const int8_t* b1 = b + ldb;
+    const int8_t* b2 = b + 2 * ldb;
+    const int8_t* b3 = b + 3 * ldb;
+    uint32_t i = 0;
+    int32_t  acc[4] = {0, 0, 0, 0};
+#if defined(__AVX512VNNI__) && defined(__AVX512BW__)
+    __m512i s0 = _mm512_setzero_si512(), s1 = s0, s2 = s0, s3 = s0;
+    for (; i + 32 <= n; i += 32) {
+      __m512i va = _mm512_cvtepi8_epi16(_mm256_loadu_si256(
+        reinterpret_cast<const __m256i*>(a + i)));
+      s0 = _mm512_dpwssd_epi32(s0, va, _mm512_cvtepi8_epi16(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b0 + i))));
+      s1 = _mm512_dpwssd_epi32(s1, va, _mm512_cvtepi8_epi16(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b1 + i))));
+      s2 = _mm512_dpwssd_epi32(s2, va, _mm512_cvtepi8_epi16(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b2 + i))));
+      s3 = _mm512_dpwssd_epi32(s3, va, _mm512_cvtepi8_epi16(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b3 + i))));
+    }
+    // Fold the accumulators to 256 bits, then horizontal sums at once
+    __m256i h0  = Fold(s0), h1 = Fold(s1), h2 = Fold(s2), h3 = Fold(s3);
+    __m256i s   = _mm256_hadd_epi32(_mm256_hadd_epi32(h0, h1),
+                                    _mm256_hadd_epi32(h2, h3));
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(s),
+                                _mm256_extracti128_si256(s, 1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(acc), sum);
+#elif defined(__AVX2__)
+    __m256i s0 = _mm256_setzero_si256(), s1 = s0, s2 = s0, s3 = s0;
+    for (; i + 16 <= n; i += 16) {
+      __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128(
+        reinterpret_cast<const __m128i*>(a + i)));
+      s0 = _mm256_add_epi32(s0, _mm256_madd_epi16(va, _mm256_cvtepi8_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(b0 + i)))));
+      s1 = _mm256_add_epi32(s1, _mm256_madd_epi16(va, _mm256_cvtepi8_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(b1 + i)))));
+      s2 = _mm256_add_epi32(s2, _mm256_madd_epi16(va, _mm256_cvtepi8_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(b2 + i)))));
+      s3 = _mm256_add_epi32(s3, _mm256_madd_epi16(va, _mm256_cvtepi8_epi16(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(b3 + i)))));
+    }
+    // Horizontal sums of the 4 accumulators at once
+    __m256i s01  = _mm256_hadd_epi32(s0, s1);
+    __m256i s23  = _mm256_hadd_epi32(s2, s3);
+    __m256i s    = _mm256_hadd_epi32(s01, s23);
+    __m128i sum  = _mm_add_epi32(_mm256_castsi256_si128(s),
+                                 _mm256_extracti128_si256(s, 1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(acc), sum);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    int32x4_t s0 = vdupq_n_s32(0), s1 = s0, s2 = s0, s3 = s0;
+    for (; i + 16 <= n; i += 16) {
+      int8x16_t va = vld1q_s8(a + i);
+      int8x16_t v0 = vld1q_s8(b0 + i);
+      int8x16_t v1 = vld1q_s8(b1 + i);
+      int8x16_t v2 = vld1q_s8(b2 + i);
+      int8x16_t v3 = vld1q_s8(b3 + i);
+      s0 = vpadalq_s16(s0, vmlal_high_s8(vmull_s8(vget_low_s8(va),
+                                                   vget_low_s8(v0)), va, v0));
+      s1 = vpadalq_s16(s1, vmlal_high_s8(vmull_s8(vget_low_s8(va),
+                                                   vget_low_s8(v1)), va, v1));
+      s2 = vpadalq_s16(s2, vmlal_high_s8(vmull_s8(vget_low_s8(va),
+                                                   vget_low_s8(v2)), va, v2));
+      s3 = vpadalq_s16(s3, vmlal_high_s8(vmull_s8(vget_low_s8(va),
+                                                   vget_low_s8(v3)), va, v3));
+    }
+    acc[0] = vaddvq_s32(s0);
+    acc[1] = vaddvq_s32(s1);
+    acc[2] = vaddvq_s32(s2);
+    acc[3] = vaddvq_s32(s3);
+#endif
+    for (; i < n; ++i) {
+      int32_t va = a[i];
+      acc[0] += va * b0[i];
+      acc[1] += va * b1[i];
+      acc[2] += va * b2[i];
+      acc[3] += va * b3[i];
+    }
+    c[0] = acc[0];
+    c[1] = acc[1];
+    c[2] = acc[2];
+    c[3] = acc[3];
+  }
+
+  /*!
+   * Dot product of two int8 vectors.
+   *
+   *  \param[in]  n: vectors size
+   *  \param[in]  a: first vector
+   *  \param[in]  b: second vector
+   *
+   *  \return     Dot product
+   */
+  static int32_t Dot(uint32_t n, const int8_t* a, const int8_t* b) {
+    int32_t acc = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+      acc += int32_t(a[i]) * int32_t(b[i]);
+    }
+    return acc;
+  }
+
+  /*!
+   * Get the input scale.
+   *
+   *  \return Input scale (value of a quantization step)
+   */
+  Dtype InScale() const {
+    Dtype range = range_->Data()[0];
+    return range > Dtype(0) ? range / 127 : Dtype(1);
+  }
+
+  /*!
+   * Get the workspace of a chunk.
+   *
+   *  \param[in]  chunk   : chunk index
+   *  \param[in]  in_size : inputs size
+   *  \param[in]  acc_size: accumulators size
+   *
+   *  \param[out] qin     : inputs (int8)
+   *  \param[out] acc     : accumulators
+   */
+  void Workspace(uint32_t chunk, size_t in_size, size_t acc_size,
+                 int8_t** qin, int32_t** acc) {
+    qin_[chunk].resize(in_size);
+    acc_[chunk].resize(acc_size);
+    *qin = &qin_[chunk][0];
+    *acc = &acc_[chunk][0];
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   */
+  Quantizer() {
+    mode_    = MODE_FLOAT;
+    num_out_ = 0;
+  }
+
+  /*!
+   * Destructor.
+   */
+  ~Quantizer() {}
+
+  /*!
+   * Set the filter to quantize.
+   *
+   *  \param[in]  filter : filter (num_out rows of Size() / num_out values)
+   *  \param[in]  num_out: number of output channels
+   */
+  void SetFilter(const std::shared_ptr<Mat<Dtype>>& filter, uint32_t num_out) {
+    filter_  = filter;
+    num_out_ = num_out;
+    qfilter_ = std::make_shared<Mat<int8_t>>(filter->size, false);
+    scale_   = std::make_shared<Mat<Dtype>>(1, 1, num_out, 1, false);
+    range_   = std::make_shared<Mat<Dtype>>(1, 1, 1, 1, false);
+  }
+
+  /*!
+   * Get the quantization mode.
+   *
+   *  \return Quantization mode
+   */
+  E_MODE Mode() const {
+    return mode_;
+  }
+
+  /*!
+   * Set the quantization mode.
+   * Switching to int8 from calibration quantizes the filter, otherwise the
+   * quantized filter must have been loaded (see Model::Load).
+   *
+   *  \param[in]  mode: quantization mode
+   */
+  void SetMode(E_MODE mode) {
+    if (mode == MODE_CALIBRATE) {
+      range_->Data()[0] = Dtype(0);
+    } else if (mode == MODE_INT8 && mode_ == MODE_CALIBRATE) {
+      QuantizeFilter();
+    }
+    mode_ = mode;
+  }
+
+  /*!
+   * Record the range of some inputs (calibration).
+   *
+   *  \param[in]  in  : inputs
+   *  \param[in]  size: number of inputs
+   */
+  void Calibrate(const Dtype* in, size_t size) {
+    Dtype range = range_->Data()[0];
+    for (size_t i = 0; i < size; ++i) {
+      range = std::max(range, std::abs(in[i]));
+    }
+    range_->Data()[0] = range;
+  }
+
+  /*!
+   * Quantize the filter (one scale per output channel).
+   */
+  void QuantizeFilter() {
+    uint32_t     row_size = filter_->Size() / num_out_;
+    const Dtype* filter   = filter_->Data();
+    int8_t*      qfilter  = qfilter_->Data();
+    Dtype*       scale    = scale_->Data();
+    for (uint32_t out = 0; out < num_out_; ++out) {
+      const Dtype* row   = filter + out * row_size;
+      Dtype        range = Dtype(0);
+      for (uint32_t i = 0; i < row_size; ++i) {
+        range = std::max(range, std::abs(row[i]));
+      }
+      scale[out] = range > Dtype(0) ? range / 127 : Dtype(1);
+      Dtype inv_scale = Dtype(1) / scale[out];
+      for (uint32_t i = 0; i < row_size; ++i) {
+        qfilter[out * row_size + i] = Round(row[i] * inv_scale);
+      }
+    }
+  }
+
+  /*!
+   * Get the tensors replacing the filter once quantized.
+   *
+   *  \param[out] qfilter: filter (int8)
+   *  \param[out] scale  : filter scales (per output)
+   *  \param[out] range  : input range
+   */
+  void GetTensor(std::shared_ptr<Mat<int8_t>>* qfilter,
+                 std::shared_ptr<Mat<Dtype>>*  scale,
+                 std::shared_ptr<Mat<Dtype>>*  range) const {
+    *qfilter = qfilter_;
+    *scale   = scale_;
+    *range   = range_;
+  }
+
+  /*!
+   * Set the number of chunks working in parallel (see ParallelFor).
+   *
+   *  \param[in]  num_chunk: number of chunks
+   */
+  void SetNumChunk(uint32_t num_chunk) {
+    qin_.resize(num_chunk);
+    acc_.resize(num_chunk);
+  }
+
+  /*!
+   * Quantized matrix multiplication: C = A * B^T
+   *
+   *  \param[in]  m: A and C number of rows
+   *  \param[in]  n: B number of rows and C number of columns
+   *  \param[in]  k: A and B number of columns
+   *  \param[in]  a: A matrix (m*k)
+   *  \param[in]  b: B matrix (n*k)
+   *
+   *  \param[out] c: C matrix (m*n)
+   */
+  static void Gemm(uint32_t m, uint32_t n, uint32_t k,
+                   const int8_t* a, const int8_t* b, int32_t* c) {
+    for (uint32_t i = 0; i < m; ++i) {
+      const int8_t* a_row = a + i * k;
+      int32_t*      c_row = c + i * n;
+      uint32_t      j     = 0;
+      for (; j + 4 <= n; j += 4) {
+        Dot4(k, a_row, b + j * k, k, c_row + j);
+      }
+      for (; j < n; ++j) {
+        c_row[j] = Dot(k, a_row, b + j * k);
+      }
+    }
+  }
+
+  /*!
+   * Forward pass with the inputs as rows: out = in * filter^T.
+   *
+   *  \param[in]  num_row: number of inputs rows (e.g. batch size)
+   *  \param[in]  in     : inputs (num_row rows of filter row size)
+   *  \param[in]  chunk  : chunk index (see SetNumChunk)
+   *
+   *  \param[out] out    : outputs (num_row rows of num_out values)
+   */
+  void ForwardRow(uint32_t num_row, const Dtype* in, uint32_t chunk,
+                  Dtype* out) {
+    uint32_t row_size = filter_->Size() / num_out_;
+    int8_t*  qin;
+    int32_t* acc;
+    Workspace(chunk, size_t(num_row) * row_size, size_t(num_row) * num_out_,
+              &qin, &acc);
+
+    Dtype in_scale     = InScale();
+    Dtype inv_in_scale = Dtype(1) / in_scale;
+    for (size_t i = 0; i < size_t(num_row) * row_size; ++i) {
+      qin[i] = Round(in[i] * inv_in_scale);
+    }
+
+    Gemm(num_row, num_out_, row_size, qin, qfilter_->Data(), acc);
+
+    const Dtype* scale = scale_->Data();
+    for (uint32_t row = 0; row < num_row; ++row) {
+      for (uint32_t o = 0; o < num_out_; ++o) {
+        out[row * num_out_ + o] = Dtype(acc[row * num_out_ + o]) *
+                                  (in_scale * scale[o]);
+      }
+    }
+  }
+
+  /*!
+   * Forward pass with the inputs as columns: out = filter * in.
+   *
+   *  \param[in]  num_col: number of inputs columns (e.g. output pixels)
+   *  \param[in]  in     : inputs (filter row size rows of num_col values)
+   *  \param[in]  chunk  : chunk index (see SetNumChunk)
+   *
+   *  \param[out] out    : outputs (num_out rows of num_col values)
+   */
+  void ForwardCol(uint32_t num_col, const Dtype* in, uint32_t chunk,
+                  Dtype* out) {
+    uint32_t row_size = filter_->Size() / num_out_;
+    int8_t*  qin;
+    int32_t* acc;
+    Workspace(chunk, size_t(num_col) * row_size, size_t(num_col) * num_out_,
+              &qin, &acc);
+
+    // Quantize the inputs, transposed so the dot products are contiguous
+    Dtype in_scale     = InScale();
+    Dtype inv_in_scale = Dtype(1) / in_scale;
+    for (uint32_t i = 0; i < row_size; ++i) {
+      for (uint32_t col = 0; col < num_col; ++col) {
+        qin[col * row_size + i] = Round(in[i * num_col + col] * inv_in_scale);
+      }
+    }
+
+    Gemm(num_out_, num_col, row_size, qfilter_->Data(), qin, acc);
+
+    const Dtype* scale = scale_->Data();
+    for (uint32_t o = 0; o < num_out_; ++o) {
+      Dtype s = in_scale * scale[o];
+      for (uint32_t col = 0; col < num_col; ++col) {
+        out[o * num_col + col] = Dtype(acc[o * num_col + col]) * s;
+      }
+    }
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_QUANTIZE_H_
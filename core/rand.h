@@ -28,6 +28,11 @@
 
 
 #include <core/mat.h>
+#include <core/thread_pool.h>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
 #include <memory>
 #include <random>
 
@@ -35,9 +40,167 @@
 namespace jik {
 
 
+/*!
+ *  \class  Philox
+ *  \brief  Counter-based random generator (Philox4x32-10)
+ *
+ * A block of 4 random 32-bit values is a function of a 128-bit counter and
+ * of a 64-bit key (10 rounds of multiplications and xors), without any
+ * state: the value i of a stream is word i % 4 of the block whose counter is
+ * (i / 4, step, stream), the key being the seed. The blocks are generated 16
+ * at a time, the rounds being vectorized, and split across the threads:
+ * the values don't depend on the number of threads.
+ *
+ * The seed is set once (see SetSeed, random by default), then each user
+ * (e.g. a weight, a dropout layer) takes its own stream (see NewStream):
+ * the random values of a model only depend on the seed and on the order in
+ * which its layers are created.
+ */
+class Philox {
+  // Public attributes
+ public:
+  static const uint32_t kLane  = 16;    // Blocks generated at once
+  static const uint32_t kChunk = 1024;  // Values generated at once per thread
+
+
+  // Protected types
+ protected:
+  struct Seeding {
+    uint64_t              seed;    // Seed (key)
+    std::atomic<uint64_t> stream;  // Next stream
+  };
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Get the seed and stream counter of the process.
+   *
+   *  \return Seeding
+   */
+  static Seeding& GetSeeding() {
+    static Seeding seeding = {
+      (uint64_t(std::random_device()()) << 32) | std::random_device()(), {0}
+    };
+    return seeding;
+  }
+
+  /*!
+   * Generate consecutive blocks.
+   *
+   *  \param[in]  first    : first block
+   *  \param[in]  num_block: number of blocks (multiple of kLane)
+   *  \param[in]  step     : step
+   *  \param[in]  stream   : stream
+   *  \param[in]  key      : key
+   *
+   *  \param[out] out      : values (4 per block)
+   */
+  static void Block(uint32_t first, uint32_t num_block, uint32_t step,
+                    uint64_t stream, uint64_t key, uint32_t* out) {
+    const uint32_t kM0 = 0xD2511F53, kM1 = 0xCD9E8D57;
+    const uint32_t kW0 = 0x9E3779B9, kW1 = 0xBB67AE85;
+
+    for (uint32_t block = 0; block < num_block; block += kLane) {
+      uint32_t c0[kLane], c1[kLane], c2[kLane], c3[kLane];
+      for (uint32_t l = 0; l < kLane; ++l) {
+        c0[l] = first + block + l;
+        c1[l] = step;
+        c2[l] = uint32_t(stream);
+        c3[l] = uint32_t(stream >> 32);
+      }
+      uint32_t k0 = uint32_t(key), k1 = uint32_t(key >> 32);
+      for (int round = 0; round < 10; ++round) {
+        for (uint32_t l = 0; l < kLane; ++l) {
+          uint64_t p0 = uint64_t(kM0) * c0[l];
+          uint64_t p1 = uint64_t(kM1) * c2[l];
+          uint32_t x0 = uint32_t(p1 >> 32) ^ c1[l] ^ k0;
+          uint32_t x2 = uint32_t(p0 >> 32) ^ c3[l] ^ k1;
+          c1[l] = uint32_t(p1);
+          c3[l] = uint32_t(p0);
+          c0[l] = x0;
+          c2[l] = x2;
+        }
+        k0 += kW0;
+        k1 += kW1;
+      }
+      uint32_t* out_block = out + 4 * block;
+      for (uint32_t l = 0; l < kLane; ++l) {
+        out_block[4 * l]     = c0[l];
+        out_block[4 * l + 1] = c1[l];
+        out_block[4 * l + 2] = c2[l];
+        out_block[4 * l + 3] = c3[l];
+      }
+    }
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Set the seed, and restart the streams.
+   *
+   *  \param[in]  seed: seed
+   */
+  static void SetSeed(uint64_t seed) {
+    GetSeeding().seed   = seed;
+    GetSeeding().stream = 0;
+  }
+
+  /*!
+   * Get a new stream.
+   *
+   *  \return Stream
+   */
+  static uint64_t NewStream() {
+    return GetSeeding().stream++;
+  }
+
+  /*!
+   * Generate the random 32-bit values of a stream, in chunks split across
+   * the threads.
+   *
+   *  \param[in]  stream: stream
+   *  \param[in]  step  : step (e.g. a forward pass counter)
+   *  \param[in]  size  : number of values
+   *  \param[in]  func  : function called with (first value, last value
+   *                      excluded, values): the chunk is rounded up to a
+   *                      multiple of 4 values (the next values are valid)
+   */
+  template <typename Func>
+  static void Generate(uint64_t stream, uint32_t step, uint32_t size,
+                       const Func& func) {
+    uint64_t key = GetSeeding().seed;
+    ParallelFor(0, (size + kChunk - 1) / kChunk,
+                [&](uint32_t chunk_start, uint32_t chunk_end, uint32_t) {
+      alignas(64) uint32_t value[kChunk];
+      for (uint32_t chunk = chunk_start; chunk < chunk_end; ++chunk) {
+        uint32_t begin = chunk * kChunk;
+        uint32_t end   = std::min(begin + kChunk, size);
+        uint32_t num_block = ((end - begin + 4 * kLane - 1) / (4 * kLane)) *
+                             kLane;
+        Block(begin / 4, num_block, step, stream, key, value);
+        func(begin, end, value);
+      }
+    });
+  }
+
+  /*!
+   * Convert a random value to a uniform float in [0, 1).
+   *
+   *  \param[in]  x: random value
+   *
+   *  \return     Uniform float
+   */
+  static float Uniform(uint32_t x) {
+    return float(x >> 8) * (1.0f / 16777216.0f);
+  }
+};
+
+
 /*!
  *  \struct Rand
- *  \brief  Random generator
+ *  \brief  Random generator (see Philox)
  */
 template <typename Dtype>
 struct Rand {
@@ -58,21 +221,21 @@ struct Rand {
                                             Dtype low, Dtype high) {
     std::shared_ptr<Mat<Dtype>> mat = std::make_shared<Mat<Dtype>>(n, d, m, f);
 
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_real_distribution<Dtype> dist(low, high);
-
     Dtype* mat_data = mat->Data();
-    for (uint32_t i = 0; i < mat->Size(); ++i) {
-      mat_data[i] = dist(gen);
-    }
+    Philox::Generate(Philox::NewStream(), 0, mat->Size(),
+                     [=](uint32_t begin, uint32_t end, const uint32_t* value) {
+      for (uint32_t i = begin; i < end; ++i) {
+        mat_data[i] = low + (high - low) * Philox::Uniform(value[i - begin]);
+      }
+    });
 
     return mat;
   }
 
 
   /*!
-   * Generate a randomly gaussian distributed matrix.
+   * Generate a randomly gaussian distributed matrix (Box-Muller transform of
+   * pairs of uniform values).
    *
    *  \param[in]  n      : matrix size
    *  \param[in]  d      : matrix size
@@ -88,14 +251,23 @@ struct Rand {
                                                  Dtype mean, Dtype std_dev) {
     std::shared_ptr<Mat<Dtype>> mat = std::make_shared<Mat<Dtype>>(n, d, m, f);
 
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::normal_distribution<Dtype> dist(mean, std_dev);
-
+    const float kTwoPi = 6.28318530718f;
     Dtype* mat_data = mat->Data();
-    for (uint32_t i = 0; i < mat->Size(); ++i) {
-      mat_data[i] = dist(gen);
-    }
+    Philox::Generate(Philox::NewStream(), 0, mat->Size(),
+                     [=](uint32_t begin, uint32_t end, const uint32_t* value) {
+      for (uint32_t i = begin; i < end; i += 2) {
+        // Radius from (0, 1] (no log of 0), angle from [0, 1)
+        float u0     = Philox::Uniform(value[i - begin]) +
+                       (1.0f / 16777216.0f);
+        float u1     = Philox::Uniform(value[i - begin + 1]);
+        float radius = std::sqrt(-2.0f * std::log(u0));
+        mat_data[i]  = mean + std_dev * Dtype(radius * std::cos(kTwoPi * u1));
+        if (i + 1 < end) {
+          mat_data[i + 1] = mean + std_dev *
+                            Dtype(radius * std::sin(kTwoPi * u1));
+        }
+      }
+    });
 
     return mat;
   }
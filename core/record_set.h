@@ -0,0 +1,279 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_RECORD_SET_H_
+#define CORE_RECORD_SET_H_
+
+
+#include <core/arena.h>
+#include <core/log.h>
+#include <algorithm>
+#include <cstdio>
+#include <memory>
+#include <numeric>
+#include <utility>
+#include <vector>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+namespace jik {
+
+
+/*!
+ *  \class  RecordSet
+ *  \brief  Set of records (image + label) mapped from shard files
+ *
+ * The records are read straight from the dataset files (the shards), mapped
+ * in memory: the pixels stay in 8 bits, the pages being loaded on demand
+ * (and dropped by the system when memory is short), so a dataset can be
+ * larger than the memory. The pixels are only converted when an image is
+ * copied (see Copy), e.g. when a batch is assembled.
+ *
+ * In a shard, the images and the labels are laid out with a fixed stride,
+ * either in the same file (label and pixels of a record next to each other)
+ * or in two files.
+ *
+ * Shuffling the set only permutes the indices of the records.
+ */
+template <typename Dtype>
+class RecordSet {
+  // Public types
+ public:
+  typedef Dtype Type;
+
+  /*!
+   *  \struct Shard
+   *  \brief  Records of a shard
+   */
+  struct Shard {
+    std::shared_ptr<uint8_t> image_mem;     // Images file (kept mapped)
+    std::shared_ptr<uint8_t> label_mem;     // Labels file (kept mapped)
+    const uint8_t*           image;         // First image
+    const uint8_t*           label;         // First label
+    size_t                   image_stride;  // Image stride (bytes)
+    size_t                   label_stride;  // Label stride (bytes)
+    uint32_t                 count;         // Number of records
+  };
+
+
+  // Protected attributes
+ protected:
+  std::vector<Shard>                          shard_;       // Shards
+  std::vector<std::pair<uint32_t, uint32_t>>  record_;      // Records
+                                                            // (shard, index)
+  uint32_t                                    image_size_;  // Image size
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   */
+  RecordSet() {
+    image_size_ = 0;
+  }
+
+  /*!
+   * Destructor.
+   */
+  ~RecordSet() {}
+
+  /*!
+   * Map a file in memory (read only).
+   * Where memory mapping is not available (Windows), the file is read.
+   *
+   *  \param[in]  file_path: path to the file
+   *
+   *  \param[out] size     : file size (bytes)
+   *  \return     Memory (nullptr on error)
+   */
+  static std::shared_ptr<uint8_t> Map(const char* file_path, size_t* size) {
+    *size = 0;
+#ifndef _WIN32
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
+      Report(kError, "Can't open file '%s'", file_path);
+      return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || !st.st_size) {
+      close(fd);
+      Report(kError, "Can't read file '%s'", file_path);
+      return nullptr;
+    }
+    size_t file_size = size_t(st.st_size);
+    void* addr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      Report(kError, "Can't map file '%s'", file_path);
+      return nullptr;
+    }
+    *size = file_size;
+    return std::shared_ptr<uint8_t>(reinterpret_cast<uint8_t*>(addr),
+                                    [file_size](uint8_t* data) {
+                                      munmap(data, file_size);
+                                    });
+#else
+    std::FILE* fp = std::fopen(file_path, "rb");
+    if (!fp) {
+      Report(kError, "Can't open file '%s'", file_path);
+      return nullptr;
+    }
+    std::fseek(fp, 0, SEEK_END);
+    size_t file_size = size_t(std::ftell(fp));
+    std::fseek(fp, 0, SEEK_SET);
+    std::shared_ptr<uint8_t> mem = Arena::AlignedAlloc(file_size);
+    bool res = file_size &&
+               std::fread(mem.get(), 1, file_size, fp) == file_size;
+    std::fclose(fp);
+    if (!res) {
+      Report(kError, "Can't read file '%s'", file_path);
+      return nullptr;
+    }
+    *size = file_size;
+    return mem;
+#endif
+  }
+
+  /*!
+   * Remove all the records.
+   */
+  void Clear() {
+    shard_.clear();
+    record_.clear();
+    image_size_ = 0;
+  }
+
+  /*!
+   * Add the records of a shard.
+   *
+   *  \param[in]  shard     : shard
+   *  \param[in]  image_size: image size (bytes, same for all the shards)
+   *
+   *  \return     Error?
+   */
+  bool Add(const Shard& shard, uint32_t image_size) {
+    if (image_size_ && image_size != image_size_) {
+      Report(kError, "Invalid image size %d (expected %d)",
+             image_size, image_size_);
+      return false;
+    }
+    image_size_ = image_size;
+
+    uint32_t index = uint32_t(shard_.size());
+    shard_.push_back(shard);
+    for (uint32_t i = 0; i < shard.count; ++i) {
+      record_.emplace_back(index, i);
+    }
+    return true;
+  }
+
+  /*!
+   * Randomly shuffle the records.
+   *
+   *  \param[in]  gen: random generator
+   */
+  template <typename Gen>
+  void Shuffle(Gen* gen) {
+    std::shuffle(record_.begin(), record_.end(), *gen);
+  }
+
+  /*!
+   * Get the number of records.
+   *
+   *  \return Number of records
+   */
+  size_t size() const {
+    return record_.size();
+  }
+
+  /*!
+   * Check if the set is empty.
+   *
+   *  \return Empty?
+   */
+  bool empty() const {
+    return record_.empty();
+  }
+
+  /*!
+   * Get the image size.
+   *
+   *  \return Image size (bytes)
+   */
+  uint32_t ImageSize() const {
+    return image_size_;
+  }
+
+  /*!
+   * Get the pixels of an image.
+   *
+   *  \param[in]  i: record index
+   *
+   *  \return     Pixels
+   */
+  const uint8_t* Image(size_t i) const {
+    const Shard& shard = shard_[record_[i].first];
+    return shard.image + record_[i].second * shard.image_stride;
+  }
+
+  /*!
+   * Get the label of a record.
+   *
+   *  \param[in]  i: record index
+   *
+   *  \return     Label
+   */
+  uint8_t Label(size_t i) const {
+    const Shard& shard = shard_[record_[i].first];
+    return shard.label[record_[i].second * shard.label_stride];
+  }
+
+  /*!
+   * Copy an image, converting the pixels to [0, 1].
+   *
+   *  \param[in]  i  : record index
+   *
+   *  \param[out] out: image
+   */
+  void Copy(size_t i, Dtype* out) const {
+    const uint8_t* image = Image(i);
+    for (uint32_t j = 0; j < image_size_; ++j) {
+      out[j] = Dtype(image[j]) / 0xFF;
+    }
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_RECORD_SET_H_
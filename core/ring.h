@@ -0,0 +1,459 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_RING_H_
+#define CORE_RING_H_
+
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <core/log.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Ring
+ *  \brief  Ring of processes connected over TCP
+ *
+ * Each process (rank) listens on its own address and connects to the next
+ * rank, receiving from the previous one: the data goes around the ring.
+ * The addresses of all the ranks are given as a comma separated list of
+ * host:port, the same on every rank.
+ *
+ * The ring all-reduce splits a buffer in one chunk per rank: each chunk is
+ * summed while going around the ring once (reduce-scatter), then the sums
+ * go around once more (all-gather). Each rank sends and receives
+ * 2 * (N - 1) / N times the buffer size, whatever the number of ranks.
+ *
+ * Sending and receiving are interleaved (see SendRecv), so the ranks never
+ * block on full socket buffers while they all send at the same time.
+ */
+class Ring {
+  // Protected attributes
+ protected:
+  uint32_t rank_;       // Rank of this process
+  uint32_t num_rank_;   // Number of ranks
+  int      next_;       // Socket to the next rank
+  int      prev_;       // Socket from the previous rank
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Split an address into host and port.
+   *
+   *  \param[in]  address: host:port
+   *
+   *  \param[out] host   : host
+   *  \param[out] port   : port
+   *  \return     Error?
+   */
+  static bool SplitAddress(const std::string& address, std::string* host,
+                           std::string* port) {
+    size_t pos = address.rfind(':');
+    if (pos == std::string::npos || !pos || pos + 1 == address.size()) {
+      return false;
+    }
+    *host = address.substr(0, pos);
+    *port = address.substr(pos + 1);
+    return true;
+  }
+
+  /*!
+   * Resolve an address.
+   *
+   *  \param[in]  address: host:port
+   *  \param[in]  passive: address to listen on?
+   *
+   *  \return     Address info (nullptr if error, to release with freeaddrinfo)
+   */
+  static addrinfo* Resolve(const std::string& address, bool passive) {
+    std::string host, port;
+    if (!SplitAddress(address, &host, &port)) {
+      return nullptr;
+    }
+    addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = passive ? AI_PASSIVE : 0;
+    addrinfo* info    = nullptr;
+    if (getaddrinfo(passive ? nullptr : host.c_str(), port.c_str(), &hints,
+                    &info)) {
+      return nullptr;
+    }
+    return info;
+  }
+
+  /*!
+   * Set the options of a connected socket: no delay (the chunks are sent
+   * as soon as possible) and non-blocking (see SendRecv).
+   *
+   *  \param[in]  sock: socket
+   */
+  static void SetOptions(int sock) {
+    int flag = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+  }
+
+  /*!
+   * Close the sockets.
+   */
+  void Close() {
+    if (next_ >= 0) {
+      close(next_);
+    }
+    if (prev_ >= 0) {
+      close(prev_);
+    }
+    next_ = prev_ = -1;
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor (a ring of one rank until connected).
+   */
+  Ring() {
+    rank_     = 0;
+    num_rank_ = 1;
+    next_     = prev_ = -1;
+  }
+
+  /*!
+   * Destructor.
+   */
+  ~Ring() {
+    Close();
+  }
+
+  Ring(const Ring&)            = delete;
+  Ring& operator=(const Ring&) = delete;
+
+  /*!
+   * Connect the ring.
+   *
+   *  \param[in]  address: addresses of all the ranks (host:port,host:port...)
+   *  \param[in]  rank   : rank of this process
+   *  \param[in]  timeout: time to wait for the other ranks (s)
+   *
+   *  \return     Error?
+   */
+  bool Connect(const char* address, uint32_t rank, double timeout = 60) {
+    Close();
+
+    std::vector<std::string> rank_address;
+    std::string list = address ? address : "";
+    for (size_t start = 0; start <= list.size();) {
+      size_t end = std::min(list.find(',', start), list.size());
+      if (end > start) {
+        rank_address.push_back(list.substr(start, end - start));
+      }
+      start = end + 1;
+    }
+    if (rank >= rank_address.size()) {
+      Report(kError, "Invalid rank %d for %ld address(es)", rank,
+             rank_address.size());
+      return false;
+    }
+    rank_     = rank;
+    num_rank_ = uint32_t(rank_address.size());
+    if (num_rank_ == 1) {
+      return true;
+    }
+
+    // Listen on our address
+    addrinfo* info = Resolve(rank_address[rank_], true);
+    if (!info) {
+      Report(kError, "Invalid address '%s'", rank_address[rank_].c_str());
+      return false;
+    }
+    int listen_sock = socket(info->ai_family, info->ai_socktype,
+                             info->ai_protocol);
+    int flag = 1;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    if (listen_sock < 0 ||
+        bind(listen_sock, info->ai_addr, info->ai_addrlen) ||
+        listen(listen_sock, 1)) {
+      freeaddrinfo(info);
+      if (listen_sock >= 0) {
+        close(listen_sock);
+      }
+      Report(kError, "Can't listen on '%s'", rank_address[rank_].c_str());
+      return false;
+    }
+    freeaddrinfo(info);
+
+    // Connect to the next rank, retrying while it starts
+    const std::string& next_address = rank_address[(rank_ + 1) % num_rank_];
+    std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+    for (;;) {
+      info = Resolve(next_address, false);
+      if (info) {
+        next_ = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+        if (next_ >= 0 && !connect(next_, info->ai_addr, info->ai_addrlen)) {
+          freeaddrinfo(info);
+          break;
+        }
+        freeaddrinfo(info);
+        if (next_ >= 0) {
+          close(next_);
+          next_ = -1;
+        }
+      }
+      if (std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                        start).count() > timeout) {
+        close(listen_sock);
+        Report(kError, "Can't connect to '%s'", next_address.c_str());
+        return false;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    // Accept the previous rank, waiting for it until the timeout
+    pollfd listen_fd;
+    listen_fd.fd     = listen_sock;
+    listen_fd.events = POLLIN;
+    for (;;) {
+      double left = timeout - std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count();
+      listen_fd.revents = 0;
+      int res = left > 0 ? poll(&listen_fd, 1, int(left * 1000) + 1) : 0;
+      if (res > 0 || (res < 0 && errno != EINTR)) {
+        break;
+      }
+      if (!res) {
+        close(listen_sock);
+        Close();
+        Report(kError, "Timeout waiting for the previous rank on '%s'",
+               rank_address[rank_].c_str());
+        return false;
+      }
+    }
+    prev_ = accept(listen_sock, nullptr, nullptr);
+    close(listen_sock);
+    if (prev_ < 0) {
+      Close();
+      Report(kError, "Can't accept the previous rank");
+      return false;
+    }
+    SetOptions(next_);
+    SetOptions(prev_);
+
+    // Make sure the whole ring is connected
+    uint32_t token = rank_;
+    for (uint32_t i = 0; i < num_rank_ - 1; ++i) {
+      uint32_t prev_token;
+      if (!SendRecv(&token, sizeof(token), &prev_token, sizeof(prev_token))) {
+        return false;
+      }
+      token = prev_token;
+    }
+    if (token != (rank_ + 1) % num_rank_) {
+      Close();
+      Report(kError, "Invalid ring: check the ranks and addresses");
+      return false;
+    }
+    return true;
+  }
+
+  /*!
+   * Get the rank of this process.
+   *
+   *  \return Rank
+   */
+  uint32_t Rank() const {
+    return rank_;
+  }
+
+  /*!
+   * Get the number of ranks.
+   *
+   *  \return Number of ranks
+   */
+  uint32_t NumRank() const {
+    return num_rank_;
+  }
+
+  /*!
+   * Send to the next rank while receiving from the previous one.
+   *
+   *  \param[in]  send     : data to send
+   *  \param[in]  send_size: number of bytes to send
+   *
+   *  \param[out] recv     : data received
+   *  \param[in]  recv_size: number of bytes to receive
+   *  \return     Error?
+   */
+  bool SendRecv(const void* send, size_t send_size, void* recv,
+                size_t recv_size) {
+    const uint8_t* send_data = static_cast<const uint8_t*>(send);
+    uint8_t*       recv_data = static_cast<uint8_t*>(recv);
+    while (send_size || recv_size) {
+      pollfd fd[2];
+      fd[0].fd      = next_;
+      fd[0].events  = send_size ? POLLOUT : 0;
+      fd[0].revents = 0;
+      fd[1].fd      = prev_;
+      fd[1].events  = recv_size ? POLLIN : 0;
+      fd[1].revents = 0;
+      if (poll(fd, 2, -1) < 0) {
+        Report(kError, "Ring poll failed");
+        return false;
+      }
+      if ((fd[0].revents | fd[1].revents) & (POLLERR | POLLNVAL)) {
+        Report(kError, "Ring connection lost");
+        return false;
+      }
+      if (fd[0].revents & POLLOUT) {
+        ssize_t size = ::send(next_, send_data, send_size, MSG_NOSIGNAL);
+        if (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+          Report(kError, "Ring send failed");
+          return false;
+        }
+        if (size > 0) {
+          send_data += size;
+          send_size -= size_t(size);
+        }
+      }
+      if (fd[1].revents & (POLLIN | POLLHUP)) {
+        ssize_t size = ::recv(prev_, recv_data, recv_size, 0);
+        if (!size || (size < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+          Report(kError, "Ring receive failed");
+          return false;
+        }
+        if (size > 0) {
+          recv_data += size;
+          recv_size -= size_t(size);
+        }
+      }
+    }
+    return true;
+  }
+
+  /*!
+   * Sum a buffer over all the ranks (ring all-reduce).
+   *
+   *  \param[in]  size   : number of values
+   *  \param[in]  scratch: scratch buffer (at least size / NumRank + 1 values)
+   *
+   *  \param[out] data   : values to sum, replaced by the sums
+   *  \return     Error?
+   */
+  template <typename Dtype>
+  bool AllReduce(size_t size, Dtype* data, Dtype* scratch) {
+    if (num_rank_ == 1 || !size) {
+      return true;
+    }
+
+    // Chunk i: [offset(i), offset(i + 1))
+    size_t chunk_size = size / num_rank_;
+    size_t remainder  = size % num_rank_;
+    auto offset = [chunk_size, remainder](uint32_t chunk) {
+      return chunk * chunk_size + std::min(size_t(chunk), remainder);
+    };
+
+    // Reduce-scatter: after N - 1 steps, chunk rank + 1 holds the sum
+    for (uint32_t step = 0; step < num_rank_ - 1; ++step) {
+      uint32_t send_chunk = (rank_ + num_rank_ - step) % num_rank_;
+      uint32_t recv_chunk = (rank_ + num_rank_ - step - 1) % num_rank_;
+      size_t   send_start = offset(send_chunk);
+      size_t   recv_start = offset(recv_chunk);
+      size_t   recv_size  = offset(recv_chunk + 1) - recv_start;
+      if (!SendRecv(data + send_start,
+                    (offset(send_chunk + 1) - send_start) * sizeof(Dtype),
+                    scratch, recv_size * sizeof(Dtype))) {
+        return false;
+      }
+      Dtype* recv_data = data + recv_start;
+      for (size_t i = 0; i < recv_size; ++i) {
+        recv_data[i] += scratch[i];
+      }
+    }
+
+    // All-gather: the sums go around the ring
+    for (uint32_t step = 0; step < num_rank_ - 1; ++step) {
+      uint32_t send_chunk = (rank_ + 1 + num_rank_ - step) % num_rank_;
+      uint32_t recv_chunk = (rank_ + num_rank_ - step) % num_rank_;
+      size_t   send_start = offset(send_chunk);
+      size_t   recv_start = offset(recv_chunk);
+      if (!SendRecv(data + send_start,
+                    (offset(send_chunk + 1) - send_start) * sizeof(Dtype),
+                    data + recv_start,
+                    (offset(recv_chunk + 1) - recv_start) * sizeof(Dtype))) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /*!
+   * Broadcast a buffer from rank 0 to all the ranks.
+   *
+   *  \param[in]  size: number of bytes
+   *
+   *  \param[out] data: data (sent by rank 0, received by the others)
+   *  \return     Error?
+   */
+  bool Broadcast(size_t size, void* data) {
+    if (num_rank_ == 1) {
+      return true;
+    }
+    // Rank 0 sends, the last rank only receives, the others forward
+    if (rank_ && !SendRecv(nullptr, 0, data, size)) {
+      return false;
+    }
+    if (rank_ + 1 < num_rank_ && !SendRecv(data, size, nullptr, 0)) {
+      return false;
+    }
+    return true;
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_RING_H_
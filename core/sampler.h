@@ -0,0 +1,144 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_SAMPLER_H_
+#define CORE_SAMPLER_H_
+
+
+#include <core/rand.h>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Sampler
+ *  \brief  Sampling of an index from a discrete distribution
+ *
+ * The distribution (e.g. the probabilities of a softmax) is restricted to its
+ * k most likely values if asked (top-k), renormalized, and turned into an
+ * alias table (Vose's method): each of the n columns of the table keeps a
+ * value with some probability, or else its alias. An index is sampled in
+ * constant time from 2 random values (a column, then the value or its
+ * alias), the table being built in linear time.
+ */
+template <typename Dtype>
+class Sampler {
+  // Public types
+ public:
+  typedef Dtype Type;
+
+
+  // Protected attributes
+ protected:
+  std::vector<uint32_t> index_;   // Index of each column
+  std::vector<Dtype>    prob_;    // Probability to keep each column index
+  std::vector<uint32_t> alias_;   // Alias of each column
+  std::vector<uint32_t> small_;   // Columns under the mean (building)
+  std::vector<uint32_t> large_;   // Columns over the mean (building)
+
+
+  // Public methods
+ public:
+  /*!
+   * Set the distribution.
+   *
+   *  \param[in]  prob : probabilities (not necessarily normalized)
+   *  \param[in]  size : number of probabilities
+   *  \param[in]  top_k: only keep the k most likely indices (0: all)
+   */
+  void Set(const Dtype* prob, uint32_t size, uint32_t top_k = 0) {
+    index_.resize(size);
+    for (uint32_t i = 0; i < size; ++i) {
+      index_[i] = i;
+    }
+    if (top_k && top_k < size) {
+      std::nth_element(index_.begin(), index_.begin() + top_k, index_.end(),
+                       [prob](uint32_t a, uint32_t b) {
+                         return prob[a] > prob[b];
+                       });
+      index_.resize(top_k);
+    }
+
+    // Probabilities scaled to a mean of 1
+    uint32_t n   = uint32_t(index_.size());
+    Dtype    sum = Dtype(0);
+    for (uint32_t i = 0; i < n; ++i) {
+      sum += prob[index_[i]];
+    }
+    prob_.resize(n);
+    alias_.resize(n);
+    small_.clear();
+    large_.clear();
+    for (uint32_t i = 0; i < n; ++i) {
+      prob_[i]  = (sum > Dtype(0)) ? prob[index_[i]] * n / sum : Dtype(1);
+      alias_[i] = i;
+      (prob_[i] < Dtype(1) ? small_ : large_).push_back(i);
+    }
+
+    // Each column under the mean is completed by a column over it
+    while (!small_.empty() && !large_.empty()) {
+      uint32_t s = small_.back();
+      uint32_t l = large_.back();
+      small_.pop_back();
+      large_.pop_back();
+      alias_[s] = l;
+      prob_[l] -= Dtype(1) - prob_[s];
+      (prob_[l] < Dtype(1) ? small_ : large_).push_back(l);
+    }
+
+    // Rounding errors: the remaining columns are full
+    for (uint32_t i : small_) {
+      prob_[i] = Dtype(1);
+    }
+    for (uint32_t i : large_) {
+      prob_[i] = Dtype(1);
+    }
+  }
+
+  /*!
+   * Sample an index.
+   *
+   *  \param[in]  x0: random value (column)
+   *  \param[in]  x1: random value (column index or alias)
+   *
+   *  \return     Index
+   */
+  uint32_t Sample(uint32_t x0, uint32_t x1) const {
+    uint32_t column = uint32_t((uint64_t(x0) * index_.size()) >> 32);
+    return index_[(Philox::Uniform(x1) < prob_[column]) ? column :
+                                                         alias_[column]];
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_SAMPLER_H_
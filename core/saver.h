@@ -0,0 +1,149 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_SAVER_H_
+#define CORE_SAVER_H_
+
+
+#include <core/log.h>
+#include <core/model_file.h>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Saver
+ *  \brief  Saving of a model being trained, in the background
+ *
+ * A save copies the tensors (the weights, and possibly the solver state) to
+ * a snapshot buffer at a step boundary, then returns: the snapshot is
+ * written on the saving thread while the training goes on (see
+ * ModelFile::Save, the file only replacing the previous one once flushed to
+ * the disk). The buffer is kept from a save to the next: the training only
+ * pays for a copy of the weights.
+ *
+ * A save waits for the previous one to be done.
+ */
+template <typename Dtype>
+class Saver {
+  // Public types
+ public:
+  typedef Dtype                             Type;
+  typedef typename ModelFile<Dtype>::Tensor Tensor;
+
+
+  // Protected attributes
+ protected:
+  std::vector<Tensor>  tensor_;   // Snapshot of the tensors
+  std::vector<uint8_t> data_;     // Snapshot data
+  std::string          path_;     // File path
+  bool                 verbose_;  // Report the saves?
+  std::thread          thread_;   // Saving thread
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Write the snapshot (saving thread).
+   */
+  void Run() {
+    size_t size = ModelFile<Dtype>::Save(path_.c_str(), tensor_);
+    if (verbose_ && size) {
+      Report(kInfo, "Saving model '%s' (%ld byte(s))", path_.c_str(), size);
+    }
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   */
+  Saver() {
+    verbose_ = false;
+  }
+
+  /*!
+   * Destructor.
+   */
+  ~Saver() {
+    Wait();
+  }
+
+  Saver(const Saver&)            = delete;
+  Saver& operator=(const Saver&) = delete;
+
+  /*!
+   * Start saving a snapshot of some tensors.
+   *
+   *  \param[in]  file_path: path to the file
+   *  \param[in]  tensor   : tensors (see Model::GetTensor)
+   *  \param[in]  verbose  : report the save once done?
+   */
+  void Save(const char* file_path, const std::vector<Tensor>& tensor,
+            bool verbose) {
+    Wait();
+
+    // Copy the data (64-byte aligned, as in the file)
+    uint64_t bytes = 0;
+    for (const Tensor& t : tensor) {
+      bytes += (t.bytes + 63) & ~uint64_t(63);
+    }
+    data_.resize(bytes);
+    tensor_ = tensor;
+    bytes   = 0;
+    for (Tensor& t : tensor_) {
+      std::memcpy(data_.data() + bytes, t.data, t.bytes);
+      t.data  = data_.data() + bytes;
+      t.wrap  = nullptr;
+      bytes  += (t.bytes + 63) & ~uint64_t(63);
+    }
+
+    path_    = file_path;
+    verbose_ = verbose;
+    thread_  = std::thread(&Saver::Run, this);
+  }
+
+  /*!
+   * Wait for the current save to be done.
+   */
+  void Wait() {
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_SAVER_H_
@@ -0,0 +1,863 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_SIMD_H_
+#define CORE_SIMD_H_
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#if defined(__AVX2__) || defined(__AVX512F__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+
+namespace jik {
+
+
+/*!
+ *  \struct SimdScalar
+ *  \brief  Scalar operations (same interface as the SIMD vectors)
+ */
+struct SimdScalar {
+  typedef float V;   // Vector
+  typedef bool  M;   // Mask
+
+  static const uint32_t kWidth = 1;   // Number of floats in a vector
+
+  static V    Load(const float* p)       { return *p;                 }
+  static void Store(float* p, V a)       { *p = a;                    }
+  static V    Set(float a)               { return a;                  }
+  static V    Add(V a, V b)              { return a + b;              }
+  static V    Sub(V a, V b)              { return a - b;              }
+  static V    Mul(V a, V b)              { return a * b;              }
+  static V    Div(V a, V b)              { return a / b;              }
+  static V    Max(V a, V b)              { return a > b ? a : b;      }
+  static V    Min(V a, V b)              { return a < b ? a : b;      }
+  static V    MulAdd(V a, V b, V c)      { return a * b + c;          }
+  static V    Sqrt(V a)                  { return std::sqrt(a);       }
+  static V    Round(V a)                 { return std::nearbyint(a);  }
+  static M    Less(V a, V b)             { return a < b;              }
+  static V    Select(M m, V a, V b)      { return m ? a : b;          }
+  static V    Pow2(V n) {
+    int32_t bits = (int32_t(n) + 127) << 23;
+    float   res;
+    std::memcpy(&res, &bits, sizeof(res));
+    return res;
+  }
+};
+
+
+/*!
+ *  \struct SimdVector
+ *  \brief  SIMD operations on float vectors (instruction set selected when
+ *          building, see JIK_SIMD)
+ */
+#if defined(__AVX512F__)
+#define JIK_SIMD "AVX-512"
+struct SimdVector {
+  typedef __m512    V;
+  typedef __mmask16 M;
+
+  static const uint32_t kWidth = 16;
+  static const M        kAll   = 0xFFFF;   // All the lanes
+
+  // (the masked forms of some operations are used with all the lanes set:
+  // the unmasked ones trigger false uninitialized warnings with gcc 12)
+
+  static V    Load(const float* p)       { return _mm512_loadu_ps(p);     }
+  static void Store(float* p, V a)       { _mm512_storeu_ps(p, a);        }
+  static V    Set(float a)               { return _mm512_set1_ps(a);      }
+  static V    Add(V a, V b)              { return _mm512_add_ps(a, b);    }
+  static V    Sub(V a, V b)              { return _mm512_sub_ps(a, b);    }
+  static V    Mul(V a, V b)              { return _mm512_mul_ps(a, b);    }
+  static V    Div(V a, V b)              { return _mm512_div_ps(a, b);    }
+  static V    Max(V a, V b) { return _mm512_mask_max_ps(a, kAll, a, b);    }
+  static V    Min(V a, V b) { return _mm512_mask_min_ps(a, kAll, a, b);    }
+  static V    MulAdd(V a, V b, V c)      { return _mm512_fmadd_ps(a, b, c); }
+  static V    Sqrt(V a)     { return _mm512_mask_sqrt_ps(a, kAll, a);    }
+  static M    Less(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+  static V    Select(M m, V a, V b)   { return _mm512_mask_blend_ps(m, b, a); }
+  static V    Round(V a) {
+    return _mm512_mask_roundscale_ps(a, kAll, a, _MM_FROUND_TO_NEAREST_INT |
+                                                 _MM_FROUND_NO_EXC);
+  }
+  static V    Pow2(V n) {
+    __m512i bias = _mm512_set1_epi32(127);
+    __m512i e    = _mm512_add_epi32(_mm512_mask_cvtps_epi32(bias, kAll, n),
+                                    bias);
+    return _mm512_castsi512_ps(_mm512_mask_slli_epi32(e, kAll, e, 23));
+  }
+};
+#elif defined(__AVX2__) && defined(__FMA__)
+#define JIK_SIMD "AVX2"
+struct SimdVector {
+  typedef __m256 V;
+  typedef __m256 M;
+
+  static const uint32_t kWidth = 8;
+
+  static V    Load(const float* p)       { return _mm256_loadu_ps(p);     }
+  static void Store(float* p, V a)       { _mm256_storeu_ps(p, a);        }
+  static V    Set(float a)               { return _mm256_set1_ps(a);      }
+  static V    Add(V a, V b)              { return _mm256_add_ps(a, b);    }
+  static V    Sub(V a, V b)              { return _mm256_sub_ps(a, b);    }
+  static V    Mul(V a, V b)              { return _mm256_mul_ps(a, b);    }
+  static V    Div(V a, V b)              { return _mm256_div_ps(a, b);    }
+  static V    Max(V a, V b)              { return _mm256_max_ps(a, b);    }
+  static V    Min(V a, V b)              { return _mm256_min_ps(a, b);    }
+  static V    MulAdd(V a, V b, V c)      { return _mm256_fmadd_ps(a, b, c); }
+  static V    Sqrt(V a)                  { return _mm256_sqrt_ps(a);      }
+  static M    Less(V a, V b)     { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+  static V    Select(M m, V a, V b)      { return _mm256_blendv_ps(b, a, m); }
+  static V    Round(V a) {
+    return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  }
+  static V    Pow2(V n) {
+    return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(
+      _mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23));
+  }
+};
+#elif defined(__SSE2__)
+#define JIK_SIMD "SSE2"
+struct SimdVector {
+  typedef __m128 V;
+  typedef __m128 M;
+
+  static const uint32_t kWidth = 4;
+
+  static V    Load(const float* p)       { return _mm_loadu_ps(p);        }
+  static void Store(float* p, V a)       { _mm_storeu_ps(p, a);           }
+  static V    Set(float a)               { return _mm_set1_ps(a);         }
+  static V    Add(V a, V b)              { return _mm_add_ps(a, b);       }
+  static V    Sub(V a, V b)              { return _mm_sub_ps(a, b);       }
+  static V    Mul(V a, V b)              { return _mm_mul_ps(a, b);       }
+  static V    Div(V a, V b)              { return _mm_div_ps(a, b);       }
+  static V    Max(V a, V b)              { return _mm_max_ps(a, b);       }
+  static V    Min(V a, V b)              { return _mm_min_ps(a, b);       }
+  static V    MulAdd(V a, V b, V c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+  static V    Sqrt(V a)                  { return _mm_sqrt_ps(a);         }
+  static M    Less(V a, V b)             { return _mm_cmplt_ps(a, b);     }
+  static V    Select(M m, V a, V b) {
+    return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b));
+  }
+  static V    Round(V a) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(a)); }
+  static V    Pow2(V n) {
+    return _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(
+      _mm_cvtps_epi32(n), _mm_set1_epi32(127)), 23));
+  }
+};
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define JIK_SIMD "NEON"
+struct SimdVector {
+  typedef float32x4_t V;
+  typedef uint32x4_t  M;
+
+  static const uint32_t kWidth = 4;
+
+  static V    Load(const float* p)       { return vld1q_f32(p);           }
+  static void Store(float* p, V a)       { vst1q_f32(p, a);               }
+  static V    Set(float a)               { return vdupq_n_f32(a);         }
+  static V    Add(V a, V b)              { return vaddq_f32(a, b);        }
+  static V    Sub(V a, V b)              { return vsubq_f32(a, b);        }
+  static V    Mul(V a, V b)              { return vmulq_f32(a, b);        }
+  static V    Div(V a, V b)              { return vdivq_f32(a, b);        }
+  static V    Max(V a, V b)              { return vmaxq_f32(a, b);        }
+  static V    Min(V a, V b)              { return vminq_f32(a, b);        }
+  static V    MulAdd(V a, V b, V c)      { return vfmaq_f32(c, a, b);     }
+  static V    Sqrt(V a)                  { return vsqrtq_f32(a);          }
+  static M    Less(V a, V b)             { return vcltq_f32(a, b);        }
+  static V    Select(M m, V a, V b)      { return vbslq_f32(m, a, b);     }
+  static V    Round(V a)                 { return vrndnq_f32(a);          }
+  static V    Pow2(V n) {
+    return vreinterpretq_f32_s32(vshlq_n_s32(vaddq_s32(
+      vcvtnq_s32_f32(n), vdupq_n_s32(127)), 23));
+  }
+};
+#else
+#define JIK_SIMD "none"
+typedef SimdScalar SimdVector;
+#endif
+
+
+/*!
+ *  \struct SimdMath
+ *  \brief  Fast approximations of the transcendental functions
+ *
+ * exp is calculated as 2^n * exp(r), n being the nearest integer of
+ * x / log(2) and exp(r) a polynomial (|r| <= log(2) / 2), the input being
+ * clamped to [-87, 88]. sigmoid derives from exp. tanh is a rational
+ * approximation (no exp, no branch).
+ *
+ * The relative error is below 5e-7 for tanh. With FMA (AVX2, AVX-512, NEON),
+ * it is below 4e-7 for exp and sigmoid too. Without FMA, -ffast-math rounds
+ * the range reduction twice: the relative error of exp and sigmoid goes up to
+ * 5e-6.
+ */
+template <typename T>
+struct SimdMath {
+  typedef typename T::V V;
+
+  /*!
+   * Exponential.
+   *
+   *  \param[in]  x: input
+   *
+   *  \return     exp(x)
+   */
+  static V Exp(V x) {
+    x = T::Min(T::Max(x, T::Set(-87.0f)), T::Set(88.0f));
+
+    // x = n * log(2) + r (log(2) split in 2 constants for more precision)
+    V n = T::Round(T::Mul(x, T::Set(1.44269504089f)));
+    V r = T::Sub(T::Sub(x, T::Mul(n, T::Set(0.693359375f))),
+                 T::Mul(n, T::Set(-2.12194440e-4f)));
+
+    // exp(r) = 1 + r + r^2 * p(r)
+    V p = T::Set(1.9875691500e-4f);
+    p = T::MulAdd(p, r, T::Set(1.3981999507e-3f));
+    p = T::MulAdd(p, r, T::Set(8.3334519073e-3f));
+    p = T::MulAdd(p, r, T::Set(4.1665795894e-2f));
+    p = T::MulAdd(p, r, T::Set(1.6666665459e-1f));
+    p = T::MulAdd(p, r, T::Set(5.0000001201e-1f));
+    p = T::Add(T::MulAdd(p, T::Mul(r, r), r), T::Set(1.0f));
+
+    return T::Mul(p, T::Pow2(n));
+  }
+
+  /*!
+   * Sigmoid.
+   *
+   *  \param[in]  x: input
+   *
+   *  \return     1 / (1 + exp(-x))
+   */
+  static V Sigmoid(V x) {
+    V one = T::Set(1.0f);
+    return T::Div(one, T::Add(one, Exp(T::Sub(T::Set(0.0f), x))));
+  }
+
+  /*!
+   * Hyperbolic tangent.
+   *
+   *  \param[in]  x: input
+   *
+   *  \return     tanh(x)
+   */
+  static V Tanh(V x) {
+    // Rational approximation (odd degree 13 / even degree 6 polynomials),
+    // tanh being rounded to +/-1 beyond the clamping range
+    x   = T::Min(T::Max(x, T::Set(-7.90531110763549805f)),
+                 T::Set(7.90531110763549805f));
+    V z = T::Mul(x, x);
+    V p = T::Set(-2.76076847742355e-16f);
+    p   = T::MulAdd(p, z, T::Set(2.00018790482477e-13f));
+    p   = T::MulAdd(p, z, T::Set(-8.60467152213735e-11f));
+    p   = T::MulAdd(p, z, T::Set(5.12229709037114e-08f));
+    p   = T::MulAdd(p, z, T::Set(1.48572235717979e-05f));
+    p   = T::MulAdd(p, z, T::Set(6.37261928875436e-04f));
+    p   = T::MulAdd(p, z, T::Set(4.89352455891786e-03f));
+    p   = T::Mul(p, x);
+    V q = T::Set(1.19825839466702e-06f);
+    q   = T::MulAdd(q, z, T::Set(1.18534705686654e-04f));
+    q   = T::MulAdd(q, z, T::Set(2.26843463243900e-03f));
+    q   = T::MulAdd(q, z, T::Set(4.89352518554385e-03f));
+    return T::Div(p, q);
+  }
+};
+
+
+/*!
+ *  \struct Simd
+ *  \brief  Elementwise kernels
+ *
+ * The default implementation is a plain loop, using the standard library.
+ *
+ * The float implementation processes the values by vectors (the widest
+ * instruction set the code is built for: AVX-512, AVX2, SSE2 or NEON, see
+ * JIK_SIMD), using fast approximations of exp, sigmoid and tanh (see
+ * SimdMath).
+ */
+template <typename Dtype>
+struct Simd {
+  /*!
+   * out = max(in, 0)
+   *
+   *  \param[in]  n  : number of values
+   *  \param[in]  in : input
+   *  \param[out] out: output
+   */
+  static void Relu(uint32_t n, const Dtype* in, Dtype* out) {
+    for (uint32_t i = 0; i < n; ++i) {
+      out[i] = in[i] > Dtype(0) ? in[i] : Dtype(0);
+    }
+  }
+
+  /*!
+   * in_deriv += out_deriv if out > 0
+   *
+   *  \param[in]  n        : number of values
+   *  \param[in]  out      : output
+   *  \param[in]  out_deriv: output derivative
+   *  \param[out] in_deriv : input derivative
+   */
+  static void ReluDeriv(uint32_t n, const Dtype* out, const Dtype* out_deriv,
+                        Dtype* in_deriv) {
+    for (uint32_t i = 0; i < n; ++i) {
+      if (out[i] > Dtype(0)) {
+        in_deriv[i] += out_deriv[i];
+      }
+    }
+  }
+
+  /*!
+   * out = 1 / (1 + exp(-in))
+   *
+   *  \param[in]  n  : number of values
+   *  \param[in]  in : input
+   *  \param[out] out: output
+   */
+  static void Sigmoid(uint32_t n, const Dtype* in, Dtype* out) {
+    for (uint32_t i = 0; i < n; ++i) {
+      out[i] = Dtype(1) / (Dtype(1) + std::exp(-in[i]));
+    }
+  }
+
+  /*!
+   * in_deriv += out * (1 - out) * out_deriv
+   *
+   *  \param[in]  n        : number of values
+   *  \param[in]  out      : output
+   *  \param[in]  out_deriv: output derivative
+   *  \param[out] in_deriv : input derivative
+   */
+  static void SigmoidDeriv(uint32_t n, const Dtype* out,
+                           const Dtype* out_deriv, Dtype* in_deriv) {
+    for (uint32_t i = 0; i < n; ++i) {
+      in_deriv[i] += out[i] * (Dtype(1) - out[i]) * out_deriv[i];
+    }
+  }
+
+  /*!
+   * out = tanh(in)
+   *
+   *  \param[in]  n  : number of values
+   *  \param[in]  in : input
+   *  \param[out] out: output
+   */
+  static void Tanh(uint32_t n, const Dtype* in, Dtype* out) {
+    for (uint32_t i = 0; i < n; ++i) {
+      out[i] = std::tanh(in[i]);
+    }
+  }
+
+  /*!
+   * in_deriv += (1 - out^2) * out_deriv
+   *
+   *  \param[in]  n        : number of values
+   *  \param[in]  out      : output
+   *  \param[in]  out_deriv: output derivative
+   *  \param[out] in_deriv : input derivative
+   */
+  static void TanhDeriv(uint32_t n, const Dtype* out, const Dtype* out_deriv,
+                        Dtype* in_deriv) {
+    for (uint32_t i = 0; i < n; ++i) {
+      in_deriv[i] += (Dtype(1) - out[i] * out[i]) * out_deriv[i];
+    }
+  }
+
+  /*!
+   * out = a + b
+   *
+   *  \param[in]  n  : number of values
+   *  \param[in]  a  : first input
+   *  \param[in]  b  : second input
+   *  \param[out] out: output
+   */
+  static void Add(uint32_t n, const Dtype* a, const Dtype* b, Dtype* out) {
+    for (uint32_t i = 0; i < n; ++i) {
+      out[i] = a[i] + b[i];
+    }
+  }
+
+  /*!
+   * out = a * b
+   *
+   *  \param[in]  n  : number of values
+   *  \param[in]  a  : first input
+   *  \param[in]  b  : second input
+   *  \param[out] out: output
+   */
+  static void Mult(uint32_t n, const Dtype* a, const Dtype* b, Dtype* out) {
+    for (uint32_t i = 0; i < n; ++i) {
+      out[i] = a[i] * b[i];
+    }
+  }
+
+  /*!
+   * out += a
+   *
+   *  \param[in]  n  : number of values
+   *  \param[in]  a  : input
+   *  \param[out] out: output
+   */
+  static void Accumulate(uint32_t n, const Dtype* a, Dtype* out) {
+    for (uint32_t i = 0; i < n; ++i) {
+      out[i] += a[i];
+    }
+  }
+
+  /*!
+   * out += a * b
+   *
+   *  \param[in]  n  : number of values
+   *  \param[in]  a  : first input
+   *  \param[in]  b  : second input
+   *  \param[out] out: output
+   */
+  static void MultAccumulate(uint32_t n, const Dtype* a, const Dtype* b,
+                             Dtype* out) {
+    for (uint32_t i = 0; i < n; ++i) {
+      out[i] += a[i] * b[i];
+    }
+  }
+
+  /*!
+   * out = a * scale + bias
+   *
+   *  \param[in]  n    : number of values
+   *  \param[in]  a    : input
+   *  \param[in]  scale: scale
+   *  \param[in]  bias : bias
+   *  \param[out] out  : output
+   */
+  static void Scale(uint32_t n, const Dtype* a, Dtype scale, Dtype bias,
+                    Dtype* out) {
+    for (uint32_t i = 0; i < n; ++i) {
+      out[i] = a[i] * scale + bias;
+    }
+  }
+
+  /*!
+   * out = max(a * scale + bias, 0)
+   *
+   *  \param[in]  n    : number of values
+   *  \param[in]  a    : input
+   *  \param[in]  scale: scale
+   *  \param[in]  bias : bias
+   *  \param[out] out  : output
+   */
+  static void ScaleRelu(uint32_t n, const Dtype* a, Dtype scale, Dtype bias,
+                        Dtype* out) {
+    for (uint32_t i = 0; i < n; ++i) {
+      Dtype val = a[i] * scale + bias;
+      out[i] = val > Dtype(0) ? val : Dtype(0);
+    }
+  }
+
+  /*!
+   * out += a * scale
+   *
+   *  \param[in]  n    : number of values
+   *  \param[in]  a    : input
+   *  \param[in]  scale: scale
+   *  \param[out] out  : output
+   */
+  static void ScaleAccumulate(uint32_t n, const Dtype* a, Dtype scale,
+                              Dtype* out) {
+    for (uint32_t i = 0; i < n; ++i) {
+      out[i] += a[i] * scale;
+    }
+  }
+
+  /*!
+   * out = exp(in) / sum(exp(in)), the maximum value being subtracted from the
+   * inputs first (no overflow)
+   *
+   *  \param[in]  n  : number of values (> 0)
+   *  \param[in]  in : input
+   *  \param[out] out: output
+   *
+   *  \return     log(sum(exp(in)))
+   */
+  static Dtype Softmax(uint32_t n, const Dtype* in, Dtype* out) {
+    Dtype val_max = *std::max_element(in, in + n);
+    Dtype sum     = Dtype(0);
+    for (uint32_t i = 0; i < n; ++i) {
+      out[i] = std::exp(in[i] - val_max);
+      sum   += out[i];
+    }
+    Dtype inv_sum = Dtype(1) / sum;
+    for (uint32_t i = 0; i < n; ++i) {
+      out[i] *= inv_sum;
+    }
+    return val_max + std::log(sum);
+  }
+
+  /*!
+   * SGD with momentum update (see SolverSGD):
+   *   prev    = momentum * prev + deriv * scale
+   *   weight -= lr * (clip(prev) + reg * weight)
+   *
+   *  \param[in]  n       : number of values
+   *  \param[in]  deriv   : weight derivative
+   *  \param[in]  scale   : derivative scale (1 / batch size)
+   *  \param[in]  momentum: momentum
+   *  \param[in]  reg     : L2 regularization
+   *  \param[in]  clip    : gradient clipping
+   *  \param[in]  lr      : learning rate
+   *  \param[out] prev    : previous update (updated)
+   *  \param[out] weight  : weight (updated)
+   */
+  static void SGD(uint32_t n, const Dtype* deriv, Dtype scale, Dtype momentum,
+                  Dtype reg, Dtype clip, Dtype lr, Dtype* prev,
+                  Dtype* weight) {
+    for (uint32_t i = 0; i < n; ++i) {
+      Dtype dv  = momentum * prev[i] + deriv[i] * scale;
+      prev[i]   = dv;
+      dv        = std::min(std::max(dv, -clip), clip);
+      weight[i] -= lr * (dv + reg * weight[i]);
+    }
+  }
+
+  /*!
+   * RMSprop update (see SolverRMSprop):
+   *   dv      = deriv * scale
+   *   prev    = decay * prev + (1 - decay) * dv^2
+   *   weight -= lr * (clip(dv) / sqrt(prev + eps) + reg * weight)
+   *
+   *  \param[in]  n     : number of values
+   *  \param[in]  deriv : weight derivative
+   *  \param[in]  scale : derivative scale (1 / batch size)
+   *  \param[in]  decay : decay rate
+   *  \param[in]  reg   : L2 regularization
+   *  \param[in]  clip  : gradient clipping
+   *  \param[in]  lr    : learning rate
+   *  \param[in]  eps   : epsilon (avoids dividing by 0)
+   *  \param[out] prev  : mean of the squared derivatives (updated)
+   *  \param[out] weight: weight (updated)
+   */
+  static void RMSprop(uint32_t n, const Dtype* deriv, Dtype scale,
+                      Dtype decay, Dtype reg, Dtype clip, Dtype lr, Dtype eps,
+                      Dtype* prev, Dtype* weight) {
+    for (uint32_t i = 0; i < n; ++i) {
+      Dtype dv  = deriv[i] * scale;
+      prev[i]   = decay * prev[i] + (Dtype(1) - decay) * dv * dv;
+      dv        = std::min(std::max(dv, -clip), clip);
+      weight[i] -= lr * (dv / std::sqrt(prev[i] + eps) + reg * weight[i]);
+    }
+  }
+
+  /*!
+   * Adam update (see SolverAdam), the bias correction being folded into the
+   * learning rate and epsilon:
+   *   dv      = clip(deriv * scale)
+   *   mean    = beta1 * mean + (1 - beta1) * dv
+   *   var     = beta2 * var  + (1 - beta2) * dv^2
+   *   weight -= lr * mean / (sqrt(var) + eps) + decay * weight
+   *
+   *  \param[in]  n     : number of values
+   *  \param[in]  deriv : weight derivative
+   *  \param[in]  scale : derivative scale (1 / batch size)
+   *  \param[in]  beta1 : decay rate of the mean
+   *  \param[in]  beta2 : decay rate of the variance
+   *  \param[in]  clip  : gradient clipping
+   *  \param[in]  lr    : learning rate (bias corrected)
+   *  \param[in]  eps   : epsilon (bias corrected)
+   *  \param[in]  decay : weight decay (learning rate * L2 regularization)
+   *  \param[out] mean  : mean of the derivatives (updated)
+   *  \param[out] var   : mean of the squared derivatives (updated)
+   *  \param[out] weight: weight (updated)
+   */
+  static void Adam(uint32_t n, const Dtype* deriv, Dtype scale, Dtype beta1,
+                   Dtype beta2, Dtype clip, Dtype lr, Dtype eps, Dtype decay,
+                   Dtype* mean, Dtype* var, Dtype* weight) {
+    for (uint32_t i = 0; i < n; ++i) {
+      Dtype dv  = std::min(std::max(deriv[i] * scale, -clip), clip);
+      mean[i]   = beta1 * mean[i] + (Dtype(1) - beta1) * dv;
+      var[i]    = beta2 * var[i]  + (Dtype(1) - beta2) * dv * dv;
+      weight[i] -= lr * mean[i] / (std::sqrt(var[i]) + eps) +
+                   decay * weight[i];
+    }
+  }
+};
+
+
+/*!
+ * Apply a vector operation to arrays of floats: vectors first, then the
+ * remaining values one by one.
+ *
+ *  \param[in]  n : number of values
+ *  \param[in]  op: operation, called with the operations set (SimdVector or
+ *                  SimdScalar) and the index of the first value
+ */
+template <typename Op>
+inline void SimdFor(uint32_t n, Op op) {
+  uint32_t i = 0;
+  for (; i + SimdVector::kWidth <= n; i += SimdVector::kWidth) {
+    op(SimdVector(), i);
+  }
+  for (; i < n; ++i) {
+    op(SimdScalar(), i);
+  }
+}
+
+
+template <>
+inline void Simd<float>::Relu(uint32_t n, const float* in, float* out) {
+  SimdFor(n, [=](auto t, uint32_t i) {
+    typedef decltype(t) T;
+    T::Store(out + i, T::Max(T::Load(in + i), T::Set(0.f)));
+  });
+}
+
+template <>
+inline void Simd<float>::ReluDeriv(uint32_t n, const float* out,
+                                   const float* out_deriv, float* in_deriv) {
+  SimdFor(n, [=](auto t, uint32_t i) {
+    typedef decltype(t) T;
+    typename T::V dv = T::Select(T::Less(T::Set(0.f), T::Load(out + i)),
+                                 T::Load(out_deriv + i), T::Set(0.f));
+    T::Store(in_deriv + i, T::Add(T::Load(in_deriv + i), dv));
+  });
+}
+
+template <>
+inline void Simd<float>::Sigmoid(uint32_t n, const float* in, float* out) {
+  SimdFor(n, [=](auto t, uint32_t i) {
+    typedef decltype(t) T;
+    T::Store(out + i, SimdMath<T>::Sigmoid(T::Load(in + i)));
+  });
+}
+
+template <>
+inline void Simd<float>::SigmoidDeriv(uint32_t n, const float* out,
+                                      const float* out_deriv,
+                                      float* in_deriv) {
+  SimdFor(n, [=](auto t, uint32_t i) {
+    typedef decltype(t) T;
+    typename T::V val = T::Load(out + i);
+    typename T::V dv  = T::Mul(val, T::Sub(T::Set(1.f), val));
+    T::Store(in_deriv + i, T::MulAdd(dv, T::Load(out_deriv + i),
+                                     T::Load(in_deriv + i)));
+  });
+}
+
+template <>
+inline void Simd<float>::Tanh(uint32_t n, const float* in, float* out) {
+  SimdFor(n, [=](auto t, uint32_t i) {
+    typedef decltype(t) T;
+    T::Store(out + i, SimdMath<T>::Tanh(T::Load(in + i)));
+  });
+}
+
+template <>
+inline void Simd<float>::TanhDeriv(uint32_t n, const float* out,
+                                   const float* out_deriv, float* in_deriv) {
+  SimdFor(n, [=](auto t, uint32_t i) {
+    typedef decltype(t) T;
+    typename T::V val = T::Load(out + i);
+    typename T::V dv  = T::Sub(T::Set(1.f), T::Mul(val, val));
+    T::Store(in_deriv + i, T::MulAdd(dv, T::Load(out_deriv + i),
+                                     T::Load(in_deriv + i)));
+  });
+}
+
+template <>
+inline void Simd<float>::Add(uint32_t n, const float* a, const float* b,
+                             float* out) {
+  SimdFor(n, [=](auto t, uint32_t i) {
+    typedef decltype(t) T;
+    T::Store(out + i, T::Add(T::Load(a + i), T::Load(b + i)));
+  });
+}
+
+template <>
+inline void Simd<float>::Mult(uint32_t n, const float* a, const float* b,
+                              float* out) {
+  SimdFor(n, [=](auto t, uint32_t i) {
+    typedef decltype(t) T;
+    T::Store(out + i, T::Mul(T::Load(a + i), T::Load(b + i)));
+  });
+}
+
+template <>
+inline void Simd<float>::Accumulate(uint32_t n, const float* a, float* out) {
+  SimdFor(n, [=](auto t, uint32_t i) {
+    typedef decltype(t) T;
+    T::Store(out + i, T::Add(T::Load(out + i), T::Load(a + i)));
+  });
+}
+
+template <>
+inline void Simd<float>::MultAccumulate(uint32_t n, const float* a,
+                                        const float* b, float* out) {
+  SimdFor(n, [=](auto t, uint32_t i) {
+    typedef decltype(t) T;
+    T::Store(out + i, T::MulAdd(T::Load(a + i), T::Load(b + i),
+                                T::Load(out + i)));
+  });
+}
+
+template <>
+inline void Simd<float>::Scale(uint32_t n, const float* a, float scale,
+                               float bias, float* out) {
+  SimdFor(n, [=](auto t, uint32_t i) {
+    typedef decltype(t) T;
+    T::Store(out + i, T::MulAdd(T::Load(a + i), T::Set(scale),
+                                T::Set(bias)));
+  });
+}
+
+template <>
+inline void Simd<float>::ScaleRelu(uint32_t n, const float* a, float scale,
+                                   float bias, float* out) {
+  SimdFor(n, [=](auto t, uint32_t i) {
+    typedef decltype(t) T;
+    T::Store(out + i, T::Max(T::MulAdd(T::Load(a + i), T::Set(scale),
+                                       T::Set(bias)), T::Set(0.f)));
+  });
+}
+
+template <>
+inline void Simd<float>::ScaleAccumulate(uint32_t n, const float* a,
+                                         float scale, float* out) {
+  SimdFor(n, [=](auto t, uint32_t i) {
+    typedef decltype(t) T;
+    T::Store(out + i, T::MulAdd(T::Load(a + i), T::Set(scale),
+                                T::Load(out + i)));
+  });
+}
+
+
+template <>
+inline float Simd<float>::Softmax(uint32_t n, const float* in, float* out) {
+  typedef SimdVector T;
+  float lane[T::kWidth];
+
+  // Maximum value (one vector of maxima, then the lanes and the remaining
+  // values)
+  float    val_max = in[0];
+  uint32_t i       = 0;
+  if (n >= T::kWidth) {
+    T::V vec_max = T::Load(in);
+    for (i = T::kWidth; i + T::kWidth <= n; i += T::kWidth) {
+      vec_max = T::Max(vec_max, T::Load(in + i));
+    }
+    T::Store(lane, vec_max);
+    val_max = *std::max_element(lane, lane + T::kWidth);
+  }
+  for (; i < n; ++i) {
+    val_max = std::max(val_max, in[i]);
+  }
+
+  // out = exp(in - max), summed in the same pass
+  T::V  vec_sum = T::Set(0.f);
+  float sum     = 0.f;
+  for (i = 0; i + T::kWidth <= n; i += T::kWidth) {
+    T::V val = SimdMath<T>::Exp(T::Sub(T::Load(in + i), T::Set(val_max)));
+    T::Store(out + i, val);
+    vec_sum  = T::Add(vec_sum, val);
+  }
+  T::Store(lane, vec_sum);
+  for (uint32_t j = 0; j < T::kWidth; ++j) {
+    sum += lane[j];
+  }
+  for (; i < n; ++i) {
+    out[i] = SimdMath<SimdScalar>::Exp(in[i] - val_max);
+    sum   += out[i];
+  }
+
+  Scale(n, out, 1.f / sum, 0.f, out);
+  return val_max + std::log(sum);
+}
+
+template <>
+inline void Simd<float>::SGD(uint32_t n, const float* deriv, float scale,
+                             float momentum, float reg, float clip, float lr,
+                             float* prev, float* weight) {
+  SimdFor(n, [=](auto t, uint32_t i) {
+    typedef decltype(t) T;
+    typename T::V dv = T::MulAdd(T::Load(prev + i), T::Set(momentum),
+                                 T::Mul(T::Load(deriv + i), T::Set(scale)));
+    T::Store(prev + i, dv);
+    dv = T::Min(T::Max(dv, T::Set(-clip)), T::Set(clip));
+    typename T::V w = T::Load(weight + i);
+    T::Store(weight + i, T::Sub(w, T::Mul(T::Set(lr),
+                                          T::MulAdd(w, T::Set(reg), dv))));
+  });
+}
+
+template <>
+inline void Simd<float>::RMSprop(uint32_t n, const float* deriv, float scale,
+                                 float decay, float reg, float clip, float lr,
+                                 float eps, float* prev, float* weight) {
+  SimdFor(n, [=](auto t, uint32_t i) {
+    typedef decltype(t) T;
+    typename T::V dv = T::Mul(T::Load(deriv + i), T::Set(scale));
+    typename T::V ms = T::MulAdd(T::Load(prev + i), T::Set(decay),
+                                 T::Mul(T::Mul(dv, dv), T::Set(1.f - decay)));
+    T::Store(prev + i, ms);
+    dv = T::Min(T::Max(dv, T::Set(-clip)), T::Set(clip));
+    typename T::V w = T::Load(weight + i);
+    typename T::V up = T::MulAdd(w, T::Set(reg),
+                                 T::Div(dv, T::Sqrt(T::Add(ms, T::Set(eps)))));
+    T::Store(weight + i, T::Sub(w, T::Mul(T::Set(lr), up)));
+  });
+}
+
+template <>
+inline void Simd<float>::Adam(uint32_t n, const float* deriv, float scale,
+                              float beta1, float beta2, float clip, float lr,
+                              float eps, float decay, float* mean, float* var,
+                              float* weight) {
+  SimdFor(n, [=](auto t, uint32_t i) {
+    typedef decltype(t) T;
+    typename T::V dv = T::Min(T::Max(T::Mul(T::Load(deriv + i),
+                                            T::Set(scale)), T::Set(-clip)),
+                              T::Set(clip));
+    typename T::V m  = T::MulAdd(T::Load(mean + i), T::Set(beta1),
+                                 T::Mul(dv, T::Set(1.f - beta1)));
+    typename T::V v  = T::MulAdd(T::Load(var + i), T::Set(beta2),
+                                 T::Mul(T::Mul(dv, dv), T::Set(1.f - beta2)));
+    T::Store(mean + i, m);
+    T::Store(var  + i, v);
+    typename T::V w  = T::Load(weight + i);
+    typename T::V up = T::Div(T::Mul(m, T::Set(lr)),
+                              T::Add(T::Sqrt(v), T::Set(eps)));
+    T::Store(weight + i, T::Sub(w, T::MulAdd(w, T::Set(decay), up)));
+  });
+}
+
+
+}  // namespace jik
+
+
+#endif  // CORE_SIMD_H_
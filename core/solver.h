@@ -27,11 +27,18 @@
 #define CORE_SOLVER_H_
 
 
+#include <core/data_parallel.h>
+#include <core/evaluator.h>
+#include <core/memory_stats.h>
 #include <core/model.h>
+#include <core/saver.h>
+#include <core/thread_pool.h>
+#include <algorithm>
 #include <memory>
 #include <cmath>
 #include <limits>
-#include <ctime>
+#include <chrono>
+#include <map>
 #include <vector>
 #include <string>
 
@@ -61,6 +68,87 @@ class Solver {
   uint32_t save_each_;      // Save the model every n steps
   uint32_t lr_scale_each_;  // Scale the learning rate every n steps
   Dtype    lr_scale_;       // Learning rate scale
+  DataParallel<Dtype>*
+           parallel_;       // Data-parallel training (nullptr if none)
+  Evaluator<Dtype>*
+           evaluator_;      // Background evaluation (nullptr if none)
+  Saver<Dtype>
+           saver_;          // Background saving
+  bool     save_state_;     // Save the solver state with the model?
+  bool     forbid_alloc_;   // Forbid the allocations in the steady state?
+  Dtype    prune_;          // Final sparsity of the pruned layers
+  std::string
+           resume_path_;    // Model file to resume the training from
+  std::vector<uint32_t>
+           range_weight_;   // Weight of each range of values to update
+  std::vector<uint32_t>
+           range_begin_;    // First value of each range
+  std::vector<uint32_t>
+           range_offset_;   // Offset of each range in the flattened values
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Apply an update kernel to the weights having a derivative.
+   *
+   * The values to update (the whole dense weights, the rows having a
+   * derivative for the sparse ones) are seen as one flattened range, split
+   * in fixed-size blocks across the threads: several small weights (e.g.
+   * biases) are updated by the same thread, and big ones are shared.
+   *
+   *  \param[in]  op: kernel, called with (weight index, first value, last
+   *                  value excluded) on contiguous values of a weight
+   */
+  template <typename Op>
+  void Update(const Op& op) {
+    // Block of values updated at once by a thread
+    const uint32_t kBlock = 16384;
+
+    range_weight_.clear();
+    range_begin_.clear();
+    range_offset_.clear();
+    uint32_t num_value = 0;
+    for (size_t i = 0; i < weight_.size(); ++i) {
+      const std::shared_ptr<Mat<Dtype>>& weight = weight_[i];
+      if (!weight->deriv) {
+        continue;
+      }
+      if (!weight->sparse) {
+        range_weight_.push_back(uint32_t(i));
+        range_begin_.push_back(0);
+        range_offset_.push_back(num_value);
+        num_value += weight->Size();
+        continue;
+      }
+      uint32_t row_size = weight->size[0];
+      for (uint32_t row : weight->DerivRow()) {
+        range_weight_.push_back(uint32_t(i));
+        range_begin_.push_back(row * row_size);
+        range_offset_.push_back(num_value);
+        num_value += row_size;
+      }
+    }
+    range_offset_.push_back(num_value);
+
+    ParallelFor(0, (num_value + kBlock - 1) / kBlock,
+                [&](uint32_t block_start, uint32_t block_end, uint32_t) {
+      uint32_t start = block_start * kBlock;
+      uint32_t end   = std::min(block_end * kBlock, num_value);
+
+      // Ranges overlapping [start, end)
+      size_t range = std::upper_bound(range_offset_.begin(),
+                                      range_offset_.end(), start) -
+                     range_offset_.begin() - 1;
+      for (; start < end; ++range) {
+        uint32_t range_end = std::min(range_offset_[range + 1], end);
+        uint32_t begin     = range_begin_[range] +
+                             (start - range_offset_[range]);
+        op(range_weight_[range], begin, begin + (range_end - start));
+        start = range_end;
+      }
+    });
+  }
 
 
   // Public methods
@@ -82,6 +170,11 @@ class Solver {
     save_each_     = save_each;
     lr_scale_each_ = lr_scale_each;
     lr_scale_      = lr_scale;
+    parallel_      = nullptr;
+    evaluator_     = nullptr;
+    save_state_    = false;
+    forbid_alloc_  = false;
+    prune_         = Dtype(0);
   }
 
   /*!
@@ -95,7 +188,126 @@ class Solver {
    *  \param[in]  batch_size   : batch size
    *  \param[in]  learning_rate: learning rate
    */
-  virtual void Learn(uint32_t batch_size, Dtype learning_rate) const = 0;
+  virtual void Learn(uint32_t batch_size, Dtype learning_rate) = 0;
+
+  /*!
+   * Reset the solver state (before training): the previous weight values are
+   * allocated for the weights of the model, and set to 0.
+   */
+  virtual void Reset() {
+    weight_prev_.resize(weight_.size());
+    for (size_t i = 0; i < weight_.size(); ++i) {
+      weight_prev_[i] = std::make_shared<Mat<Dtype>>(weight_[i]->size, false);
+    }
+  }
+
+  /*!
+   * Get the solver state as tensors (see ModelFile): the previous weight
+   * values ("solver.prev.<index>", in the order of the model weights).
+   *
+   *  \param[out] tensor: list of tensors (added)
+   */
+  virtual void GetState(
+    std::vector<typename ModelFile<Dtype>::Tensor>* tensor) {
+    for (size_t i = 0; i < weight_prev_.size(); ++i) {
+      tensor->push_back(ModelFile<Dtype>::Describe(
+        "solver.prev." + std::to_string(i), weight_prev_[i]));
+    }
+  }
+
+  /*!
+   * The solver state was read from a file (see GetState).
+   */
+  virtual void StateChanged() {}
+
+  /*!
+   * Get the memory of the solver state of a weight: its previous values.
+   *
+   *  \param[in]  i: weight index
+   *
+   *  \return     Memory (bytes)
+   */
+  virtual size_t WeightStateMemory(size_t i) const {
+    return size_t(weight_prev_[i]->Capacity()) * sizeof(Dtype);
+  }
+
+  /*!
+   * Get the memory of the solver state of each weight (see
+   * Model::PrintMemory).
+   *
+   *  \return Memory (bytes), indexed by the weight data
+   */
+  std::map<const Dtype*, size_t> StateMemory() const {
+    std::map<const Dtype*, size_t> state;
+    for (size_t i = 0; i < weight_.size() && i < weight_prev_.size(); ++i) {
+      state[weight_[i]->Data()] += WeightStateMemory(i);
+    }
+    return state;
+  }
+
+  /*!
+   * Save the solver state next to the weights in the model files, for the
+   * training to be resumed exactly (see SetResume).
+   *
+   *  \param[in]  save_state: save the solver state?
+   */
+  void SetSaveState(bool save_state) {
+    save_state_ = save_state;
+  }
+
+  /*!
+   * Resume the training from a model file saved with the solver state (the
+   * weights are loaded with the model, see Model::Load).
+   *
+   *  \param[in]  file_path: path to the file (nullptr: start from scratch)
+   */
+  void SetResume(const char* file_path) {
+    resume_path_ = file_path ? file_path : "";
+  }
+
+  /*!
+   * Check that the training steps don't allocate any matrix once the first
+   * one has run (see MemoryStats::Forbid): an allocation is then an error.
+   *
+   *  \param[in]  forbid_alloc: forbid the allocations in the steady state?
+   */
+  void SetForbidAlloc(bool forbid_alloc) {
+    forbid_alloc_ = forbid_alloc;
+  }
+
+  /*!
+   * Prune the model gradually while training (see Model::Prune): the
+   * sparsity goes up to its final value over the first half of the training,
+   * in 10 steps (s * (1 - (1 - t)^3), t going from 0.1 to 1), the second
+   * half fine-tuning the blocks left.
+   *
+   *  \param[in]  sparsity: final sparsity (0: no pruning)
+   */
+  void SetPrune(Dtype sparsity) {
+    prune_ = sparsity;
+  }
+
+  /*!
+   * Train the model in data-parallel mode: the weight derivatives are
+   * averaged over all the ranks before each update. Only rank 0 prints,
+   * tests and saves the model.
+   *
+   *  \param[in]  parallel: data-parallel training (nullptr: none)
+   */
+  void SetParallel(DataParallel<Dtype>* parallel) {
+    parallel_ = parallel;
+  }
+
+  /*!
+   * Test the model in the background (see Evaluator): the training goes on
+   * while a snapshot of the weights is tested.
+   *
+   *  \param[in]  evaluator: evaluator, started (nullptr: test on the training
+   *                         thread)
+   */
+  void SetEvaluator(Evaluator<Dtype>* evaluator) {
+    evaluator_ = evaluator;
+  }
 
   /*!
    * Train a model.
@@ -115,55 +327,136 @@ class Solver {
     // Get the model weights and keep track of the previous weights values
     weight_.clear();
     model->GetWeight(&weight_);
-    weight_prev_.resize(weight_.size());
-    for (size_t i = 0; i < weight_.size(); ++i) {
-      weight_prev_[i] = std::make_shared<Mat<Dtype>>(weight_[i]->size, false);
+    Reset();
+
+    // Previous solver state
+    if (!resume_path_.empty()) {
+      std::FILE* fp = std::fopen(resume_path_.c_str(), "rb");
+      if (!fp) {
+        Report(kError, "Can't open file '%s' for read", resume_path_.c_str());
+        return false;
+      }
+      std::vector<typename ModelFile<Dtype>::Tensor> state;
+      GetState(&state);
+      size_t size = ModelFile<Dtype>::Detect(fp) ?
+                    ModelFile<Dtype>::Read(fp, state) : 0;
+      std::fclose(fp);
+      if (!size) {
+        Report(kError, "No solver state in '%s'", resume_path_.c_str());
+        return false;
+      }
+      StateChanged();
+      Report(kInfo, "Resuming from '%s'", resume_path_.c_str());
     }
 
-    std::clock_t start = std::clock();
+    // Same initial weights on all the ranks
+    if (parallel_ && !parallel_->Attach(model)) {
+      return false;
+    }
+    bool master = !parallel_ || !parallel_->Rank();
+
+    MemoryStats& memory = MemoryStats::Get();
+    uint64_t num_alloc = memory.NumAlloc();
+
+    // Wall-clock time (the CPU time would add up all the threads)
+    std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+    // Pruning schedule
+    const uint32_t kNumPrune = 10;
+    uint32_t       num_prune = 0;
 
     uint32_t print = 0;
     uint32_t test  = 0;
     uint32_t save  = 0;
     uint32_t lr    = 0;
     for (uint32_t step = 0; step < num_step; ++step) {
-      // Train (calculate output values and input/weight derivatives)
-      Dtype loss = model->Train();
+      Dtype loss;
+      {
+        // The first step allocates what the following ones reuse
+        MemoryStats::Forbid forbid(forbid_alloc_ && step);
 
-      // Learn (update the weights)
-      Learn(model->BatchSize(), learning_rate);
+        // Train (calculate output values and input/weight derivatives)
+        loss = model->Train();
 
-      // Clean
-      model->ClearDeriv();
+        // Average the derivatives over the ranks
+        if (parallel_) {
+          parallel_->Wait();
+        }
 
-      if (print_each_ && !step) {
+        // Learn (update the weights)
+        Learn(model->BatchSize(), learning_rate);
+
+        // Prune some more, or keep the pruned weights at 0 (e.g. of a pruned
+        // model being fine-tuned)
+        if (prune_ > Dtype(0) && num_prune < kNumPrune &&
+            step + 1 >= uint64_t(num_prune + 1) * num_step / (2 * kNumPrune)) {
+          Dtype    left      = Dtype(1) - Dtype(++num_prune) / kNumPrune;
+          Dtype    sparsity  = prune_ * (Dtype(1) - left * left * left);
+          uint32_t num_layer = model->Prune(sparsity);
+          if (master && print_each_) {
+            Report(kInfo, "Step #%d Pruning %d layer(s) to %.1f%% sparsity",
+                   step + 1, num_layer, 100 * sparsity);
+          }
+        } else {
+          model->ApplyMask();
+        }
+
+        // Clean
+        model->ClearDeriv();
+      }
+
+      // Memory of the model and of the solver state, once the first step
+      // measured the peak memory of the layers
+      if (master && !step && memory.Enabled()) {
+        model->PrintMemory(StateMemory());
+      }
+
+      if (master && print_each_ && !step) {
         Report(kInfo, "Step #%ld LR: %f, Initial loss: %f",
                step + 1, learning_rate, loss);
       }
 
-      if (print_each_ && ((++print >= print_each_) ||
+      if (master && print_each_ && ((++print >= print_each_) ||
                           (step == num_step - 1))) {
+        std::chrono::steady_clock::time_point now =
+          std::chrono::steady_clock::now();
         Report(kInfo, "Step #%ld LR: %f, Loss: %f, Speed: %f steps/sec",
                step + 1, learning_rate, loss, print_each_ /
-               (static_cast<double>(std::clock() - start) / CLOCKS_PER_SEC));
+               std::chrono::duration<double>(now - start).count());
+        if (memory.Enabled()) {
+          Report(kInfo, "Step #%ld Memory: %.3f MB live, %.3f MB peak, "
+                 "%.1f allocation(s)/step", step + 1, memory.Live() * 1e-6,
+                 memory.Peak() * 1e-6,
+                 double(memory.NumAlloc() - num_alloc) / print);
+          num_alloc = memory.NumAlloc();
+        }
         print = 0;
-        start = std::clock();
+        start = now;
       }
 
-      if (test_each_ && ((++test >= test_each_) || (step == num_step - 1))) {
-        Report(kInfo, "Step #%d Accuracy: %f",
-               step + 1, model->Test());
+      if (master && test_each_ &&
+          ((++test >= test_each_) || (step == num_step - 1))) {
+        if (evaluator_) {
+          evaluator_->Test(model, step + 1);
+        } else {
+          Report(kInfo, "Step #%d Accuracy: %f",
+                 step + 1, model->Test());
+        }
         test = 0;
       }
 
-      if (save_each_ && ((++save >= save_each_) || (step == num_step - 1))) {
+      if (master && save_each_ &&
+          ((++save >= save_each_) || (step == num_step - 1))) {
+        // Snapshot of the weights, written in the background
         std::string file_name = model->Name() + std::string("_") +
                                 std::to_string(step + 1) + ".model";
-        size_t size = model->Save(file_name.c_str());
-        if (print_each_ && size) {
-          Report(kInfo, "Saving model '%s' (%ld byte(s))",
-                 file_name.c_str(), size);
+        std::vector<typename ModelFile<Dtype>::Tensor> tensor;
+        model->GetTensor(&tensor);
+        if (save_state_) {
+          GetState(&tensor);
         }
+        saver_.Save(file_name.c_str(), tensor, print_each_ != 0);
         save = 0;
       }
 
@@ -178,7 +471,16 @@ class Solver {
       }
     }
 
+    // Last evaluation and save
+    if (evaluator_) {
+      evaluator_->Wait();
+    }
+    saver_.Wait();
+
     // Clear the weights
+    if (parallel_) {
+      parallel_->Detach();
+    }
     weight_.clear();
     weight_prev_.clear();
 
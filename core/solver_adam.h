@@ -0,0 +1,188 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#ifndef CORE_SOLVER_ADAM_H_
+#define CORE_SOLVER_ADAM_H_
+
+
+#include <core/simd.h>
+#include <core/solver.h>
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  SolverAdam
+ *  \brief  Adam solver
+ *
+ * The mean of the derivatives is kept in the previous weights, the mean of
+ * the squared derivatives in weight_var_. Both are bias corrected using the
+ * number of steps since the training started.
+ */
+template <typename Dtype>
+class SolverAdam: public Solver<Dtype> {
+  // Public types
+ public:
+  typedef Dtype         Type;
+  typedef Solver<Dtype> Parent;
+
+
+  // Protected attributes
+ protected:
+  Dtype    beta1_;        // Decay rate of the mean
+  Dtype    beta2_;        // Decay rate of the variance
+  Dtype    eps_;          // Epsilon (avoids dividing by 0)
+  Dtype    reg_;          // L2 regularization
+  Dtype    clip_;         // Gradient clipping value
+  uint32_t step_;         // Number of steps
+  std::vector<std::shared_ptr<Mat<Dtype>>>
+           weight_var_;   // Mean of the squared derivatives of the weights
+  std::shared_ptr<Mat<Dtype>>
+           step_state_;   // Number of steps, as a tensor (see GetState)
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  print_each   : print the model stats every n steps
+   *  \param[in]  test_each    : test the model every n steps
+   *  \param[in]  save_each    : save the model every n steps
+   *  \param[in]  lr_scale_each: save the model every n steps
+   *  \param[in]  lr_scale     : learning rate scale
+   *  \param[in]  beta1        : decay rate of the mean
+   *  \param[in]  beta2        : decay rate of the variance
+   *  \param[in]  reg          : L2 regularization
+   *  \param[in]  clip         : gradient clipping
+   */
+  SolverAdam(uint32_t print_each, uint32_t test_each, uint32_t save_each,
+             uint32_t lr_scale_each, Dtype lr_scale,
+             Dtype beta1, Dtype beta2, Dtype reg, Dtype clip):
+    Parent(print_each, test_each, save_each, lr_scale_each, lr_scale) {
+    beta1_ = beta1;
+    beta2_ = beta2;
+    eps_   = Dtype(1e-8);
+    reg_   = reg;
+    clip_  = clip;
+    step_  = 0;
+    step_state_ = std::make_shared<Mat<Dtype>>(1, 1, 1, 1, false);
+  }
+
+  /*!
+   * Destructor.
+   */
+  virtual ~SolverAdam() {}
+
+  /*!
+   * Reset the solver state (before training).
+   */
+  virtual void Reset() {
+    Parent::Reset();
+    weight_var_.resize(Parent::weight_.size());
+    for (size_t i = 0; i < Parent::weight_.size(); ++i) {
+      weight_var_[i] = std::make_shared<Mat<Dtype>>(Parent::weight_[i]->size,
+                                                    false);
+    }
+    step_ = 0;
+  }
+
+  /*!
+   * Get the memory of the solver state of a weight: the mean and the mean of
+   * the squares of its derivatives.
+   *
+   *  \param[in]  i: weight index
+   *
+   *  \return     Memory (bytes)
+   */
+  virtual size_t WeightStateMemory(size_t i) const {
+    return Parent::WeightStateMemory(i) +
+           size_t(weight_var_[i]->Capacity()) * sizeof(Dtype);
+  }
+
+  /*!
+   * Get the solver state as tensors: the mean ("solver.prev.<index>") and
+   * the mean of the squares ("solver.var.<index>") of the derivatives, and
+   * the number of steps ("solver.step").
+   *
+   *  \param[out] tensor: list of tensors (added)
+   */
+  virtual void GetState(
+    std::vector<typename ModelFile<Dtype>::Tensor>* tensor) {
+    Parent::GetState(tensor);
+    for (size_t i = 0; i < weight_var_.size(); ++i) {
+      tensor->push_back(ModelFile<Dtype>::Describe(
+        "solver.var." + std::to_string(i), weight_var_[i]));
+    }
+    step_state_->Data()[0] = Dtype(step_);
+    tensor->push_back(ModelFile<Dtype>::Describe("solver.step", step_state_));
+  }
+
+  /*!
+   * The solver state was read from a file.
+   */
+  virtual void StateChanged() {
+    step_ = uint32_t(step_state_->Data()[0]);
+  }
+
+  /*!
+   * Learning function.
+   * With a sparse derivative, only the rows having a derivative are updated
+   * (the decay of the moments and the regularization of the other rows are
+   * skipped).
+   *
+   *  \param[in]  batch_size   : batch size
+   *  \param[in]  learning_rate: learning rate
+   */
+  virtual void Learn(uint32_t batch_size, Dtype learning_rate) {
+    // Bias correction, folded into the learning rate and epsilon
+    ++step_;
+    Dtype mean_corr = Dtype(1) - std::pow(beta1_, Dtype(step_));
+    Dtype var_corr  = std::sqrt(Dtype(1) - std::pow(beta2_, Dtype(step_)));
+    Dtype lr        = learning_rate * var_corr / mean_corr;
+    Dtype eps       = eps_ * var_corr;
+    Dtype decay     = learning_rate * reg_;
+
+    Parent::Update([&](uint32_t i, uint32_t begin, uint32_t end) {
+      const std::shared_ptr<Mat<Dtype>>& weight = Parent::weight_[i];
+      Simd<Dtype>::Adam(end - begin, weight->DerivData() + begin,
+                        Dtype(1) / batch_size, beta1_, beta2_, clip_, lr, eps,
+                        decay, Parent::weight_prev_[i]->Data() + begin,
+                        weight_var_[i]->Data() + begin,
+                        weight->Data() + begin);
+    });
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_SOLVER_ADAM_H_
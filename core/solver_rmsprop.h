@@ -27,6 +27,7 @@
 #define CORE_SOLVER_RMSPROP_H_
 
 
+#include <core/simd.h>
 #include <core/solver.h>
 #include <memory>
 #include <limits>
@@ -83,10 +84,12 @@ class SolverRMSprop: public Solver<Dtype> {
   virtual ~SolverRMSprop() {}
 
   /*!
-   * Stochastic gradient descent.
+   * RMSprop (range of values).
    *
    *  \param[in]  weight       : weights
    *  \param[in]  weight_prev  : previous weights
+   *  \param[in]  begin        : first value
+   *  \param[in]  end          : last value (excluded)
    *  \param[in]  batch_size   : batch size
    *  \param[in]  learning_rate: learning rate
    *  \param[in]  decay_rate   : decay rate
@@ -95,46 +98,28 @@ class SolverRMSprop: public Solver<Dtype> {
    */
   static void RMSprop(const std::shared_ptr<Mat<Dtype>>& weight,
                       const std::shared_ptr<Mat<Dtype>>& weight_prev,
+                      uint32_t begin, uint32_t end,
                       uint32_t batch_size, Dtype learning_rate,
                       Dtype decay_rate, Dtype reg, Dtype clip) {
-  Dtype* weight_data             = weight->Data();
-  const Dtype* weight_deriv_data = weight->DerivData();
-  Dtype* weight_prev_data        = weight_prev->Data();
-
-  for (uint32_t i = 0; i < weight->Size(); ++i) {
-      // RMSprop adaptive learning rate
-      Dtype dv  = weight_deriv_data[i] / batch_size;
-      Dtype ddv = decay_rate * weight_prev_data[i] +
-                  (Dtype(1) - decay_rate) * dv * dv;
-
-      // Save previous value for next iteration
-      weight_prev_data[i] = ddv;
-
-      // Gradient clip
-      if (dv > clip) {
-        dv = clip;
-      } else if (dv < -clip) {
-        dv = -clip;
-      }
-
-      // Update and regularize
-      weight_data[i] -= learning_rate * (dv / std::sqrt(weight_prev_data[i] +
-        std::numeric_limits<Dtype>::epsilon()) +
-        reg * weight_data[i]);
-    }
+    Simd<Dtype>::RMSprop(end - begin, weight->DerivData() + begin,
+                         Dtype(1) / batch_size, decay_rate, reg, clip,
+                         learning_rate, std::numeric_limits<Dtype>::epsilon(),
+                         weight_prev->Data() + begin, weight->Data() + begin);
   }
 
   /*!
    * Learning function.
+   * With a sparse derivative, only the rows having a derivative are updated
+   * (the decay and regularization of the other rows are skipped).
    *
    *  \param[in]  batch_size   : batch size
    *  \param[in]  learning_rate: learning rate
    */
-  virtual void Learn(uint32_t batch_size, Dtype learning_rate) const {
-    for (size_t i = 0; i < Parent::weight_.size(); ++i) {
-      RMSprop(Parent::weight_[i], Parent::weight_prev_[i],
+  virtual void Learn(uint32_t batch_size, Dtype learning_rate) {
+    Parent::Update([&](uint32_t i, uint32_t begin, uint32_t end) {
+      RMSprop(Parent::weight_[i], Parent::weight_prev_[i], begin, end,
               batch_size, learning_rate, decay_rate_, reg_, clip_);
-    }
+    });
   }
 };
 
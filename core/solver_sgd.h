@@ -27,6 +27,7 @@
 #define CORE_SOLVER_SGD_H_
 
 
+#include <core/simd.h>
 #include <core/solver.h>
 #include <memory>
 
@@ -82,10 +83,12 @@ class SolverSGD: public Solver<Dtype> {
   virtual ~SolverSGD() {}
 
   /*!
-   * Stochastic gradient descent.
+   * Stochastic gradient descent (range of values).
    *
    *  \param[in]  weight       : weights
    *  \param[in]  weight_prev  : previous weights
+   *  \param[in]  begin        : first value
+   *  \param[in]  end          : last value (excluded)
    *  \param[in]  batch_size   : batch size
    *  \param[in]  learning_rate: learning rate
    *  \param[in]  momentum     : momentum
@@ -94,43 +97,28 @@ class SolverSGD: public Solver<Dtype> {
    */
   static void SGD(const std::shared_ptr<Mat<Dtype>>& weight,
                   const std::shared_ptr<Mat<Dtype>>& weight_prev,
+                  uint32_t begin, uint32_t end,
                   uint32_t batch_size, Dtype learning_rate,
                   Dtype momentum, Dtype reg, Dtype clip) {
-    Dtype*       weight_data       = weight->Data();
-    const Dtype* weight_deriv_data = weight->DerivData();
-    Dtype*       weight_prev_data  = weight_prev->Data();
-
-    for (uint32_t i = 0; i < weight->Size(); ++i) {
-      // SGD with momentum
-      Dtype dv = weight_deriv_data[i] / batch_size;
-      dv       = momentum * weight_prev_data[i] + dv;
-
-      // Save previous value for next iteration
-      weight_prev_data[i] = dv;
-
-      // Gradient clip
-      if (dv > clip) {
-        dv = clip;
-      } else if (dv < -clip) {
-        dv = -clip;
-      }
-
-      // Update and regularize
-      weight_data[i] -= learning_rate * (dv + reg * weight_data[i]);
-    }
+    Simd<Dtype>::SGD(end - begin, weight->DerivData() + begin,
+                     Dtype(1) / batch_size, momentum, reg, clip,
+                     learning_rate, weight_prev->Data() + begin,
+                     weight->Data() + begin);
   }
 
   /*!
    * Learning function.
+   * With a sparse derivative, only the rows having a derivative are updated
+   * (the momentum and regularization of the other rows are skipped).
    *
    *  \param[in]  batch_size   : batch size
    *  \param[in]  learning_rate: learning rate
    */
-  virtual void Learn(uint32_t batch_size, Dtype learning_rate) const {
-    for (size_t i = 0; i < Parent::weight_.size(); ++i) {
-      SGD(Parent::weight_[i], Parent::weight_prev_[i],
+  virtual void Learn(uint32_t batch_size, Dtype learning_rate) {
+    Parent::Update([&](uint32_t i, uint32_t begin, uint32_t end) {
+      SGD(Parent::weight_[i], Parent::weight_prev_[i], begin, end,
           batch_size, learning_rate, momentum_, reg_, clip_);
-    }
+    });
   }
 };
 
@@ -0,0 +1,409 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#ifndef CORE_SPARSE_H_
+#define CORE_SPARSE_H_
+
+
+#include <core/log.h>
+#include <core/mat.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  SparseFilter
+ *  \brief  Pruned (block-sparse) filter of a layer
+ *
+ * Magnitude pruning of the filter of a layer computing, for each output, a
+ * dot product of its filter row with the inputs (e.g. inner product): the
+ * filter is split in blocks of kBlock consecutive outputs for one input (8x1
+ * blocks), and the blocks of smallest L1 norm are set to 0 (see Prune). The
+ * pruned blocks are kept at 0 while training (see ApplyMask).
+ *
+ * The blocks left are stored in a compressed format (block CSR, see Pack):
+ *  + the values of the blocks (kBlock values each, 0 past the last output),
+ *    group of kBlock outputs by group
+ *  + the input of each block
+ *  + the first block of each group, and the number of blocks
+ * These replace the filter when the model is saved (see Model::GetTensor):
+ * at 90% sparsity, the file is about 9 times smaller.
+ *
+ * The forward pass only goes through the blocks left (see ForwardRow): the
+ * outputs of a group are accumulated for kRow input rows at once, the values
+ * of a block being loaded once for all the rows, in fixed-size loops the
+ * compiler vectorizes.
+ *
+ * The sparse forward pass is only used for inference (testing phase):
+ * training still uses the Dtype filter, the pruned blocks being 0.
+ */
+template <typename Dtype>
+class SparseFilter {
+  // Public types
+ public:
+  typedef Dtype Type;
+
+  static const uint32_t kBlock = 8;   // Outputs per block
+  static const uint32_t kRow   = 4;   // Input rows processed at once
+
+
+  // Protected attributes
+ protected:
+  std::shared_ptr<Mat<Dtype>>   filter_;    // Filter (Dtype)
+  uint32_t                      num_out_;   // Number of outputs
+  uint32_t                      num_in_;    // Number of inputs
+  bool                          active_;    // Pruned?
+  bool                          packed_;    // Compressed blocks up to date?
+  uint32_t                      num_block_; // Number of blocks left
+  std::vector<uint8_t>          mask_;      // Kept blocks (group, input)
+  std::vector<Dtype>            norm_;      // Norm of the blocks
+  std::vector<uint32_t>         order_;     // Blocks sorted by norm
+  std::shared_ptr<Mat<Dtype>>   value_;     // Values of the blocks
+  std::shared_ptr<Mat<int32_t>> index_;     // Input of each block
+  std::shared_ptr<Mat<int32_t>> offset_;    // First block of each group
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Forward pass of a group of outputs for some input rows.
+   *
+   *  \param[in]  group: group of outputs
+   *  \param[in]  in   : inputs (R rows of num_in values)
+   *
+   *  \param[out] out  : outputs (R rows of num_out values)
+   */
+  template <uint32_t R>
+  void ForwardGroup(uint32_t group, const Dtype* in, Dtype* out) const {
+    const Dtype*   value  = value_->Data();
+    const int32_t* index  = index_->Data();
+    const int32_t* offset = offset_->Data();
+
+    Dtype acc[R][kBlock] = {};
+    for (int32_t block = offset[group]; block < offset[group + 1]; ++block) {
+      const Dtype* v = value + size_t(block) * kBlock;
+      const Dtype* x = in + index[block];
+      for (uint32_t r = 0; r < R; ++r) {
+        Dtype x_r = x[size_t(r) * num_in_];
+        for (uint32_t i = 0; i < kBlock; ++i) {
+          acc[r][i] += x_r * v[i];
+        }
+      }
+    }
+
+    uint32_t out_start = group * kBlock;
+    uint32_t num       = std::min(kBlock, num_out_ - out_start);
+    for (uint32_t r = 0; r < R; ++r) {
+      Dtype* out_r = out + size_t(r) * num_out_ + out_start;
+      for (uint32_t i = 0; i < num; ++i) {
+        out_r[i] = acc[r][i];
+      }
+    }
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   */
+  SparseFilter() {
+    num_out_ = num_in_ = num_block_ = 0;
+    active_  = false;
+    packed_  = false;
+  }
+
+  /*!
+   * Destructor.
+   */
+  ~SparseFilter() {}
+
+  /*!
+   * Set the filter to prune.
+   *
+   *  \param[in]  filter : filter (num_out rows of Size() / num_out values)
+   *  \param[in]  num_out: number of outputs
+   */
+  void SetFilter(const std::shared_ptr<Mat<Dtype>>& filter, uint32_t num_out) {
+    filter_  = filter;
+    num_out_ = num_out;
+    num_in_  = filter->Size() / num_out;
+    mask_.assign(size_t(NumGroup()) * num_in_, 1);
+    num_block_ = uint32_t(mask_.size());
+    value_   = std::make_shared<Mat<Dtype>>(kBlock, 0, 1, 1, false);
+    index_   = std::make_shared<Mat<int32_t>>(0, 1, 1, 1, false);
+    offset_  = std::make_shared<Mat<int32_t>>(NumGroup() + 1, 1, 1, 1,
+                                              false);
+  }
+
+  /*!
+   * Check if the filter is pruned.
+   *
+   *  \return Pruned?
+   */
+  bool Active() const {
+    return active_;
+  }
+
+  /*!
+   * Get the number of groups of kBlock outputs.
+   *
+   *  \return Number of groups
+   */
+  uint32_t NumGroup() const {
+    return (num_out_ + kBlock - 1) / kBlock;
+  }
+
+  /*!
+   * Get the number of blocks left.
+   *
+   *  \return Number of blocks
+   */
+  uint32_t NumBlock() const {
+    return num_block_;
+  }
+
+  /*!
+   * Prune the blocks of smallest L1 norm, the blocks already pruned staying
+   * pruned (their norm is 0). At least one block is kept.
+   * The norm of a block is averaged over its outputs: the last group can
+   * have less than kBlock outputs, its blocks would be pruned first
+   * otherwise.
+   *
+   *  \param[in]  sparsity: fraction of the blocks to prune
+   */
+  void Prune(Dtype sparsity) {
+    const Dtype* filter = filter_->Data();
+    norm_.assign(mask_.size(), Dtype(0));
+    for (uint32_t out = 0; out < num_out_; ++out) {
+      const Dtype* row       = filter + size_t(out) * num_in_;
+      Dtype*       norm      = &norm_[size_t(out / kBlock) * num_in_];
+      uint32_t     out_start = out / kBlock * kBlock;
+      Dtype        scale     = Dtype(1) / std::min(kBlock,
+                                                   num_out_ - out_start);
+      for (uint32_t i = 0; i < num_in_; ++i) {
+        norm[i] += std::abs(row[i]) * scale;
+      }
+    }
+
+    size_t num_prune = std::min(size_t(Dtype(mask_.size()) *
+                                       std::max(sparsity, Dtype(0))),
+                                mask_.size() - 1);
+    order_.resize(mask_.size());
+    for (uint32_t i = 0; i < order_.size(); ++i) {
+      order_[i] = i;
+    }
+    std::nth_element(order_.begin(), order_.begin() + num_prune, order_.end(),
+                     [this](uint32_t a, uint32_t b) {
+      return norm_[a] < norm_[b];
+    });
+    std::fill(mask_.begin(), mask_.end(), uint8_t(1));
+    for (size_t i = 0; i < num_prune; ++i) {
+      mask_[order_[i]] = 0;
+    }
+    num_block_ = uint32_t(mask_.size() - num_prune);
+    active_    = true;
+    ApplyMask();
+  }
+
+  /*!
+   * Set the pruned blocks of the filter to 0 (e.g. after a weight update).
+   */
+  void ApplyMask() {
+    Dtype* filter = filter_->Data();
+    for (uint32_t out = 0; out < num_out_; ++out) {
+      Dtype*         row  = filter + size_t(out) * num_in_;
+      const uint8_t* mask = &mask_[size_t(out / kBlock) * num_in_];
+      for (uint32_t i = 0; i < num_in_; ++i) {
+        if (!mask[i]) {
+          row[i] = Dtype(0);
+        }
+      }
+    }
+    packed_ = false;
+  }
+
+  /*!
+   * The filter was changed: the compressed blocks are out of date.
+   */
+  void WeightChanged() {
+    packed_ = false;
+  }
+
+  /*!
+   * Check if the compressed blocks are up to date.
+   *
+   *  \return Up to date?
+   */
+  bool Packed() const {
+    return packed_;
+  }
+
+  /*!
+   * Compress the blocks left of the filter.
+   */
+  void Pack() {
+    uint32_t num_block = num_block_;
+    if (index_->Size() != num_block) {
+      value_ = std::make_shared<Mat<Dtype>>(kBlock, num_block, 1, 1, false);
+      index_ = std::make_shared<Mat<int32_t>>(num_block, 1, 1, 1, false);
+    }
+
+    const Dtype* filter = filter_->Data();
+    Dtype*       value  = value_->Data();
+    int32_t*     index  = index_->Data();
+    int32_t*     offset = offset_->Data();
+    int32_t      block  = 0;
+    for (uint32_t group = 0; group < NumGroup(); ++group) {
+      offset[group] = block;
+      uint32_t       out_start = group * kBlock;
+      uint32_t       num       = std::min(kBlock, num_out_ - out_start);
+      const uint8_t* mask      = &mask_[size_t(group) * num_in_];
+      for (uint32_t i = 0; i < num_in_; ++i) {
+        if (!mask[i]) {
+          continue;
+        }
+        Dtype* v = value + size_t(block) * kBlock;
+        for (uint32_t j = 0; j < kBlock; ++j) {
+          v[j] = j < num ? filter[size_t(out_start + j) * num_in_ + i] :
+                           Dtype(0);
+        }
+        index[block++] = int32_t(i);
+      }
+    }
+    offset[NumGroup()] = block;
+    packed_ = true;
+  }
+
+  /*!
+   * Allocate the compressed blocks, before reading them (see Model::Load).
+   *
+   *  \param[in]  num_block: number of blocks
+   */
+  void Resize(uint32_t num_block) {
+    value_  = std::make_shared<Mat<Dtype>>(kBlock, num_block, 1, 1, false);
+    index_  = std::make_shared<Mat<int32_t>>(num_block, 1, 1, 1, false);
+    active_ = true;
+    packed_ = true;
+  }
+
+  /*!
+   * Expand the compressed blocks (e.g. read from a file) into the filter.
+   *
+   *  \return Error?
+   */
+  bool Unpack() {
+    const Dtype*   value     = value_->Data();
+    const int32_t* index     = index_->Data();
+    const int32_t* offset    = offset_->Data();
+    int32_t        num_block = int32_t(index_->Size());
+    Dtype*         filter    = filter_->Data();
+
+    std::fill(filter, filter + filter_->Size(), Dtype(0));
+    std::fill(mask_.begin(), mask_.end(), uint8_t(0));
+    for (uint32_t group = 0; group < NumGroup(); ++group) {
+      if (offset[group] < 0 || offset[group] > offset[group + 1] ||
+          offset[group + 1] > num_block) {
+        Report(kError, "Sparse filter is corrupted");
+        return false;
+      }
+      uint32_t out_start = group * kBlock;
+      uint32_t num       = std::min(kBlock, num_out_ - out_start);
+      for (int32_t block = offset[group]; block < offset[group + 1];
+           ++block) {
+        if (index[block] < 0 || uint32_t(index[block]) >= num_in_) {
+          Report(kError, "Sparse filter is corrupted");
+          return false;
+        }
+        const Dtype* v = value + size_t(block) * kBlock;
+        for (uint32_t j = 0; j < num; ++j) {
+          filter[size_t(out_start + j) * num_in_ + index[block]] = v[j];
+        }
+        mask_[size_t(group) * num_in_ + index[block]] = 1;
+      }
+    }
+    num_block_ = uint32_t(std::count(mask_.begin(), mask_.end(),
+                                     uint8_t(1)));
+    active_    = true;
+    packed_    = true;
+    return true;
+  }
+
+  /*!
+   * Get the tensors replacing the filter once pruned.
+   *
+   *  \param[out] value : values of the blocks
+   *  \param[out] index : input of each block
+   *  \param[out] offset: first block of each group
+   */
+  void GetTensor(std::shared_ptr<Mat<Dtype>>*   value,
+                 std::shared_ptr<Mat<int32_t>>* index,
+                 std::shared_ptr<Mat<int32_t>>* offset) const {
+    *value  = value_;
+    *index  = index_;
+    *offset = offset_;
+  }
+
+  /*!
+   * Forward pass with the inputs as rows, for some groups of outputs:
+   * out = in * filter^T (see Pack).
+   *
+   *  \param[in]  group_start: first group of outputs
+   *  \param[in]  group_end  : last group of outputs (excluded)
+   *  \param[in]  num_row    : number of input rows (e.g. batch size)
+   *  \param[in]  in         : inputs (num_row rows of num_in values)
+   *
+   *  \param[out] out        : outputs (num_row rows of num_out values)
+   */
+  void ForwardRow(uint32_t group_start, uint32_t group_end, uint32_t num_row,
+                  const Dtype* in, Dtype* out) const {
+    for (uint32_t group = group_start; group < group_end; ++group) {
+      uint32_t row = 0;
+      for (; row + kRow <= num_row; row += kRow) {
+        ForwardGroup<kRow>(group, in + size_t(row) * num_in_,
+                           out + size_t(row) * num_out_);
+      }
+      for (; row < num_row; ++row) {
+        ForwardGroup<1>(group, in + size_t(row) * num_in_,
+                        out + size_t(row) * num_out_);
+      }
+    }
+  }
+};
+
+template <typename Dtype> const uint32_t SparseFilter<Dtype>::kBlock;
+template <typename Dtype> const uint32_t SparseFilter<Dtype>::kRow;
+
+
+}  // namespace jik
+
+
+#endif  // CORE_SPARSE_H_
@@ -45,13 +45,17 @@ struct State {
   };
 
   E_PHASE phase;      // State phase
+  bool    recompute;  // Forward pass run again before the backward pass
+                      // (see Model::Checkpoint): the layers must not
+                      // update their state twice (e.g. moving averages,
+                      // dropout mask)
 
   /*!
    * Constructor.
    *
    *  \param[in]  p: phase
    */
-  explicit State(E_PHASE p): phase(p) {}
+  explicit State(E_PHASE p): phase(p), recompute(false) {}
 };
 
 
@@ -0,0 +1,610 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#ifndef CORE_STATIC_GRAPH_H_
+#define CORE_STATIC_GRAPH_H_
+
+
+#include <core/log.h>
+#include <core/model_file.h>
+#include <core/simd.h>
+#include <cstdint>
+#include <cstdio>
+#include <initializer_list>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  StaticLayer
+ *  \brief  Base of the layers of a StaticGraph
+ *
+ * A static layer is a type: its sizes are template parameters and its
+ * forward pass takes one sample (kNumIn values) to kNumOut values, with
+ * loops of constant bounds. There's no virtual function, no parameter
+ * lookup and no allocation, the compiler inlining the whole graph.
+ *
+ * A layer with weights redefines kNumWeight, Weight and WeightSize, its
+ * weights having the shapes of the matching dynamic layer (e.g.
+ * LayerInnerProduct) to be read from the same model files.
+ */
+template <typename Dtype, uint32_t NUM_IN, uint32_t NUM_OUT>
+class StaticLayer {
+  // Public types
+ public:
+  typedef Dtype Type;
+
+  static const uint32_t kNumIn     = NUM_IN;    // Number of inputs
+  static const uint32_t kNumOut    = NUM_OUT;   // Number of outputs
+  static const uint32_t kNumWeight = 0;         // Number of weights
+
+
+  // Public methods
+ public:
+  /*!
+   * Get a weight.
+   *
+   *  \param[in]  i: weight index
+   *
+   *  \return     Weight
+   */
+  Dtype* Weight(uint32_t i) {
+    return nullptr;
+  }
+
+  /*!
+   * Get the size of a weight (4 dimensions, see Mat).
+   *
+   *  \param[in]  i   : weight index
+   *
+   *  \param[out] size: weight size
+   */
+  static void WeightSize(uint32_t i, uint32_t size[4]) {
+    size[0] = size[1] = size[2] = size[3] = 0;
+  }
+};
+
+
+/*!
+ *  \class  StaticInnerProduct
+ *  \brief  Inner product of a StaticGraph (see LayerInnerProduct)
+ *
+ * out = filter * in + bias, the filter being NUM_OUT rows of NUM_IN values.
+ */
+template <typename Dtype, uint32_t NUM_IN, uint32_t NUM_OUT, bool BIAS = true>
+class StaticInnerProduct: public StaticLayer<Dtype, NUM_IN, NUM_OUT> {
+  // Public types
+ public:
+  typedef Dtype Type;
+
+  static const uint32_t kNumWeight = BIAS ? 2 : 1;   // Filter and bias
+
+  // Number of outputs calculated at once: the long rows are bound by the
+  // loads, the short ones by the reductions
+  static const uint32_t kRow = NUM_IN >= 256 ? 4 : 1;
+
+
+  // Protected attributes
+ protected:
+  Dtype filter_[NUM_OUT * NUM_IN];    // Filter
+  Dtype bias_[BIAS ? NUM_OUT : 1];   // Bias
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor (weights set to 0).
+   */
+  StaticInnerProduct(): filter_(), bias_() {}
+
+  /*!
+   * Get a weight.
+   *
+   *  \param[in]  i: weight index (0: filter, 1: bias)
+   *
+   *  \return     Weight
+   */
+  Dtype* Weight(uint32_t i) {
+    return i ? bias_ : filter_;
+  }
+
+  /*!
+   * Get the size of a weight (as in LayerInnerProduct).
+   *
+   *  \param[in]  i   : weight index
+   *
+   *  \param[out] size: weight size
+   */
+  static void WeightSize(uint32_t i, uint32_t size[4]) {
+    size[0] = i ? 1       : NUM_IN;
+    size[1] = i ? 1       : NUM_OUT;
+    size[2] = i ? NUM_OUT : 1;
+    size[3] = 1;
+  }
+
+  /*!
+   * Forward pass of a sample.
+   *
+   *  \param[in]  in : inputs
+   *
+   *  \param[out] out: outputs
+   */
+  void Forward(const Dtype* in, Dtype* out) const {
+    // kRow outputs at once, sharing the loads of the inputs
+    uint32_t i = 0;
+    for (; i + kRow <= NUM_OUT; i += kRow) {
+      const Dtype* filter = filter_ + i * NUM_IN;
+      Dtype sum[kRow];
+      for (uint32_t r = 0; r < kRow; ++r) {
+        sum[r] = BIAS ? bias_[i + r] : Dtype(0);
+      }
+      for (uint32_t j = 0; j < NUM_IN; ++j) {
+        for (uint32_t r = 0; r < kRow; ++r) {
+          sum[r] += filter[r * NUM_IN + j] * in[j];
+        }
+      }
+      for (uint32_t r = 0; r < kRow; ++r) {
+        out[i + r] = sum[r];
+      }
+    }
+    for (; i < NUM_OUT; ++i) {
+      const Dtype* filter = filter_ + i * NUM_IN;
+      Dtype sum = BIAS ? bias_[i] : Dtype(0);
+      for (uint32_t j = 0; j < NUM_IN; ++j) {
+        sum += filter[j] * in[j];
+      }
+      out[i] = sum;
+    }
+  }
+};
+
+
+/*!
+ *  \class  StaticScale
+ *  \brief  Scale of a StaticGraph (see LayerScale)
+ *
+ * out = scale * in + bias, with 1 scale and bias per channel of
+ * DATA_SIZE values.
+ */
+template <typename Dtype, uint32_t NUM_CHANNEL, uint32_t DATA_SIZE = 1,
+          bool BIAS = true>
+class StaticScale: public StaticLayer<Dtype, NUM_CHANNEL * DATA_SIZE,
+                                      NUM_CHANNEL * DATA_SIZE> {
+  // Public types
+ public:
+  typedef Dtype Type;
+
+  static const uint32_t kNumWeight = BIAS ? 2 : 1;   // Scale and bias
+
+
+  // Protected attributes
+ protected:
+  Dtype scale_[NUM_CHANNEL];             // Scale
+  Dtype bias_[BIAS ? NUM_CHANNEL : 1];   // Bias
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor (scale set to 1, bias to 0).
+   */
+  StaticScale(): bias_() {
+    for (uint32_t i = 0; i < NUM_CHANNEL; ++i) {
+      scale_[i] = Dtype(1);
+    }
+  }
+
+  /*!
+   * Get a weight.
+   *
+   *  \param[in]  i: weight index (0: scale, 1: bias)
+   *
+   *  \return     Weight
+   */
+  Dtype* Weight(uint32_t i) {
+    return i ? bias_ : scale_;
+  }
+
+  /*!
+   * Get the size of a weight (as in LayerScale).
+   *
+   *  \param[in]  i   : weight index
+   *
+   *  \param[out] size: weight size
+   */
+  static void WeightSize(uint32_t i, uint32_t size[4]) {
+    size[0] = size[1] = size[3] = 1;
+    size[2] = NUM_CHANNEL;
+  }
+
+  /*!
+   * Forward pass of a sample.
+   *
+   *  \param[in]  in : inputs
+   *
+   *  \param[out] out: outputs
+   */
+  void Forward(const Dtype* in, Dtype* out) const {
+    for (uint32_t i = 0; i < NUM_CHANNEL; ++i) {
+      for (uint32_t j = 0; j < DATA_SIZE; ++j) {
+        out[i * DATA_SIZE + j] = scale_[i] * in[i * DATA_SIZE + j] +
+                                 (BIAS ? bias_[i] : Dtype(0));
+      }
+    }
+  }
+};
+
+
+/*!
+ *  \class  StaticRelu
+ *  \brief  ReLU of a StaticGraph (see LayerRelu)
+ */
+template <typename Dtype, uint32_t NUM>
+class StaticRelu: public StaticLayer<Dtype, NUM, NUM> {
+  // Public methods
+ public:
+  /*!
+   * Forward pass of a sample.
+   *
+   *  \param[in]  in : inputs
+   *
+   *  \param[out] out: outputs
+   */
+  void Forward(const Dtype* in, Dtype* out) const {
+    Simd<Dtype>::Relu(NUM, in, out);
+  }
+};
+
+
+/*!
+ *  \class  StaticSigmoid
+ *  \brief  Sigmoid of a StaticGraph (see LayerSigmoid)
+ */
+template <typename Dtype, uint32_t NUM>
+class StaticSigmoid: public StaticLayer<Dtype, NUM, NUM> {
+  // Public methods
+ public:
+  /*!
+   * Forward pass of a sample.
+   *
+   *  \param[in]  in : inputs
+   *
+   *  \param[out] out: outputs
+   */
+  void Forward(const Dtype* in, Dtype* out) const {
+    Simd<Dtype>::Sigmoid(NUM, in, out);
+  }
+};
+
+
+/*!
+ *  \class  StaticTanh
+ *  \brief  Tanh of a StaticGraph (see LayerTanh)
+ */
+template <typename Dtype, uint32_t NUM>
+class StaticTanh: public StaticLayer<Dtype, NUM, NUM> {
+  // Public methods
+ public:
+  /*!
+   * Forward pass of a sample.
+   *
+   *  \param[in]  in : inputs
+   *
+   *  \param[out] out: outputs
+   */
+  void Forward(const Dtype* in, Dtype* out) const {
+    Simd<Dtype>::Tanh(NUM, in, out);
+  }
+};
+
+
+/*!
+ *  \class  StaticGraph
+ *  \brief  Graph of static layers, for the inference of small fixed models
+ *
+ * The topology and the sizes of the graph are template parameters: a chain
+ * of static layers (see StaticLayer), the outputs of each layer being the
+ * inputs of the next one, e.g. for the fully connected MNIST model:
+ *   StaticGraph<float, StaticInnerProduct<float, 784, 64>,
+ *                      StaticRelu<float, 64>,
+ *                      StaticInnerProduct<float, 64, 64>,
+ *                      StaticRelu<float, 64>,
+ *                      StaticInnerProduct<float, 64, 10>>
+ *
+ * The forward pass of a sample is a single function the compiler inlines,
+ * unrolls and vectorizes end to end, the activations living on the stack:
+ * for tiny models in tight request loops, the virtual calls, parameter
+ * lookups and runtime sized loops of a Model cost more than the math.
+ * The graph is const once loaded: it can run from several threads.
+ *
+ * The weights are read from the files of the matching Model, the layers
+ * being named as in the model (see Model::GetTensor): both the legacy and
+ * the current format (see ModelFile) are supported, except the quantized
+ * and pruned files (the static layers only keep Dtype filters).
+ */
+template <typename Dtype, typename... Layers>
+class StaticGraph {
+  // Public types
+ public:
+  typedef Dtype                 Type;
+  typedef std::tuple<Layers...> Tuple;
+
+  static const size_t kNumLayer = sizeof...(Layers);   // Number of layers
+
+  static_assert(kNumLayer > 0, "A static graph must have a layer");
+
+  /*!
+   * First and last layers
+   */
+  typedef typename std::tuple_element<0, Tuple>::type             First;
+  typedef typename std::tuple_element<kNumLayer - 1, Tuple>::type Last;
+
+  static const uint32_t kNumIn  = First::kNumIn;    // Number of inputs
+  static const uint32_t kNumOut = Last::kNumOut;    // Number of outputs
+
+
+  // Protected types
+ protected:
+  /*!
+   *  \struct Chain
+   *  \brief  Check the outputs of each layer match the inputs of the next one
+   */
+  template <typename... L>
+  struct Chain: std::true_type {};
+  template <typename L0, typename L1, typename... L>
+  struct Chain<L0, L1, L...>:
+    std::integral_constant<bool, L0::kNumOut == L1::kNumIn &&
+                                 Chain<L1, L...>::value> {};
+
+  static_assert(Chain<Layers...>::value,
+                "The outputs of a layer must be the inputs of the next one");
+  static_assert(std::is_same<std::tuple<Dtype, typename Layers::Type...>,
+                std::tuple<typename Layers::Type..., Dtype>>::value,
+                "The layers must have the same type as the graph");
+
+
+  // Protected attributes
+ protected:
+  std::string              name_;         // Graph name
+  std::vector<std::string> layer_name_;   // Layer names
+  Tuple                    layer_;        // Layers
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Forward pass of a sample from a layer to the last one.
+   *
+   *  \param[in]  in : inputs of the layer
+   *
+   *  \param[out] out: outputs of the graph
+   */
+  template <size_t I>
+  void ForwardFrom(const Dtype* in, Dtype* out,
+                   std::true_type /* last */) const {
+    std::get<I>(layer_).Forward(in, out);
+  }
+  template <size_t I>
+  void ForwardFrom(const Dtype* in, Dtype* out,
+                   std::false_type /* last */) const {
+    alignas(64) Dtype act[std::tuple_element<I, Tuple>::type::kNumOut];
+    std::get<I>(layer_).Forward(in, act);
+    ForwardFrom<I + 1>(act, out,
+                       std::integral_constant<bool, I + 2 == kNumLayer>());
+  }
+
+  /*!
+   * Add the weights of a layer to a list of tensors.
+   *
+   *  \param[out] tensor: list of tensors
+   */
+  template <size_t I>
+  void AddTensor(std::vector<typename ModelFile<Dtype>::Tensor>* tensor) const {
+    typedef typename std::tuple_element<I, Tuple>::type L;
+    // The tensors are written into when read
+    L* layer = const_cast<L*>(&std::get<I>(layer_));
+    for (uint32_t j = 0; j < L::kNumWeight; ++j) {
+      uint32_t size[4];
+      L::WeightSize(j, size);
+      tensor->push_back(ModelFile<Dtype>::Describe(
+        layer_name_[I] + "." + std::to_string(j), layer->Weight(j), size));
+    }
+  }
+
+  /*!
+   * Get the weights of the layers as tensors.
+   *
+   *  \param[out] tensor: list of tensors
+   */
+  template <size_t... I>
+  void GetTensor(std::vector<typename ModelFile<Dtype>::Tensor>* tensor,
+                 std::index_sequence<I...>) const {
+    int expand[] = {0, (AddTensor<I>(tensor), 0)...};
+    static_cast<void>(expand);
+  }
+
+  /*!
+   * Read the weights from a file stream in the legacy format (see
+   * Model::ReadLegacy).
+   *
+   *  \param[in]  fp    : file stream
+   *  \param[in]  tensor: weights
+   *
+   *  \return     Data size read from the file (0 on error)
+   */
+  static size_t ReadLegacy(
+    std::FILE*                                            fp,
+    const std::vector<typename ModelFile<Dtype>::Tensor>& tensor) {
+    size_t res = 0;
+    for (const typename ModelFile<Dtype>::Tensor& t : tensor) {
+      uint32_t weight_size;
+      if (std::fread(&weight_size, 1, sizeof(uint32_t), fp) !=
+          sizeof(uint32_t)) {
+        Report(kError, "Model file is truncated");
+        return 0;
+      }
+      if (t.bytes != uint64_t(weight_size) * sizeof(Dtype)) {
+        Report(kError, "Weights from file is not matching current model");
+        return 0;
+      }
+      if (std::fread(t.data, 1, t.bytes, fp) != t.bytes) {
+        Report(kError, "Model file is truncated");
+        return 0;
+      }
+      res += sizeof(uint32_t) + t.bytes;
+    }
+    return res;
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  name      : graph name
+   *  \param[in]  layer_name: layer names, as in the matching model
+   */
+  StaticGraph(const char* name,
+              const std::initializer_list<const char*>& layer_name) {
+    Check(name && *name, "A graph must have a name");
+    Check(layer_name.size() == kNumLayer, "Static graph '%s' must have %ld "
+          "layer name(s)", name, kNumLayer);
+    name_ = name;
+    for (const char* n : layer_name) {
+      layer_name_.push_back(n);
+    }
+  }
+
+  /*!
+   * Get the graph name.
+   *
+   *  \return Graph name
+   */
+  const char* Name() const {
+    return name_.c_str();
+  }
+
+  /*!
+   * Get a layer.
+   *
+   *  \return Layer
+   */
+  template <size_t I>
+  typename std::tuple_element<I, Tuple>::type& GetLayer() {
+    return std::get<I>(layer_);
+  }
+
+  /*!
+   * Get the weights of the layers as tensors, with their names
+   * ("<layer name>.<index>", see Model::GetTensor).
+   *
+   *  \param[out] tensor: list of tensors
+   */
+  void GetTensor(std::vector<typename ModelFile<Dtype>::Tensor>* tensor) const {
+    tensor->clear();
+    GetTensor(tensor, std::index_sequence_for<Layers...>());
+  }
+
+  /*!
+   * Read the weights from disk (a file of the matching model).
+   *
+   *  \param[in]  file_path: path to the file
+   *
+   *  \return     Data size read from the file (0 on error)
+   */
+  size_t Load(const char* file_path) {
+    if (!file_path || !*file_path) {
+      Report(kError, "Invalid file name");
+      return 0;
+    }
+    std::FILE* fp = std::fopen(file_path, "rb");
+    if (!fp) {
+      Report(kError, "Can't open file '%s' for read", file_path);
+      return 0;
+    }
+    std::vector<typename ModelFile<Dtype>::Tensor> tensor;
+    GetTensor(&tensor);
+    size_t size = ModelFile<Dtype>::Detect(fp) ?
+                  ModelFile<Dtype>::Read(fp, tensor) : ReadLegacy(fp, tensor);
+    std::fclose(fp);
+    return size;
+  }
+
+  /*!
+   * Save the weights on disk (see ModelFile::Save), to be read by the
+   * matching model.
+   *
+   *  \param[in]  file_path: path to the file
+   *
+   *  \return     Data size written to the file
+   */
+  size_t Save(const char* file_path) const {
+    if (!file_path || !*file_path) {
+      Report(kError, "Invalid file name");
+      return 0;
+    }
+    std::vector<typename ModelFile<Dtype>::Tensor> tensor;
+    GetTensor(&tensor);
+    return ModelFile<Dtype>::Save(file_path, tensor);
+  }
+
+  /*!
+   * Forward pass of a sample.
+   *
+   *  \param[in]  in : inputs (kNumIn values)
+   *
+   *  \param[out] out: outputs (kNumOut values)
+   */
+  void Forward(const Dtype* in, Dtype* out) const {
+    ForwardFrom<0>(in, out, std::integral_constant<bool, kNumLayer == 1>());
+  }
+
+  /*!
+   * Forward pass of a batch, sample by sample.
+   *
+   *  \param[in]  num_batch: batch size
+   *  \param[in]  in       : inputs (kNumIn values per sample)
+   *
+   *  \param[out] out      : outputs (kNumOut values per sample)
+   */
+  void Forward(uint32_t num_batch, const Dtype* in, Dtype* out) const {
+    for (uint32_t batch = 0; batch < num_batch; ++batch) {
+      Forward(in + batch * kNumIn, out + batch * kNumOut);
+    }
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_STATIC_GRAPH_H_
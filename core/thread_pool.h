@@ -0,0 +1,363 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#ifndef CORE_THREAD_POOL_H_
+#define CORE_THREAD_POOL_H_
+
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  ThreadPool
+ *  \brief  Pool of worker threads
+ *
+ * The pool runs a list of tasks on its workers and on the calling thread,
+ * and returns once all of them are done. A single pool is shared by the
+ * whole process (see Get) and is mono-threaded until SetNumThread is called.
+ *
+ * A task running inside the pool never starts a nested parallel run:
+ * the nested tasks are executed serially on the current thread. This way a
+ * layer can split its batch across the threads while the matrix
+ * multiplications it calls stay serial, or be split themselves when the
+ * layer runs on a single thread.
+ */
+class ThreadPool {
+  // Protected attributes
+ protected:
+  std::vector<std::thread>              worker_;      // Worker threads
+  std::mutex                            run_mutex_;   // One run at a time
+  std::mutex                            mutex_;       // Task queue lock
+  std::condition_variable               work_cond_;   // Tasks available
+  std::condition_variable               done_cond_;   // Tasks done
+  const std::function<void(uint32_t)>*  task_;        // Current task
+  uint32_t                              num_task_;    // Number of tasks
+  uint32_t                              next_task_;   // Next task to run
+  uint32_t                              num_left_;    // Tasks not done yet
+  uint64_t                              generation_;  // Run counter
+  bool                                  stop_;        // Stop the workers?
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Flag set on threads currently running a task.
+   *
+   *  \return Reference to the flag
+   */
+  static bool& InTask() {
+    static thread_local bool in_task = false;
+    return in_task;
+  }
+
+  /*!
+   * Run the tasks of the current run until there is no more to start.
+   *
+   *  \param[in]  lock: task queue lock (locked)
+   */
+  void RunTasks(std::unique_lock<std::mutex>* lock) {
+    while (next_task_ < num_task_) {
+      uint32_t task = next_task_++;
+      lock->unlock();
+      InTask() = true;
+      (*task_)(task);
+      InTask() = false;
+      lock->lock();
+      if (!--num_left_) {
+        done_cond_.notify_one();
+      }
+    }
+  }
+
+  /*!
+   * Worker thread loop.
+   */
+  void Worker() {
+    uint64_t generation = 0;
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      work_cond_.wait(lock, [this, generation] {
+        return stop_ || generation_ != generation;
+      });
+      if (stop_) {
+        return;
+      }
+      generation = generation_;
+      RunTasks(&lock);
+    }
+  }
+
+  /*!
+   * Stop and join all the workers.
+   */
+  void Stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    work_cond_.notify_all();
+    for (std::thread& worker : worker_) {
+      worker.join();
+    }
+    worker_.clear();
+    stop_ = false;
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  num_thread: number of threads (including the caller)
+   */
+  explicit ThreadPool(uint32_t num_thread = 1) {
+    task_       = nullptr;
+    num_task_   = next_task_ = num_left_ = 0;
+    generation_ = 0;
+    stop_       = false;
+    SetNumThread(num_thread);
+  }
+
+  /*!
+   * Destructor.
+   */
+  ~ThreadPool() {
+    Stop();
+  }
+
+  /*!
+   * Get the process thread pool.
+   *
+   *  \return Thread pool
+   */
+  static ThreadPool& Get() {
+    static ThreadPool pool;
+    return pool;
+  }
+
+  /*!
+   * Set the number of threads.
+   *
+   *  \param[in]  num_thread: number of threads, including the calling thread
+   *                          (0: number of hardware threads)
+   */
+  void SetNumThread(uint32_t num_thread) {
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    if (!num_thread) {
+      num_thread = std::max(1u, std::thread::hardware_concurrency());
+    }
+    Stop();
+    for (uint32_t i = 1; i < num_thread; ++i) {
+      worker_.emplace_back(&ThreadPool::Worker, this);
+    }
+  }
+
+  /*!
+   * Get the number of threads.
+   *
+   *  \return Number of threads, including the calling thread
+   */
+  uint32_t NumThread() const {
+    return uint32_t(worker_.size()) + 1;
+  }
+
+  /*!
+   * Check if tasks started now would run in parallel.
+   *
+   *  \return Parallel?
+   */
+  bool Parallel() const {
+    return !worker_.empty() && !InTask();
+  }
+
+  /*!
+   *  \class  Serial
+   *  \brief  Run the tasks started by the current thread serially, while in
+   *          scope
+   *
+   * A thread running next to the pool (e.g. a background evaluation, see
+   * Evaluator) this way doesn't wait for the workers used by the other
+   * threads.
+   */
+  class Serial {
+    // Protected attributes
+   protected:
+    bool in_task_;  // Previous flag
+
+
+    // Public methods
+   public:
+    /*!
+     * Constructor.
+     */
+    Serial() {
+      in_task_ = InTask();
+      InTask() = true;
+    }
+
+    /*!
+     * Destructor.
+     */
+    ~Serial() {
+      InTask() = in_task_;
+    }
+  };
+
+  /*!
+   * Run some tasks and wait for them to be done.
+   *
+   *  \param[in]  num_task: number of tasks
+   *  \param[in]  task    : task function, called with the task index
+   */
+  void Run(uint32_t num_task, const std::function<void(uint32_t)>& task) {
+    if (num_task <= 1 || !Parallel()) {
+      for (uint32_t i = 0; i < num_task; ++i) {
+        task(i);
+      }
+      return;
+    }
+
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    std::unique_lock<std::mutex> lock(mutex_);
+    task_      = &task;
+    num_task_  = num_task;
+    next_task_ = 0;
+    num_left_  = num_task;
+    ++generation_;
+    work_cond_.notify_all();
+
+    // The calling thread takes its share of the tasks too
+    RunTasks(&lock);
+    done_cond_.wait(lock, [this] { return !num_left_; });
+    task_ = nullptr;
+  }
+};
+
+
+/*!
+ * Split a range into contiguous chunks, one per thread, and run them in
+ * parallel. The chunk index is in [0, ThreadPool::Get().NumThread()) and can be
+ * used to select per-thread data (e.g. a ThreadDeriv buffer).
+ *
+ *  \param[in]  begin: first index
+ *  \param[in]  end  : last index (excluded)
+ *  \param[in]  func : function called with (chunk begin, chunk end, chunk)
+ */
+template <typename Func>
+void ParallelFor(uint32_t begin, uint32_t end, const Func& func) {
+  if (begin >= end) {
+    return;
+  }
+  ThreadPool& pool = ThreadPool::Get();
+  uint32_t size      = end - begin;
+  uint32_t num_chunk = pool.Parallel() ? std::min(pool.NumThread(), size) : 1;
+  pool.Run(num_chunk, [begin, size, num_chunk, &func](uint32_t chunk) {
+    uint32_t chunk_begin = begin + uint32_t(uint64_t(size) * chunk / num_chunk);
+    uint32_t chunk_end   = begin + uint32_t(uint64_t(size) * (chunk + 1) /
+                                            num_chunk);
+    func(chunk_begin, chunk_end, chunk);
+  });
+}
+
+
+/*!
+ *  \class  ThreadDeriv
+ *  \brief  Per-thread derivatives accumulators
+ *
+ * When the batch is split across the threads, every thread accumulates the
+ * weight derivatives of its own chunk in a private buffer, and all of them
+ * are added to the weight derivatives once the threads are done. The first
+ * chunk writes directly into the weight derivatives. The reduction follows
+ * the chunk order so the result doesn't depend on the thread scheduling.
+ */
+template <typename Dtype>
+class ThreadDeriv {
+  // Protected attributes
+ protected:
+  std::vector<std::vector<Dtype>> deriv_;  // Accumulators (chunks 1+)
+
+
+  // Public methods
+ public:
+  /*!
+   * Prepare zeroed accumulators for the current thread pool.
+   *
+   *  \param[in]  size: derivatives size
+   */
+  void Reset(uint32_t size) {
+    ThreadPool& pool = ThreadPool::Get();
+    deriv_.resize(pool.Parallel() ? pool.NumThread() - 1 : 0);
+    for (std::vector<Dtype>& deriv : deriv_) {
+      deriv.assign(size, Dtype(0));
+    }
+  }
+
+  /*!
+   * Get the accumulator of a chunk.
+   *
+   *  \param[in]  chunk: chunk index
+   *  \param[in]  deriv: weight derivatives (used by the first chunk)
+   *
+   *  \return     Accumulator
+   */
+  Dtype* Data(uint32_t chunk, Dtype* deriv) {
+    if (!chunk || !deriv) {
+      return deriv;
+    }
+    return &deriv_[chunk - 1][0];
+  }
+
+  /*!
+   * Add the accumulators to the weight derivatives.
+   *
+   *  \param[out] deriv: weight derivatives
+   */
+  void Reduce(Dtype* deriv) const {
+    if (!deriv) {
+      return;
+    }
+    for (const std::vector<Dtype>& acc : deriv_) {
+      for (size_t i = 0; i < acc.size(); ++i) {
+        deriv[i] += acc[i];
+      }
+    }
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_THREAD_POOL_H_
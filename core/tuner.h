@@ -0,0 +1,264 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#ifndef CORE_TUNER_H_
+#define CORE_TUNER_H_
+
+
+#include <core/log.h>
+#include <core/simd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+
+// Build identification (see Tuner::Machine)
+#define JIK_TUNER_STR(x)  #x
+#define JIK_TUNER_XSTR(x) JIK_TUNER_STR(x)
+#ifdef JIK_VERSION
+#define JIK_TUNER_VERSION JIK_TUNER_XSTR(JIK_VERSION)
+#else
+#define JIK_TUNER_VERSION "?"
+#endif
+#ifdef __VERSION__
+#define JIK_TUNER_COMPILER __VERSION__
+#else
+#define JIK_TUNER_COMPILER "?"
+#endif
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Tuner
+ *  \brief  Per-shape selection of the fastest algorithm of a layer
+ *
+ * When enabled, a layer having several algorithms for the same calculation
+ * (e.g. LayerConv) times each of them the first time it runs with a given
+ * shape, batch size and number of threads (the key), and keeps the fastest
+ * one. All the algorithms give the same result: the output of the timed
+ * runs is the output of the pass.
+ *
+ * The choices can be kept in a cache file, read when enabling the tuner:
+ * later runs start with the tuned algorithms. Each line of the file is a
+ * choice, for a CPU model and a build of the library (see Machine), a key
+ * and an algorithm name; the choices of other machines or builds are
+ * ignored, and new choices are appended.
+ *
+ * A single tuner is shared by the whole process (see Get).
+ */
+class Tuner {
+  // Public types
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  static const uint32_t kNumRun = 3;   // Timed runs per algorithm (min kept)
+
+
+  // Protected attributes
+ protected:
+  std::mutex  mutex_;     // Choices lock
+  bool        enabled_;   // Enabled?
+  std::string path_;      // Cache file path (empty: none)
+  std::string machine_;   // CPU model and build
+  std::unordered_map<std::string, std::string>
+              choice_;    // Algorithm name for each key
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Constructor.
+   */
+  Tuner() {
+    enabled_ = false;
+    machine_ = Machine();
+  }
+
+  /*!
+   * Append a choice to the cache file.
+   *
+   *  \param[in]  key : key
+   *  \param[in]  name: algorithm name
+   */
+  void Append(const std::string& key, const std::string& name) {
+    if (path_.empty()) {
+      return;
+    }
+    std::FILE* fp = std::fopen(path_.c_str(), "a");
+    if (!fp) {
+      Report(kWarning, "Can't open file '%s' for write", path_.c_str());
+      return;
+    }
+    std::fprintf(fp, "%s\t%s\t%s\n", machine_.c_str(), key.c_str(),
+                 name.c_str());
+    std::fclose(fp);
+  }
+
+
+  // Public methods
+ public:
+  Tuner(const Tuner&)            = delete;
+  Tuner& operator=(const Tuner&) = delete;
+
+  /*!
+   * Get the process tuner.
+   *
+   *  \return Tuner
+   */
+  static Tuner& Get() {
+    static Tuner tuner;
+    return tuner;
+  }
+
+  /*!
+   * Get the machine the choices are made for: the CPU model (Linux only)
+   * and the build (library version, compiler and SIMD instruction set).
+   *
+   *  \return Machine
+   */
+  static std::string Machine() {
+    std::string cpu = "unknown cpu";
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+      if (!line.compare(0, 10, "model name")) {
+        size_t pos = line.find(':');
+        pos = (pos != std::string::npos) ?
+              line.find_first_not_of(' ', pos + 1) : pos;
+        if (pos != std::string::npos) {
+          cpu = line.substr(pos);
+        }
+        break;
+      }
+    }
+    return cpu + " / jik " JIK_TUNER_VERSION " " JIK_SIMD " " +
+           JIK_TUNER_COMPILER;
+  }
+
+  /*!
+   * Enable the tuner, reading the previous choices from a cache file.
+   *
+   *  \param[in]  file_path: path to the cache file (nullptr: none)
+   */
+  void Enable(const char* file_path = nullptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    enabled_ = true;
+    path_    = file_path ? file_path : "";
+    choice_.clear();
+    if (path_.empty()) {
+      return;
+    }
+    std::ifstream file(path_);
+    std::string line;
+    while (std::getline(file, line)) {
+      size_t tab1 = line.find('\t');
+      size_t tab2 = line.rfind('\t');
+      if (tab1 == std::string::npos || tab1 == tab2 ||
+          line.compare(0, tab1, machine_)) {
+        continue;
+      }
+      choice_[line.substr(tab1 + 1, tab2 - tab1 - 1)] = line.substr(tab2 + 1);
+    }
+    Report(kInfo, "Tuning the layers (%ld choice(s) in '%s')",
+           choice_.size(), path_.c_str());
+  }
+
+  /*!
+   * Check if the tuner is enabled.
+   *
+   *  \return Enabled?
+   */
+  bool Enabled() const {
+    return enabled_;
+  }
+
+  /*!
+   * Select the fastest algorithm for a key, timing them if it wasn't
+   * selected yet.
+   *
+   *  \param[in]  key : key (layer type, shape, batch size, threads...)
+   *  \param[in]  name: algorithm names
+   *  \param[in]  run : run an algorithm, called with its index: all the
+   *                    passes the choice applies to (e.g. forward and
+   *                    backward when training)
+   *
+   *  \return     Index of the fastest algorithm
+   */
+  template <typename Run>
+  uint32_t Tune(const std::string& key, const std::vector<std::string>& name,
+                const Run& run) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = choice_.find(key);
+      if (it != choice_.end()) {
+        for (uint32_t i = 0; i < name.size(); ++i) {
+          if (name[i] == it->second) {
+            return i;
+          }
+        }
+      }
+    }
+
+    // Time the algorithms, the first run of each one being a warm-up
+    std::vector<double> best(name.size(), std::numeric_limits<double>::max());
+    for (uint32_t i = 0; i < name.size(); ++i) {
+      run(i);
+      for (uint32_t j = 0; j < kNumRun; ++j) {
+        Clock::time_point start = Clock::now();
+        run(i);
+        best[i] = std::min(best[i], std::chrono::duration<double>(
+                                      Clock::now() - start).count());
+      }
+    }
+    uint32_t res = 0;
+    for (uint32_t i = 1; i < name.size(); ++i) {
+      if (best[i] < best[res]) {
+        res = i;
+      }
+    }
+    Report(kInfo, "Tuned '%s': %s (%f ms)", key.c_str(), name[res].c_str(),
+           best[res] * 1000);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    choice_[key] = name[res];
+    Append(key, name[res]);
+    return res;
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // CORE_TUNER_H_
@@ -30,6 +30,8 @@
 #include <recurrent/recurrent.h>
 #include <core/layer_add.h>
 #include <core/layer_eltwise_mult.h>
+#include <core/layer_embedding.h>
+#include <core/layer_lstm_cell.h>
 #include <core/layer_mult.h>
 #include <core/layer_tanh.h>
 #include <core/layer_sigmoid.h>
@@ -67,12 +69,221 @@ class Lstm: public Recurrent<Dtype> {
   std::vector<std::shared_ptr<Mat<Dtype>>> wcx_;          // Cell write weights
   std::vector<std::shared_ptr<Mat<Dtype>>> wch_;          // Cell write weights
   std::vector<std::shared_ptr<Mat<Dtype>>> bc_;           // Cell write weights
+  std::vector<std::shared_ptr<Mat<Dtype>>> w_;            // Fused weights
+  std::vector<std::shared_ptr<Mat<Dtype>>> b_;            // Fused weights
   std::shared_ptr<Mat<Dtype>>              whd_;          // Decoder weights
   std::shared_ptr<Mat<Dtype>>              bd_;           // Decoder weights
-  std::shared_ptr<Mat<Dtype>>              wil_;          // Decoder weights
+  std::shared_ptr<Mat<Dtype>>              wil_;          // Embedding table
   std::vector<std::shared_ptr<Mat<Dtype>>> hidden_prev_;  // Previous hidden
   std::vector<std::shared_ptr<Mat<Dtype>>> cell_prev_;    // Previous cells
   std::vector<uint32_t>                    hidden_size_;  // Hidden state size
+  uint32_t                                 batch_size_;   // Batch size
+  bool                                     fused_;        // Fused cells?
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Create an input (one index per batch) for a step.
+   *
+   *  \return Input
+   */
+  virtual std::shared_ptr<Mat<Dtype>> NewInput() const {
+    return std::make_shared<Mat<Dtype>>(1, 1, 1, batch_size_, false);
+  }
+
+  /*!
+   * Add the layers of a cell (one layer per operation).
+   *
+   *  \param[in]  d          : depth
+   *  \param[in]  in_vector  : input vector
+   *  \param[in]  hidden_prev: previous hidden state
+   *  \param[in]  cell_prev  : previous cell state
+   *  \param[out] hidden     : new hidden state
+   *  \param[out] cell       : new cell state
+   */
+  void AddCell(size_t d, const std::shared_ptr<Mat<Dtype>>& in_vector,
+               const std::shared_ptr<Mat<Dtype>>& hidden_prev,
+               const std::shared_ptr<Mat<Dtype>>& cell_prev,
+               std::shared_ptr<Mat<Dtype>>* hidden,
+               std::shared_ptr<Mat<Dtype>>* cell) {
+    // Input gate
+    std::shared_ptr<Mat<Dtype>> hi0 = Parent::Add(
+      std::make_shared<LayerMult<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wix_[d],
+      in_vector}))[0];
+    std::shared_ptr<Mat<Dtype>> hi1 = Parent::Add(
+      std::make_shared<LayerMult<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wih_[d],
+      hidden_prev}))[0];
+    std::shared_ptr<Mat<Dtype>> hi = Parent::Add(
+      std::make_shared<LayerAdd<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{hi0, hi1}))[0];
+    std::shared_ptr<Mat<Dtype>> biasi = Parent::Add(
+      std::make_shared<LayerAdd<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{hi, bi_[d]}))[0];
+    std::shared_ptr<Mat<Dtype>> gate_in = Parent::Add(
+      std::make_shared<LayerSigmoid<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{biasi}))[0];
+
+    // Forget gate
+    std::shared_ptr<Mat<Dtype>> hf0 = Parent::Add(
+      std::make_shared<LayerMult<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wfx_[d],
+      in_vector}))[0];
+    std::shared_ptr<Mat<Dtype>> hf1 = Parent::Add(
+      std::make_shared<LayerMult<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wfh_[d],
+      hidden_prev}))[0];
+    std::shared_ptr<Mat<Dtype>> hf = Parent::Add(
+      std::make_shared<LayerAdd<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{hf0, hf1}))[0];
+    std::shared_ptr<Mat<Dtype>> biasf = Parent::Add(
+      std::make_shared<LayerAdd<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{hf, bf_[d]}))[0];
+    std::shared_ptr<Mat<Dtype>> gate_forget = Parent::Add(
+      std::make_shared<LayerSigmoid<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{biasf}))[0];
+
+    // Output gate
+    std::shared_ptr<Mat<Dtype>> ho0 = Parent::Add(
+      std::make_shared<LayerMult<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wox_[d],
+      in_vector}))[0];
+    std::shared_ptr<Mat<Dtype>> ho1 = Parent::Add(
+      std::make_shared<LayerMult<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{woh_[d],
+      hidden_prev}))[0];
+    std::shared_ptr<Mat<Dtype>> ho = Parent::Add(
+      std::make_shared<LayerAdd<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{ho0, ho1}))[0];
+    std::shared_ptr<Mat<Dtype>> biaso = Parent::Add(
+      std::make_shared<LayerAdd<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{ho, bo_[d]}))[0];
+    std::shared_ptr<Mat<Dtype>> gate_out = Parent::Add(
+      std::make_shared<LayerSigmoid<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{biaso}))[0];
+
+    // Write operation on cells
+    std::shared_ptr<Mat<Dtype>> hw0 = Parent::Add(
+      std::make_shared<LayerMult<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wcx_[d],
+      in_vector}))[0];
+    std::shared_ptr<Mat<Dtype>> hw1 = Parent::Add(
+      std::make_shared<LayerMult<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wch_[d],
+      hidden_prev}))[0];
+    std::shared_ptr<Mat<Dtype>> hw = Parent::Add(
+      std::make_shared<LayerAdd<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{hw0, hw1}))[0];
+    std::shared_ptr<Mat<Dtype>> biasw = Parent::Add(
+      std::make_shared<LayerAdd<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{hw, bc_[d]}))[0];
+    std::shared_ptr<Mat<Dtype>> cell_write = Parent::Add(
+      std::make_shared<LayerTanh<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{biasw}))[0];
+
+    // Compute the new cell activation
+    // Add what we want to keep from the cell
+    std::shared_ptr<Mat<Dtype>> cell_retain = Parent::Add(
+      std::make_shared<LayerEltwiseMult<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{gate_forget,
+      cell_prev}))[0];
+    // Add what we want to write to the cell
+    std::shared_ptr<Mat<Dtype>> write_cell = Parent::Add(
+      std::make_shared<LayerEltwiseMult<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{gate_in,
+      cell_write}))[0];
+    // Add the new cell content
+    std::shared_ptr<Mat<Dtype>> cell_curr = Parent::Add(
+      std::make_shared<LayerAdd<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{cell_retain,
+      write_cell}))[0];
+
+    // Compute the hidden state as a gated and saturated cell activations
+    std::shared_ptr<Mat<Dtype>> tanhc = Parent::Add(
+      std::make_shared<LayerTanh<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{cell_curr}))[0];
+    std::shared_ptr<Mat<Dtype>> hidden_curr = Parent::Add(
+      std::make_shared<LayerEltwiseMult<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{gate_out,
+      tanhc}))[0];
+
+    *hidden = hidden_curr;
+    *cell   = cell_curr;
+  }
+
+  /*!
+   * Add the cell layers of a step, from the previous step state.
+   *
+   *  \param[in]  in: step input
+   *
+   *  \return     Step output
+   */
+  virtual std::shared_ptr<Mat<Dtype>> AddStep(
+    const std::shared_ptr<Mat<Dtype>>& in) {
+    if (hidden_prev_.empty()) {
+      for (size_t d = 0; d < hidden_size_.size(); d++) {
+        hidden_prev_.push_back(std::make_shared<Mat<Dtype>>(
+          hidden_size_[d], 1, 1, batch_size_));
+      }
+    }
+    if (cell_prev_.empty()) {
+      for (size_t d = 0; d < hidden_size_.size(); d++) {
+        cell_prev_.push_back(std::make_shared<Mat<Dtype>>(hidden_size_[d],
+                                                          1, 1, batch_size_));
+      }
+    }
+
+    std::shared_ptr<Mat<Dtype>> x = Parent::Add(
+      std::make_shared<LayerEmbedding<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wil_, in}))[0];
+
+    std::vector<std::shared_ptr<Mat<Dtype>>> hidden;
+    std::vector<std::shared_ptr<Mat<Dtype>>> cell;
+    for (size_t d = 0; d < hidden_size_.size(); d++) {
+      std::shared_ptr<Mat<Dtype>> in_vector;
+      if (d == 0) {
+        in_vector = x;
+      } else {
+        in_vector = hidden[d - 1];
+      }
+
+      std::shared_ptr<Mat<Dtype>> hidden_prev = hidden_prev_[d];
+      std::shared_ptr<Mat<Dtype>> cell_prev   = cell_prev_[d];
+
+      std::shared_ptr<Mat<Dtype>> hidden_curr;
+      std::shared_ptr<Mat<Dtype>> cell_curr;
+      if (fused_) {
+        const std::vector<std::shared_ptr<Mat<Dtype>>>& out = Parent::Add(
+          std::make_shared<LayerLstmCell<Dtype>>("",
+          std::initializer_list<std::shared_ptr<Mat<Dtype>>>{in_vector,
+          hidden_prev, cell_prev, w_[d], b_[d]}));
+        hidden_curr = out[0];
+        cell_curr   = out[1];
+      } else {
+        AddCell(d, in_vector, hidden_prev, cell_prev, &hidden_curr,
+                &cell_curr);
+      }
+
+      cell.push_back(cell_curr);
+      hidden.push_back(hidden_curr);
+    }
+
+    // Decoder
+    std::shared_ptr<Mat<Dtype>> hd = Parent::Add(
+      std::make_shared<LayerMult<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{whd_,
+      hidden[hidden.size() - 1]}))[0];
+    std::shared_ptr<Mat<Dtype>> out = Parent::Add(
+      std::make_shared<LayerAdd<Dtype>>("",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{hd, bd_}))[0];
+
+    hidden_prev_ = hidden;
+    cell_prev_   = cell;
+
+    return out;
+  }
 
 
   // Public methods
@@ -86,12 +297,16 @@ class Lstm: public Recurrent<Dtype> {
    *  \param[in]  size_out   : output size
    *  \param[in]  range      : value range ([-range/2, range/2])
    *  \param[in]  batch_size : batch size
+   *  \param[in]  fused      : use a single fused layer per cell
+   *                           (see LayerLstmCell)?
    */
   Lstm(const char* name, uint32_t size_in,
        const std::vector<uint32_t>& hidden_size,
        uint32_t size_out, Dtype range,
-       uint32_t batch_size): Recurrent<Dtype>(name) {
+       uint32_t batch_size, bool fused = false): Recurrent<Dtype>(name) {
     hidden_size_ = hidden_size;
+    batch_size_  = batch_size;
+    fused_       = fused;
 
     Dtype hrange   = 0.5f * range;
     uint32_t hsize = 0;
@@ -104,37 +319,45 @@ class Lstm: public Recurrent<Dtype> {
       }
       hsize = hidden_size_[d];
 
+      if (fused_) {
+        // Add the 4 gates weights ([i, f, o, g]) as a single matrix
+        w_.push_back(Rand<Dtype>::GenMat(4 * hsize, size_prev + hsize, 1, 1,
+                                         -hrange, hrange));
+        b_.push_back(std::make_shared<Mat<Dtype>>(4 * hsize, 1, 1, 1));
+        continue;
+      }
+
       // Add the gates weights
-      wix_.push_back(Rand<Dtype>::GenMat(hsize, size_prev, 1, batch_size,
+      wix_.push_back(Rand<Dtype>::GenMat(hsize, size_prev, 1, 1,
                                          -hrange, hrange));
-      wih_.push_back(Rand<Dtype>::GenMat(hsize, hsize, 1, batch_size,
+      wih_.push_back(Rand<Dtype>::GenMat(hsize, hsize, 1, 1,
                                          -hrange, hrange));
-      bi_.push_back(std::make_shared<Mat<Dtype>>(hsize, 1, 1, batch_size));
-      wfx_.push_back(Rand<Dtype>::GenMat(hsize, size_prev, 1, batch_size,
+      bi_.push_back(std::make_shared<Mat<Dtype>>(hsize, 1, 1, 1));
+      wfx_.push_back(Rand<Dtype>::GenMat(hsize, size_prev, 1, 1,
                                          -hrange, hrange));
-      wfh_.push_back(Rand<Dtype>::GenMat(hsize, hsize, 1, batch_size,
+      wfh_.push_back(Rand<Dtype>::GenMat(hsize, hsize, 1, 1,
                                          -hrange, hrange));
-      bf_.push_back(std::make_shared<Mat<Dtype>>(hsize, 1, 1, batch_size));
-      wox_.push_back(Rand<Dtype>::GenMat(hsize, size_prev, 1, batch_size,
+      bf_.push_back(std::make_shared<Mat<Dtype>>(hsize, 1, 1, 1));
+      wox_.push_back(Rand<Dtype>::GenMat(hsize, size_prev, 1, 1,
                                          -hrange, hrange));
-      woh_.push_back(Rand<Dtype>::GenMat(hsize, hsize, 1, batch_size,
+      woh_.push_back(Rand<Dtype>::GenMat(hsize, hsize, 1, 1,
                                          -hrange, hrange));
-      bo_.push_back(std::make_shared<Mat<Dtype>>(hsize, 1, 1, batch_size));
+      bo_.push_back(std::make_shared<Mat<Dtype>>(hsize, 1, 1, 1));
 
       // Add the cell write weights
-      wcx_.push_back(Rand<Dtype>::GenMat(hsize, size_prev, 1, batch_size,
+      wcx_.push_back(Rand<Dtype>::GenMat(hsize, size_prev, 1, 1,
                                          -hrange, hrange));
-      wch_.push_back(Rand<Dtype>::GenMat(hsize, hsize, 1, batch_size,
+      wch_.push_back(Rand<Dtype>::GenMat(hsize, hsize, 1, 1,
                                          -hrange, hrange));
-      bc_.push_back(std::make_shared<Mat<Dtype>>(hsize, 1, 1, batch_size));
+      bc_.push_back(std::make_shared<Mat<Dtype>>(hsize, 1, 1, 1));
     }
 
     // Create the decoder weights
-    whd_ = Rand<Dtype>::GenMat(size_out, hsize, 1, batch_size,
+    whd_ = Rand<Dtype>::GenMat(size_out, hsize, 1, 1,
                                -hrange, hrange);
     bd_  = std::shared_ptr<Mat<Dtype>>(std::make_shared<Mat<Dtype>>(
-                                       size_out, 1, 1, batch_size));
-    wil_ = Rand<Dtype>::GenMat(size_in, size_out, 1, batch_size,
+                                       size_out, 1, 1, 1));
+    wil_ = Rand<Dtype>::GenMat(size_in, size_out, 1, 1,
                                -hrange, hrange);
   }
 
@@ -152,6 +375,11 @@ class Lstm: public Recurrent<Dtype> {
     weight->clear();
     weight->reserve(12 * hidden_size_.size() + 3);
     for (size_t i = 0; i < hidden_size_.size(); ++i) {
+      if (fused_) {
+        weight->push_back(w_[i]);
+        weight->push_back(b_[i]);
+        continue;
+      }
       weight->push_back(wix_[i]);
       weight->push_back(wih_[i]);
       weight->push_back(bi_[i]);
@@ -170,170 +398,6 @@ class Lstm: public Recurrent<Dtype> {
     weight->push_back(wil_);
   }
 
-  /*!
-   * Create at a specific index.
-   *
-   *  \param[in]  index: data index
-   */
-  virtual void Create(uint32_t index) {
-    // Clear all the layers
-    Parent::Clear();
-
-    uint32_t batch_size = wil_->size[3];
-
-    if (hidden_prev_.empty()) {
-      for (size_t d = 0; d < hidden_size_.size(); d++) {
-        hidden_prev_.push_back(std::make_shared<Mat<Dtype>>(
-          hidden_size_[d], 1, 1, batch_size));
-      }
-    }
-    if (cell_prev_.empty()) {
-      for (size_t d = 0; d < hidden_size_.size(); d++) {
-        cell_prev_.push_back(std::make_shared<Mat<Dtype>>(hidden_size_[d],
-                                                          1, 1, batch_size));
-      }
-    }
-
-    Parent::in_ = std::make_shared<Mat<Dtype>>(wil_->size[1],
-                                               1, 1, batch_size);
-    Parent::in_->Data()[index] = Dtype(1);
-
-    std::shared_ptr<Mat<Dtype>> x = Parent::Add(
-      std::make_shared<LayerMult<Dtype>>("",
-      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wil_,
-      Parent::in_}))[0];
-
-    std::vector<std::shared_ptr<Mat<Dtype>>> hidden;
-    std::vector<std::shared_ptr<Mat<Dtype>>> cell;
-    for (size_t d = 0; d < hidden_size_.size(); d++) {
-      std::shared_ptr<Mat<Dtype>> in_vector;
-      if (d == 0) {
-        in_vector = x;
-      } else {
-        in_vector = hidden[d - 1];
-      }
-
-      std::shared_ptr<Mat<Dtype>> hidden_prev = hidden_prev_[d];
-      std::shared_ptr<Mat<Dtype>> cell_prev   = cell_prev_[d];
-
-      // Input gate
-      std::shared_ptr<Mat<Dtype>> hi0 = Parent::Add(
-        std::make_shared<LayerMult<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wix_[d],
-        in_vector}))[0];
-      std::shared_ptr<Mat<Dtype>> hi1 = Parent::Add(
-        std::make_shared<LayerMult<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wih_[d],
-        hidden_prev}))[0];
-      std::shared_ptr<Mat<Dtype>> hi = Parent::Add(
-        std::make_shared<LayerAdd<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{hi0, hi1}))[0];
-      std::shared_ptr<Mat<Dtype>> biasi = Parent::Add(
-        std::make_shared<LayerAdd<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{hi, bi_[d]}))[0];
-      std::shared_ptr<Mat<Dtype>> gate_in = Parent::Add(
-        std::make_shared<LayerSigmoid<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{biasi}))[0];
-
-      // Forget gate
-      std::shared_ptr<Mat<Dtype>> hf0 = Parent::Add(
-        std::make_shared<LayerMult<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wfx_[d],
-        in_vector}))[0];
-      std::shared_ptr<Mat<Dtype>> hf1 = Parent::Add(
-        std::make_shared<LayerMult<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wfh_[d],
-        hidden_prev}))[0];
-      std::shared_ptr<Mat<Dtype>> hf = Parent::Add(
-        std::make_shared<LayerAdd<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{hf0, hf1}))[0];
-      std::shared_ptr<Mat<Dtype>> biasf = Parent::Add(
-        std::make_shared<LayerAdd<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{hf, bf_[d]}))[0];
-      std::shared_ptr<Mat<Dtype>> gate_forget = Parent::Add(
-        std::make_shared<LayerSigmoid<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{biasf}))[0];
-
-      // Output gate
-      std::shared_ptr<Mat<Dtype>> ho0 = Parent::Add(
-        std::make_shared<LayerMult<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wox_[d],
-        in_vector}))[0];
-      std::shared_ptr<Mat<Dtype>> ho1 = Parent::Add(
-        std::make_shared<LayerMult<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{woh_[d],
-        hidden_prev}))[0];
-      std::shared_ptr<Mat<Dtype>> ho = Parent::Add(
-        std::make_shared<LayerAdd<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{ho0, ho1}))[0];
-      std::shared_ptr<Mat<Dtype>> biaso = Parent::Add(
-        std::make_shared<LayerAdd<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{ho, bo_[d]}))[0];
-      std::shared_ptr<Mat<Dtype>> gate_out = Parent::Add(
-        std::make_shared<LayerSigmoid<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{biaso}))[0];
-
-      // Write operation on cells
-      std::shared_ptr<Mat<Dtype>> hw0 = Parent::Add(
-        std::make_shared<LayerMult<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wcx_[d],
-        in_vector}))[0];
-      std::shared_ptr<Mat<Dtype>> hw1 = Parent::Add(
-        std::make_shared<LayerMult<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{wch_[d],
-        hidden_prev}))[0];
-      std::shared_ptr<Mat<Dtype>> hw = Parent::Add(
-        std::make_shared<LayerAdd<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{hw0, hw1}))[0];
-      std::shared_ptr<Mat<Dtype>> biasw = Parent::Add(
-        std::make_shared<LayerAdd<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{hw, bc_[d]}))[0];
-      std::shared_ptr<Mat<Dtype>> cell_write = Parent::Add(
-        std::make_shared<LayerTanh<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{biasw}))[0];
-
-      // Compute the new cell activation
-      // Add what we want to keep from the cell
-      std::shared_ptr<Mat<Dtype>> cell_retain = Parent::Add(
-        std::make_shared<LayerEltwiseMult<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{gate_forget,
-        cell_prev}))[0];
-      // Add what we want to write to the cell
-      std::shared_ptr<Mat<Dtype>> write_cell = Parent::Add(
-        std::make_shared<LayerEltwiseMult<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{gate_in,
-        cell_write}))[0];
-      // Add the new cell content
-      std::shared_ptr<Mat<Dtype>> cell_curr = Parent::Add(
-        std::make_shared<LayerAdd<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{cell_retain,
-        write_cell}))[0];
-
-      // Compute the hidden state as a gated and saturated cell activations
-      std::shared_ptr<Mat<Dtype>> tanhc = Parent::Add(
-        std::make_shared<LayerTanh<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{cell_curr}))[0];
-      std::shared_ptr<Mat<Dtype>> hidden_curr = Parent::Add(
-        std::make_shared<LayerEltwiseMult<Dtype>>("",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{gate_out,
-        tanhc}))[0];
-
-      cell.push_back(cell_curr);
-      hidden.push_back(hidden_curr);
-    }
-
-    // Decoder
-    std::shared_ptr<Mat<Dtype>> hd = Parent::Add(
-      std::make_shared<LayerMult<Dtype>>("",
-      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{whd_,
-      hidden[hidden.size() - 1]}))[0];
-    Parent::out_ = Parent::Add(std::make_shared<LayerAdd<Dtype>>("",
-      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{hd, bd_}))[0];
-
-    hidden_prev_ = hidden;
-    cell_prev_   = cell;
-  }
-
   /*!
    * Clear the previous iteration state.
    */
@@ -28,6 +28,10 @@
 
 
 #include <core/model.h>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
 
 
 namespace jik {
@@ -36,6 +40,25 @@ namespace jik {
 /*!
  *  \class  Recurrent
  *  \brief  Recurrent model
+ *
+ * A recurrent model is a cell graph repeated at each step of a sequence,
+ * the state computed by a step being used by the next one.
+ *
+ * The graph can be built one step at a time (see Rebuild), the state being
+ * kept from the previous graph and the backpropagation being truncated to the
+ * current step.
+ *
+ * It can also be unrolled once for a maximum number of steps (see Unroll):
+ * all the steps activations are preallocated, the inputs are set in place
+ * and the forward/backward passes run over the first steps of the tape
+ * (backpropagation through time), without any allocation.
+ *
+ * The weights are stored once and shared by all the batches: the batches
+ * are independent sequences running in lockstep.
+ *
+ * An unrolled graph can be checkpointed by groups of steps (see Checkpoint):
+ * only the activations passed from a group to the next one are kept, the
+ * steps of a group being run again during the backward pass.
  */
 template <typename Dtype>
 class Recurrent: public Model<Dtype> {
@@ -45,6 +68,47 @@ class Recurrent: public Model<Dtype> {
   typedef Model<Dtype> Parent;
 
 
+  // Protected attributes
+ protected:
+  std::vector<std::shared_ptr<Mat<Dtype>>> step_in_;     // Steps input
+  std::vector<std::shared_ptr<Mat<Dtype>>> step_out_;    // Steps output
+  std::vector<size_t>                      step_layer_;  // Steps first layer
+  uint32_t                                 step_run_;    // Steps run
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Create an input (one index per batch) for a step.
+   *
+   *  \return Input
+   */
+  virtual std::shared_ptr<Mat<Dtype>> NewInput() const = 0;
+
+  /*!
+   * Add the cell layers of a step, from the previous step state.
+   *
+   *  \param[in]  in: step input
+   *
+   *  \return     Step output
+   */
+  virtual std::shared_ptr<Mat<Dtype>> AddStep(
+    const std::shared_ptr<Mat<Dtype>>& in) = 0;
+
+  /*!
+   * Add the layers on top of a step output (e.g. a loss).
+   *
+   *  \param[in]  step: step index
+   *  \param[in]  out : step output
+   *
+   *  \return     Output
+   */
+  virtual std::shared_ptr<Mat<Dtype>> AddHead(
+    uint32_t step, const std::shared_ptr<Mat<Dtype>>& out) {
+    return out;
+  }
+
+
   // Public methods
  public:
   /*!
@@ -52,7 +116,9 @@ class Recurrent: public Model<Dtype> {
    *
    *  \param[in]  name: model name
    */
-  explicit Recurrent(const char* name): Model<Dtype>(name) {}
+  explicit Recurrent(const char* name): Model<Dtype>(name) {
+    step_run_ = 0;
+  }
 
   /*!
    * Destructor.
@@ -64,7 +130,179 @@ class Recurrent: public Model<Dtype> {
    *
    *  \param[in]  index: data index
    */
-  virtual void Create(uint32_t index) {}
+  virtual void Create(uint32_t index) {
+    // Clear all the layers
+    Parent::Clear();
+    step_in_.clear();
+    step_out_.clear();
+    step_layer_.clear();
+
+    Parent::in_ = NewInput();
+    Parent::in_->Data()[0] = Dtype(index);
+    Parent::out_ = AddHead(0, AddStep(Parent::in_));
+  }
+
+  /*!
+   * Rebuild the graph at a specific index.
+   * The previous graph memory is recycled once not used anymore.
+   *
+   *  \param[in]  index: data index
+   */
+  void Rebuild(uint32_t index) {
+    // Clear all the layers before recycling their memory
+    Parent::Clear();
+    Parent::Memory()->Reset();
+    Arena::Scope scope(Parent::Memory());
+    Create(index);
+  }
+
+  /*!
+   * Unroll the graph for a maximum number of steps.
+   * The first step starts from a cleared state.
+   *
+   *  \param[in]  num_step: number of steps
+   */
+  void Unroll(uint32_t num_step) {
+    // Clear all the layers before recycling their memory
+    Parent::Clear();
+    Parent::Memory()->Reset();
+    Arena::Scope scope(Parent::Memory());
+
+    step_in_.clear();
+    step_out_.clear();
+    step_layer_.clear();
+    step_run_ = 0;
+    ClearPrevState();
+    for (uint32_t step = 0; step < num_step; ++step) {
+      step_layer_.push_back(Parent::layer_.size());
+      step_in_.push_back(NewInput());
+      step_out_.push_back(AddHead(step, AddStep(step_in_.back())));
+    }
+    step_layer_.push_back(Parent::layer_.size());
+
+    // The state now belongs to the tape
+    ClearPrevState();
+
+    if (num_step) {
+      Parent::in_  = step_in_.front();
+      Parent::out_ = step_out_.back();
+    }
+  }
+
+  /*!
+   * Get the number of unrolled steps.
+   *
+   *  \return Number of steps
+   */
+  uint32_t NumStep() const {
+    return uint32_t(step_in_.size());
+  }
+
+  /*!
+   * Set the input of an unrolled step for one batch.
+   *
+   *  \param[in]  step : step index
+   *  \param[in]  batch: batch index
+   *  \param[in]  index: data index
+   */
+  void SetInput(uint32_t step, uint32_t batch, uint32_t index) {
+    step_in_[step]->Data()[batch] = Dtype(index);
+  }
+
+  /*!
+   * Get the output of an unrolled step.
+   *
+   *  \param[in]  step: step index
+   *
+   *  \return     Step output
+   */
+  const std::shared_ptr<Mat<Dtype>>& StepOut(uint32_t step) const {
+    return step_out_[step];
+  }
+
+  /*!
+   * Forward pass over some unrolled steps.
+   * The steps before have to be done already.
+   *
+   *  \param[in]  state: state
+   *  \param[in]  begin: first step
+   *  \param[in]  end  : last step (excluded)
+   */
+  void ForwardSteps(const State& state, uint32_t begin, uint32_t end) {
+    for (size_t i = step_layer_[begin]; i < step_layer_[end]; ++i) {
+      Parent::ForwardLayer(i, state);
+    }
+    step_run_ = std::max(step_run_, end);
+  }
+
+  /*!
+   * Backward pass over some unrolled steps (backpropagation through time).
+   * The steps after have to be done already.
+   *
+   *  \param[in]  state: state
+   *  \param[in]  begin: first step
+   *  \param[in]  end  : last step (excluded)
+   */
+  void BackwardSteps(const State& state, uint32_t begin, uint32_t end) {
+    Parent::BackwardRange(state, step_layer_[begin], step_layer_[end]);
+  }
+
+  /*!
+   * Split the unrolled steps into checkpointed segments of about the same
+   * number of steps (see Model::Checkpoint): the hidden states at the
+   * boundaries of the segments are kept, the steps of a segment are run
+   * again before backpropagating through them.
+   *
+   *  \param[in]  num_segment: number of segments (0: square root of the
+   *                           number of steps)
+   *
+   *  \return     Number of segments (0: no checkpointing)
+   */
+  virtual uint32_t Checkpoint(uint32_t num_segment = 0) {
+    if (step_layer_.empty()) {
+      return Parent::Checkpoint(num_segment);
+    }
+    uint32_t num_step = NumStep();
+    if (!num_segment) {
+      num_segment = uint32_t(std::lround(std::sqrt(double(num_step))));
+    }
+    num_segment = std::min(num_segment, num_step);
+    std::vector<size_t> bound;
+    if (num_segment > 1) {
+      for (uint32_t s = 0; s <= num_segment; ++s) {
+        bound.push_back(step_layer_[num_step * s / num_segment]);
+      }
+    }
+    Parent::SetSegment(bound);
+    return uint32_t(Parent::inner_.size());
+  }
+
+  /*!
+   * Clear the derivatives.
+   * For an unrolled graph, only the steps run since the last clear are
+   * cleared, and the weights (shared by all the steps) only once.
+   */
+  virtual void ClearDeriv() {
+    if (step_layer_.empty()) {
+      Parent::ClearDeriv();
+      return;
+    }
+    for (size_t i = step_layer_[0]; i < step_layer_[step_run_]; ++i) {
+      const std::shared_ptr<Layer<Dtype>>& layer = Parent::layer_[i];
+      if (i < step_layer_[1]) {
+        // The first step clears the weights and the initial state
+        layer->ClearDeriv();
+        continue;
+      }
+      for (const std::shared_ptr<Mat<Dtype>>& out : layer->Output()) {
+        out->ZeroDeriv();
+      }
+    }
+    for (uint32_t step = 0; step < step_run_; ++step) {
+      step_in_[step]->ZeroDeriv();
+    }
+    step_run_ = 0;
+  }
 
   /*!
    * Clear the previous iteration state.
@@ -23,752 +23,18 @@
  */
 
 
-#include <sys/stat.h>
 #include <core/arg_parse.h>
-#include <core/log.h>
-#include <core/dataset.h>
-#include <core/layer_data.h>
-#include <core/layer_batch_norm.h>
-#include <core/layer_scale.h>
-#include <core/layer_conv.h>
-#include <core/layer_relu.h>
-#include <core/layer_pool_max.h>
-#include <core/layer_inner_product.h>
-#include <core/layer_softmax_loss.h>
+#include <core/device.h>
+#include <core/evaluator.h>
+#include <core/thread_pool.h>
+#include <core/memory_stats.h>
+#include <core/profiler.h>
+#include <core/rand.h>
+#include <core/tuner.h>
 #include <core/solver_sgd.h>
 #include <core/solver_rmsprop.h>
-
-
-namespace jik {
-
-
-/*!
- *  \class  Cifar10Dataset
- *  \brief  Cifar10 dataset
- */
-template <typename Dtype>
-class Cifar10Dataset: public Dataset {
-  // Public types
- public:
-  typedef Dtype   Type;
-  typedef Dataset Parent;
-
-
-  // Public structures
- public:
-  /*!
-   *  \struct Image
-   *  \brief  Cifar10 image = image bytes + label (10 classes)
-   */
-  struct Image {
-    std::vector<Dtype> image;   // Image
-    uint8_t            label;   // Label
-  };
-
-
-  // Protected attributes
- protected:
-  bool               gray_;     // Grayscale the input?
-  std::vector<Image> train_;    // Training set
-  std::vector<Image> test_;     // Testing set
-
-
-  // Protected methods
- protected:
-  /*!
-   * Get the cifar10 image width.
-   *
-   *  \return Cifar10 image width
-   */
-  static uint32_t Cifar10ImageWidth() {
-    return 32;
-  }
-
-  /*!
-   * Get the cifar10 image height.
-   *
-   *  \return Cifar10 image height
-   */
-  static uint32_t Cifar10ImageHeight() {
-    return 32;
-  }
-
-  /*!
-   * Get the cifar10 image channel.
-   *
-   *  \return Cifar10 image channel
-   */
-  static uint32_t Cifar10ImageChannel() {
-    return 3;
-  }
-
-  /*!
-   * Read a cifar10 dataset.
-   * Check here for the dataset format:
-   * http://www.cs.toronto.edu/~kriz/cifar.html
-   *
-   *  \param[in]  dataset_file: file containing the dataset
-   *
-   *  \param[out] dataset     : cifar10 dataset
-   *  \return     Error?
-   */
-  bool ReadDataset(const char* dataset_file,
-                   std::vector<Image>* dataset) {
-    // Open the images file
-    std::FILE* fp = std::fopen(dataset_file, "rb");
-    if (!fp) {
-      Report(kError, "Can't open file '%s'", dataset_file);
-      return false;
-    }
-
-    std::fseek(fp, 0, SEEK_END);
-    size_t file_size = std::ftell(fp);
-    std::fseek(fp, 0, SEEK_SET);
-
-    // Size of a cifar image
-    uint32_t cifar10_image_size = Cifar10ImageWidth()  *
-                                  Cifar10ImageHeight() *
-                                  Cifar10ImageChannel();
-
-    // Size of an image
-    size_t image_size = ImageWidth() * ImageHeight() * ImageChannel();
-
-    // Size of a label
-    size_t label_size = 1;
-
-    // Number of images
-    size_t image_count =
-      file_size / ((label_size + cifar10_image_size) * sizeof(uint8_t));
-
-    // Number of channels (diff)
-    size_t num_channel_diff = cifar10_image_size / image_size;
-
-    // Add the images to the dataset
-    size_t index = dataset->size();
-    dataset->resize(index + image_count);
-
-    // Read all the images
-    std::vector<uint8_t> buffer(cifar10_image_size);
-    for (size_t i = 0; i < image_count; ++i) {
-      Image& img = (*dataset)[index + i];
-      uint32_t size_to_read = label_size * sizeof(uint8_t);
-      if (std::fread(&img.label, 1, size_to_read, fp) != size_to_read) {
-        Report(kError, "Can't read images in '%s'", dataset_file);
-        std::fclose(fp);
-        return false;
-      }
-      // Check the label is between [0, 9]
-      if (img.label > 9) {
-        Report(kError, "Invalid label %d in file '%s'",
-               img.label, dataset_file);
-        std::fclose(fp);
-        return false;
-      }
-      size_to_read = cifar10_image_size * sizeof(uint8_t);
-      if (std::fread(&buffer[0], 1, size_to_read, fp) != size_to_read) {
-        Report(kError, "Can't read images in '%s'", dataset_file);
-        std::fclose(fp);
-        return false;
-      }
-      img.image.resize(image_size);
-      uint32_t buffer_index = 0;
-      for (size_t j = 0; j < image_size; ++j) {
-        if (num_channel_diff == 1) {
-          img.image[j] = Dtype(buffer[buffer_index++]);
-        } else if (num_channel_diff == 3) {
-          // Convert RGB to grayscale (luminosity)
-          img.image[j] = Dtype(0.2126 * buffer[buffer_index + 0]) +
-                         Dtype(0.7152 * buffer[buffer_index + 1]) +
-                         Dtype(0.0722 * buffer[buffer_index + 2]);
-          buffer_index += 3;
-        } else {
-          Report(kError, "Unknown image depth in '%s'", dataset_file);
-          std::fclose(fp);
-          return false;
-        }
-        img.image[j] /= 0xFF;
-      }
-    }
-
-    std::fclose(fp);
-    return true;
-  }
-
-
-  // Public methods
- public:
-  /*!
-   * Constructor.
-   *
-   *  \param[in]  gray: grayscale the input?
-   */
-  explicit Cifar10Dataset(bool gray) {
-    gray_ = gray;
-  }
-
-  /*!
-   * Destructor.
-   */
-  virtual ~Cifar10Dataset() {}
-
-  /*!
-   * Get the image width.
-   *
-   *  \return Image width
-   */
-  static uint32_t ImageWidth() {
-    return Cifar10ImageWidth();
-  }
-
-  /*!
-   * Get the image height.
-   *
-   *  \return Image height
-   */
-  static uint32_t ImageHeight() {
-    return Cifar10ImageHeight();
-  }
-
-  /*!
-   * Get the image channel.
-   *
-   *  \return Image channel
-   */
-  uint32_t ImageChannel() const {
-    if (gray_) {
-      return 1;
-    }
-    return Cifar10ImageChannel();
-  }
-
-  /*!
-   * Get the number of classes.
-   *
-   *  \return Number of classes
-   */
-  static uint32_t NumClass() {
-    return 10;
-  }
-
-  /*!
-   * Load a cifar10 dataset.
-   *
-   *  \param[in]  dataset_path: path to the dataset
-   *  \param[in]  prefix      : dataset prefix
-   *
-   *  \param[out] dataset     : cifar10 dataset
-   *  \return     Error?
-   */
-  bool LoadDataset(const char* dataset_path, const char* prefix,
-                   std::vector<Image>* dataset) {
-    bool res;
-    std::string dataset_file = std::string(dataset_path) + "/" +
-                               std::string(prefix) + "_batch.bin";
-    struct stat buffer;
-    if (stat(dataset_file.c_str(), &buffer)) {
-      res          = true;
-      size_t index = 1;
-      while (true) {
-        dataset_file = std::string(dataset_path) + "/" + std::string(prefix) +
-                       "_batch_" + std::to_string(index) + ".bin";
-        if (stat(dataset_file.c_str(), &buffer)) {
-          break;
-        }
-        res = ReadDataset(dataset_file.c_str(), dataset) && res;
-        ++index;
-      }
-    } else {
-      res = ReadDataset(dataset_file.c_str(), dataset);
-    }
-    return res;
-  }
-
-  /*!
-   * Load the dataset.
-   *
-   *  \param[in]  dataset_path: path to the dataset root directory
-   *
-   *  \return     Error?
-   */
-  virtual bool Load(const char* dataset_path) {
-    // Clear datasets
-    train_.clear();
-    test_.clear();
-
-    const char* path = std::strtok(const_cast<char*>(dataset_path), ":");
-    while (path) {
-      Report(kInfo, "Loading dataset from '%s'", path);
-      std::string spath = std::string(path);
-
-      // Training set
-      if (!LoadDataset(spath.c_str(), "data", &train_) ||
-          !LoadDataset(spath.c_str(), "test", &test_)) {
-        return false;
-      }
-
-      // Go to next path
-      path = std::strtok(nullptr, ":");
-    }
-
-    // Randomly shuffle the dataset to have uniform mini-batches with a good
-    // estimation of the gradient: we want each mini-batch gradient to be very
-    // close to the batch (dataset) gradient
-    std::random_device rd;
-    std::default_random_engine re(rd());
-    std::shuffle(train_.begin(), train_.end(), re);
-    std::shuffle(test_.begin() , test_.end() , re);
-
-    return true;
-  }
-
-  /*!
-   * Get the training set.
-   *
-   *  \return Training set
-   */
-  const std::vector<Image>& Train() const {
-    return train_;
-  }
-
-  /*!
-   * Get the testing set.
-   *
-   *  \return Testing set
-   */
-  const std::vector<Image>& Test() const {
-    return test_;
-  }
-};
-
-
-/*!
- *  \class  Cifar10DataLayer
- *  \brief  Cifar10 data layer
- */
-template <typename Dtype>
-class Cifar10DataLayer: public LayerData<Dtype> {
-  // Public types
- public:
-  typedef Dtype             Type;
-  typedef LayerData<Dtype>  Parent;
-
-
-  // Protected attributes
- protected:
-  Cifar10Dataset<Dtype> dataset_;               // Cifar10 dataset
-  uint32_t              dataset_train_index_;   // Dataset index (training)
-  uint32_t              dataset_test_index_;    // Dataset index (testing)
-
-
-  // Public methods
- public:
-  /*!
-   * Constructor.
-   *
-   *  \param[in]  name : layer name
-   *  \param[in]  param: parameters
-   *  \param[in]  gray : grayscale the input?
-   */
-  Cifar10DataLayer(const char* name, const Param& param, bool gray):
-    LayerData<Dtype>(name), dataset_(gray) {
-    // Parameters
-    std::string dataset_path;
-    uint32_t batch_size;
-    param.Get("dataset_path", &dataset_path);
-    param.Get("batch_size"  , &batch_size);
-
-    if (!dataset_.Load(dataset_path.c_str())) {
-      return;
-    }
-
-    Report(kInfo, "Training set: %ld image(s)", dataset_.Train().size());
-    Report(kInfo, "Testing  set: %ld image(s)", dataset_.Test().size());
-
-    // Set index at the beginning of the dataset
-    dataset_train_index_ = dataset_test_index_ = 0;
-
-    // Create 2 outputs: images and labels
-    // There's no derivative for the labels as we don't backpropagate them
-    Parent::out_.resize(2);
-    Parent::out_[0] = std::make_shared<Mat<Dtype>>(dataset_.ImageWidth(),
-                                           dataset_.ImageHeight(),
-                                           dataset_.ImageChannel(),
-                                           batch_size);
-    Parent::out_[1] = std::make_shared<Mat<Dtype>>(1, 1, 1, batch_size, false);
-  }
-
-  /*!
-   * Destructor.
-   */
-  virtual ~Cifar10DataLayer() {}
-
-  /*!
-   * Get the test index.
-   *
-   *  \return Test index
-   */
-  uint32_t TestIndex() const {
-    return dataset_test_index_;
-  }
-
-  /*!
-   * Check if testing is done
-   * (i.e. if we are at the end of the testing dataset).
-   *
-   *  \return Testing done?
-   */
-  bool TestingDone() {
-    uint32_t dataset_test_size = uint32_t(dataset_.Test().size());
-    if (!dataset_test_size) {
-      // No dataset: we are done
-      return true;
-    }
-
-    // We are done if we are at the end of the testing dataset
-    bool testing_done = dataset_test_index_ >= dataset_test_size;
-
-    if (testing_done) {
-      // If we are done, we rewind
-      dataset_test_index_ = 0;
-    }
-
-    return testing_done;
-  }
-
-  /*!
-   * Forward pass.
-   *
-   *  \param[in]  state: state
-   */
-  virtual void Forward(const State& state) {
-    // Get the proper dataset (either training or testing one)
-    const std::vector<typename Cifar10Dataset<Dtype>::Image>* dataset;
-    uint32_t* dataset_index;
-    if (state.phase == State::PHASE_TRAIN) {
-      dataset       = &dataset_.Train();
-      dataset_index = &dataset_train_index_;
-    } else {
-      dataset       = &dataset_.Test();
-      dataset_index = &dataset_test_index_;
-    }
-
-    if (dataset->empty()) {
-      Report(kError, "Empty dataset");
-      Parent::out_[0]->Zero();
-      Parent::out_[1]->Zero();
-      return;
-    }
-
-    if (*dataset_index >= uint32_t(dataset->size())) {
-      Report(kError, "Invalid dataset index");
-      Parent::out_[0]->Zero();
-      Parent::out_[1]->Zero();
-      return;
-    }
-
-    Dtype* image_data = Parent::out_[0]->Data();
-    Dtype* label_data = Parent::out_[1]->Data();
-
-    uint32_t image_size = Parent::out_[0]->size[0] * Parent::out_[0]->size[1] *
-                          Parent::out_[0]->size[2];
-    uint32_t batch_size = Parent::out_[0]->size[3];
-
-    bool testing_done = false;
-
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      // Current image
-      const typename Cifar10Dataset<Dtype>::Image& image =
-        (*dataset)[*dataset_index];
-
-      // Copy the pixels
-      std::memcpy(image_data + batch * image_size,
-                  &image.image[0], image_size * sizeof(Dtype));
-
-      // Copy the labels
-      label_data[batch] = image.label;
-
-      // Go to the next image
-      if (++*dataset_index >= uint32_t(dataset->size())) {
-        if (state.phase == State::PHASE_TRAIN) {
-          // Rewind
-          *dataset_index = 0;
-        } else {
-          // Clamp
-          *dataset_index = uint32_t(dataset->size()) - 1;
-          testing_done   = true;
-        }
-      }
-    }
-
-    if (testing_done) {
-      // Mark the testing dataset as done
-      *dataset_index = uint32_t(dataset->size());
-    }
-  }
-};
-
-
-/*!
- *  \class  Cifar10Model
- *  \brief  Cifar10 model
- */
-template <typename Dtype>
-class Cifar10Model: public Model<Dtype> {
-  // Public types
- public:
-  typedef Dtype         Type;
-  typedef Model<Dtype>  Parent;
-
-
-  // Protected attributes
- protected:
-  std::shared_ptr<Mat<Dtype>> label_;   // Labels
-  std::shared_ptr<Mat<Dtype>>  prob_;   // Probabilities
-
-
-  // Public methods
- public:
-  /*!
-   * Constructor.
-   *
-   *  \param[in]  name        : model name
-   *  \param[in]  dataset_path: path to the dataset
-   *  \param[in]  num_output  : matrix size (number of classes)
-   *  \param[in]  batch_size  : matrix size (batch size)
-   *  \param[in]  gray : grayscale the input?
-   *  \param[in]  use_bn      : use batch norm?
-   */
-  Cifar10Model(const char* name, const char* dataset_path, uint32_t num_output,
-               uint32_t batch_size, bool gray, bool use_bn):
-
-  Model<Dtype>(name) {
-    // Network architecture:
-    //
-    // DATA1 (INPUT)
-    //   |
-    //   |
-    // CONV1
-    //   |
-    //   |
-    // POOL1
-    //   |
-    //   |
-    // RELU1
-    //   |
-    //   |
-    // (BN1)
-    //   |
-    //   |
-    // (SCALE1)
-    //   |
-    //   |
-    // CONV2
-    //   |
-    //   |
-    // RELU2
-    //   |
-    //   |
-    // POOL2
-    //   |
-    //   |
-    // (BN2)
-    //   |
-    //   |
-    // (SCALE2)
-    //   |
-    //   |
-    // CONV3
-    //   |
-    //   |
-    // RELU3
-    //   |
-    //   |
-    // POOL3
-    //   |
-    //   |
-    // IP1
-    //   |
-    //   |
-    // LOSS (OUTPUT)
-
-    // Input layer parameters
-    Param data_param;
-    data_param.Add("dataset_path", dataset_path);
-    data_param.Add("batch_size"  , batch_size);
-
-    // Input layer
-    std::vector<std::shared_ptr<Mat<Dtype>>> out = Parent::Add(
-      std::make_shared<Cifar10DataLayer<Dtype>>("data1", data_param, gray));
-
-    // Model input (images) and labels
-    Parent::in_ = out[0];
-    label_      = out[1];
-
-    // Output of previous layer
-    Parent::out_ = Parent::in_;
-
-    // Conv layer parameters
-    Param conv_param;
-    conv_param.Add("num_output"   , 32);
-    conv_param.Add("filter_width" , 3);
-    conv_param.Add("filter_height", 3);
-    conv_param.Add("padding_x"    , 1);
-    conv_param.Add("padding_y"    , 1);
-    conv_param.Add("stride_x"     , 1);
-    conv_param.Add("stride_y"     , 1);
-
-    // Pool layer parameters
-    Param pool_param;
-    pool_param.Add("filter_width" , 3);
-    pool_param.Add("filter_height", 3);
-    pool_param.Add("padding_x"    , 1);
-    pool_param.Add("padding_y"    , 1);
-    pool_param.Add("stride_x"     , 2);
-    pool_param.Add("stride_y"     , 2);
-
-    // Conv1, Pool1, Relu1
-    Parent::out_ = Parent::Add(std::make_shared<LayerConv<Dtype>>("conv1",
-      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-      conv_param))[0];
-    Parent::out_ = Parent::Add(std::make_shared<LayerPoolMax<Dtype>>("pool1",
-      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-      pool_param))[0];
-    Parent::out_ = Parent::Add(std::make_shared<LayerRelu<Dtype>>("relu1",
-      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_}))[0];
-
-    // BN layer parameters
-    Param bn_param;
-    bn_param.Add("moving_avg_frac", 0.99f);
-    if (use_bn) {
-      // BN1, Scale1 (whitening activations)
-      Parent::out_ = Parent::Add(std::make_shared<LayerBatchNorm<Dtype>>("bn1",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-        bn_param))[0];
-      Parent::out_ = Parent::Add(std::make_shared<LayerScale<Dtype>>("scale1",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-        Param()))[0];
-    }
-
-    // Conv2, Relu2, Pool2
-    Parent::out_ = Parent::Add(std::make_shared<LayerConv<Dtype>>("conv2",
-      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-      conv_param))[0];
-    Parent::out_ = Parent::Add(std::make_shared<LayerRelu<Dtype>>("relu2",
-      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_}))[0];
-    Parent::out_ = Parent::Add(std::make_shared<LayerPoolMax<Dtype>>("pool2",
-      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-      pool_param))[0];
-
-    if (use_bn) {
-      // BN2, Scale2 (whitening activations)
-      Parent::out_ = Parent::Add(std::make_shared<LayerBatchNorm<Dtype>>("bn2",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-        bn_param))[0];
-      Parent::out_ = Parent::Add(std::make_shared<LayerScale<Dtype>>("scale2",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-        Param()))[0];
-    }
-
-    // Increase the depth for the next conv layer
-    conv_param.Add("num_output", 64);
-
-    // Conv3, Relu3, Pool3
-    Parent::out_ = Parent::Add(std::make_shared<LayerConv<Dtype>>("conv3",
-      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-      conv_param))[0];
-    Parent::out_ = Parent::Add(std::make_shared<LayerRelu<Dtype>>("relu3",
-      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_}))[0];
-    Parent::out_ = Parent::Add(std::make_shared<LayerPoolMax<Dtype>>("pool3",
-      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-      pool_param))[0];
-
-    // IP layer parameters
-    Param ip_param;
-    ip_param.Add("num_output", num_output);
-
-    // IP1
-    Parent::out_ = Parent::Add(std::make_shared<LayerInnerProduct<Dtype>>(
-      "ip1", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-      ip_param))[0];
-
-    // Loss (softmax)
-    const std::vector<std::shared_ptr<Mat<Dtype>>>& softmax_out =
-    Parent::Add(std::make_shared<LayerSoftMaxLoss<Dtype>>("loss",
-      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_,
-      label_}));
-    Parent::out_ = softmax_out[0];
-    prob_        = softmax_out[1];
-  }
-
-  /*!
-   * Destructor.
-   */
-  virtual ~Cifar10Model() {}
-
-  /*!
-   * Graph testing (inference).
-   *
-   *  \return     Accuracy
-   */
-  virtual Dtype Test() {
-    // Create the state
-    State state(State::PHASE_TEST);
-
-    // Number of classes (outputs)
-    uint32_t num_output = prob_->size[2];
-
-    // Get the data layer to keep track of the testing index
-    std::shared_ptr<Cifar10DataLayer<Dtype>> cifar10_data =
-      std::dynamic_pointer_cast<Cifar10DataLayer<Dtype>>(Parent::DataLayer());
-    if (!cifar10_data) {
-      Report(kError, "No data layer found in model '%s'", Parent::Name());
-      return Dtype(0);
-    }
-
-    uint32_t step = 0;
-    Dtype acc     = Dtype(0);
-    while (!cifar10_data->TestingDone()) {
-      // Current test index
-      uint32_t index = cifar10_data->TestIndex();
-
-      // Inference
-      Parent::Forward(state);
-
-      // Actual batch size = where we are - where we were
-      uint32_t actual_batch_size = cifar10_data->TestIndex() - index;
-
-      // Prediction
-      uint32_t pred = 0;
-      for (uint32_t batch = 0; batch < actual_batch_size; ++batch) {
-        // Outputs
-        const Dtype* data = prob_->Data() + batch * num_output;
-
-        // Network prediction
-        uint32_t predicted_number = 0;
-        for (uint32_t number = 0; number < num_output; ++number) {
-          if (data[predicted_number] < data[number]) {
-            predicted_number = number;
-          }
-        }
-
-        // Check if the prediction is correct
-        if (uint32_t(label_->Data()[batch]) == predicted_number) {
-          ++pred;
-        }
-      }
-
-      // Go to next step and accumulate the accuracy
-      ++step;
-      acc += Dtype(pred) / actual_batch_size;
-    }
-
-    // Overall accuracy
-    return acc / step;
-  }
-};
-
-
-}  // namespace jik
+#include <core/solver_adam.h>
+#include <sandbox/cifar10/cifar10.h>
 
 
 int main(int argc, char* argv[]) {
@@ -786,9 +52,27 @@ int main(int argc, char* argv[]) {
   bool        train        = arg.ArgExists("-train");
   bool        gray         = arg.ArgExists("-gray");
   bool        use_bn       = arg.ArgExists("-bn");
+  bool        quantize     = arg.ArgExists("-quantize");
+  bool        profile      = arg.ArgExists("-profile");
+  const char* trace_path   = arg.Arg("-trace");
+  const char* log_path     = arg.Arg("-log");
+  const char* layout_name  = arg.Arg("-layout");
+  const char* hosts        = arg.Arg("-hosts");
+  const char* resume_path  = arg.Arg("-resume");
+  const char* tune_path    = arg.Arg("-tune");
+  const char* device_name  = arg.Arg("-device");
+  bool        save_state   = arg.ArgExists("-savestate");
+  bool        memory       = arg.ArgExists("-memory");
+  bool        no_alloc     = arg.ArgExists("-noalloc");
   uint32_t batch_size;
   Dtype learning_rate, decay_rate, momentum, reg, clip, lr_scale;
   uint32_t num_step, print_each, test_each, save_each, lr_scale_each;
+  uint32_t num_thread;
+  uint32_t num_prefetch;
+  uint32_t rank;
+  uint32_t num_segment;
+  uint32_t seed;
+  uint32_t num_test_worker;
   arg.Arg<uint32_t>("-batchsize"  , 128          , &batch_size);
   arg.Arg<Dtype>   ("-lr"         , Dtype(0.0005), &learning_rate);
   arg.Arg<Dtype>   ("-decayrate"  , Dtype(0.999) , &decay_rate);
@@ -801,10 +85,64 @@ int main(int argc, char* argv[]) {
   arg.Arg<uint32_t>("-saveeach"   , 1000         , &save_each);
   arg.Arg<uint32_t>("-lrscaleeach", 10000        , &lr_scale_each);
   arg.Arg<Dtype>   ("-lrscale"    , Dtype(0.1)   , &lr_scale);
-
-  if (!dataset_path || (!train && !model_path) || arg.ArgExists("-h")) {
+  arg.Arg<uint32_t>("-threads"    , 1            , &num_thread);
+  arg.Arg<uint32_t>("-prefetch"   , 2            , &num_prefetch);
+  arg.Arg<uint32_t>("-rank"       , 0            , &rank);
+  bool checkpoint =
+    arg.Arg<uint32_t>("-checkpoint" , 0            , &num_segment);
+  bool seeded =
+    arg.Arg<uint32_t>("-seed"       , 0            , &seed);
+  arg.Arg<uint32_t>("-testworkers", 1            , &num_test_worker);
+
+  if (!dataset_path || (!train && !model_path) || (resume_path && !train) ||
+      arg.ArgExists("-h")) {
     Report(kInfo, "Usage: %s -dataset <path/to/cifar10/dataset> [-train] "
-           "[-model <path/to/cifar10/model>] [-gray] [-bn]", argv[0]);
+           "[-model <path/to/cifar10/model>] [-gray] [-bn] [-quantize] "
+           "[-profile] [-trace <path/to/trace>] [-log <path/to/log>] "
+           "[-seed <n>] "
+           "[-hosts <host:port,host:port...> -rank <rank>] "
+           "[-checkpoint <segments>] [-layout <nchw/nhwc>] "
+           "[-testworkers <n>] [-savestate] [-resume <path/to/cifar10/model>] "
+           "[-tune <path/to/cache>] [-device <cpu/cuda>] "
+           "[-memory] [-noalloc]",
+           argv[0]);
+    return -1;
+  }
+
+  // Also write the messages to a file
+  if (log_path) {
+    Logger::Get().SetFile(log_path);
+  }
+
+  // Same initial weights and dropout masks from run to run (see Philox)
+  if (seeded) {
+    Philox::SetSeed(seed);
+  }
+
+  // Device running the large matrix multiplications (see Device)
+  if (device_name && !Device::Get().Set(device_name)) {
+    return -1;
+  }
+
+  // Fastest algorithm of the layers for each shape, the choices being kept
+  // for the next runs (see Tuner)
+  if (tune_path) {
+    Tuner::Get().Enable(tune_path);
+  }
+
+  // Resume a training: the weights and the solver state are in the same file
+  if (resume_path) {
+    model_path = resume_path;
+  }
+
+  // Memory layout of the activations
+  Layout::E_LAYOUT layout = Layout::NCHW;
+  if (layout_name && !Layout::Get(layout_name, &layout)) {
+    Report(kError, "Unknown layout '%s'", layout_name);
+    return -1;
+  }
+  if (layout != Layout::NCHW && quantize) {
+    Report(kError, "Post-training quantization needs the nchw layout");
     return -1;
   }
 
@@ -829,26 +167,131 @@ int main(int argc, char* argv[]) {
   Report(kInfo, "Save each               : %d", save_each);
   Report(kInfo, "Scale learning rate each: %d", lr_scale_each);
   Report(kInfo, "Learning rate scale     : %f", lr_scale);
+  Report(kInfo, "Number of threads       : %d", num_thread);
+  Report(kInfo, "Prefetched batches      : %d", num_prefetch);
+  Report(kInfo, "Testing workers         : %d", num_test_worker);
+
+  // The training set is sharded by the prefetching pipeline
+  if (hosts && train && !num_prefetch) {
+    Report(kWarning, "Data-parallel training prefetches the batches");
+    num_prefetch = 1;
+  }
+
+  // Split the work across the threads
+  ThreadPool::Get().SetNumThread(num_thread);
+
+  // Time the layers (the trace records each call)
+  if (profile || trace_path) {
+    Profiler::Get().Enable(trace_path != nullptr);
+  }
+
+  // Report the memory of the layers and the allocations per step
+  if (memory) {
+    MemoryStats::Get().Enable();
+  }
 
   // Create the model
   Cifar10Model<Dtype> model(model_name, dataset_path,
                             Cifar10Dataset<Dtype>::NumClass(),
-                            batch_size, gray, use_bn);
+                            batch_size, gray, use_bn, num_prefetch);
 
-  // Load the model if one is specified
+  // Load the model if one is specified (mapped in memory if only testing)
   if (model_path) {
-    size_t size = model.Load(model_path);
+    size_t size = model.Load(model_path, !train);
     Report(kInfo, "Loading model '%s' (%ld byte(s))", model_path, size);
   }
 
+  // A quantized model only has int8 filters
+  if (train && model.Quantized()) {
+    Report(kError, "Can't train quantized model '%s'", model_path);
+    return -1;
+  }
+
+  // Channels-last activations: the layers supporting them switch to it,
+  // with reorder layers at the boundaries
+  if (layout != Layout::NCHW) {
+    Report(kInfo, "Switching to %s (%d reorder layer(s))",
+           Layout::Name(layout), model.SetLayout(layout));
+  }
+
   // Testing the model only
   if (!train) {
+    // Fuse the layers for inference (the weights are constant)
+    uint32_t num_fused = model.Fuse();
+    Report(kInfo, "Fusing %d layer(s)", num_fused);
+
+    // Share the memory of the activations (inference only)
+    size_t mem = model.ActivationMemory();
+    Report(kInfo, "Planning activations: %ld byte(s) -> %ld byte(s)", mem,
+           model.Plan(State::PHASE_TEST));
+
+    // Post-training quantization: the testing pass calibrates the model
+    quantize = quantize && !model.Quantized();
+    if (quantize) {
+      model.SetQuantMode(Quantizer<Dtype>::MODE_CALIBRATE);
+    }
+
     Report(kInfo, "Testing model '%s'", model_name);
     Dtype acc = model.Test();
     Report(kInfo, "Accuracy: %f", acc);
+    if (memory) {
+      model.PrintMemory();
+    }
+
+    if (quantize) {
+      model.SetQuantMode(Quantizer<Dtype>::MODE_INT8);
+      Report(kInfo, "Testing quantized model '%s'", model_name);
+      acc = model.Test();
+      Report(kInfo, "Accuracy: %f", acc);
+
+      std::string quant_path = std::string(model_name) + "_int8.model";
+      size_t size = model.Save(quant_path.c_str());
+      Report(kInfo, "Saving quantized model '%s' (%ld byte(s))",
+             quant_path.c_str(), size);
+    }
+    Profiler::Get().Finish(trace_path);
     return 0;
   }
 
+  // Gradient checkpointing: only keep the activations between the segments
+  // (0: square root of the number of layers)
+  if (checkpoint) {
+    Report(kInfo, "Checkpointing %d segment(s)",
+           model.Checkpoint(num_segment));
+  }
+
+  // Run the elementwise layers in place
+  size_t mem = model.ActivationMemory();
+  Report(kInfo, "Planning activations: %ld byte(s) -> %ld byte(s)", mem,
+         model.Plan(State::PHASE_TRAIN));
+
+  // Data-parallel training: each rank trains on a shard of the training set
+  Ring ring;
+  std::unique_ptr<DataParallel<Dtype>> parallel;
+  if (hosts) {
+    if (!ring.Connect(hosts, rank)) {
+      return -1;
+    }
+    Report(kInfo, "Training as rank %d of %d", ring.Rank(), ring.NumRank());
+    model.DataLayer()->SetShard(ring.Rank(), ring.NumRank());
+    parallel.reset(new DataParallel<Dtype>(&ring));
+  }
+
+  // Test in the background on a snapshot of the weights, the testing set
+  // being split across the workers (0: test on the training thread)
+  Evaluator<Dtype> evaluator;
+  if (num_test_worker && test_each && (!hosts || !ring.Rank())) {
+    if (!evaluator.Start([&]() {
+          std::unique_ptr<Model<Dtype>> replica(new Cifar10Model<Dtype>(
+            model_name, dataset_path, Cifar10Dataset<Dtype>::NumClass(),
+            batch_size, gray, use_bn, 0));
+          replica->SetLayout(layout);
+          return replica;
+        }, num_test_worker)) {
+      return -1;
+    }
+  }
+
   Solver<Dtype>* solver;
   if (!std::strcmp(solver_type, "sgd")) {
     Report(kInfo, "Creating SGD solver");
@@ -860,12 +303,24 @@ int main(int argc, char* argv[]) {
     solver = new SolverRMSprop<Dtype>(print_each, test_each, save_each,
                                       lr_scale_each, lr_scale, decay_rate,
                                       reg, clip);
+  } else if (!std::strcmp(solver_type, "adam")) {
+    // The momentum and decay rate are the decay rates of the mean and
+    // variance of the derivatives
+    Report(kInfo, "Creating Adam solver");
+    solver = new SolverAdam<Dtype>(print_each, test_each, save_each,
+                                   lr_scale_each, lr_scale, momentum,
+                                   decay_rate, reg, clip);
   } else {
     Report(kError, "Unknown solver type '%s'", solver_type);
     return -1;
   }
 
   // Train the model
+  solver->SetParallel(parallel.get());
+  solver->SetEvaluator(evaluator.NumWorker() ? &evaluator : nullptr);
+  solver->SetSaveState(save_state);
+  solver->SetResume(resume_path);
+  solver->SetForbidAlloc(no_alloc);
   if (!solver->Train(&model, num_step, learning_rate)) {
     return -1;
   }
@@ -873,5 +328,6 @@ int main(int argc, char* argv[]) {
   // Clean
   delete solver;
 
+  Profiler::Get().Finish(trace_path);
   return 0;
 }
@@ -0,0 +1,785 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#ifndef SANDBOX_CIFAR10_CIFAR10_H_
+#define SANDBOX_CIFAR10_CIFAR10_H_
+
+
+#include <sys/stat.h>
+#include <core/log.h>
+#include <core/dataset.h>
+#include <core/record_set.h>
+#include <core/layer_data.h>
+#include <core/layer_batch_norm.h>
+#include <core/layer_scale.h>
+#include <core/layer_conv.h>
+#include <core/layer_relu.h>
+#include <core/layer_pool_max.h>
+#include <core/layer_inner_product.h>
+#include <core/layer_softmax_loss.h>
+#include <algorithm>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  Cifar10Dataset
+ *  \brief  Cifar10 dataset
+ */
+template <typename Dtype>
+class Cifar10Dataset: public Dataset {
+  // Public types
+ public:
+  typedef Dtype   Type;
+  typedef Dataset Parent;
+
+
+  // Protected attributes
+ protected:
+  bool              gray_;    // Grayscale the input?
+  RecordSet<Dtype>  train_;   // Training set
+  RecordSet<Dtype>  test_;    // Testing set
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Get the cifar10 image width.
+   *
+   *  \return Cifar10 image width
+   */
+  static uint32_t Cifar10ImageWidth() {
+    return 32;
+  }
+
+  /*!
+   * Get the cifar10 image height.
+   *
+   *  \return Cifar10 image height
+   */
+  static uint32_t Cifar10ImageHeight() {
+    return 32;
+  }
+
+  /*!
+   * Get the cifar10 image channel.
+   *
+   *  \return Cifar10 image channel
+   */
+  static uint32_t Cifar10ImageChannel() {
+    return 3;
+  }
+
+  /*!
+   * Read a cifar10 dataset (mapping the file in memory).
+   * Check here for the dataset format:
+   * http://www.cs.toronto.edu/~kriz/cifar.html
+   *
+   *  \param[in]  dataset_file: file containing the dataset
+   *
+   *  \param[out] dataset     : cifar10 dataset
+   *  \return     Error?
+   */
+  bool ReadDataset(const char* dataset_file, RecordSet<Dtype>* dataset) {
+    // Map the images file
+    size_t file_size;
+    std::shared_ptr<uint8_t> mem = RecordSet<Dtype>::Map(dataset_file,
+                                                         &file_size);
+    if (!mem) {
+      return false;
+    }
+
+    // Size of a cifar image
+    uint32_t cifar10_image_size = Cifar10ImageWidth()  *
+                                  Cifar10ImageHeight() *
+                                  Cifar10ImageChannel();
+
+    // Size of a label
+    size_t label_size = 1;
+
+    // Size of a record: label + image
+    size_t record_size = (label_size + cifar10_image_size) * sizeof(uint8_t);
+
+    // Number of images
+    uint32_t image_count = uint32_t(file_size / record_size);
+
+    // Check the labels are between [0, 9]
+    for (uint32_t i = 0; i < image_count; ++i) {
+      uint8_t label = mem.get()[i * record_size];
+      if (label > 9) {
+        Report(kError, "Invalid label %d in file '%s'", label, dataset_file);
+        return false;
+      }
+    }
+
+    // Add the images to the dataset
+    typename RecordSet<Dtype>::Shard shard;
+    shard.image_mem    = mem;
+    shard.label_mem    = mem;
+    shard.image        = mem.get() + label_size;
+    shard.label        = mem.get();
+    shard.image_stride = record_size;
+    shard.label_stride = record_size;
+    shard.count        = image_count;
+    return dataset->Add(shard, cifar10_image_size);
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  gray: grayscale the input?
+   */
+  explicit Cifar10Dataset(bool gray) {
+    gray_ = gray;
+  }
+
+  /*!
+   * Destructor.
+   */
+  virtual ~Cifar10Dataset() {}
+
+  /*!
+   * Get the image width.
+   *
+   *  \return Image width
+   */
+  static uint32_t ImageWidth() {
+    return Cifar10ImageWidth();
+  }
+
+  /*!
+   * Get the image height.
+   *
+   *  \return Image height
+   */
+  static uint32_t ImageHeight() {
+    return Cifar10ImageHeight();
+  }
+
+  /*!
+   * Get the image channel.
+   *
+   *  \return Image channel
+   */
+  uint32_t ImageChannel() const {
+    if (gray_) {
+      return 1;
+    }
+    return Cifar10ImageChannel();
+  }
+
+  /*!
+   * Get the number of classes.
+   *
+   *  \return Number of classes
+   */
+  static uint32_t NumClass() {
+    return 10;
+  }
+
+  /*!
+   * Load a cifar10 dataset.
+   *
+   *  \param[in]  dataset_path: path to the dataset
+   *  \param[in]  prefix      : dataset prefix
+   *
+   *  \param[out] dataset     : cifar10 dataset
+   *  \return     Error?
+   */
+  bool LoadDataset(const char* dataset_path, const char* prefix,
+                   RecordSet<Dtype>* dataset) {
+    bool res;
+    std::string dataset_file = std::string(dataset_path) + "/" +
+                               std::string(prefix) + "_batch.bin";
+    struct stat buffer;
+    if (stat(dataset_file.c_str(), &buffer)) {
+      res          = true;
+      size_t index = 1;
+      while (true) {
+        dataset_file = std::string(dataset_path) + "/" + std::string(prefix) +
+                       "_batch_" + std::to_string(index) + ".bin";
+        if (stat(dataset_file.c_str(), &buffer)) {
+          break;
+        }
+        res = ReadDataset(dataset_file.c_str(), dataset) && res;
+        ++index;
+      }
+    } else {
+      res = ReadDataset(dataset_file.c_str(), dataset);
+    }
+    return res;
+  }
+
+  /*!
+   * Load the dataset.
+   *
+   *  \param[in]  dataset_path: path to the dataset root directory
+   *
+   *  \return     Error?
+   */
+  virtual bool Load(const char* dataset_path) {
+    // Clear datasets
+    train_.Clear();
+    test_.Clear();
+
+    const char* path = std::strtok(const_cast<char*>(dataset_path), ":");
+    while (path) {
+      Report(kInfo, "Loading dataset from '%s'", path);
+      std::string spath = std::string(path);
+
+      // Training set
+      if (!LoadDataset(spath.c_str(), "data", &train_) ||
+          !LoadDataset(spath.c_str(), "test", &test_)) {
+        return false;
+      }
+
+      // Go to next path
+      path = std::strtok(nullptr, ":");
+    }
+
+    // Randomly shuffle the dataset to have uniform mini-batches with a good
+    // estimation of the gradient: we want each mini-batch gradient to be very
+    // close to the batch (dataset) gradient
+    std::random_device rd;
+    std::default_random_engine re(rd());
+    // The testing set keeps the order of the files: the replicas of a
+    // parallel evaluation split the same images (see Evaluator)
+    train_.Shuffle(&re);
+
+    return true;
+  }
+
+  /*!
+   * Copy an image of a set, converting the pixels to [0, 1]
+   * (and to grayscale if needed).
+   *
+   *  \param[in]  dataset: training or testing set
+   *  \param[in]  i      : image index
+   *
+   *  \param[out] out    : image
+   */
+  void Copy(const RecordSet<Dtype>& dataset, size_t i, Dtype* out) const {
+    if (!gray_) {
+      dataset.Copy(i, out);
+      return;
+    }
+
+    // Convert RGB to grayscale (luminosity)
+    const uint8_t* image = dataset.Image(i);
+    size_t image_size = ImageWidth() * ImageHeight() * ImageChannel();
+    for (size_t j = 0; j < image_size; ++j, image += 3) {
+      out[j] = (Dtype(0.2126 * image[0]) +
+                Dtype(0.7152 * image[1]) +
+                Dtype(0.0722 * image[2])) / 0xFF;
+    }
+  }
+
+  /*!
+   * Get the training set.
+   *
+   *  \return Training set
+   */
+  const RecordSet<Dtype>& Train() const {
+    return train_;
+  }
+
+  /*!
+   * Get the testing set.
+   *
+   *  \return Testing set
+   */
+  const RecordSet<Dtype>& Test() const {
+    return test_;
+  }
+};
+
+
+/*!
+ *  \class  Cifar10DataLayer
+ *  \brief  Cifar10 data layer
+ */
+template <typename Dtype>
+class Cifar10DataLayer: public LayerData<Dtype> {
+  // Public types
+ public:
+  typedef Dtype             Type;
+  typedef LayerData<Dtype>  Parent;
+
+
+  // Protected attributes
+ protected:
+  Cifar10Dataset<Dtype> dataset_;               // Cifar10 dataset
+  uint32_t              dataset_train_index_;   // Dataset index (training)
+  uint32_t              dataset_test_index_;    // Dataset index (testing)
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Get the number of training images (for the pipeline).
+   *
+   *  \return Number of training images
+   */
+  virtual uint32_t NumTrainSample() const {
+    return uint32_t(dataset_.Train().size());
+  }
+
+  /*!
+   * Copy a training image in a batch (called on the producer thread).
+   *
+   *  \param[in]  sample: image index
+   *  \param[in]  batch : index in the batch
+   *
+   *  \param[out] data  : batch (images and labels)
+   */
+  virtual void FillTrainSample(uint32_t sample, uint32_t batch,
+                               typename DataPipeline<Dtype>::Batch* data) {
+    size_t image_size = dataset_.ImageWidth() * dataset_.ImageHeight() *
+                        dataset_.ImageChannel();
+    dataset_.Copy(dataset_.Train(), sample,
+                  &(*data)[0][batch * image_size]);
+    (*data)[1][batch] = dataset_.Train().Label(sample);
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  name : layer name
+   *  \param[in]  param: parameters
+   *  \param[in]  gray : grayscale the input?
+   */
+  Cifar10DataLayer(const char* name, const Param& param, bool gray):
+    LayerData<Dtype>(name), dataset_(gray) {
+    // Parameters
+    std::string dataset_path;
+    uint32_t batch_size, num_prefetch;
+    param.Get("dataset_path", &dataset_path);
+    param.Get("batch_size"  , &batch_size);
+    param.Get("num_prefetch", uint32_t(0), &num_prefetch);
+    Parent::num_prefetch_ = num_prefetch;
+
+    if (!dataset_.Load(dataset_path.c_str())) {
+      return;
+    }
+
+    Report(kInfo, "Training set: %ld image(s)", dataset_.Train().size());
+    Report(kInfo, "Testing  set: %ld image(s)", dataset_.Test().size());
+
+    // Set index at the beginning of the dataset
+    dataset_train_index_ = dataset_test_index_ = 0;
+
+    // Create 2 outputs: images and labels
+    // There's no derivative for the labels as we don't backpropagate them
+    Parent::out_.resize(2);
+    Parent::out_[0] = std::make_shared<Mat<Dtype>>(dataset_.ImageWidth(),
+                                           dataset_.ImageHeight(),
+                                           dataset_.ImageChannel(),
+                                           batch_size);
+    Parent::out_[1] = std::make_shared<Mat<Dtype>>(1, 1, 1, batch_size, false);
+  }
+
+  /*!
+   * Destructor.
+   */
+  virtual ~Cifar10DataLayer() {
+    // The pipeline copies the images from the dataset
+    Parent::StopPrefetch();
+  }
+
+  /*!
+   * Set the test index (the next testing batch starts at this image).
+   *
+   *  \param[in]  index: test index
+   */
+  void SetTestIndex(uint32_t index) {
+    dataset_test_index_ = index;
+  }
+
+  /*!
+   * Get the size of the testing dataset.
+   *
+   *  \return Testing dataset size
+   */
+  uint32_t TestSize() const {
+    return uint32_t(dataset_.Test().size());
+  }
+
+  /*!
+   * Forward pass.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Forward(const State& state) {
+    // Prefetched training batch
+    if (Parent::Prefetch(state)) {
+      return;
+    }
+
+    // Get the proper dataset (either training or testing one)
+    const RecordSet<Dtype>* dataset;
+    uint32_t* dataset_index;
+    if (state.phase == State::PHASE_TRAIN) {
+      dataset       = &dataset_.Train();
+      dataset_index = &dataset_train_index_;
+    } else {
+      dataset       = &dataset_.Test();
+      dataset_index = &dataset_test_index_;
+    }
+
+    if (dataset->empty()) {
+      Report(kError, "Empty dataset");
+      Parent::out_[0]->Zero();
+      Parent::out_[1]->Zero();
+      return;
+    }
+
+    if (*dataset_index >= uint32_t(dataset->size())) {
+      Report(kError, "Invalid dataset index");
+      Parent::out_[0]->Zero();
+      Parent::out_[1]->Zero();
+      return;
+    }
+
+    Dtype* image_data = Parent::out_[0]->Data();
+    Dtype* label_data = Parent::out_[1]->Data();
+
+    uint32_t image_size = Parent::out_[0]->size[0] * Parent::out_[0]->size[1] *
+                          Parent::out_[0]->size[2];
+    uint32_t batch_size = Parent::out_[0]->size[3];
+
+    bool testing_done = false;
+
+    for (uint32_t batch = 0; batch < batch_size; ++batch) {
+      // Copy the pixels
+      dataset_.Copy(*dataset, *dataset_index,
+                    image_data + batch * image_size);
+
+      // Copy the labels
+      label_data[batch] = dataset->Label(*dataset_index);
+
+      // Go to the next image
+      if (++*dataset_index >= uint32_t(dataset->size())) {
+        if (state.phase == State::PHASE_TRAIN) {
+          // Rewind
+          *dataset_index = 0;
+        } else {
+          // Clamp
+          *dataset_index = uint32_t(dataset->size()) - 1;
+          testing_done   = true;
+        }
+      }
+    }
+
+    if (testing_done) {
+      // Mark the testing dataset as done
+      *dataset_index = uint32_t(dataset->size());
+    }
+  }
+};
+
+
+/*!
+ *  \class  Cifar10Model
+ *  \brief  Cifar10 model
+ */
+template <typename Dtype>
+class Cifar10Model: public Model<Dtype> {
+  // Public types
+ public:
+  typedef Dtype         Type;
+  typedef Model<Dtype>  Parent;
+
+
+  // Protected attributes
+ protected:
+  std::shared_ptr<Mat<Dtype>> label_;   // Labels
+  std::shared_ptr<Mat<Dtype>>  prob_;   // Probabilities
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  name        : model name
+   *  \param[in]  dataset_path: path to the dataset
+   *  \param[in]  num_output  : matrix size (number of classes)
+   *  \param[in]  batch_size  : matrix size (batch size)
+   *  \param[in]  gray : grayscale the input?
+   *  \param[in]  use_bn      : use batch norm?
+   *  \param[in]  num_prefetch: number of training batches to prefetch
+   */
+  Cifar10Model(const char* name, const char* dataset_path, uint32_t num_output,
+               uint32_t batch_size, bool gray, bool use_bn,
+               uint32_t num_prefetch):
+
+  Model<Dtype>(name) {
+    // Allocate all the activations and weights from the model arena
+    Arena::Scope arena_scope(Parent::Memory());
+
+    // Network architecture:
+    //
+    // DATA1 (INPUT)
+    //   |
+    //   |
+    // CONV1
+    //   |
+    //   |
+    // POOL1
+    //   |
+    //   |
+    // RELU1
+    //   |
+    //   |
+    // (BN1)
+    //   |
+    //   |
+    // (SCALE1)
+    //   |
+    //   |
+    // CONV2
+    //   |
+    //   |
+    // RELU2
+    //   |
+    //   |
+    // POOL2
+    //   |
+    //   |
+    // (BN2)
+    //   |
+    //   |
+    // (SCALE2)
+    //   |
+    //   |
+    // CONV3
+    //   |
+    //   |
+    // RELU3
+    //   |
+    //   |
+    // POOL3
+    //   |
+    //   |
+    // IP1
+    //   |
+    //   |
+    // LOSS (OUTPUT)
+
+    // Input layer parameters
+    Param data_param;
+    data_param.Add("dataset_path", dataset_path);
+    data_param.Add("batch_size"  , batch_size);
+    data_param.Add("num_prefetch", num_prefetch);
+
+    // Input layer
+    std::vector<std::shared_ptr<Mat<Dtype>>> out = Parent::Add(
+      std::make_shared<Cifar10DataLayer<Dtype>>("data1", data_param, gray));
+
+    // Model input (images) and labels
+    Parent::in_ = out[0];
+    label_      = out[1];
+
+    // Output of previous layer
+    Parent::out_ = Parent::in_;
+
+    // Conv layer parameters
+    Param conv_param;
+    conv_param.Add("num_output"   , 32);
+    conv_param.Add("filter_width" , 3);
+    conv_param.Add("filter_height", 3);
+    conv_param.Add("padding_x"    , 1);
+    conv_param.Add("padding_y"    , 1);
+    conv_param.Add("stride_x"     , 1);
+    conv_param.Add("stride_y"     , 1);
+
+    // Pool layer parameters
+    Param pool_param;
+    pool_param.Add("filter_width" , 3);
+    pool_param.Add("filter_height", 3);
+    pool_param.Add("padding_x"    , 1);
+    pool_param.Add("padding_y"    , 1);
+    pool_param.Add("stride_x"     , 2);
+    pool_param.Add("stride_y"     , 2);
+
+    // Conv1, Pool1, Relu1
+    Parent::out_ = Parent::Add(std::make_shared<LayerConv<Dtype>>("conv1",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
+      conv_param))[0];
+    Parent::out_ = Parent::Add(std::make_shared<LayerPoolMax<Dtype>>("pool1",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
+      pool_param))[0];
+    Parent::out_ = Parent::Add(std::make_shared<LayerRelu<Dtype>>("relu1",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_}))[0];
+
+    // BN layer parameters
+    Param bn_param;
+    bn_param.Add("moving_avg_frac", 0.99f);
+    if (use_bn) {
+      // BN1, Scale1 (whitening activations)
+      Parent::out_ = Parent::Add(std::make_shared<LayerBatchNorm<Dtype>>("bn1",
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
+        bn_param))[0];
+      Parent::out_ = Parent::Add(std::make_shared<LayerScale<Dtype>>("scale1",
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
+        Param()))[0];
+    }
+
+    // Conv2, Relu2, Pool2
+    Parent::out_ = Parent::Add(std::make_shared<LayerConv<Dtype>>("conv2",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
+      conv_param))[0];
+    Parent::out_ = Parent::Add(std::make_shared<LayerRelu<Dtype>>("relu2",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_}))[0];
+    Parent::out_ = Parent::Add(std::make_shared<LayerPoolMax<Dtype>>("pool2",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
+      pool_param))[0];
+
+    if (use_bn) {
+      // BN2, Scale2 (whitening activations)
+      Parent::out_ = Parent::Add(std::make_shared<LayerBatchNorm<Dtype>>("bn2",
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
+        bn_param))[0];
+      Parent::out_ = Parent::Add(std::make_shared<LayerScale<Dtype>>("scale2",
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
+        Param()))[0];
+    }
+
+    // Increase the depth for the next conv layer
+    conv_param.Add("num_output", 64);
+
+    // Conv3, Relu3, Pool3
+    Parent::out_ = Parent::Add(std::make_shared<LayerConv<Dtype>>("conv3",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
+      conv_param))[0];
+    Parent::out_ = Parent::Add(std::make_shared<LayerRelu<Dtype>>("relu3",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_}))[0];
+    Parent::out_ = Parent::Add(std::make_shared<LayerPoolMax<Dtype>>("pool3",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
+      pool_param))[0];
+
+    // IP layer parameters
+    Param ip_param;
+    ip_param.Add("num_output", num_output);
+
+    // IP1
+    Parent::out_ = Parent::Add(std::make_shared<LayerInnerProduct<Dtype>>(
+      "ip1", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
+      ip_param))[0];
+
+    // Loss (softmax)
+    const std::vector<std::shared_ptr<Mat<Dtype>>>& softmax_out =
+    Parent::Add(std::make_shared<LayerSoftMaxLoss<Dtype>>("loss",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_,
+      label_}));
+    Parent::out_ = softmax_out[0];
+    prob_        = softmax_out[1];
+  }
+
+  /*!
+   * Destructor.
+   */
+  virtual ~Cifar10Model() {}
+
+  /*!
+   * Get the number of testing images.
+   *
+   *  \return Number of testing images
+   */
+  virtual uint32_t TestSize() {
+    std::shared_ptr<Cifar10DataLayer<Dtype>> cifar10_data =
+      std::dynamic_pointer_cast<Cifar10DataLayer<Dtype>>(Parent::DataLayer());
+    return cifar10_data ? cifar10_data->TestSize() : 0;
+  }
+
+  /*!
+   * Graph testing (inference) on a range of the testing images.
+   *
+   *  \param[in]  begin: first image
+   *  \param[in]  end  : last image (excluded)
+   *
+   *  \return     Number of correct predictions
+   */
+  virtual uint64_t TestRange(uint32_t begin, uint32_t end) {
+    // Create the state
+    State state(State::PHASE_TEST);
+
+    // Number of classes (outputs)
+    uint32_t num_output = prob_->size[2];
+
+    // Get the data layer to set the testing index
+    std::shared_ptr<Cifar10DataLayer<Dtype>> cifar10_data =
+      std::dynamic_pointer_cast<Cifar10DataLayer<Dtype>>(Parent::DataLayer());
+    if (!cifar10_data) {
+      Report(kError, "No data layer found in model '%s'", Parent::Name());
+      return 0;
+    }
+
+    uint64_t num_correct = 0;
+    uint32_t batch_size  = Parent::BatchSize();
+    for (uint32_t index = begin; index < end; index += batch_size) {
+      // Inference, the last batch only running on the remaining images
+      uint32_t actual_batch_size = std::min(batch_size, end - index);
+      cifar10_data->SetTestIndex(index);
+      Parent::SetBatchSize(actual_batch_size);
+      Parent::Forward(state);
+
+      // Prediction
+      for (uint32_t batch = 0; batch < actual_batch_size; ++batch) {
+        // Outputs
+        const Dtype* data = prob_->Data() + batch * num_output;
+
+        // Network prediction
+        uint32_t predicted_number = 0;
+        for (uint32_t number = 0; number < num_output; ++number) {
+          if (data[predicted_number] < data[number]) {
+            predicted_number = number;
+          }
+        }
+
+        // Check if the prediction is correct
+        if (uint32_t(label_->Data()[batch]) == predicted_number) {
+          ++num_correct;
+        }
+      }
+    }
+    Parent::SetBatchSize(batch_size);
+
+    return num_correct;
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // SANDBOX_CIFAR10_CIFAR10_H_
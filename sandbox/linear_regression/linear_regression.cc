@@ -24,6 +24,7 @@
 
 
 #include <core/arg_parse.h>
+#include <core/thread_pool.h>
 #include <core/log.h>
 #include <core/dataset.h>
 #include <core/layer_data.h>
@@ -31,7 +32,11 @@
 #include <core/layer_euclidean_loss.h>
 #include <core/solver_sgd.h>
 #include <core/solver_rmsprop.h>
+#include <core/solver_adam.h>
+#include <core/static_graph.h>
+#include <algorithm>
 #include <random>
+#include <vector>
 
 
 namespace jik {
@@ -112,6 +117,15 @@ class LinearRegressionDataLayer: public LayerData<Dtype> {
     return dataset_test_index_;
   }
 
+  /*!
+   * Get the size of the testing dataset.
+   *
+   *  \return Testing dataset size
+   */
+  uint32_t TestSize() const {
+    return dataset_test_size_;
+  }
+
   /*!
    * Check if testing is done
    * (i.e. if we are at the end of the testing dataset).
@@ -250,6 +264,9 @@ class LinearRegressionModel: public Model<Dtype> {
                         Dtype scale, Dtype min, Dtype max, Dtype noise,
                         uint32_t size_train, uint32_t size_test):
     Model<Dtype>(name) {
+    // Allocate all the activations and weights from the model arena
+    Arena::Scope arena_scope(Parent::Memory());
+
     // Save the scale
     scale_ = scale;
 
@@ -330,13 +347,16 @@ class LinearRegressionModel: public Model<Dtype> {
       return Dtype(0);
     }
 
-    uint32_t step = 0;
-    Dtype acc     = Dtype(0);
+    uint32_t num_sample = 0;
+    Dtype acc           = Dtype(0);
+    uint32_t batch_size = Parent::BatchSize();
     while (!linear_regression_data->TestingDone()) {
       // Current test index
       uint32_t index = linear_regression_data->TestIndex();
 
-      // Inference
+      // Inference, the last batch only running on the remaining samples
+      Parent::SetBatchSize(
+        std::min(batch_size, linear_regression_data->TestSize() - index));
       Parent::Forward(state);
 
       // Actual batch size = where we are - where we were
@@ -345,22 +365,77 @@ class LinearRegressionModel: public Model<Dtype> {
       const Dtype* label_data = label_->Data();
       const Dtype* dist2_data = dist2_->Data();
 
-      // Batch accuracy
-      Dtype bacc = Dtype(0);
+      // Accumulate the accuracy of each sample (the last batch can be
+      // smaller)
       for (uint32_t batch = 0; batch < actual_batch_size; ++batch) {
         Dtype dist2_orig = scale_ * label_data[batch] - label_data[batch];
         dist2_orig      *= dist2_orig;
-        bacc            += Dtype(1) - dist2_data[batch] / dist2_orig;
+        acc             += Dtype(1) - dist2_data[batch] / dist2_orig;
       }
+      num_sample += actual_batch_size;
+    }
+    Parent::SetBatchSize(batch_size);
+
+    // Overall accuracy
+    if (num_sample) {
+      return acc / num_sample;
+    }
+    return Dtype(1);
+  }
+
+  /*!
+   * Graph testing (inference) through a static graph of the same weights
+   * (see StaticGraph), the data layer still generating the samples.
+   *
+   *  \param[in]  graph: static graph
+   *
+   *  \return     Accuracy
+   */
+  template <typename Graph>
+  Dtype TestStatic(const Graph& graph) {
+    // Create the state
+    State state(State::PHASE_TEST);
+
+    // Get the data layer to keep track of the testing index
+    std::shared_ptr<LinearRegressionDataLayer<Dtype>> linear_regression_data =
+      std::dynamic_pointer_cast<LinearRegressionDataLayer<Dtype>>(
+      Parent::DataLayer());
+    if (!linear_regression_data) {
+      Report(kError, "No data layer found in model '%s'", Parent::Name());
+      return Dtype(0);
+    }
+
+    uint32_t num_sample = 0;
+    Dtype acc           = Dtype(0);
+    uint32_t batch_size = Parent::BatchSize();
+    std::vector<Dtype> out(batch_size);
+    while (!linear_regression_data->TestingDone()) {
+      // Current test index
+      uint32_t index = linear_regression_data->TestIndex();
 
-      // Go to next step and accumulate the accuracy
-      ++step;
-      acc += bacc / actual_batch_size;
+      // Generate the samples and run the static graph on them
+      Parent::SetBatchSize(
+        std::min(batch_size, linear_regression_data->TestSize() - index));
+      linear_regression_data->Forward(state);
+      uint32_t actual_batch_size = linear_regression_data->TestIndex() - index;
+      graph.Forward(actual_batch_size, Parent::in_->Data(), out.data());
+
+      // Accumulate the accuracy of each sample
+      const Dtype* label_data = label_->Data();
+      for (uint32_t batch = 0; batch < actual_batch_size; ++batch) {
+        Dtype dist2      = out[batch] - label_data[batch];
+        dist2           *= dist2;
+        Dtype dist2_orig = scale_ * label_data[batch] - label_data[batch];
+        dist2_orig      *= dist2_orig;
+        acc             += Dtype(1) - dist2 / dist2_orig;
+      }
+      num_sample += actual_batch_size;
     }
+    Parent::SetBatchSize(batch_size);
 
     // Overall accuracy
-    if (step) {
-      return acc / step;
+    if (num_sample) {
+      return acc / num_sample;
     }
     return Dtype(1);
   }
@@ -382,10 +457,12 @@ int main(int argc, char* argv[]) {
   const char* model_name   = arg.Arg("-name");
   const char* solver_type  = arg.Arg("-solver");
   bool        train        = arg.ArgExists("-train");
+  bool        use_static   = arg.ArgExists("-static");
   uint32_t batch_size;
   Dtype learning_rate, decay_rate, momentum,
         reg, clip, lr_scale, mult, min, max, noise;
   uint32_t num_step, print_each, test_each, save_each, lr_scale_each;
+  uint32_t num_thread;
   arg.Arg<uint32_t>("-batchsize"  , 1                   , &batch_size);
   arg.Arg<Dtype>   ("-lr"         , Dtype(0.01)         , &learning_rate);
   arg.Arg<Dtype>   ("-decayrate"  , Dtype(0.999)        , &decay_rate);
@@ -402,11 +479,12 @@ int main(int argc, char* argv[]) {
   arg.Arg<Dtype>   ("-min"        , Dtype(0)            , &min);
   arg.Arg<Dtype>   ("-max"        , Dtype(1)            , &max);
   arg.Arg<Dtype>   ("-noise"      , Dtype(0.001)        , &noise);
+  arg.Arg<uint32_t>("-threads"    , 1                   , &num_thread);
 
   if ((!train && !model_path) || arg.ArgExists("-h")) {
     Report(kInfo, "Usage: %s [-train] [-scale <SCALE>] [-min <MIN>] "
            "[-max <MAX>] [-noise <NOISE>] "
-           "[-model <path/to/linear_regression/model>]", argv[0]);
+           "[-model <path/to/linear_regression/model>] [-static]", argv[0]);
     return -1;
   }
 
@@ -431,6 +509,10 @@ int main(int argc, char* argv[]) {
   Report(kInfo, "Save each               : %d", save_each);
   Report(kInfo, "Scale learning rate each: %d", lr_scale_each);
   Report(kInfo, "Learning rate scale     : %f", lr_scale);
+  Report(kInfo, "Number of threads       : %d", num_thread);
+
+  // Split the work across the threads
+  ThreadPool::Get().SetNumThread(num_thread);
 
   // Create the model: make sure we have enough data to cover exactly 1 epoch
   LinearRegressionModel<Dtype> model(model_name, batch_size,
@@ -438,16 +520,30 @@ int main(int argc, char* argv[]) {
                                      num_step * batch_size,
                                      num_step * batch_size);
 
-  // Load the model if one is specified
+  // Load the model if one is specified (mapped in memory if only testing)
   if (model_path) {
-    size_t size = model.Load(model_path);
+    size_t size = model.Load(model_path, !train);
     Report(kInfo, "Loading model '%s' (%ld byte(s))", model_path, size);
   }
 
   // Testing the model only
   if (!train) {
     Report(kInfo, "Testing model '%s'", model_name);
-    Dtype acc = model.Test();
+    Dtype acc;
+    if (use_static) {
+      // Same weights in a static graph: one scale, no bias
+      StaticGraph<Dtype, StaticScale<Dtype, 1, 1, false>> graph(model_name,
+                                                                {"scale"});
+      size_t size = graph.Load(model_path);
+      Report(kInfo, "Loading static graph '%s' (%ld byte(s))", graph.Name(),
+             size);
+      if (!size) {
+        return -1;
+      }
+      acc = model.TestStatic(graph);
+    } else {
+      acc = model.Test();
+    }
     Report(kInfo, "Accuracy: %f", acc);
     return 0;
   }
@@ -463,6 +559,13 @@ int main(int argc, char* argv[]) {
     solver = new SolverRMSprop<Dtype>(print_each, test_each, save_each,
                                       lr_scale_each, lr_scale, decay_rate,
                                       reg, clip);
+  } else if (!std::strcmp(solver_type, "adam")) {
+    // The momentum and decay rate are the decay rates of the mean and
+    // variance of the derivatives
+    Report(kInfo, "Creating Adam solver");
+    solver = new SolverAdam<Dtype>(print_each, test_each, save_each,
+                                   lr_scale_each, lr_scale, momentum,
+                                   decay_rate, reg, clip);
   } else {
     Report(kError, "Unknown solver type '%s'", solver_type);
     return -1;
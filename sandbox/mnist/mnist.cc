@@ -24,785 +24,23 @@
 
 
 #include <core/arg_parse.h>
-#include <core/log.h>
-#include <core/dataset.h>
-#include <core/layer_data.h>
-#include <core/layer_batch_norm.h>
-#include <core/layer_scale.h>
-#include <core/layer_conv.h>
-#include <core/layer_relu.h>
-#include <core/layer_pool_max.h>
-#include <core/layer_inner_product.h>
-#include <core/layer_softmax_loss.h>
+#include <core/device.h>
+#include <core/evaluator.h>
+#include <core/inference.h>
+#include <core/memory_stats.h>
+#include <core/thread_pool.h>
+#include <core/profiler.h>
+#include <core/rand.h>
+#include <core/tuner.h>
 #include <core/solver_sgd.h>
 #include <core/solver_rmsprop.h>
-
-
-namespace jik {
-
-
-/*!
- *  \class  MnistDataset
- *  \brief  Mnist dataset
- */
-template <typename Dtype>
-class MnistDataset: public Dataset {
-  // Public types
- public:
-  typedef Dtype   Type;
-  typedef Dataset Parent;
-
-
-  // Public structures
- public:
-  /*!
-   *  \struct Image
-   *  \brief  Mnist image = image bytes + label (10 classes: 0 to 9 number)
-   */
-  struct Image {
-    std::vector<Dtype> image;         // Image
-    uint8_t            label;         // Label
-  };
-
-
-  // Protected attributes
- protected:
-  uint32_t           image_width_;    // Image width
-  uint32_t           image_height_;   // Image height
-  std::vector<Image> train_;          // Training set
-  std::vector<Image> test_;           // Testing set
-
-
-  // Protected methods
- protected:
-  /*!
-   * Switch the endianness of a 32-bits number.
-   *
-   *  \param[in]  num: 32-bits number
-   *
-   *  \return     32-bits number with endianness switched
-   */
-  uint32_t SwapEndian32(uint32_t num) {
-    return (num & 0x000000FF) << 24 |
-           (num & 0x0000FF00) << 8  |
-           (num & 0x00FF0000) >> 8  |
-           (num & 0xFF000000) >> 24;
-  }
-
-  /*!
-   * Read a mnist dataset.
-   * Check here for the dataset format: http://yann.lecun.com/exdb/mnist/
-   *
-   *  \param[in]  file_image: file containing the images
-   *  \param[in]  file_label: file containing the labels
-   *
-   *  \param[out] dataset   : mnist dataset
-   *  \return     Error?
-   */
-  bool ReadDataset(const std::string& file_image,
-                   const std::string& file_label,
-                   std::vector<Image>* dataset) {
-    // File header constants
-    const uint32_t kMnistImageHeader = 0x803;
-    const uint32_t kMnistLabelHeader = 0x801;
-
-    // Open the images file
-    std::FILE* fp = std::fopen(file_image.c_str(), "rb");
-    if (!fp) {
-      Report(kError, "Can't open file '%s'", file_image.c_str());
-      return false;
-    }
-
-    // Read the images file header
-    uint32_t magic, image_count, image_rows, image_columns;
-    size_t size_to_read = sizeof(uint32_t);
-    if (std::fread(&magic        , 1, size_to_read, fp) != size_to_read ||
-        std::fread(&image_count  , 1, size_to_read, fp) != size_to_read ||
-        std::fread(&image_rows   , 1, size_to_read, fp) != size_to_read ||
-        std::fread(&image_columns, 1, size_to_read, fp) != size_to_read) {
-      Report(kError, "Invalid file header in '%s'", file_image.c_str());
-      std::fclose(fp);
-      return false;
-    }
-    magic         = SwapEndian32(magic);
-    image_count   = SwapEndian32(image_count);
-    image_rows    = SwapEndian32(image_rows);
-    image_columns = SwapEndian32(image_columns);
-
-    // Check the magic number
-    if (magic != kMnistImageHeader) {
-      Report(kError, "Invalid file format in '%s'", file_image.c_str());
-      std::fclose(fp);
-      return false;
-    }
-
-    // Set or check the image width
-    if (image_width_) {
-      if (image_rows != image_width_) {
-        Report(kError, "Invalid image format in '%s'", file_image.c_str());
-        std::fclose(fp);
-        return false;
-      }
-    } else {
-      image_width_ = image_rows;
-    }
-
-    // Set or check the image height
-    if (image_height_) {
-      if (image_columns != image_height_) {
-        Report(kError, "Invalid image format in '%s'", file_image.c_str());
-        std::fclose(fp);
-        return false;
-      }
-    } else {
-      image_height_ = image_columns;
-    }
-
-    // Size of an image
-    uint32_t mnist_size = image_rows * image_columns;
-
-    // Read all the images
-    std::vector<uint8_t> images(image_count * mnist_size);
-    size_to_read = image_count * mnist_size * sizeof(uint8_t);
-    if (std::fread(&images[0], 1, size_to_read, fp) != size_to_read) {
-      Report(kError, "Can't read images in '%s'", file_image.c_str());
-      std::fclose(fp);
-      return false;
-    }
-    std::fclose(fp);
-
-    // Open the labels file
-    fp = std::fopen(file_label.c_str(), "rb");
-    if (!fp) {
-      Report(kError, "Can't open file '%s'", file_label.c_str());
-      return false;
-    }
-
-    // Read the label file header
-    uint32_t label_count;
-    size_to_read = sizeof(uint32_t);
-    if (std::fread(&magic      , 1, size_to_read, fp) != size_to_read ||
-        std::fread(&label_count, 1, size_to_read, fp) != size_to_read) {
-      Report(kError, "Invalid file header in '%s'", file_label.c_str());
-      std::fclose(fp);
-      return false;
-    }
-    magic       = SwapEndian32(magic);
-    label_count = SwapEndian32(label_count);
-
-    // Check the magic number and the number of labels
-    // (must match the number of images)
-    if (magic != kMnistLabelHeader || label_count != image_count) {
-      Report(kError, "Invalid file format in '%s'", file_label.c_str());
-      std::fclose(fp);
-      return false;
-    }
-
-    // Read all the labels
-    std::vector<uint8_t> labels(image_count);
-    size_to_read = image_count * sizeof(uint8_t);
-    if (std::fread(&labels[0], 1, size_to_read, fp) != size_to_read) {
-      Report(kError, "Can't read labels in '%s'", file_label.c_str());
-      std::fclose(fp);
-      return false;
-    }
-    std::fclose(fp);
-
-    // Add the images to the dataset
-    size_t index = dataset->size();
-    dataset->resize(index + image_count);
-
-    // Create the dataset
-    for (uint32_t i = 0; i < image_count; ++i) {
-      Image& img = (*dataset)[index + i];
-
-      // Save the image
-      img.image.resize(mnist_size);
-      uint32_t image_index = i * mnist_size;
-      for (uint32_t j = 0; j < image_columns; ++j) {
-        for (uint32_t k = 0; k < image_rows; ++k) {
-          uint32_t index = j * image_columns + k;
-          img.image[index] = Dtype(images[image_index + index]) / 0xFF;
-        }
-      }
-
-      // Save the label
-      img.label = labels[i];
-      // Check the label is between [0, 9]
-      if (img.label > 9) {
-        Report(kError, "Invalid label %d in file '%s'",
-               img.label, file_label.c_str());
-        std::fclose(fp);
-        return false;
-      }
-    }
-
-    return true;
-  }
-
-
-  // Public methods
- public:
-  /*!
-   * Default constructor.
-   */
-  MnistDataset() {
-    image_width_ = image_height_ = 0;
-  }
-
-  /*!
-   * Destructor.
-   */
-  virtual ~MnistDataset() {}
-
-  /*!
-   * Get the image width.
-   *
-   *  \return Image width
-   */
-  uint32_t ImageWidth() const {
-    return image_width_;
-  }
-
-  /*!
-   * Get the image height.
-   *
-   *  \return Image height
-   */
-  uint32_t ImageHeight() const {
-    return image_height_;
-  }
-
-  /*!
-   * Get the image channel.
-   *
-   *  \return Image channel
-   */
-  static uint32_t ImageChannel() {
-    return 1;
-  }
-
-  /*!
-   * Get the number of classes.
-   *
-   *  \return Number of classes
-   */
-  static uint32_t NumClass() {
-    return 10;
-  }
-
-  /*!
-   * Load the dataset.
-   *
-   *  \param[in]  dataset_path: path to the dataset root directory
-   *
-   *  \return     Error?
-   */
-  virtual bool Load(const char* dataset_path) {
-    // Clear datasets
-    train_.clear();
-    test_.clear();
-
-    const char* path = std::strtok(const_cast<char*>(dataset_path), ":");
-    while (path) {
-      Report(kInfo, "Loading dataset from '%s'", path);
-      std::string spath = std::string(path);
-
-      // Training set
-      std::string train_file_image(spath + "/train-images-idx3-ubyte");
-      std::string train_file_label(spath + "/train-labels-idx1-ubyte");
-      if (!ReadDataset(train_file_image, train_file_label, &train_)) {
-        return false;
-      }
-
-      // Testing set
-      std::string test_file_image(spath + "/t10k-images-idx3-ubyte");
-      std::string test_file_label(spath + "/t10k-labels-idx1-ubyte");
-      if (!ReadDataset(test_file_image, test_file_label, &test_)) {
-          return false;
-      }
-
-      // Go to next path
-      path = std::strtok(nullptr, ":");
-    }
-
-    // Randomly shuffle the dataset to have uniform mini-batches with a good
-    // estimation of the gradient: we want each mini-batch gradient to be very
-    // close to the batch (dataset) gradient
-    std::random_device rd;
-    std::default_random_engine re(rd());
-    std::shuffle(train_.begin(), train_.end(), re);
-    std::shuffle(test_.begin() , test_.end() , re);
-
-    return true;
-  }
-
-  /*!
-   * Get the training set.
-   *
-   *  \return Training set
-   */
-  const std::vector<Image>& Train() const {
-    return train_;
-  }
-
-  /*!
-   * Get the testing set.
-   *
-   *  \return Testing set
-   */
-  const std::vector<Image>& Test() const {
-    return test_;
-  }
-};
-
-
-/*!
- *  \class  MnistDataLayer
- *  \brief  Mnist data layer
- */
-template <typename Dtype>
-class MnistDataLayer: public LayerData<Dtype> {
-  // Public types
- public:
-  typedef Dtype             Type;
-  typedef LayerData<Dtype>  Parent;
-
-
-  // Protected attributes
- protected:
-  MnistDataset<Dtype> dataset_;               // Mnist dataset
-  uint32_t            dataset_train_index_;   // Dataset index (training)
-  uint32_t            dataset_test_index_;    // Dataset index (testing)
-
-
-  // Public methods
- public:
-  /*!
-   * Constructor.
-   *
-   *  \param[in]  name : layer name
-   *  \param[in]  param: parameters
-   */
-  MnistDataLayer(const char* name, const Param& param):
-    LayerData<Dtype>(name) {
-    // Parameters
-    std::string dataset_path;
-    uint32_t batch_size;
-    param.Get("dataset_path", &dataset_path);
-    param.Get("batch_size"  , &batch_size);
-
-    if (!dataset_.Load(dataset_path.c_str())) {
-      return;
-    }
-
-    Report(kInfo, "Training set: %ld image(s)", dataset_.Train().size());
-    Report(kInfo, "Testing  set: %ld image(s)", dataset_.Test().size());
-
-    // Set index at the beginning of the dataset
-    dataset_train_index_ = dataset_test_index_ = 0;
-
-    // Create 2 outputs: images and labels
-    // There's no derivative for the labels as we don't backpropagate them
-    Parent::out_.resize(2);
-    Parent::out_[0] = std::make_shared<Mat<Dtype>>(
-      dataset_.ImageWidth(), dataset_.ImageHeight(),
-      dataset_.ImageChannel(), batch_size);
-    Parent::out_[1] = std::make_shared<Mat<Dtype>>(1, 1, 1, batch_size, false);
-  }
-
-  /*!
-   * Destructor.
-   */
-  virtual ~MnistDataLayer() {}
-
-  /*!
-   * Get the test index.
-   *
-   *  \return Test index
-   */
-  uint32_t TestIndex() const {
-    return dataset_test_index_;
-  }
-
-  /*!
-   * Check if testing is done
-   * (i.e. if we are at the end of the testing dataset).
-   *
-   *  \return Testing done?
-   */
-  bool TestingDone() {
-    uint32_t dataset_test_size = uint32_t(dataset_.Test().size());
-    if (!dataset_test_size) {
-      // No dataset: we are done
-      return true;
-    }
-
-    // We are done if we are at the end of the testing dataset
-    bool testing_done = dataset_test_index_ >= dataset_test_size;
-
-    if (testing_done) {
-      // If we are done, we rewind
-      dataset_test_index_ = 0;
-    }
-
-    return testing_done;
-  }
-
-  /*!
-   * Forward pass.
-   *
-   *  \param[in]  state: state
-   */
-  virtual void Forward(const State& state) {
-    // Get the proper dataset (either training or testing one)
-    const std::vector<typename MnistDataset<Dtype>::Image>* dataset;
-    uint32_t* dataset_index;
-    if (state.phase == State::PHASE_TRAIN) {
-      dataset       = &dataset_.Train();
-      dataset_index = &dataset_train_index_;
-    } else {
-      dataset       = &dataset_.Test();
-      dataset_index = &dataset_test_index_;
-    }
-
-    if (dataset->empty()) {
-      Report(kError, "Empty dataset");
-      Parent::out_[0]->Zero();
-      Parent::out_[1]->Zero();
-      return;
-    }
-
-    if (*dataset_index >= uint32_t(dataset->size())) {
-      Report(kError, "Invalid dataset index");
-      Parent::out_[0]->Zero();
-      Parent::out_[1]->Zero();
-      return;
-    }
-
-    Dtype* image_data = Parent::out_[0]->Data();
-    Dtype* label_data = Parent::out_[1]->Data();
-
-    uint32_t image_size = Parent::out_[0]->size[0] * Parent::out_[0]->size[1] *
-                          Parent::out_[0]->size[2];
-    uint32_t batch_size = Parent::out_[0]->size[3];
-
-    bool testing_done = false;
-
-    for (uint32_t batch = 0; batch < batch_size; ++batch) {
-      // Current image
-      const typename MnistDataset<Dtype>::Image& image =
-        (*dataset)[*dataset_index];
-
-      // Copy the pixels
-      std::memcpy(image_data + batch * image_size,
-                  &image.image[0], image_size * sizeof(Dtype));
-
-      // Copy the labels
-      label_data[batch] = image.label;
-
-      // Go to the next image
-      if (++*dataset_index >= uint32_t(dataset->size())) {
-        if (state.phase == State::PHASE_TRAIN) {
-          // Rewind
-          *dataset_index = 0;
-        } else {
-          // Clamp
-          *dataset_index = uint32_t(dataset->size()) - 1;
-          testing_done   = true;
-        }
-      }
-    }
-
-    if (testing_done) {
-      // Mark the testing dataset as done
-      *dataset_index = uint32_t(dataset->size());
-    }
-  }
-};
-
-
-/*!
- *  \class  MnistModel
- *  \brief  Mnist model
- */
-template <typename Dtype>
-class MnistModel: public Model<Dtype> {
-  // Public types
- public:
-  typedef Dtype         Type;
-  typedef Model<Dtype>  Parent;
-
-
-  // Protected attributes
- protected:
-  std::shared_ptr<Mat<Dtype>> label_;   // Labels
-  std::shared_ptr<Mat<Dtype>> prob_;    // Probabilities
-
-
-  // Public methods
- public:
-  /*!
-   * Constructor.
-   *
-   *  \param[in]  name        : model name
-   *  \param[in]  dataset_path: path to the dataset
-   *  \param[in]  num_output  : matrix size (number of classes)
-   *  \param[in]  batch_size  : matrix size (batch size)
-   *  \param[in]  use_fc      : use fully-connected network?
-   *  \param[in]  use_bn      : use batch norm?
-   */
-  MnistModel(const char* name, const char* dataset_path, uint32_t num_output,
-             uint32_t batch_size, bool use_fc, bool use_bn):
-    Model<Dtype>(name) {
-    // Input layer parameters
-    Param data_param;
-    data_param.Add("dataset_path", dataset_path);
-    data_param.Add("batch_size"  , batch_size);
-
-    // Input layer
-    std::vector<std::shared_ptr<Mat<Dtype>>> out = Parent::Add(
-      std::make_shared<MnistDataLayer<Dtype>>("data1", data_param));
-
-    // Model input (images) and labels
-    Parent::in_ = out[0];
-    label_      = out[1];
-
-    // Output of previous layer
-    Parent::out_ = Parent::in_;
-
-    if (use_fc) {
-      // Network architecture:
-      //
-      // DATA1 (INPUT)
-      //   |
-      //   |
-      // IP1
-      //   |
-      //   |
-      // RELU1
-      //   |
-      //   |
-      // IP2
-      //   |
-      //   |
-      // RELU2
-      //   |
-      //   |
-      // IP3
-      //   |
-      //   |
-      // LOSS (OUTPUT)
-
-      // Hidden IP layer parameters
-      // We use 64 hidden units
-      Param ip_hidden_param;
-      ip_hidden_param.Add("num_output", 64);
-
-      // IP1
-      Parent::out_ = Parent::Add(std::make_shared<LayerInnerProduct<Dtype>>(
-        "ip1", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
-        Parent::out_}, ip_hidden_param))[0];
-
-      // Relu1
-      Parent::out_ = Parent::Add(std::make_shared<LayerRelu<Dtype>>("relu1",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_}))[0];
-
-      // IP2
-      Parent::out_ = Parent::Add(std::make_shared<LayerInnerProduct<Dtype>>(
-        "ip2", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
-        Parent::out_}, ip_hidden_param))[0];
-
-      // Relu2
-      Parent::out_ = Parent::Add(std::make_shared<LayerRelu<Dtype>>("relu2",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_}))[0];
-
-      // IP3
-      // Final IP layer parameters
-      Param ip_final_param;
-      ip_final_param.Add("num_output", num_output);
-      Parent::out_ = Parent::Add(std::make_shared<LayerInnerProduct<Dtype>>(
-        "ip3", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
-        Parent::out_}, ip_final_param))[0];
-    } else {
-      // Network architecture:
-      //
-      // DATA1 (INPUT)
-      //   |
-      //   |
-      // CONV1
-      //   |
-      //   |
-      // RELU1
-      //   |
-      //   |
-      // POOL1
-      //   |
-      //   |
-      // (BN1)
-      //   |
-      //   |
-      // (SCALE1)
-      //   |
-      //   |
-      // CONV2
-      //   |
-      //   |
-      // RELU2
-      //   |
-      //   |
-      // POOL2
-      //   |
-      //   |
-      // IP1
-      //   |
-      //   |
-      // LOSS (OUTPUT)
-
-      // Conv layer parameters
-      Param conv_param;
-      conv_param.Add("num_output"   , 8);
-      conv_param.Add("filter_width" , 3);
-      conv_param.Add("filter_height", 3);
-      conv_param.Add("padding_x"    , 1);
-      conv_param.Add("padding_y"    , 1);
-      conv_param.Add("stride_x"     , 1);
-      conv_param.Add("stride_y"     , 1);
-
-      // Pool layer parameters
-      Param pool_param;
-      pool_param.Add("filter_width" , 3);
-      pool_param.Add("filter_height", 3);
-      pool_param.Add("padding_x"    , 1);
-      pool_param.Add("padding_y"    , 1);
-      pool_param.Add("stride_x"     , 2);
-      pool_param.Add("stride_y"     , 2);
-
-      // Conv1, Relu1, Pool1
-      Parent::out_ = Parent::Add(std::make_shared<LayerConv<Dtype>>("conv1",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-        conv_param))[0];
-      Parent::out_ = Parent::Add(std::make_shared<LayerRelu<Dtype>>("relu1",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_}))[0];
-      Parent::out_ = Parent::Add(std::make_shared<LayerPoolMax<Dtype>>("pool1",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-        pool_param))[0];
-
-      if (use_bn) {
-        // BN layer parameters
-        Param bn_param;
-        bn_param.Add("moving_avg_frac", 0.99f);
-
-        // BN1, Scale1 (whitening activations)
-        Parent::out_ = Parent::Add(std::make_shared<LayerBatchNorm<Dtype>>(
-          "bn1", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
-          Parent::out_}, bn_param))[0];
-        Parent::out_ = Parent::Add(std::make_shared<LayerScale<Dtype>>(
-          "scale1", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
-          Parent::out_}, Param()))[0];
-      }
-
-      // Increase the depth for the next conv layer
-      conv_param.Add("num_output", 16);
-
-      // Conv2, Relu2, Pool2
-      Parent::out_ = Parent::Add(std::make_shared<LayerConv<Dtype>>("conv2",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-        conv_param))[0];
-      Parent::out_ = Parent::Add(std::make_shared<LayerRelu<Dtype>>("relu2",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_}))[0];
-      Parent::out_ = Parent::Add(std::make_shared<LayerPoolMax<Dtype>>("pool2",
-        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
-        pool_param))[0];
-
-      // IP layer parameters
-      Param ip_param;
-      ip_param.Add("num_output", num_output);
-
-      // IP1
-      Parent::out_ = Parent::Add(std::make_shared<LayerInnerProduct<Dtype>>(
-        "ip1", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
-        Parent::out_}, ip_param))[0];
-    }
-
-    // Loss (softmax)
-    const std::vector<std::shared_ptr<Mat<Dtype>>>& softmax_out =
-    Parent::Add(std::make_shared<LayerSoftMaxLoss<Dtype>>("loss",
-      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_,
-      label_}));
-    Parent::out_ = softmax_out[0];
-    prob_        = softmax_out[1];
-  }
-
-  /*!
-   * Destructor.
-   */
-  virtual ~MnistModel() {}
-
-  /*!
-   * Graph testing (inference).
-   *
-   *  \return     Accuracy
-   */
-  virtual Dtype Test() {
-    // Create the state
-    State state(State::PHASE_TEST);
-
-    // Number of classes (outputs)
-    uint32_t num_output = prob_->size[2];
-
-    // Get the data layer to keep track of the testing index
-    std::shared_ptr<MnistDataLayer<Dtype>> mnist_data =
-      std::dynamic_pointer_cast<MnistDataLayer<Dtype>>(Parent::DataLayer());
-    if (!mnist_data) {
-      Report(kError, "No data layer found in model '%s'", Parent::Name());
-      return Dtype(0);
-    }
-
-    uint32_t step = 0;
-    Dtype acc     = Dtype(0);
-    while (!mnist_data->TestingDone()) {
-      // Current test index
-      uint32_t index = mnist_data->TestIndex();
-
-      // Inference
-      Parent::Forward(state);
-
-      // Actual batch size = where we are - where we were
-      uint32_t actual_batch_size = mnist_data->TestIndex() - index;
-
-      // Prediction
-      uint32_t pred = 0;
-      for (uint32_t batch = 0; batch < actual_batch_size; ++batch) {
-        // Outputs
-        const Dtype* data = prob_->Data() + batch * num_output;
-
-        // Network prediction
-        uint32_t predicted_number = 0;
-        for (uint32_t number = 0; number < num_output; ++number) {
-          if (data[predicted_number] < data[number]) {
-            predicted_number = number;
-          }
-        }
-
-        // Check if the prediction is correct
-        if (uint32_t(label_->Data()[batch]) == predicted_number) {
-          ++pred;
-        }
-      }
-
-      // Go to next step and accumulate the accuracy
-      ++step;
-      acc += Dtype(pred) / actual_batch_size;
-    }
-
-    // Overall accuracy
-    return acc / step;
-  }
-};
-
-
-}  // namespace jik
+#include <core/solver_adam.h>
+#include <sandbox/mnist/mnist.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
 
 
 int main(int argc, char* argv[]) {
@@ -820,9 +58,30 @@ int main(int argc, char* argv[]) {
   bool        train        = arg.ArgExists("-train");
   bool        use_fc       = arg.ArgExists("-fc");
   bool        use_bn       = arg.ArgExists("-bn");
+  bool        quantize     = arg.ArgExists("-quantize");
+  bool        profile      = arg.ArgExists("-profile");
+  bool        serve        = arg.ArgExists("-serve");
+  const char* trace_path   = arg.Arg("-trace");
+  const char* log_path     = arg.Arg("-log");
+  const char* layout_name  = arg.Arg("-layout");
+  const char* hosts        = arg.Arg("-hosts");
+  const char* resume_path  = arg.Arg("-resume");
+  const char* tune_path    = arg.Arg("-tune");
+  const char* device_name  = arg.Arg("-device");
+  bool        save_state   = arg.ArgExists("-savestate");
+  bool        memory       = arg.ArgExists("-memory");
+  bool        no_alloc     = arg.ArgExists("-noalloc");
   uint32_t batch_size;
   Dtype learning_rate, decay_rate, momentum, reg, clip, lr_scale;
   uint32_t num_step, print_each, test_each, save_each, lr_scale_each;
+  uint32_t num_thread;
+  uint32_t num_prefetch;
+  uint32_t rank;
+  uint32_t num_segment;
+  uint32_t seed;
+  uint32_t num_test_worker;
+  uint32_t num_worker, num_client, max_delay;
+  Dtype sparsity;
   arg.Arg<uint32_t>("-batchsize"  , 128          , &batch_size);
   arg.Arg<Dtype>   ("-lr"         , Dtype(0.0005), &learning_rate);
   arg.Arg<Dtype>   ("-decayrate"  , Dtype(0.999) , &decay_rate);
@@ -835,10 +94,68 @@ int main(int argc, char* argv[]) {
   arg.Arg<uint32_t>("-saveeach"   , 1000         , &save_each);
   arg.Arg<uint32_t>("-lrscaleeach", 10000        , &lr_scale_each);
   arg.Arg<Dtype>   ("-lrscale"    , Dtype(0.1)   , &lr_scale);
-
-  if (!dataset_path || (!train && !model_path) || arg.ArgExists("-h")) {
+  arg.Arg<uint32_t>("-threads"    , 1            , &num_thread);
+  arg.Arg<uint32_t>("-prefetch"   , 2            , &num_prefetch);
+  arg.Arg<uint32_t>("-rank"       , 0            , &rank);
+  bool checkpoint =
+    arg.Arg<uint32_t>("-checkpoint" , 0            , &num_segment);
+  bool seeded =
+    arg.Arg<uint32_t>("-seed"       , 0            , &seed);
+  arg.Arg<uint32_t>("-testworkers", 1            , &num_test_worker);
+  arg.Arg<uint32_t>("-workers"    , 1            , &num_worker);
+  arg.Arg<uint32_t>("-clients"    , 16           , &num_client);
+  arg.Arg<uint32_t>("-maxdelay"   , 2000         , &max_delay);
+  bool prune =
+    arg.Arg<Dtype>   ("-prune"      , Dtype(0)     , &sparsity);
+
+  if (!dataset_path || (!train && !model_path) || (serve && train) ||
+      (resume_path && !train) || arg.ArgExists("-h")) {
     Report(kInfo, "Usage: %s -dataset <path/to/mnist/dataset> [-train] "
-           "[-model <path/to/mnist/model>] [-fc] [-bn]", argv[0]);
+           "[-model <path/to/mnist/model>] [-fc] [-bn] [-quantize] [-profile] "
+           "[-trace <path/to/trace>] [-log <path/to/log>] [-seed <n>] "
+           "[-hosts <host:port,host:port...> -rank <rank>] "
+           "[-checkpoint <segments>] [-layout <nchw/nhwc>] [-testworkers <n>] "
+           "[-savestate] [-resume <path/to/mnist/model>] "
+           "[-tune <path/to/cache>] [-device <cpu/cuda>] "
+           "[-memory] [-noalloc] [-prune <sparsity>] "
+           "[-serve [-workers <n>] [-clients <n>] [-maxdelay <us>]]", argv[0]);
+    return -1;
+  }
+
+  // Also write the messages to a file
+  if (log_path) {
+    Logger::Get().SetFile(log_path);
+  }
+
+  // Same initial weights and dropout masks from run to run (see Philox)
+  if (seeded) {
+    Philox::SetSeed(seed);
+  }
+
+  // Device running the large matrix multiplications (see Device)
+  if (device_name && !Device::Get().Set(device_name)) {
+    return -1;
+  }
+
+  // Fastest algorithm of the layers for each shape, the choices being kept
+  // for the next runs (see Tuner)
+  if (tune_path) {
+    Tuner::Get().Enable(tune_path);
+  }
+
+  // Resume a training: the weights and the solver state are in the same file
+  if (resume_path) {
+    model_path = resume_path;
+  }
+
+  // Memory layout of the activations
+  Layout::E_LAYOUT layout = Layout::NCHW;
+  if (layout_name && !Layout::Get(layout_name, &layout)) {
+    Report(kError, "Unknown layout '%s'", layout_name);
+    return -1;
+  }
+  if (layout != Layout::NCHW && quantize) {
+    Report(kError, "Post-training quantization needs the nchw layout");
     return -1;
   }
 
@@ -863,26 +180,195 @@ int main(int argc, char* argv[]) {
   Report(kInfo, "Save each               : %d", save_each);
   Report(kInfo, "Scale learning rate each: %d", lr_scale_each);
   Report(kInfo, "Learning rate scale     : %f", lr_scale);
+  Report(kInfo, "Number of threads       : %d", num_thread);
+  Report(kInfo, "Prefetched batches      : %d", num_prefetch);
+  Report(kInfo, "Testing workers         : %d", num_test_worker);
+
+  // The training set is sharded by the prefetching pipeline
+  if (hosts && train && !num_prefetch) {
+    Report(kWarning, "Data-parallel training prefetches the batches");
+    num_prefetch = 1;
+  }
+
+  // Split the work across the threads
+  ThreadPool::Get().SetNumThread(num_thread);
+
+  // Time the layers (the trace records each call)
+  if (profile || trace_path) {
+    Profiler::Get().Enable(trace_path != nullptr);
+  }
+
+  // Report the memory of the layers and the allocations per step
+  if (memory) {
+    MemoryStats::Get().Enable();
+  }
+
+  // Serve the model: each test image is a request from one of the clients,
+  // the requests being batched by the workers
+  if (serve) {
+    Report(kInfo, "Serving model '%s' (%d worker(s), %d client(s), max "
+           "delay %d us)", model_path, num_worker, num_client, max_delay);
+    InferenceSession<Dtype> session(batch_size, max_delay);
+    if (!session.Start([&]() {
+          return std::unique_ptr<Model<Dtype>>(new MnistModel<Dtype>(
+            model_name, dataset_path, MnistDataset<Dtype>::NumClass(),
+            batch_size, use_fc, use_bn, 0));
+        }, model_path, num_worker)) {
+      return -1;
+    }
+
+    MnistDataset<Dtype> dataset;
+    if (!dataset.Load(dataset_path)) {
+      return -1;
+    }
+    const RecordSet<Dtype>& test_set = dataset.Test();
+
+    std::atomic<uint32_t> num_correct(0);
+    std::vector<std::thread> client(std::max(num_client, 1u));
+    std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+    for (size_t c = 0; c < client.size(); ++c) {
+      client[c] = std::thread([&, c]() {
+        std::vector<Dtype> in(session.InSize()), out(session.OutSize());
+        for (size_t i = c; i < test_set.size(); i += client.size()) {
+          test_set.Copy(i, in.data());
+          if (!session.Infer(in.data(), out.data())) {
+            return;
+          }
+          size_t pred = std::max_element(out.begin(), out.end()) -
+                        out.begin();
+          if (pred == test_set.Label(i)) {
+            ++num_correct;
+          }
+        }
+      });
+    }
+    for (std::thread& thread : client) {
+      thread.join();
+    }
+    session.Print(std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count());
+    Report(kInfo, "Accuracy: %f",
+           Dtype(num_correct) / std::max(test_set.size(), size_t(1)));
+    Profiler::Get().Finish(trace_path);
+    return 0;
+  }
 
   // Create the model
   MnistModel<Dtype> model(model_name, dataset_path,
                           MnistDataset<Dtype>::NumClass(),
-                          batch_size, use_fc, use_bn);
+                          batch_size, use_fc, use_bn, num_prefetch);
 
-  // Load the model if one is specified
+  // Load the model if one is specified (mapped in memory if only testing)
   if (model_path) {
-    size_t size = model.Load(model_path);
+    size_t size = model.Load(model_path, !train);
     Report(kInfo, "Loading model '%s' (%ld byte(s))", model_path, size);
   }
 
+  // A quantized model only has int8 filters
+  if (train && model.Quantized()) {
+    Report(kError, "Can't train quantized model '%s'", model_path);
+    return -1;
+  }
+
+  // Channels-last activations: the layers supporting them switch to it,
+  // with reorder layers at the boundaries
+  if (layout != Layout::NCHW) {
+    Report(kInfo, "Switching to %s (%d reorder layer(s))",
+           Layout::Name(layout), model.SetLayout(layout));
+  }
+
   // Testing the model only
   if (!train) {
+    // Post-training pruning: the layers switch to sparse inference
+    if (prune) {
+      Report(kInfo, "Pruning %d layer(s) to %.1f%% sparsity",
+             model.Prune(sparsity), 100 * sparsity);
+    }
+
+    // Fuse the layers for inference (the weights are constant)
+    uint32_t num_fused = model.Fuse();
+    Report(kInfo, "Fusing %d layer(s)", num_fused);
+
+    // Share the memory of the activations (inference only)
+    size_t mem = model.ActivationMemory();
+    Report(kInfo, "Planning activations: %ld byte(s) -> %ld byte(s)", mem,
+           model.Plan(State::PHASE_TEST));
+
+    // Post-training quantization: the testing pass calibrates the model
+    quantize = quantize && !model.Quantized();
+    if (quantize) {
+      model.SetQuantMode(Quantizer<Dtype>::MODE_CALIBRATE);
+    }
+
     Report(kInfo, "Testing model '%s'", model_name);
     Dtype acc = model.Test();
     Report(kInfo, "Accuracy: %f", acc);
+    if (memory) {
+      model.PrintMemory();
+    }
+
+    if (prune) {
+      std::string sparse_path = std::string(model_name) + "_sparse.model";
+      size_t size = model.Save(sparse_path.c_str());
+      Report(kInfo, "Saving pruned model '%s' (%ld byte(s))",
+             sparse_path.c_str(), size);
+    }
+
+    if (quantize) {
+      model.SetQuantMode(Quantizer<Dtype>::MODE_INT8);
+      Report(kInfo, "Testing quantized model '%s'", model_name);
+      acc = model.Test();
+      Report(kInfo, "Accuracy: %f", acc);
+
+      std::string quant_path = std::string(model_name) + "_int8.model";
+      size_t size = model.Save(quant_path.c_str());
+      Report(kInfo, "Saving quantized model '%s' (%ld byte(s))",
+             quant_path.c_str(), size);
+    }
+    Profiler::Get().Finish(trace_path);
     return 0;
   }
 
+  // Gradient checkpointing: only keep the activations between the segments
+  // (0: square root of the number of layers)
+  if (checkpoint) {
+    Report(kInfo, "Checkpointing %d segment(s)",
+           model.Checkpoint(num_segment));
+  }
+
+  // Run the elementwise layers in place
+  size_t mem = model.ActivationMemory();
+  Report(kInfo, "Planning activations: %ld byte(s) -> %ld byte(s)", mem,
+         model.Plan(State::PHASE_TRAIN));
+
+  // Data-parallel training: each rank trains on a shard of the training set
+  Ring ring;
+  std::unique_ptr<DataParallel<Dtype>> parallel;
+  if (hosts) {
+    if (!ring.Connect(hosts, rank)) {
+      return -1;
+    }
+    Report(kInfo, "Training as rank %d of %d", ring.Rank(), ring.NumRank());
+    model.DataLayer()->SetShard(ring.Rank(), ring.NumRank());
+    parallel.reset(new DataParallel<Dtype>(&ring));
+  }
+
+  // Test in the background on a snapshot of the weights, the testing set
+  // being split across the workers (0: test on the training thread)
+  Evaluator<Dtype> evaluator;
+  if (num_test_worker && test_each && (!hosts || !ring.Rank())) {
+    if (!evaluator.Start([&]() {
+          std::unique_ptr<Model<Dtype>> replica(new MnistModel<Dtype>(
+            model_name, dataset_path, MnistDataset<Dtype>::NumClass(),
+            batch_size, use_fc, use_bn, 0));
+          replica->SetLayout(layout);
+          return replica;
+        }, num_test_worker)) {
+      return -1;
+    }
+  }
+
   Solver<Dtype>* solver;
   if (!std::strcmp(solver_type, "sgd")) {
     Report(kInfo, "Creating SGD solver");
@@ -894,12 +380,25 @@ int main(int argc, char* argv[]) {
     solver = new SolverRMSprop<Dtype>(print_each, test_each, save_each,
                                       lr_scale_each, lr_scale, decay_rate,
                                       reg, clip);
+  } else if (!std::strcmp(solver_type, "adam")) {
+    // The momentum and decay rate are the decay rates of the mean and
+    // variance of the derivatives
+    Report(kInfo, "Creating Adam solver");
+    solver = new SolverAdam<Dtype>(print_each, test_each, save_each,
+                                   lr_scale_each, lr_scale, momentum,
+                                   decay_rate, reg, clip);
   } else {
     Report(kError, "Unknown solver type '%s'", solver_type);
     return -1;
   }
 
   // Train the model
+  solver->SetParallel(parallel.get());
+  solver->SetEvaluator(evaluator.NumWorker() ? &evaluator : nullptr);
+  solver->SetSaveState(save_state);
+  solver->SetResume(resume_path);
+  solver->SetForbidAlloc(no_alloc);
+  solver->SetPrune(sparsity);
   if (!solver->Train(&model, num_step, learning_rate)) {
     return -1;
   }
@@ -907,5 +406,6 @@ int main(int argc, char* argv[]) {
   // Clean
   delete solver;
 
+  Profiler::Get().Finish(trace_path);
   return 0;
 }
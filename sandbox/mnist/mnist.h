@@ -0,0 +1,802 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#ifndef SANDBOX_MNIST_MNIST_H_
+#define SANDBOX_MNIST_MNIST_H_
+
+
+#include <core/log.h>
+#include <core/dataset.h>
+#include <core/record_set.h>
+#include <core/layer_data.h>
+#include <core/layer_batch_norm.h>
+#include <core/layer_scale.h>
+#include <core/layer_conv.h>
+#include <core/layer_relu.h>
+#include <core/layer_pool_max.h>
+#include <core/layer_inner_product.h>
+#include <core/layer_softmax_loss.h>
+#include <algorithm>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  MnistDataset
+ *  \brief  Mnist dataset
+ */
+template <typename Dtype>
+class MnistDataset: public Dataset {
+  // Public types
+ public:
+  typedef Dtype   Type;
+  typedef Dataset Parent;
+
+
+  // Protected attributes
+ protected:
+  uint32_t          image_width_;    // Image width
+  uint32_t          image_height_;   // Image height
+  RecordSet<Dtype>  train_;          // Training set
+  RecordSet<Dtype>  test_;           // Testing set
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Switch the endianness of a 32-bits number.
+   *
+   *  \param[in]  num: 32-bits number
+   *
+   *  \return     32-bits number with endianness switched
+   */
+  uint32_t SwapEndian32(uint32_t num) {
+    return (num & 0x000000FF) << 24 |
+           (num & 0x0000FF00) << 8  |
+           (num & 0x00FF0000) >> 8  |
+           (num & 0xFF000000) >> 24;
+  }
+
+  /*!
+   * Read a mnist dataset (mapping the files in memory).
+   * Check here for the dataset format: http://yann.lecun.com/exdb/mnist/
+   *
+   *  \param[in]  file_image: file containing the images
+   *  \param[in]  file_label: file containing the labels
+   *
+   *  \param[out] dataset   : mnist dataset
+   *  \return     Error?
+   */
+  bool ReadDataset(const std::string& file_image,
+                   const std::string& file_label,
+                   RecordSet<Dtype>* dataset) {
+    // File header constants
+    const uint32_t kMnistImageHeader = 0x803;
+    const uint32_t kMnistLabelHeader = 0x801;
+
+    // Map the images file
+    size_t image_file_size;
+    std::shared_ptr<uint8_t> image_mem =
+      RecordSet<Dtype>::Map(file_image.c_str(), &image_file_size);
+    if (!image_mem) {
+      return false;
+    }
+
+    // Read the images file header
+    uint32_t header[4];
+    if (image_file_size < sizeof(header)) {
+      Report(kError, "Invalid file header in '%s'", file_image.c_str());
+      return false;
+    }
+    std::memcpy(header, image_mem.get(), sizeof(header));
+    uint32_t magic         = SwapEndian32(header[0]);
+    uint32_t image_count   = SwapEndian32(header[1]);
+    uint32_t image_rows    = SwapEndian32(header[2]);
+    uint32_t image_columns = SwapEndian32(header[3]);
+
+    // Check the magic number
+    if (magic != kMnistImageHeader) {
+      Report(kError, "Invalid file format in '%s'", file_image.c_str());
+      return false;
+    }
+
+    // Set or check the image width
+    if (image_width_) {
+      if (image_rows != image_width_) {
+        Report(kError, "Invalid image format in '%s'", file_image.c_str());
+        return false;
+      }
+    } else {
+      image_width_ = image_rows;
+    }
+
+    // Set or check the image height
+    if (image_height_) {
+      if (image_columns != image_height_) {
+        Report(kError, "Invalid image format in '%s'", file_image.c_str());
+        return false;
+      }
+    } else {
+      image_height_ = image_columns;
+    }
+
+    // Size of an image
+    uint32_t mnist_size = image_rows * image_columns;
+
+    // Check all the images are there
+    if (image_file_size < sizeof(header) + size_t(image_count) * mnist_size) {
+      Report(kError, "Can't read images in '%s'", file_image.c_str());
+      return false;
+    }
+
+    // Map the labels file
+    size_t label_file_size;
+    std::shared_ptr<uint8_t> label_mem =
+      RecordSet<Dtype>::Map(file_label.c_str(), &label_file_size);
+    if (!label_mem) {
+      return false;
+    }
+
+    // Read the label file header
+    if (label_file_size < 2 * sizeof(uint32_t)) {
+      Report(kError, "Invalid file header in '%s'", file_label.c_str());
+      return false;
+    }
+    std::memcpy(header, label_mem.get(), 2 * sizeof(uint32_t));
+    magic                = SwapEndian32(header[0]);
+    uint32_t label_count = SwapEndian32(header[1]);
+
+    // Check the magic number and the number of labels
+    // (must match the number of images)
+    if (magic != kMnistLabelHeader || label_count != image_count) {
+      Report(kError, "Invalid file format in '%s'", file_label.c_str());
+      return false;
+    }
+
+    // Check all the labels are there
+    const uint8_t* labels = label_mem.get() + 2 * sizeof(uint32_t);
+    if (label_file_size < 2 * sizeof(uint32_t) + image_count) {
+      Report(kError, "Can't read labels in '%s'", file_label.c_str());
+      return false;
+    }
+
+    // Check the labels are between [0, 9]
+    for (uint32_t i = 0; i < image_count; ++i) {
+      if (labels[i] > 9) {
+        Report(kError, "Invalid label %d in file '%s'",
+               labels[i], file_label.c_str());
+        return false;
+      }
+    }
+
+    // Add the images to the dataset
+    typename RecordSet<Dtype>::Shard shard;
+    shard.image_mem    = image_mem;
+    shard.label_mem    = label_mem;
+    shard.image        = image_mem.get() + sizeof(header);
+    shard.label        = labels;
+    shard.image_stride = mnist_size;
+    shard.label_stride = 1;
+    shard.count        = image_count;
+    return dataset->Add(shard, mnist_size);
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Default constructor.
+   */
+  MnistDataset() {
+    image_width_ = image_height_ = 0;
+  }
+
+  /*!
+   * Destructor.
+   */
+  virtual ~MnistDataset() {}
+
+  /*!
+   * Get the image width.
+   *
+   *  \return Image width
+   */
+  uint32_t ImageWidth() const {
+    return image_width_;
+  }
+
+  /*!
+   * Get the image height.
+   *
+   *  \return Image height
+   */
+  uint32_t ImageHeight() const {
+    return image_height_;
+  }
+
+  /*!
+   * Get the image channel.
+   *
+   *  \return Image channel
+   */
+  static uint32_t ImageChannel() {
+    return 1;
+  }
+
+  /*!
+   * Get the number of classes.
+   *
+   *  \return Number of classes
+   */
+  static uint32_t NumClass() {
+    return 10;
+  }
+
+  /*!
+   * Load the dataset.
+   *
+   *  \param[in]  dataset_path: path to the dataset root directory
+   *
+   *  \return     Error?
+   */
+  virtual bool Load(const char* dataset_path) {
+    // Clear datasets
+    train_.Clear();
+    test_.Clear();
+
+    const char* path = std::strtok(const_cast<char*>(dataset_path), ":");
+    while (path) {
+      Report(kInfo, "Loading dataset from '%s'", path);
+      std::string spath = std::string(path);
+
+      // Training set
+      std::string train_file_image(spath + "/train-images-idx3-ubyte");
+      std::string train_file_label(spath + "/train-labels-idx1-ubyte");
+      if (!ReadDataset(train_file_image, train_file_label, &train_)) {
+        return false;
+      }
+
+      // Testing set
+      std::string test_file_image(spath + "/t10k-images-idx3-ubyte");
+      std::string test_file_label(spath + "/t10k-labels-idx1-ubyte");
+      if (!ReadDataset(test_file_image, test_file_label, &test_)) {
+          return false;
+      }
+
+      // Go to next path
+      path = std::strtok(nullptr, ":");
+    }
+
+    // Randomly shuffle the dataset to have uniform mini-batches with a good
+    // estimation of the gradient: we want each mini-batch gradient to be very
+    // close to the batch (dataset) gradient
+    std::random_device rd;
+    std::default_random_engine re(rd());
+    // The testing set keeps the order of the files: the replicas of a
+    // parallel evaluation split the same images (see Evaluator)
+    train_.Shuffle(&re);
+
+    return true;
+  }
+
+  /*!
+   * Get the training set.
+   *
+   *  \return Training set
+   */
+  const RecordSet<Dtype>& Train() const {
+    return train_;
+  }
+
+  /*!
+   * Get the testing set.
+   *
+   *  \return Testing set
+   */
+  const RecordSet<Dtype>& Test() const {
+    return test_;
+  }
+};
+
+
+/*!
+ *  \class  MnistDataLayer
+ *  \brief  Mnist data layer
+ */
+template <typename Dtype>
+class MnistDataLayer: public LayerData<Dtype> {
+  // Public types
+ public:
+  typedef Dtype             Type;
+  typedef LayerData<Dtype>  Parent;
+
+
+  // Protected attributes
+ protected:
+  MnistDataset<Dtype> dataset_;               // Mnist dataset
+  uint32_t            dataset_train_index_;   // Dataset index (training)
+  uint32_t            dataset_test_index_;    // Dataset index (testing)
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Get the number of training images (for the pipeline).
+   *
+   *  \return Number of training images
+   */
+  virtual uint32_t NumTrainSample() const {
+    return uint32_t(dataset_.Train().size());
+  }
+
+  /*!
+   * Copy a training image in a batch (called on the producer thread).
+   *
+   *  \param[in]  sample: image index
+   *  \param[in]  batch : index in the batch
+   *
+   *  \param[out] data  : batch (images and labels)
+   */
+  virtual void FillTrainSample(uint32_t sample, uint32_t batch,
+                               typename DataPipeline<Dtype>::Batch* data) {
+    const RecordSet<Dtype>& dataset = dataset_.Train();
+    dataset.Copy(sample, &(*data)[0][batch * dataset.ImageSize()]);
+    (*data)[1][batch] = dataset.Label(sample);
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  name : layer name
+   *  \param[in]  param: parameters
+   */
+  MnistDataLayer(const char* name, const Param& param):
+    LayerData<Dtype>(name) {
+    // Parameters
+    std::string dataset_path;
+    uint32_t batch_size, num_prefetch;
+    param.Get("dataset_path", &dataset_path);
+    param.Get("batch_size"  , &batch_size);
+    param.Get("num_prefetch", uint32_t(0), &num_prefetch);
+    Parent::num_prefetch_ = num_prefetch;
+
+    if (!dataset_.Load(dataset_path.c_str())) {
+      return;
+    }
+
+    Report(kInfo, "Training set: %ld image(s)", dataset_.Train().size());
+    Report(kInfo, "Testing  set: %ld image(s)", dataset_.Test().size());
+
+    // Set index at the beginning of the dataset
+    dataset_train_index_ = dataset_test_index_ = 0;
+
+    // Create 2 outputs: images and labels
+    // There's no derivative for the labels as we don't backpropagate them
+    Parent::out_.resize(2);
+    Parent::out_[0] = std::make_shared<Mat<Dtype>>(
+      dataset_.ImageWidth(), dataset_.ImageHeight(),
+      dataset_.ImageChannel(), batch_size);
+    Parent::out_[1] = std::make_shared<Mat<Dtype>>(1, 1, 1, batch_size, false);
+  }
+
+  /*!
+   * Destructor.
+   */
+  virtual ~MnistDataLayer() {
+    // The pipeline copies the images from the dataset
+    Parent::StopPrefetch();
+  }
+
+  /*!
+   * Set the test index (the next testing batch starts at this image).
+   *
+   *  \param[in]  index: test index
+   */
+  void SetTestIndex(uint32_t index) {
+    dataset_test_index_ = index;
+  }
+
+  /*!
+   * Get the size of the testing dataset.
+   *
+   *  \return Testing dataset size
+   */
+  uint32_t TestSize() const {
+    return uint32_t(dataset_.Test().size());
+  }
+
+  /*!
+   * Forward pass.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Forward(const State& state) {
+    // Prefetched training batch
+    if (Parent::Prefetch(state)) {
+      return;
+    }
+
+    // Get the proper dataset (either training or testing one)
+    const RecordSet<Dtype>* dataset;
+    uint32_t* dataset_index;
+    if (state.phase == State::PHASE_TRAIN) {
+      dataset       = &dataset_.Train();
+      dataset_index = &dataset_train_index_;
+    } else {
+      dataset       = &dataset_.Test();
+      dataset_index = &dataset_test_index_;
+    }
+
+    if (dataset->empty()) {
+      Report(kError, "Empty dataset");
+      Parent::out_[0]->Zero();
+      Parent::out_[1]->Zero();
+      return;
+    }
+
+    if (*dataset_index >= uint32_t(dataset->size())) {
+      Report(kError, "Invalid dataset index");
+      Parent::out_[0]->Zero();
+      Parent::out_[1]->Zero();
+      return;
+    }
+
+    Dtype* image_data = Parent::out_[0]->Data();
+    Dtype* label_data = Parent::out_[1]->Data();
+
+    uint32_t image_size = Parent::out_[0]->size[0] * Parent::out_[0]->size[1] *
+                          Parent::out_[0]->size[2];
+    uint32_t batch_size = Parent::out_[0]->size[3];
+
+    bool testing_done = false;
+
+    for (uint32_t batch = 0; batch < batch_size; ++batch) {
+      // Copy the pixels
+      dataset->Copy(*dataset_index, image_data + batch * image_size);
+
+      // Copy the labels
+      label_data[batch] = dataset->Label(*dataset_index);
+
+      // Go to the next image
+      if (++*dataset_index >= uint32_t(dataset->size())) {
+        if (state.phase == State::PHASE_TRAIN) {
+          // Rewind
+          *dataset_index = 0;
+        } else {
+          // Clamp
+          *dataset_index = uint32_t(dataset->size()) - 1;
+          testing_done   = true;
+        }
+      }
+    }
+
+    if (testing_done) {
+      // Mark the testing dataset as done
+      *dataset_index = uint32_t(dataset->size());
+    }
+  }
+};
+
+
+/*!
+ *  \class  MnistModel
+ *  \brief  Mnist model
+ */
+template <typename Dtype>
+class MnistModel: public Model<Dtype> {
+  // Public types
+ public:
+  typedef Dtype         Type;
+  typedef Model<Dtype>  Parent;
+
+
+  // Protected attributes
+ protected:
+  std::shared_ptr<Mat<Dtype>> label_;   // Labels
+  std::shared_ptr<Mat<Dtype>> prob_;    // Probabilities
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  name        : model name
+   *  \param[in]  dataset_path: path to the dataset
+   *  \param[in]  num_output  : matrix size (number of classes)
+   *  \param[in]  batch_size  : matrix size (batch size)
+   *  \param[in]  use_fc      : use fully-connected network?
+   *  \param[in]  use_bn      : use batch norm?
+   *  \param[in]  num_prefetch: number of training batches to prefetch
+   */
+  MnistModel(const char* name, const char* dataset_path, uint32_t num_output,
+             uint32_t batch_size, bool use_fc, bool use_bn,
+             uint32_t num_prefetch):
+    Model<Dtype>(name) {
+    // Allocate all the activations and weights from the model arena
+    Arena::Scope arena_scope(Parent::Memory());
+
+    // Input layer parameters
+    Param data_param;
+    data_param.Add("dataset_path", dataset_path);
+    data_param.Add("batch_size"  , batch_size);
+    data_param.Add("num_prefetch", num_prefetch);
+
+    // Input layer
+    std::vector<std::shared_ptr<Mat<Dtype>>> out = Parent::Add(
+      std::make_shared<MnistDataLayer<Dtype>>("data1", data_param));
+
+    // Model input (images) and labels
+    Parent::in_ = out[0];
+    label_      = out[1];
+
+    // Output of previous layer
+    Parent::out_ = Parent::in_;
+
+    if (use_fc) {
+      // Network architecture:
+      //
+      // DATA1 (INPUT)
+      //   |
+      //   |
+      // IP1
+      //   |
+      //   |
+      // RELU1
+      //   |
+      //   |
+      // IP2
+      //   |
+      //   |
+      // RELU2
+      //   |
+      //   |
+      // IP3
+      //   |
+      //   |
+      // LOSS (OUTPUT)
+
+      // Hidden IP layer parameters
+      // We use 64 hidden units
+      Param ip_hidden_param;
+      ip_hidden_param.Add("num_output", 64);
+
+      // IP1
+      Parent::out_ = Parent::Add(std::make_shared<LayerInnerProduct<Dtype>>(
+        "ip1", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+        Parent::out_}, ip_hidden_param))[0];
+
+      // Relu1
+      Parent::out_ = Parent::Add(std::make_shared<LayerRelu<Dtype>>("relu1",
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_}))[0];
+
+      // IP2
+      Parent::out_ = Parent::Add(std::make_shared<LayerInnerProduct<Dtype>>(
+        "ip2", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+        Parent::out_}, ip_hidden_param))[0];
+
+      // Relu2
+      Parent::out_ = Parent::Add(std::make_shared<LayerRelu<Dtype>>("relu2",
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_}))[0];
+
+      // IP3
+      // Final IP layer parameters
+      Param ip_final_param;
+      ip_final_param.Add("num_output", num_output);
+      Parent::out_ = Parent::Add(std::make_shared<LayerInnerProduct<Dtype>>(
+        "ip3", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+        Parent::out_}, ip_final_param))[0];
+    } else {
+      // Network architecture:
+      //
+      // DATA1 (INPUT)
+      //   |
+      //   |
+      // CONV1
+      //   |
+      //   |
+      // RELU1
+      //   |
+      //   |
+      // POOL1
+      //   |
+      //   |
+      // (BN1)
+      //   |
+      //   |
+      // (SCALE1)
+      //   |
+      //   |
+      // CONV2
+      //   |
+      //   |
+      // RELU2
+      //   |
+      //   |
+      // POOL2
+      //   |
+      //   |
+      // IP1
+      //   |
+      //   |
+      // LOSS (OUTPUT)
+
+      // Conv layer parameters
+      Param conv_param;
+      conv_param.Add("num_output"   , 8);
+      conv_param.Add("filter_width" , 3);
+      conv_param.Add("filter_height", 3);
+      conv_param.Add("padding_x"    , 1);
+      conv_param.Add("padding_y"    , 1);
+      conv_param.Add("stride_x"     , 1);
+      conv_param.Add("stride_y"     , 1);
+
+      // Pool layer parameters
+      Param pool_param;
+      pool_param.Add("filter_width" , 3);
+      pool_param.Add("filter_height", 3);
+      pool_param.Add("padding_x"    , 1);
+      pool_param.Add("padding_y"    , 1);
+      pool_param.Add("stride_x"     , 2);
+      pool_param.Add("stride_y"     , 2);
+
+      // Conv1, Relu1, Pool1
+      Parent::out_ = Parent::Add(std::make_shared<LayerConv<Dtype>>("conv1",
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
+        conv_param))[0];
+      Parent::out_ = Parent::Add(std::make_shared<LayerRelu<Dtype>>("relu1",
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_}))[0];
+      Parent::out_ = Parent::Add(std::make_shared<LayerPoolMax<Dtype>>("pool1",
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
+        pool_param))[0];
+
+      if (use_bn) {
+        // BN layer parameters
+        Param bn_param;
+        bn_param.Add("moving_avg_frac", 0.99f);
+
+        // BN1, Scale1 (whitening activations)
+        Parent::out_ = Parent::Add(std::make_shared<LayerBatchNorm<Dtype>>(
+          "bn1", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+          Parent::out_}, bn_param))[0];
+        Parent::out_ = Parent::Add(std::make_shared<LayerScale<Dtype>>(
+          "scale1", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+          Parent::out_}, Param()))[0];
+      }
+
+      // Increase the depth for the next conv layer
+      conv_param.Add("num_output", 16);
+
+      // Conv2, Relu2, Pool2
+      Parent::out_ = Parent::Add(std::make_shared<LayerConv<Dtype>>("conv2",
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
+        conv_param))[0];
+      Parent::out_ = Parent::Add(std::make_shared<LayerRelu<Dtype>>("relu2",
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_}))[0];
+      Parent::out_ = Parent::Add(std::make_shared<LayerPoolMax<Dtype>>("pool2",
+        std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
+        pool_param))[0];
+
+      // IP layer parameters
+      Param ip_param;
+      ip_param.Add("num_output", num_output);
+
+      // IP1
+      Parent::out_ = Parent::Add(std::make_shared<LayerInnerProduct<Dtype>>(
+        "ip1", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{
+        Parent::out_}, ip_param))[0];
+    }
+
+    // Loss (softmax)
+    const std::vector<std::shared_ptr<Mat<Dtype>>>& softmax_out =
+    Parent::Add(std::make_shared<LayerSoftMaxLoss<Dtype>>("loss",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_,
+      label_}));
+    Parent::out_ = softmax_out[0];
+    prob_        = softmax_out[1];
+  }
+
+  /*!
+   * Destructor.
+   */
+  virtual ~MnistModel() {}
+
+  /*!
+   * Get the number of testing images.
+   *
+   *  \return Number of testing images
+   */
+  virtual uint32_t TestSize() {
+    std::shared_ptr<MnistDataLayer<Dtype>> mnist_data =
+      std::dynamic_pointer_cast<MnistDataLayer<Dtype>>(Parent::DataLayer());
+    return mnist_data ? mnist_data->TestSize() : 0;
+  }
+
+  /*!
+   * Graph testing (inference) on a range of the testing images.
+   *
+   *  \param[in]  begin: first image
+   *  \param[in]  end  : last image (excluded)
+   *
+   *  \return     Number of correct predictions
+   */
+  virtual uint64_t TestRange(uint32_t begin, uint32_t end) {
+    // Create the state
+    State state(State::PHASE_TEST);
+
+    // Number of classes (outputs)
+    uint32_t num_output = prob_->size[2];
+
+    // Get the data layer to set the testing index
+    std::shared_ptr<MnistDataLayer<Dtype>> mnist_data =
+      std::dynamic_pointer_cast<MnistDataLayer<Dtype>>(Parent::DataLayer());
+    if (!mnist_data) {
+      Report(kError, "No data layer found in model '%s'", Parent::Name());
+      return 0;
+    }
+
+    uint64_t num_correct = 0;
+    uint32_t batch_size  = Parent::BatchSize();
+    for (uint32_t index = begin; index < end; index += batch_size) {
+      // Inference, the last batch only running on the remaining images
+      uint32_t actual_batch_size = std::min(batch_size, end - index);
+      mnist_data->SetTestIndex(index);
+      Parent::SetBatchSize(actual_batch_size);
+      Parent::Forward(state);
+
+      // Prediction
+      for (uint32_t batch = 0; batch < actual_batch_size; ++batch) {
+        // Outputs
+        const Dtype* data = prob_->Data() + batch * num_output;
+
+        // Network prediction
+        uint32_t predicted_number = 0;
+        for (uint32_t number = 0; number < num_output; ++number) {
+          if (data[predicted_number] < data[number]) {
+            predicted_number = number;
+          }
+        }
+
+        // Check if the prediction is correct
+        if (uint32_t(label_->Data()[batch]) == predicted_number) {
+          ++num_correct;
+        }
+      }
+    }
+    Parent::SetBatchSize(batch_size);
+
+    return num_correct;
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // SANDBOX_MNIST_MNIST_H_
@@ -0,0 +1,683 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+#ifndef SANDBOX_TEXTGEN_TEXTGEN_H_
+#define SANDBOX_TEXTGEN_TEXTGEN_H_
+
+
+#include <core/log.h>
+#include <core/dataset.h>
+#include <core/layer_eltwise_scale.h>
+#include <core/layer_softmax_loss.h>
+#include <core/rand.h>
+#include <core/sampler.h>
+#include <core/thread_pool.h>
+#include <recurrent/rnn.h>
+#include <recurrent/lstm.h>
+#include <vector>
+#include <set>
+#include <map>
+#include <string>
+#include <fstream>
+#include <algorithm>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  TextgenDataset
+ *  \brief  Textgen dataset
+ */
+class TextgenDataset: public Dataset {
+  // Public types
+ public:
+  typedef Dataset Parent;
+
+
+  // Protected attributes
+ protected:
+  std::vector<std::string> sentence_;         // List of sentences
+  std::set<char>           vocab_;            // Vocabulary
+  std::map<char, uint32_t> letter_to_index_;  // Mapping letters to indices
+  std::map<uint32_t, char> index_to_letter_;  // Mapping indices to letters
+  uint32_t                 max_length_;       // Longest sentence length
+
+
+  // Protected methods
+ protected:
+   /*!
+    * Cleaning a string.
+    * Removing leading and trailing spaces and tabs.
+    *
+    * \param[in]  str: string
+    */
+  static void CleanString(std::string* str) {
+    // Trim leading spaces and tabs
+    size_t startpos = str->find_first_not_of(" \t");
+    if (std::string::npos != startpos) {
+      *str = str->substr(startpos);
+    }
+
+    // Trim trailing spaces and tabs
+    size_t endpos = str->find_last_not_of(" \t");
+    if (std::string::npos != endpos) {
+      *str = str->substr(0, endpos + 1);
+    }
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Default constructor.
+   */
+  TextgenDataset() {
+    max_length_ = 0;
+  }
+
+  /*!
+   * Destructor.
+   */
+  virtual ~TextgenDataset() {}
+
+  /*!
+   * Load the dataset.
+   *
+   *  \param[in]  dataset_path: path to the dataset root directory
+   *
+   *  \return     Error?
+   */
+  virtual bool Load(const char* dataset_path) {
+    Report(kInfo, "Loading dataset '%s'", dataset_path);
+
+    std::string line;
+    std::ifstream fp(dataset_path);
+    if (fp.fail()) {
+      Report(kError, "Can't open file '%s'", dataset_path);
+      return false;
+    }
+
+    while (std::getline(fp, line)) {
+      CleanString(&line);
+      if (line.empty()) {
+        continue;
+      }
+      for (uint32_t i = 0; i < line.length(); ++i) {
+        vocab_.insert(line[i]);
+      }
+      sentence_.push_back(line);
+      max_length_ = std::max(max_length_, uint32_t(line.length()));
+    }
+
+    // Reserve index 0
+    uint32_t i = 1;
+    for (auto it = vocab_.begin(); it != vocab_.end(); ++it, ++i) {
+      letter_to_index_[*it] = i;
+      index_to_letter_[i]   = *it;
+    }
+
+    return true;
+  }
+
+  /*!
+   * Get the number of sentences.
+   *
+   *  \return Number of sentences
+   */
+  uint32_t SentenceSize() const {
+    return uint32_t(sentence_.size());
+  }
+
+  /*!
+   * Get the length of the longest sentence.
+   *
+   *  \return Longest sentence length
+   */
+  uint32_t MaxSentenceLength() const {
+    return max_length_;
+  }
+
+  /*!
+   * Get the number of letters.
+   *
+   *  \return Number of letters
+   */
+  uint32_t VocabSize() const {
+    return uint32_t(vocab_.size());
+  }
+
+  /*!
+   * Get a given sentence.
+   *
+   *  \param[in]  index: sentence index
+   *
+   *  \return     Sentence
+   */
+  const std::string& Sentence(uint32_t index) const {
+    return sentence_[index];
+  }
+
+  /*!
+   * Convert a character to an index.
+   *
+   *  \param[in]  ch: character
+   *
+   *  \return     Index
+   */
+  uint32_t LetterToIndex(char ch) const {
+    auto it = letter_to_index_.find(ch);
+    if (it == letter_to_index_.end()) {
+      return 0;
+    }
+    return it->second;
+  }
+
+  /*!
+   * Convert an index to a letter.
+   *
+   *  \param[in]  index: index
+   *
+   *  \return     Letter
+   */
+  char IndexToLetter(uint32_t index) const {
+    auto it = index_to_letter_.find(index);
+    if (it == index_to_letter_.end()) {
+      return '\0';
+    }
+    return it->second;
+  }
+};
+
+
+/*!
+ *  \class  TextgenDataLayer
+ *  \brief  Textgen data layer
+ */
+template <typename Dtype>
+class TextgenDataLayer: public LayerData<Dtype> {
+  // Public types
+ public:
+  typedef Dtype             Type;
+  typedef LayerData<Dtype>  Parent;
+
+
+  // Protected attributes
+ protected:
+  TextgenDataset           dataset_;              // Textgen dataset
+  uint32_t                 dataset_train_index_;  // Training dataset index
+  uint32_t                 dataset_test_index_;   // Testing dataset index
+  uint32_t                 num_predict_;          // Number of predictions
+  uint32_t                 num_batch_predict_;    // Predictions of the batch
+  uint32_t                 batch_size_;           // Batch size
+  std::vector<std::string> sentence_;             // Loaded sentences
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  name : layer name
+   *  \param[in]  param: parameters
+   */
+  TextgenDataLayer(const char* name, const Param& param):
+    Parent(name) {
+    // Parameters
+    std::string dataset_path;
+    param.Get("dataset_path", &dataset_path);
+    param.Get("num_predict" , &num_predict_);
+    param.Get("batch_size"  , &batch_size_);
+
+    if (!dataset_.Load(dataset_path.c_str())) {
+      return;
+    }
+
+    Report(kInfo, "Sentence   size: %ld", dataset_.SentenceSize());
+    Report(kInfo, "Vocabulary size: %ld", dataset_.VocabSize());
+
+    // Set index at the beginning of the dataset
+    dataset_train_index_ = dataset_test_index_ = 0;
+    num_batch_predict_   = 0;
+
+    // Create 1 output for the labels
+    // There's no derivative as we don't backpropagate them
+    Parent::out_.resize(1);
+    Parent::out_[0] = std::make_shared<Mat<Dtype>>(1, 1, 1, batch_size_,
+                                                   false);
+  }
+
+  /*!
+   * Destructor.
+   */
+  virtual ~TextgenDataLayer() {}
+
+  /*!
+   * Get the dataset.
+   *
+   *  \return Dataset
+   */
+  const TextgenDataset& Dataset() const {
+    return dataset_;
+  }
+
+  /*!
+   * Get the prediction index (aka testing index): number of predictions,
+   * including the ones of the batch.
+   *
+   *  \return Prediction index
+   */
+  uint32_t PredictionIndex() const {
+    return dataset_test_index_;
+  }
+
+  /*!
+   * Get the number of predictions of the batch.
+   *
+   *  \return Number of predictions
+   */
+  uint32_t NumBatchPrediction() const {
+    return num_batch_predict_;
+  }
+
+  /*!
+   * Check if testing is done
+   * (i.e. if we are at the end of the testing dataset).
+   *
+   *  \return Testing done?
+   */
+  bool TestingDone() {
+    if (!num_predict_) {
+      // No prediction: we are done
+      return true;
+    }
+
+    // We are done if we did all the predictions
+    bool testing_done = dataset_test_index_ == num_predict_;
+
+    if (testing_done) {
+      // If we are done, we rewind
+      dataset_test_index_ = 0;
+    }
+
+    return testing_done;
+  }
+
+  /*!
+   * Get a currently loaded sentence.
+   *
+   *  \param[in]  batch: batch index
+   *
+   *  \return     Currently loaded sentence
+   */
+  const std::string& Sentence(uint32_t batch) const {
+    return sentence_[batch];
+  }
+
+  /*!
+   * Forward pass.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Forward(const State& state) {
+    if (state.phase == State::PHASE_TEST) {
+      if (dataset_test_index_ >= num_predict_) {
+        Report(kError, "Invalid dataset index");
+        return;
+      }
+      // During testing, just count the predictions of the batch
+      num_batch_predict_ = std::min(batch_size_,
+                                    num_predict_ - dataset_test_index_);
+      dataset_test_index_ += num_batch_predict_;
+      return;
+    }
+
+    // No sentence loaded by default
+    sentence_.assign(batch_size_, std::string());
+
+    uint32_t sentence_size = dataset_.SentenceSize();
+    if (!sentence_size) {
+      Report(kError, "Empty dataset");
+      return;
+    }
+    if (dataset_train_index_ >= sentence_size) {
+      Report(kError, "Invalid dataset index");
+      return;
+    }
+
+    for (uint32_t batch = 0; batch < batch_size_; ++batch) {
+      // Load the current sentence
+      sentence_[batch] = dataset_.Sentence(dataset_train_index_);
+
+      // Go to the next sentence
+      if (++dataset_train_index_ >= sentence_size) {
+        dataset_train_index_ = 0;
+      }
+    }
+  }
+};
+
+
+/*!
+ *  \class  TextgenModel
+ *  \brief  Textgen recurrent model
+ */
+template <class R>
+class TextgenModel: public R {
+  // Protected types
+ protected:
+  // Public types
+ public:
+  typedef typename R::Type  Dtype;
+  typedef Dtype             Type;
+  typedef R                 Parent;
+
+
+  // Protected attributes
+ protected:
+  std::shared_ptr<TextgenDataLayer<Dtype>> data_layer_;   // Data layer
+  Dtype                                    temperature_;  // Temperature
+  uint32_t                                 top_k_;        // Top-k sampling
+                                                          // (0: none)
+  uint64_t                                 stream_;       // Random stream
+                                                          // (sampling)
+  uint32_t                                 num_sample_;   // Number of
+                                                          // sampling steps
+  std::vector<Sampler<Dtype>>              sampler_;      // Samplers
+                                                          // (per thread)
+  std::vector<std::shared_ptr<Mat<Dtype>>> label_;        // Steps labels
+  std::vector<std::shared_ptr<Mat<Dtype>>> prob_;         // Steps probabilities
+  std::vector<std::shared_ptr<Mat<Dtype>>> loss_;         // Steps losses
+
+  // Max length of a predicted sentence
+  static const uint32_t kMaxSentenceLen = 80;
+
+
+  // Protected methods
+ protected:
+  /*!
+   * Add the layers on top of a step output.
+   *
+   *  \param[in]  step: step index
+   *  \param[in]  out : step output
+   *
+   *  \return     Output
+   */
+  virtual std::shared_ptr<Mat<Dtype>> AddHead(
+    uint32_t step, const std::shared_ptr<Mat<Dtype>>& out) {
+    if (!step) {
+      label_.clear();
+      prob_.clear();
+      loss_.clear();
+    }
+
+    // Add a scale (temperature) layer
+    std::shared_ptr<Mat<Dtype>> scaled = out;
+    if (temperature_ > std::numeric_limits<Dtype>::epsilon() &&
+        temperature_ < Dtype(1) -
+        std::numeric_limits<Dtype>::epsilon()) {
+      Param param;
+      param.Add("scale", temperature_);
+      scaled = Parent::Add(std::make_shared<EltwiseScaleLayer<Dtype>>(
+        "", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{out},
+        param))[0];
+    }
+
+    // Add a softmax layer, with its own label
+    // There's no derivative as we don't backpropagate them
+    std::shared_ptr<Mat<Dtype>> label = std::make_shared<Mat<Dtype>>(
+      1, 1, 1, out->size[3], false);
+    const std::vector<std::shared_ptr<Mat<Dtype>>>& loss =
+    Parent::Add(std::make_shared<LayerSoftMaxLoss<Dtype>>(
+      "", std::initializer_list<std::shared_ptr<Mat<Dtype>>>{scaled, label}));
+    label_.push_back(label);
+    loss_.push_back(loss[0]);
+    prob_.push_back(loss[1]);
+    return loss[0];
+  }
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   * The graph is unrolled once for the longest sentence (training) or
+   * prediction (testing).
+   *
+   *  \param[in]  name       : model name
+   *  \param[in]  data_layer : data layer
+   *  \param[in]  size_in    : input size
+   *  \param[in]  hidden_size: hidden state size
+   *  \param[in]  range      : value range ([-range/2, range/2])
+   *  \param[in]  batch_size : batch size
+   *  \param[in]  args       : extra recurrent model arguments
+   */
+  template <typename... Args>
+  TextgenModel(const char* name,
+               const std::shared_ptr<TextgenDataLayer<Dtype>>& data_layer,
+               Dtype temperature, uint32_t size_in,
+               const std::vector<uint32_t>& hidden_size,
+               Dtype range, uint32_t batch_size, Args... args):
+    R(name, size_in, hidden_size, data_layer->Dataset().VocabSize() + 1,
+      range, batch_size, args...) {
+    data_layer_  = data_layer;
+    temperature_ = temperature;
+    top_k_       = 0;
+    stream_      = Philox::NewStream();
+    num_sample_  = 0;
+
+    // One step per character, plus the end of the sentence
+    Parent::Unroll(std::max(data_layer_->Dataset().MaxSentenceLength(),
+                            uint32_t(kMaxSentenceLen)) + 1);
+  }
+
+  /*!
+   * Destructor.
+   */
+  virtual ~TextgenModel() {}
+
+  /*!
+   * Only sample the k most likely letters when testing.
+   *
+   *  \param[in]  top_k: number of letters (0: all)
+   */
+  void SetTopK(uint32_t top_k) {
+    top_k_ = top_k;
+  }
+
+  /*!
+   * Create a data layer.
+   *
+   *  \param[in]  dataset_path: path to the dataset
+   *  \param[in]  num_predict : number of predictions
+   *  \param[in]  batch_size  : batch size
+   *
+   *  \return     Data layer
+   */
+  static std::shared_ptr<TextgenDataLayer<Dtype>> CreateDataLayer(
+    const char* dataset_path, uint32_t num_predict, uint32_t batch_size) {
+    Param param;
+    param.Add("dataset_path", dataset_path);
+    param.Add("num_predict" , num_predict);
+    param.Add("batch_size"  , batch_size);
+    return std::make_shared<TextgenDataLayer<Dtype>>("data1", param);
+  }
+
+  /*!
+   * Graph training (forward + backward pass).
+   *
+   *  \return Loss
+   */
+  virtual Dtype Train() {
+    State state(State::PHASE_TRAIN);
+
+    // Load the data
+    data_layer_->Forward(state);
+
+    // Get the sentence dataset
+    const TextgenDataset& dataset = data_layer_->Dataset();
+
+    // The batch runs as long as its longest sentence
+    uint32_t batch_size = Parent::BatchSize();
+    uint32_t max_len    = 0;
+    uint32_t num_letter = 0;
+    for (uint32_t batch = 0; batch < batch_size; ++batch) {
+      uint32_t len = data_layer_->Sentence(batch).length();
+      max_len     = std::max(max_len, len);
+      num_letter += len;
+    }
+    if (!num_letter) {
+      return Dtype(0);
+    }
+
+    // Set the inputs and labels of all the steps
+    uint32_t num_step = std::min(max_len + 1, Parent::NumStep());
+    for (uint32_t i = 0; i < num_step; ++i) {
+      Dtype* label = label_[i]->Data();
+      for (uint32_t batch = 0; batch < batch_size; ++batch) {
+        const std::string& sentence = data_layer_->Sentence(batch);
+        uint32_t len = sentence.length();
+        if (i > len) {
+          // Padding after the end of the sentence: masked out
+          Parent::SetInput(i, batch, 0);
+          label[batch] = Dtype(-1);
+          continue;
+        }
+
+        uint32_t index_src = 0;
+        uint32_t index_dst = 0;
+        if (i) {
+          index_src = dataset.LetterToIndex(sentence[i - 1]);
+        }
+        if (i != len) {
+          index_dst = dataset.LetterToIndex(sentence[i]);
+        }
+
+        Parent::SetInput(i, batch, index_src);
+        label[batch] = index_dst;
+      }
+    }
+
+    // Backpropagate through the whole sentences
+    Parent::ForwardSteps(state, 0, num_step);
+    Parent::BackwardSteps(state, 0, num_step);
+
+    // The steps losses are averaged over the batch (including the padding)
+    Dtype loss = Dtype(0);
+    for (uint32_t i = 0; i < num_step; ++i) {
+      loss += *loss_[i]->Data();
+    }
+
+    return loss * batch_size / num_letter;
+  }
+
+  /*!
+   * Graph testing (inference).
+   * The sentences are predicted a batch at a time, one letter of each
+   * sentence per step of the unrolled graph: the step inputs are the last
+   * letters and the next ones are sampled from their probabilities (see
+   * Sampler), until the end of all the sentences.
+   *
+   *  \return Accuracy
+   */
+  virtual Dtype Test() {
+    State state(State::PHASE_TEST);
+
+    // Get the sentence dataset
+    const TextgenDataset& dataset = data_layer_->Dataset();
+
+    uint32_t batch_size = Parent::BatchSize();
+    std::vector<std::string> sentence(batch_size);
+    std::vector<uint8_t>     done(batch_size);
+    std::vector<uint32_t>    value(2 * batch_size);
+    sampler_.resize(ThreadPool::Get().NumThread());
+
+    while (!data_layer_->TestingDone()) {
+      // Load the data (the number of sentences of the batch)
+      data_layer_->Forward(state);
+      uint32_t num_sentence = data_layer_->NumBatchPrediction();
+      for (uint32_t batch = 0; batch < batch_size; ++batch) {
+        sentence[batch].clear();
+        done[batch] = batch >= num_sentence;
+      }
+
+      uint32_t num_active = num_sentence;
+      for (uint32_t step = 0; step < Parent::NumStep() && num_active;
+           ++step) {
+        for (uint32_t batch = 0; batch < batch_size; ++batch) {
+          const std::string& s = sentence[batch];
+          Parent::SetInput(step, batch, (done[batch] || s.empty()) ? 0 :
+                           dataset.LetterToIndex(s[s.length() - 1]));
+        }
+
+        // Inference (one more step)
+        Parent::ForwardSteps(state, step, step + 1);
+
+        // Pseudo-randomly choose the next letters (2 random values each)
+        Philox::Generate(stream_, num_sample_++, 2 * batch_size,
+                         [&](uint32_t begin, uint32_t end,
+                             const uint32_t* x) {
+          std::copy(x, x + (end - begin), value.begin() + begin);
+        });
+        const std::shared_ptr<Mat<Dtype>>& prob = prob_[step];
+        uint32_t num_index = prob->Size() / batch_size;
+        ParallelFor(0, num_sentence, [&](uint32_t batch_start,
+                                         uint32_t batch_end, uint32_t chunk) {
+          Sampler<Dtype>& sampler = sampler_[chunk];
+          for (uint32_t batch = batch_start; batch < batch_end; ++batch) {
+            if (done[batch]) {
+              continue;
+            }
+            sampler.Set(prob->Data() + num_index * batch, num_index, top_k_);
+            uint32_t index = sampler.Sample(value[2 * batch],
+                                            value[2 * batch + 1]);
+
+            // End of the sentence predicted, or too many characters
+            if (index) {
+              sentence[batch] += dataset.IndexToLetter(index);
+            }
+            done[batch] = !index ||
+                          sentence[batch].length() > kMaxSentenceLen;
+          }
+        });
+        num_active = uint32_t(std::count(done.begin(), done.end(), 0));
+      }
+
+      uint32_t first = data_layer_->PredictionIndex() - num_sentence;
+      for (uint32_t batch = 0; batch < num_sentence; ++batch) {
+        Report(kInfo, "Predicted sentence %ld: '%s'", first + batch + 1,
+               sentence[batch].c_str());
+      }
+    }
+
+    return Dtype(1);
+  }
+};
+
+
+}  // namespace jik
+
+
+#endif  // SANDBOX_TEXTGEN_TEXTGEN_H_
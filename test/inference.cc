@@ -0,0 +1,158 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#include <core/inference.h>
+#include <core/layer_data.h>
+#include <core/layer_scale.h>
+#include <core/log.h>
+#include <cstdio>
+#include <memory>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  TestDataLayer
+ *  \brief  Data layer without dataset (the inputs are set by the session)
+ */
+template <typename Dtype>
+class TestDataLayer: public LayerData<Dtype> {
+  // Public types
+ public:
+  typedef Dtype             Type;
+  typedef LayerData<Dtype>  Parent;
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  name      : layer name
+   *  \param[in]  batch_size: batch size
+   */
+  TestDataLayer(const char* name, uint32_t batch_size): Parent(name) {
+    Parent::out_.resize(1);
+    Parent::out_[0] = std::make_shared<Mat<Dtype>>(1, 1, 2, batch_size);
+  }
+
+  /*!
+   * Forward pass.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Forward(const State& state) {}
+};
+
+
+/*!
+ *  \class  TestModel
+ *  \brief  Scale of 2 inputs, without loss layer
+ */
+template <typename Dtype>
+class TestModel: public Model<Dtype> {
+  // Public types
+ public:
+  typedef Dtype         Type;
+  typedef Model<Dtype>  Parent;
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  name      : model name
+   *  \param[in]  batch_size: batch size
+   */
+  TestModel(const char* name, uint32_t batch_size): Parent(name) {
+    Parent::in_ = Parent::Add(
+      std::make_shared<TestDataLayer<Dtype>>("data", batch_size))[0];
+    Param scale_param;
+    scale_param.Add("use_bias", false);
+    Parent::out_ = Parent::Add(std::make_shared<LayerScale<Dtype>>("scale",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::in_},
+      scale_param))[0];
+  }
+};
+
+
+}  // namespace jik
+
+
+int main() {
+  using namespace jik;  // NOLINT(build/namespaces)
+  typedef float Dtype;
+
+  const char*    model_path = "test_inference.model";
+  const uint32_t batch_size = 4;
+
+  // Model file with a scale of 3 (the replicas map it)
+  {
+    TestModel<Dtype> model("test", batch_size);
+    std::vector<std::shared_ptr<Mat<Dtype>>> weight;
+    model.GetWeight(&weight);
+    weight[0]->Set(Dtype(3));
+    Check(model.Save(model_path) != 0, "Can't save the model");
+  }
+
+  InferenceSession<Dtype> session(batch_size, 100);
+  uint32_t num_model = 0;
+  auto factory = [batch_size]() {
+    return std::unique_ptr<Model<Dtype>>(
+      new TestModel<Dtype>("test", batch_size));
+  };
+  auto failing_factory = [&num_model, batch_size]() {
+    // The second replica can't be created
+    return std::unique_ptr<Model<Dtype>>(++num_model == 2 ? nullptr :
+      new TestModel<Dtype>("test", batch_size));
+  };
+  Dtype in[2] = {1, 2}, out[2] = {0, 0};
+
+  // Some workers
+  Check(session.Start(factory, model_path, 2), "Start failed");
+  Check(session.InSize() == 2 && session.OutSize() == 2,
+        "Wrong request size: %d inputs, %d outputs",
+        session.InSize(), session.OutSize());
+  Check(session.Infer(in, out), "Infer failed");
+  Check(out[0] == 3 && out[1] == 6, "Wrong outputs: %f, %f", out[0], out[1]);
+
+  // A replica fails: no worker is left, the requests are refused
+  Check(!session.Start(failing_factory, model_path, 3),
+        "Start succeeded without all the replicas");
+  Check(num_model == 2, "%d replicas created instead of 2", num_model);
+  Check(!session.Infer(in, out), "Infer succeeded without worker");
+
+  // Restarted
+  Check(session.Start(factory, model_path, 1), "Restart failed");
+  Check(session.Infer(in, out), "Infer failed after restart");
+  session.Stop();
+  Check(!session.Infer(in, out), "Infer succeeded once stopped");
+
+  std::remove(model_path);
+  return 0;
+}
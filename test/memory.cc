@@ -0,0 +1,239 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#include <core/layer_data.h>
+#include <core/layer_scale.h>
+#include <core/log.h>
+#include <core/memory_stats.h>
+#include <core/solver_adam.h>
+#include <map>
+#include <memory>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  TestDataLayer
+ *  \brief  Data layer without dataset
+ */
+template <typename Dtype>
+class TestDataLayer: public LayerData<Dtype> {
+  // Public types
+ public:
+  typedef Dtype             Type;
+  typedef LayerData<Dtype>  Parent;
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  name: layer name
+   */
+  explicit TestDataLayer(const char* name): Parent(name) {
+    Parent::out_.resize(1);
+    Parent::out_[0] = std::make_shared<Mat<Dtype>>(1, 1, 2);
+  }
+
+  /*!
+   * Forward pass.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Forward(const State& state) {}
+};
+
+
+/*!
+ *  \class  TestScratchLayer
+ *  \brief  Layer allocating a scratch buffer in its forward pass (its output
+ *          is its input)
+ */
+template <typename Dtype>
+class TestScratchLayer: public Layer<Dtype> {
+  // Public types
+ public:
+  typedef Dtype         Type;
+  typedef Layer<Dtype>  Parent;
+
+  static const uint32_t kScratchSize = 1 << 16;  // Scratch buffer size
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  name: layer name
+   *  \param[in]  in  : input activations
+   */
+  TestScratchLayer(const char*                                     name,
+                   const std::vector<std::shared_ptr<Mat<Dtype>>>& in):
+    Parent(name, in) {
+    Parent::out_ = in;
+  }
+
+  /*!
+   * Forward pass.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Forward(const State& state) {
+    Mat<Dtype> scratch(kScratchSize, 1, 1, 1, false);
+  }
+
+  /*!
+   * Backward pass.
+   *
+   *  \param[in]  state: state
+   */
+  virtual void Backward(const State& state) {}
+};
+
+
+/*!
+ *  \class  TestModel
+ *  \brief  Scratch and scale layers
+ */
+template <typename Dtype>
+class TestModel: public Model<Dtype> {
+  // Public types
+ public:
+  typedef Dtype         Type;
+  typedef Model<Dtype>  Parent;
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  name: model name
+   */
+  explicit TestModel(const char* name): Parent(name) {
+    Parent::in_  = Parent::Add(
+      std::make_shared<TestDataLayer<Dtype>>("data"))[0];
+    Parent::out_ = Parent::Add(std::make_shared<TestScratchLayer<Dtype>>(
+      "scratch",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::in_}))[0];
+    Param scale_param;
+    scale_param.Add("use_bias", false);
+    Parent::out_ = Parent::Add(std::make_shared<LayerScale<Dtype>>("scale",
+      std::initializer_list<std::shared_ptr<Mat<Dtype>>>{Parent::out_},
+      scale_param))[0];
+  }
+
+  /*!
+   * Get the peak heap memory of the passes of a layer.
+   *
+   *  \param[in]  i: layer index
+   *
+   *  \return     Memory (bytes)
+   */
+  size_t LayerPeak(size_t i) const {
+    return i < Parent::layer_peak_.size() ? Parent::layer_peak_[i] : 0;
+  }
+};
+
+
+/*!
+ *  \class  TestSolver
+ *  \brief  Adam solver of a model, without training
+ */
+template <typename Dtype>
+class TestSolver: public SolverAdam<Dtype> {
+  // Public types
+ public:
+  typedef Dtype             Type;
+  typedef SolverAdam<Dtype> Parent;
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   */
+  TestSolver(): Parent(0, 0, 0, 0, Dtype(1), Dtype(0.9), Dtype(0.999),
+                       Dtype(0), Dtype(0)) {}
+
+  /*!
+   * Allocate the solver state of the weights of a model.
+   *
+   *  \param[in]  model: model
+   */
+  void Attach(Model<Dtype>* model) {
+    model->GetWeight(&(Parent::weight_));
+    Parent::Reset();
+  }
+};
+
+
+}  // namespace jik
+
+
+int main() {
+  using namespace jik;  // NOLINT(build/namespaces)
+  typedef float Dtype;
+
+  MemoryStats& memory = MemoryStats::Get();
+  memory.Enable();
+
+  // Peak since a mark
+  size_t live = memory.Mark();
+  {
+    Mat<Dtype> mat(1000, 1, 1, 1, false);
+  }
+  Check(memory.PeakSinceMark() >= live + 1000 * sizeof(Dtype),
+        "Peak since the mark: %ld byte(s) instead of at least %ld",
+        memory.PeakSinceMark(), live + 1000 * sizeof(Dtype));
+  Check(memory.Live() == live, "Live memory: %ld byte(s) instead of %ld",
+        memory.Live(), live);
+
+  // Peak of the layers: the scratch buffer of the scratch layer only
+  TestModel<Dtype> model("test");
+  model.Forward(State(State::PHASE_TEST));
+  size_t scratch = TestScratchLayer<Dtype>::kScratchSize * sizeof(Dtype);
+  Check(model.LayerPeak(1) >= scratch,
+        "Scratch layer peak: %ld byte(s) instead of at least %ld",
+        model.LayerPeak(1), scratch);
+  Check(model.LayerPeak(2) < scratch,
+        "Scale layer peak: %ld byte(s), less than %ld expected",
+        model.LayerPeak(2), scratch);
+
+  // Adam state: 2 values per weight value (the scale, 2 channels)
+  TestSolver<Dtype> solver;
+  solver.Attach(&model);
+  std::map<const Dtype*, size_t> state = solver.StateMemory();
+  Check(state.size() == 1, "State of %ld weight(s) instead of 1",
+        state.size());
+  size_t state_byte = model.PrintMemory(state) - model.PrintMemory();
+  Check(state_byte == 2 * 2 * sizeof(Dtype),
+        "Solver state: %ld byte(s) instead of %ld", state_byte,
+        2 * 2 * sizeof(Dtype));
+  return 0;
+}
@@ -0,0 +1,128 @@
+/*!
+  The MIT License (MIT)
+
+  Copyright (c)2016 Olivier Soares
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+
+
+#include <core/log.h>
+#include <core/solver_adam.h>
+#include <core/solver_rmsprop.h>
+#include <core/solver_sgd.h>
+#include <memory>
+
+
+namespace jik {
+
+
+/*!
+ *  \class  TestSolver
+ *  \brief  Solver learning a single weight, without model
+ */
+template <class Solver>
+class TestSolver: public Solver {
+  // Public types
+ public:
+  typedef typename Solver::Type Type;
+  typedef Solver                Parent;
+
+
+  // Public methods
+ public:
+  /*!
+   * Constructor.
+   *
+   *  \param[in]  param: solver parameters (after the learning rate scale)
+   */
+  template <typename... Param>
+  explicit TestSolver(Param... param): Parent(0, 0, 0, 0, Type(1),
+                                              param...) {}
+
+  /*!
+   * Set the weight to learn, and reset the solver state (the previous
+   * values, or first moments, are set to 0.5).
+   *
+   *  \param[in]  weight: weight
+   */
+  void SetWeight(const std::shared_ptr<Mat<Type>>& weight) {
+    Parent::weight_ = {weight};
+    Parent::Reset();
+    Parent::weight_prev_[0]->Set(Type(0.5));
+  }
+};
+
+
+/*!
+ * Check that a sparse weight only has the rows having a derivative updated:
+ * the momentum, decay and regularization of the other rows are skipped.
+ *
+ *  \param[in]  name  : solver name
+ *
+ *  \param[out] solver: solver
+ */
+template <class Solver>
+void CheckSparseLearn(const char* name, Solver* solver) {
+  typedef typename Solver::Type Dtype;
+
+  // 4 rows of 3 values, only the row 1 having a derivative
+  std::shared_ptr<Mat<Dtype>> weight = std::make_shared<Mat<Dtype>>(3, 4);
+  weight->sparse = true;
+  weight->Set(Dtype(1));
+  solver->SetWeight(weight);
+  for (uint32_t step = 0; step < 2; ++step) {
+    for (uint32_t i = 0; i < 3; ++i) {
+      weight->DerivData()[3 + i] = Dtype(1);
+    }
+    weight->AddDerivRow(1);
+    solver->Learn(1, Dtype(0.1));
+    weight->ZeroDeriv();
+  }
+
+  for (uint32_t row = 0; row < 4; ++row) {
+    for (uint32_t i = 0; i < 3; ++i) {
+      Dtype value = weight->Data()[row * 3 + i];
+      Check((value == Dtype(1)) == (row != 1),
+            "%s: row %d %s (value: %f)", name, row,
+            row == 1 ? "not updated" : "updated", value);
+    }
+  }
+}
+
+
+}  // namespace jik
+
+
+int main() {
+  using namespace jik;  // NOLINT(build/namespaces)
+  typedef float Dtype;
+
+  // Momentum/decay, L2 regularization and clipping (learning rate: 0.1)
+  TestSolver<SolverSGD<Dtype>>     sgd(Dtype(0.9), Dtype(0.01), Dtype(5));
+  TestSolver<SolverRMSprop<Dtype>> rmsprop(Dtype(0.9), Dtype(0.01),
+                                           Dtype(5));
+  TestSolver<SolverAdam<Dtype>>    adam(Dtype(0.9), Dtype(0.999),
+                                        Dtype(0.01), Dtype(5));
+  CheckSparseLearn("SGD"    , &sgd);
+  CheckSparseLearn("RMSprop", &rmsprop);
+  CheckSparseLearn("Adam"   , &adam);
+  return 0;
+}